@@ -0,0 +1,187 @@
+/* acmatch.c - Aho-Corasick multi-word matching
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "acmatch.h"
+
+struct acmatch_word {
+    char *word;
+    unsigned int tags;
+};
+
+/* The compiled form is a DFA over byte classes: every byte that
+ * appears in some word gets its own class (with upper and lower case
+ * sharing one), and all other bytes share class 0, which always
+ * leads back to the root. */
+struct acmatch {
+    struct acmatch_word *words;
+    unsigned int words_used, words_size;
+    unsigned int total_len;
+
+    unsigned char classes[256];
+    unsigned int nclasses;
+    unsigned int states;
+    unsigned int *next;
+    unsigned int *tags;
+};
+
+struct acmatch *
+acmatch_new(void)
+{
+    return calloc(1, sizeof(struct acmatch));
+}
+
+void
+acmatch_delete(struct acmatch *ac)
+{
+    unsigned int ii;
+
+    if (!ac)
+        return;
+    for (ii = 0; ii < ac->words_used; ii++)
+        free(ac->words[ii].word);
+    free(ac->words);
+    free(ac->next);
+    free(ac->tags);
+    free(ac);
+}
+
+static unsigned char
+acmatch_fold(unsigned char ch)
+{
+    return (ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+}
+
+void
+acmatch_add(struct acmatch *ac, const char *word, unsigned int tags)
+{
+    if (!*word)
+        return;
+    if (ac->words_used == ac->words_size) {
+        ac->words_size = ac->words_size ? ac->words_size << 1 : 8;
+        ac->words = realloc(ac->words, ac->words_size * sizeof(ac->words[0]));
+    }
+    ac->words[ac->words_used].word = strdup(word);
+    ac->words[ac->words_used].tags = tags;
+    ac->words_used++;
+    ac->total_len += strlen(word);
+}
+
+void
+acmatch_compile(struct acmatch *ac)
+{
+    unsigned int *fail, *queue, head, tail;
+    unsigned int ii, cls, state, child, max_states;
+    const unsigned char *p;
+
+    free(ac->next);
+    free(ac->tags);
+    memset(ac->classes, 0, sizeof(ac->classes));
+    ac->nclasses = 1;
+    for (ii = 0; ii < ac->words_used; ii++)
+        for (p = (const unsigned char*)ac->words[ii].word; *p; p++)
+            if (!ac->classes[acmatch_fold(*p)])
+                ac->classes[acmatch_fold(*p)] = ac->nclasses++;
+    for (ii = 'A'; ii <= 'Z'; ii++)
+        ac->classes[ii] = ac->classes[ii - 'A' + 'a'];
+
+    /* Build the trie; state 0 is the root, so an edge of 0 means
+     * "no child" until the failure links are filled in. */
+    max_states = ac->total_len + 1;
+    ac->next = calloc(max_states * ac->nclasses, sizeof(ac->next[0]));
+    ac->tags = calloc(max_states, sizeof(ac->tags[0]));
+    ac->states = 1;
+    for (ii = 0; ii < ac->words_used; ii++) {
+        state = 0;
+        for (p = (const unsigned char*)ac->words[ii].word; *p; p++) {
+            cls = ac->classes[*p];
+            if (!ac->next[state * ac->nclasses + cls])
+                ac->next[state * ac->nclasses + cls] = ac->states++;
+            state = ac->next[state * ac->nclasses + cls];
+        }
+        ac->tags[state] |= ac->words[ii].tags;
+    }
+
+    /* Breadth-first, turn the trie into a DFA: missing edges follow
+     * the failure link, and each state inherits its failure state's
+     * tags. */
+    fail = calloc(ac->states, sizeof(fail[0]));
+    queue = malloc(ac->states * sizeof(queue[0]));
+    head = tail = 0;
+    for (cls = 1; cls < ac->nclasses; cls++)
+        if ((child = ac->next[cls]))
+            queue[tail++] = child;
+    while (head < tail) {
+        state = queue[head++];
+        for (cls = 1; cls < ac->nclasses; cls++) {
+            child = ac->next[state * ac->nclasses + cls];
+            if (child) {
+                fail[child] = ac->next[fail[state] * ac->nclasses + cls];
+                ac->tags[child] |= ac->tags[fail[child]];
+                queue[tail++] = child;
+            } else
+                ac->next[state * ac->nclasses + cls] = ac->next[fail[state] * ac->nclasses + cls];
+        }
+    }
+    free(queue);
+    free(fail);
+
+    if (ac->states < max_states) {
+        ac->next = realloc(ac->next, ac->states * ac->nclasses * sizeof(ac->next[0]));
+        ac->tags = realloc(ac->tags, ac->states * sizeof(ac->tags[0]));
+    }
+}
+
+unsigned int
+acmatch_size(const struct acmatch *ac)
+{
+    return ac->words_used;
+}
+
+unsigned int
+acmatch_step(const struct acmatch *ac, unsigned int state, unsigned char ch)
+{
+    return ac->next[state * ac->nclasses + ac->classes[ch]];
+}
+
+unsigned int
+acmatch_tags(const struct acmatch *ac, unsigned int state)
+{
+    return ac->tags[state];
+}
+
+/* Returns the tags of every word found in text, stopping early once
+ * any of stop_tags has been seen. */
+unsigned int
+acmatch_scan(const struct acmatch *ac, const char *text, unsigned int stop_tags)
+{
+    const unsigned char *p;
+    unsigned int state, found;
+
+    if (!ac->next)
+        return 0;
+    for (p = (const unsigned char*)text, state = found = 0; *p; p++) {
+        state = ac->next[state * ac->nclasses + ac->classes[*p]];
+        found |= ac->tags[state];
+        if (found & stop_tags)
+            break;
+    }
+    return found;
+}
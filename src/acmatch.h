@@ -0,0 +1,46 @@
+/* acmatch.h - Aho-Corasick multi-word matching
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef ACMATCH_H
+#define ACMATCH_H
+
+/* An acmatch finds which of a set of words occur in a text in one
+ * pass, however many words there are.  Each word carries a mask of
+ * tag bits; a scan reports the OR of the tags of every word found.
+ * Matching ignores ASCII case.
+ *
+ * Add the words, compile, then scan.  To change the words, build a
+ * new acmatch.  Scanning can also be driven one byte at a time with
+ * acmatch_step(), starting from state 0, so that callers can filter
+ * the text as they go.
+ */
+
+struct acmatch;
+
+struct acmatch *acmatch_new(void);
+void acmatch_delete(struct acmatch *ac);
+void acmatch_add(struct acmatch *ac, const char *word, unsigned int tags);
+void acmatch_compile(struct acmatch *ac);
+unsigned int acmatch_size(const struct acmatch *ac);
+unsigned int acmatch_step(const struct acmatch *ac, unsigned int state, unsigned char ch);
+unsigned int acmatch_tags(const struct acmatch *ac, unsigned int state);
+unsigned int acmatch_scan(const struct acmatch *ac, const char *text, unsigned int stop_tags);
+
+#endif /* ndef ACMATCH_H */
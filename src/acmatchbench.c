@@ -0,0 +1,126 @@
+#include "acmatch.h"
+#include "common.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* Compares SpamServ's old one-strstr-per-word badword check with an
+ * acmatch over recorded channel traffic:
+ *
+ *   acmatchbench <word file> <traffic file> [rounds]
+ *
+ * Both files have one entry per line.  Traffic lines are used as
+ * message text; lines in raw IRC form (":src PRIVMSG #chan :text")
+ * are trimmed to the text.  The two methods must agree on every
+ * line. */
+
+struct line_list {
+    char **list;
+    unsigned int used, size;
+};
+
+static void
+read_lines(const char *fname, struct line_list *lines, int lower)
+{
+    char buf[1024], *text, *nl;
+    FILE *file;
+
+    if (!(file = fopen(fname, "r"))) {
+        perror(fname);
+        exit(1);
+    }
+    while (fgets(buf, sizeof(buf), file)) {
+        if ((nl = strpbrk(buf, "\r\n")))
+            *nl = '\0';
+        text = buf;
+        if (*text == ':' && (nl = strstr(text, " :")))
+            text = nl + 2;
+        if (!*text)
+            continue;
+        if (lower)
+            for (nl = text; *nl; nl++)
+                if (*nl >= 'A' && *nl <= 'Z')
+                    *nl += 'a' - 'A';
+        if (lines->used == lines->size) {
+            lines->size = lines->size ? lines->size << 1 : 1024;
+            lines->list = realloc(lines->list, lines->size * sizeof(lines->list[0]));
+        }
+        lines->list[lines->used++] = strdup(text);
+    }
+    fclose(file);
+}
+
+static double
+elapsed(const struct timeval *start)
+{
+    struct timeval stop;
+    gettimeofday(&stop, NULL);
+    return (stop.tv_sec - start->tv_sec) + (stop.tv_usec - start->tv_usec) / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct line_list words, traffic;
+    struct acmatch *ac;
+    struct timeval start;
+    unsigned int ii, jj, round, rounds, old_hits, new_hits, mismatches;
+    unsigned long scanned;
+    double old_time, new_time;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <word file> <traffic file> [rounds]\n", argv[0]);
+        return 1;
+    }
+    rounds = (argc > 3) ? strtoul(argv[3], NULL, 0) : 10;
+    if (!rounds)
+        rounds = 1;
+    memset(&words, 0, sizeof(words));
+    memset(&traffic, 0, sizeof(traffic));
+    read_lines(argv[1], &words, 1);
+    read_lines(argv[2], &traffic, 1);
+
+    gettimeofday(&start, NULL);
+    ac = acmatch_new();
+    for (ii = 0; ii < words.used; ii++)
+        acmatch_add(ac, words.list[ii], 1);
+    acmatch_compile(ac);
+    printf("%u words, %u lines; compile took %.3f ms\n", words.used, traffic.used, elapsed(&start) * 1000);
+
+    old_hits = new_hits = mismatches = 0;
+    gettimeofday(&start, NULL);
+    for (round = 0; round < rounds; round++) {
+        for (ii = 0; ii < traffic.used; ii++) {
+            for (jj = 0; jj < words.used; jj++)
+                if (strstr(traffic.list[ii], words.list[jj]))
+                    break;
+            old_hits += (jj < words.used);
+        }
+    }
+    old_time = elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (round = 0; round < rounds; round++)
+        for (ii = 0; ii < traffic.used; ii++)
+            new_hits += acmatch_scan(ac, traffic.list[ii], 1) != 0;
+    new_time = elapsed(&start);
+
+    for (ii = 0; ii < traffic.used; ii++) {
+        for (jj = 0; jj < words.used; jj++)
+            if (strstr(traffic.list[ii], words.list[jj]))
+                break;
+        if ((jj < words.used) != (acmatch_scan(ac, traffic.list[ii], 1) != 0)) {
+            fprintf(stderr, "Mismatch on line: %s\n", traffic.list[ii]);
+            mismatches++;
+        }
+    }
+
+    scanned = (unsigned long)rounds * traffic.used;
+    if (!scanned)
+        scanned = 1;
+    printf("strstr:  %u matches, %.3f s (%.2f us/line)\n", old_hits / rounds, old_time, old_time * 1e6 / scanned);
+    printf("acmatch: %u matches, %.3f s (%.2f us/line)\n", new_hits / rounds, new_time, new_time * 1e6 / scanned);
+    acmatch_delete(ac);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,844 @@
+/* auditlog.c - indexed on-disk store for audited commands
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "auditlog.h"
+#include "dict.h"
+#include "sweep.h"
+
+#include <dirent.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <sys/stat.h>
+
+/* The store is a directory of append-only segment files named
+ * NNNNNNNN.dat.  Each record is a fixed header followed by seven
+ * NUL-terminated strings:
+ *
+ *   0  record length (including this header), little-endian
+ *   4  time, little-endian
+ *   8  AUDIT_MAGIC
+ *   9  severity
+ *  10  lengths of type, bot, channel, nick, account and hostmask
+ *  16  length of command, little-endian
+ *  18  reserved
+ *
+ * Segments are scanned once when the store is opened; after that the
+ * per-segment record, channel and account offset lists answer every
+ * query, so only the matching records are ever read back.
+ *
+ * New records wait in a buffer, like lines for the file logs, and are
+ * written out (and indexed) together once it is half full or when the
+ * log flush timer fires.
+ *
+ * An import of an old text log writes import-NNNNNNNN.dat segments in
+ * the background; once it is done they are renamed to sort before the
+ * live segments, so every walk still sees records newest first.
+ */
+#define AUDIT_HEADER_SIZE  20
+#define AUDIT_MAGIC        0xa5
+#define AUDIT_MAX_FIELD    255
+#define AUDIT_MAX_COMMAND  1024
+#define AUDIT_MAX_RECORD   (AUDIT_HEADER_SIZE + 6*(AUDIT_MAX_FIELD+1) + AUDIT_MAX_COMMAND + 1)
+#define AUDIT_NUM_FIELDS   7
+#define AUDIT_IMPORT_BUFFER 65536
+
+DECLARE_LIST(audit_offsets, unsigned int);
+DEFINE_LIST(audit_offsets, unsigned int)
+
+struct audit_segment {
+    unsigned long seq;
+    int fd;
+    unsigned long size;
+    time_t first;
+    time_t last;
+    struct audit_offsets records;
+    dict_t channels;
+    dict_t accounts;
+    struct audit_segment *older;
+    struct audit_segment *newer;
+};
+
+static struct {
+    char *directory;
+    unsigned long segment_size;
+    unsigned int max_segments;
+    unsigned int buffer_size;
+} audit_conf;
+
+static struct audit_segment *audit_oldest;
+static struct audit_segment *audit_newest;
+static unsigned int audit_segment_count;
+static int audit_state; /* 0 = closed, 1 = open, -1 = failed to open */
+static unsigned char *audit_buf;
+static unsigned int audit_buf_used;
+static unsigned int audit_buf_size;
+
+static struct {
+    struct sweep *sweep;
+    FILE *file;
+    long end;
+    struct audit_segment *oldest;
+    struct audit_segment *newest;
+    unsigned int segment_count;
+    unsigned char *buf;
+    unsigned int buf_used;
+    unsigned long count;
+    audit_import_func done;
+    void *extra;
+} audit_import;
+
+static void audit_import_abandon(void);
+
+static void
+audit_offsets_free(void *data)
+{
+    struct audit_offsets *offsets = data;
+    audit_offsets_clean(offsets);
+    free(offsets);
+}
+
+static void
+audit_postings_add(dict_t postings, const char *key, unsigned int offset)
+{
+    struct audit_offsets *offsets;
+
+    if (!(offsets = dict_find(postings, key, NULL))) {
+        offsets = malloc(sizeof(*offsets));
+        audit_offsets_init(offsets);
+        dict_insert(postings, strdup(key), offsets);
+    }
+    audit_offsets_append(offsets, offset);
+}
+
+static void
+audit_segment_path(char *dest, size_t size, unsigned long seq)
+{
+    snprintf(dest, size, "%s/%08lu.dat", audit_conf.directory, seq);
+}
+
+static void
+audit_import_path(char *dest, size_t size, unsigned long seq)
+{
+    snprintf(dest, size, "%s/import-%08lu.dat", audit_conf.directory, seq);
+}
+
+static struct audit_segment *
+audit_segment_alloc(unsigned long seq, int fd)
+{
+    struct audit_segment *seg;
+
+    seg = calloc(1, sizeof(*seg));
+    seg->seq = seq;
+    seg->fd = fd;
+    audit_offsets_init(&seg->records);
+    seg->channels = dict_new();
+    dict_set_free_keys(seg->channels, free);
+    dict_set_free_data(seg->channels, audit_offsets_free);
+    seg->accounts = dict_new();
+    dict_set_free_keys(seg->accounts, free);
+    dict_set_free_data(seg->accounts, audit_offsets_free);
+    return seg;
+}
+
+static void
+audit_segment_free(struct audit_segment *seg)
+{
+    close(seg->fd);
+    audit_offsets_clean(&seg->records);
+    dict_delete(seg->channels);
+    dict_delete(seg->accounts);
+    free(seg);
+}
+
+/* Links seg in as the newest segment. */
+static void
+audit_segment_link(struct audit_segment *seg)
+{
+    seg->older = audit_newest;
+    seg->newer = NULL;
+    if (audit_newest)
+        audit_newest->newer = seg;
+    else
+        audit_oldest = seg;
+    audit_newest = seg;
+    audit_segment_count++;
+}
+
+static void
+audit_segment_index(struct audit_segment *seg, unsigned int offset, const struct audit_record *rec)
+{
+    audit_offsets_append(&seg->records, offset);
+    if (rec->channel_name)
+        audit_postings_add(seg->channels, rec->channel_name, offset);
+    if (rec->user_account)
+        audit_postings_add(seg->accounts, rec->user_account, offset);
+    if (!seg->first)
+        seg->first = rec->when;
+    seg->last = rec->when;
+}
+
+static void
+audit_put32(unsigned char *dest, unsigned long value)
+{
+    dest[0] = value & 255;
+    dest[1] = (value >> 8) & 255;
+    dest[2] = (value >> 16) & 255;
+    dest[3] = (value >> 24) & 255;
+}
+
+static unsigned long
+audit_get32(const unsigned char *src)
+{
+    return src[0] | (src[1] << 8) | ((unsigned long)src[2] << 16) | ((unsigned long)src[3] << 24);
+}
+
+/* Serializes rec into dest (at least AUDIT_MAX_RECORD bytes) and
+ * returns the record length.  Over-long fields are truncated. */
+static unsigned int
+audit_encode(const struct audit_record *rec, unsigned char *dest)
+{
+    const char *fields[AUDIT_NUM_FIELDS];
+    unsigned int ii, len, pos, max;
+
+    fields[0] = rec->type;
+    fields[1] = rec->bot;
+    fields[2] = rec->channel_name;
+    fields[3] = rec->user_nick;
+    fields[4] = rec->user_account;
+    fields[5] = rec->user_hostmask;
+    fields[6] = rec->command;
+    dest[8] = AUDIT_MAGIC;
+    dest[9] = rec->sev;
+    dest[18] = dest[19] = 0;
+    pos = AUDIT_HEADER_SIZE;
+    for (ii = 0; ii < AUDIT_NUM_FIELDS; ++ii) {
+        max = (ii == AUDIT_NUM_FIELDS - 1) ? AUDIT_MAX_COMMAND : AUDIT_MAX_FIELD;
+        len = fields[ii] ? strlen(fields[ii]) : 0;
+        if (len > max)
+            len = max;
+        if (ii < AUDIT_NUM_FIELDS - 1) {
+            dest[10 + ii] = len;
+        } else {
+            dest[16] = len & 255;
+            dest[17] = len >> 8;
+        }
+        memcpy(dest + pos, fields[ii] ? fields[ii] : "", len);
+        pos += len;
+        dest[pos++] = '\0';
+    }
+    audit_put32(dest, pos);
+    audit_put32(dest + 4, rec->when);
+    return pos;
+}
+
+/* Parses the record at the start of src, which holds avail bytes.
+ * Returns the record length, or zero if the data is incomplete or
+ * corrupt.  The strings in rec point into src. */
+static unsigned int
+audit_decode(unsigned char *src, unsigned int avail, struct audit_record *rec)
+{
+    const char *fields[AUDIT_NUM_FIELDS];
+    unsigned int ii, len, pos, total;
+
+    if (avail < AUDIT_HEADER_SIZE || src[8] != AUDIT_MAGIC)
+        return 0;
+    total = audit_get32(src);
+    if (total < AUDIT_HEADER_SIZE + AUDIT_NUM_FIELDS || total > AUDIT_MAX_RECORD || total > avail)
+        return 0;
+    pos = AUDIT_HEADER_SIZE;
+    for (ii = 0; ii < AUDIT_NUM_FIELDS; ++ii) {
+        len = (ii < AUDIT_NUM_FIELDS - 1) ? src[10 + ii] : (src[16] | (src[17] << 8));
+        if (pos + len >= total || src[pos + len] != '\0')
+            return 0;
+        fields[ii] = len ? (const char*)src + pos : NULL;
+        pos += len + 1;
+    }
+    if (pos != total || src[9] >= LOG_NUM_SEVERITIES)
+        return 0;
+    rec->when = audit_get32(src + 4);
+    rec->sev = src[9];
+    rec->type = fields[0] ? fields[0] : "";
+    rec->bot = fields[1] ? fields[1] : "";
+    rec->channel_name = fields[2];
+    rec->user_nick = fields[3] ? fields[3] : "";
+    rec->user_account = fields[4];
+    rec->user_hostmask = fields[5];
+    rec->command = fields[6] ? fields[6] : "";
+    return total;
+}
+
+/* Rebuilds the in-memory indexes of seg.  A torn record at the end of
+ * the newest segment (from a crash mid-write) is cut off. */
+static void
+audit_segment_scan(struct audit_segment *seg, const char *fname, int is_newest)
+{
+    struct audit_record rec;
+    unsigned char *buf;
+    unsigned int used, pos, len;
+    unsigned long offset;
+    ssize_t res;
+    int bad = 0;
+
+    buf = malloc(65536 + AUDIT_MAX_RECORD);
+    offset = used = 0;
+    while (1) {
+        res = read(seg->fd, buf + used, 65536 + AUDIT_MAX_RECORD - used);
+        if (res < 0) {
+            log_module(MAIN_LOG, LOG_ERROR, "Unable to read audit segment %s: %s", fname, strerror(errno));
+            break;
+        }
+        used += res;
+        for (pos = 0; (len = audit_decode(buf + pos, used - pos, &rec)); pos += len)
+            audit_segment_index(seg, offset + pos, &rec);
+        offset += pos;
+        memmove(buf, buf + pos, used - pos);
+        used -= pos;
+        if (res == 0 || used >= AUDIT_MAX_RECORD) {
+            bad = (used > 0);
+            break;
+        }
+    }
+    free(buf);
+    seg->size = offset;
+    if (!bad)
+        return;
+    if (is_newest && !ftruncate(seg->fd, offset)) {
+        log_module(MAIN_LOG, LOG_WARNING, "Truncated audit segment %s at %lu (damaged record).", fname, offset);
+    } else {
+        log_module(MAIN_LOG, LOG_WARNING, "Audit segment %s is damaged after %lu bytes; ignoring the rest.", fname, offset);
+    }
+}
+
+static int
+audit_seq_compare(const void *a_, const void *b_)
+{
+    unsigned long a = *(const unsigned long*)a_, b = *(const unsigned long*)b_;
+    return (a < b) ? -1 : (a > b);
+}
+
+static void
+audit_trim(void)
+{
+    struct audit_segment *seg;
+    char fname[MAXLEN];
+
+    while (audit_segment_count > audit_conf.max_segments && audit_oldest != audit_newest) {
+        seg = audit_oldest;
+        audit_oldest = seg->newer;
+        audit_oldest->older = NULL;
+        audit_segment_count--;
+        audit_segment_path(fname, sizeof(fname), seg->seq);
+        if (unlink(fname) < 0)
+            log_module(MAIN_LOG, LOG_ERROR, "Unable to remove audit segment %s: %s", fname, strerror(errno));
+        audit_segment_free(seg);
+    }
+}
+
+static int
+audit_rotate(void)
+{
+    unsigned long seq;
+    char fname[MAXLEN];
+    int fd;
+
+    seq = audit_newest ? audit_newest->seq + 1 : 1;
+    audit_segment_path(fname, sizeof(fname), seq);
+    if ((fd = open(fname, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0666)) < 0) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to create audit segment %s: %s", fname, strerror(errno));
+        return 0;
+    }
+    audit_segment_link(audit_segment_alloc(seq, fd));
+    audit_trim();
+    return 1;
+}
+
+void
+audit_store_configure(const char *directory, unsigned long segment_size, unsigned int max_segments, unsigned int buffer_size)
+{
+    if (!directory || !*directory) {
+        audit_store_close();
+        free(audit_conf.directory);
+        audit_conf.directory = NULL;
+    } else if (!audit_conf.directory || strcmp(audit_conf.directory, directory)) {
+        audit_store_close();
+        free(audit_conf.directory);
+        audit_conf.directory = strdup(directory);
+    }
+    audit_conf.segment_size = segment_size ? segment_size : 16777216;
+    audit_conf.max_segments = max_segments ? max_segments : 1;
+    if (audit_conf.buffer_size != buffer_size) {
+        audit_store_flush();
+        free(audit_buf);
+        audit_buf = NULL;
+        audit_buf_size = 0;
+        audit_conf.buffer_size = buffer_size;
+    }
+    if (audit_state > 0)
+        audit_trim();
+}
+
+int
+audit_store_open(void)
+{
+    struct audit_segment *seg;
+    struct dirent *dirent;
+    unsigned long *seqs, seq;
+    unsigned int count, size, ii;
+    char fname[MAXLEN], *end;
+    DIR *dir;
+    int fd;
+
+    if (audit_state)
+        return audit_state > 0;
+    if (!audit_conf.directory)
+        return 0;
+    audit_state = -1;
+    if (mkdir(audit_conf.directory, 0777) < 0 && errno != EEXIST) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to create audit store %s: %s", audit_conf.directory, strerror(errno));
+        return 0;
+    }
+    if (!(dir = opendir(audit_conf.directory))) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to open audit store %s: %s", audit_conf.directory, strerror(errno));
+        return 0;
+    }
+    size = 16;
+    count = 0;
+    seqs = malloc(size * sizeof(seqs[0]));
+    while ((dirent = readdir(dir))) {
+        seq = strtoul(dirent->d_name, &end, 10);
+        if (!seq || strcmp(end, ".dat"))
+            continue;
+        if (count == size)
+            seqs = realloc(seqs, (size <<= 1) * sizeof(seqs[0]));
+        seqs[count++] = seq;
+    }
+    closedir(dir);
+    qsort(seqs, count, sizeof(seqs[0]), audit_seq_compare);
+
+    for (ii = 0; ii < count; ++ii) {
+        audit_segment_path(fname, sizeof(fname), seqs[ii]);
+        if ((fd = open(fname, (ii == count - 1) ? (O_RDWR | O_APPEND) : O_RDONLY)) < 0) {
+            log_module(MAIN_LOG, LOG_ERROR, "Unable to open audit segment %s: %s", fname, strerror(errno));
+            continue;
+        }
+        seg = audit_segment_alloc(seqs[ii], fd);
+        audit_segment_scan(seg, fname, ii == count - 1);
+        audit_segment_link(seg);
+    }
+    free(seqs);
+
+    if (!audit_newest && !audit_rotate())
+        return 0;
+    audit_state = 1;
+    audit_trim();
+    return 1;
+}
+
+void
+audit_store_close(void)
+{
+    struct audit_segment *seg;
+
+    audit_import_abandon();
+    audit_store_flush();
+    while ((seg = audit_oldest)) {
+        audit_oldest = seg->newer;
+        audit_segment_free(seg);
+    }
+    audit_newest = NULL;
+    audit_segment_count = 0;
+    audit_state = 0;
+}
+
+/* Writes used bytes of buf to the end of seg and indexes them. */
+static void
+audit_segment_write(struct audit_segment *seg, unsigned char *buf, unsigned int used)
+{
+    struct audit_record stored;
+    unsigned int pos, len;
+    ssize_t res;
+
+    res = write(seg->fd, buf, used);
+    if (res != (ssize_t)used) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to write audit records: %s", (res < 0) ? strerror(errno) : "short write");
+        if (res > 0 && ftruncate(seg->fd, seg->size) < 0)
+            log_module(MAIN_LOG, LOG_ERROR, "Unable to discard partial audit records: %s", strerror(errno));
+        return;
+    }
+    /* Index what was actually stored, since fields may be truncated. */
+    for (pos = 0; pos < used; pos += len) {
+        if (!(len = audit_decode(buf + pos, used - pos, &stored)))
+            break;
+        audit_segment_index(seg, seg->size + pos, &stored);
+    }
+    seg->size += used;
+}
+
+void
+audit_store_flush(void)
+{
+    if (!audit_buf_used)
+        return;
+    audit_segment_write(audit_newest, audit_buf, audit_buf_used);
+    audit_buf_used = 0;
+}
+
+int
+audit_store_append(const struct audit_record *rec)
+{
+    unsigned char buf[AUDIT_MAX_RECORD];
+    unsigned int len;
+
+    if (!audit_store_open())
+        return 0;
+    len = audit_encode(rec, buf);
+    if ((audit_newest->size + audit_buf_used)
+        && (audit_newest->size + audit_buf_used + len > audit_conf.segment_size)) {
+        audit_store_flush();
+        audit_rotate();
+    }
+    if (!audit_buf) {
+        audit_buf_size = audit_conf.buffer_size + AUDIT_MAX_RECORD;
+        audit_buf = malloc(audit_buf_size);
+    }
+    if (audit_buf_used + len > audit_buf_size)
+        audit_store_flush();
+    memcpy(audit_buf + audit_buf_used, buf, len);
+    audit_buf_used += len;
+    if (audit_buf_used >= audit_conf.buffer_size / 2) {
+        audit_store_flush();
+        return 0;
+    }
+    return 1;
+}
+
+unsigned int
+audit_store_walk(const char *channel, const char *account, time_t min_time, unsigned int max_read, audit_walk_func func, void *extra)
+{
+    unsigned char buf[AUDIT_MAX_RECORD];
+    struct audit_segment *seg;
+    struct audit_offsets *offsets;
+    struct audit_record rec;
+    unsigned int ii, nread;
+    ssize_t res;
+
+    if (!audit_store_open())
+        return 0;
+    audit_store_flush();
+    nread = 0;
+    for (seg = audit_newest; seg; seg = seg->older) {
+        if (seg->records.used && seg->last < min_time)
+            break;
+        if (channel)
+            offsets = dict_find(seg->channels, channel, NULL);
+        else if (account)
+            offsets = dict_find(seg->accounts, account, NULL);
+        else
+            offsets = &seg->records;
+        if (!offsets)
+            continue;
+        for (ii = offsets->used; ii > 0; ) {
+            if (nread >= max_read)
+                return nread;
+            nread++;
+            res = pread(seg->fd, buf, sizeof(buf), offsets->list[--ii]);
+            if (res <= 0 || !audit_decode(buf, res, &rec)) {
+                log_module(MAIN_LOG, LOG_ERROR, "Unable to read audit record %lu:%u.", seg->seq, offsets->list[ii]);
+                continue;
+            }
+            if (rec.when < min_time)
+                return nread;
+            if (channel && account && (!rec.user_account || irccasecmp(rec.user_account, account)))
+                continue;
+            if (func(&rec, extra))
+                return nread;
+        }
+    }
+    return nread;
+}
+
+/* Splits "nick[!ident@host][:account]" from a text audit line.  IPv6
+ * hosts contain colons too, so a trailing hex group after one is taken
+ * to be part of the host rather than an account name. */
+static void
+audit_import_user(char *text, struct audit_record *rec)
+{
+    char *bang, *at, *colon, *pos;
+
+    rec->user_nick = text;
+    rec->user_account = rec->user_hostmask = NULL;
+    bang = strchr(text, '!');
+    at = bang ? strchr(bang, '@') : NULL;
+    colon = strrchr(text, ':');
+    if (colon && at && colon > at && memchr(at, ':', colon - at)) {
+        for (pos = colon + 1; isxdigit(*pos); ++pos) ;
+        if (!*pos)
+            colon = NULL;
+    }
+    if (colon) {
+        *colon = '\0';
+        rec->user_account = colon + 1;
+    }
+    if (bang) {
+        *bang = '\0';
+        rec->user_hostmask = bang + 1;
+    }
+}
+
+/* Parses one "[HH:MM:SS MM/DD/YYYY] (bot[:#channel]) [user]: command"
+ * line into rec, which then points into line. */
+static int
+audit_import_parse(char *line, struct audit_record *rec)
+{
+    char *pos, *end;
+    struct tm tm;
+    int len;
+
+    memset(&tm, 0, sizeof(tm));
+    len = 0;
+    if (sscanf(line, "[%d:%d:%d %d/%d/%d] (%n", &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_mon, &tm.tm_mday, &tm.tm_year, &len) < 6 || !len)
+        return 0;
+    pos = line + len;
+    if (!(end = strstr(pos, ") [")))
+        return 0;
+    *end = '\0';
+    memset(rec, 0, sizeof(*rec));
+    rec->sev = LOG_COMMAND;
+    rec->bot = rec->type = pos;
+    if ((rec->channel_name = strchr(pos, ':')))
+        *(char*)rec->channel_name++ = '\0';
+    pos = end + 3;
+    if (!(end = strstr(pos, "]: ")))
+        return 0;
+    *end = '\0';
+    audit_import_user(pos, rec);
+    rec->command = end + 3;
+    if ((end = strpbrk(rec->command, "\r\n")))
+        *end = '\0';
+    tm.tm_mon -= 1;
+    tm.tm_year -= 1900;
+    tm.tm_isdst = -1;
+    rec->when = mktime(&tm);
+    return 1;
+}
+
+static void
+audit_import_free(int discard)
+{
+    struct audit_segment *seg;
+    char fname[MAXLEN];
+
+    if (audit_import.file)
+        fclose(audit_import.file);
+    free(audit_import.buf);
+    while (discard && (seg = audit_import.oldest)) {
+        audit_import.oldest = seg->newer;
+        audit_import_path(fname, sizeof(fname), seg->seq);
+        unlink(fname);
+        audit_segment_free(seg);
+    }
+    memset(&audit_import, 0, sizeof(audit_import));
+}
+
+static int
+audit_import_rotate(void)
+{
+    struct audit_segment *seg;
+    unsigned long seq;
+    char fname[MAXLEN];
+    int fd;
+
+    seq = audit_import.newest ? audit_import.newest->seq + 1 : 1;
+    audit_import_path(fname, sizeof(fname), seq);
+    if ((fd = open(fname, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0666)) < 0) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to create audit segment %s: %s", fname, strerror(errno));
+        return 0;
+    }
+    seg = audit_segment_alloc(seq, fd);
+    seg->older = audit_import.newest;
+    if (audit_import.newest)
+        audit_import.newest->newer = seg;
+    else
+        audit_import.oldest = seg;
+    audit_import.newest = seg;
+    /* Anything that would be trimmed right after the import can go now. */
+    if (++audit_import.segment_count > audit_conf.max_segments) {
+        seg = audit_import.oldest;
+        audit_import.oldest = seg->newer;
+        audit_import.oldest->older = NULL;
+        audit_import.segment_count--;
+        audit_import_path(fname, sizeof(fname), seg->seq);
+        unlink(fname);
+        audit_segment_free(seg);
+    }
+    return 1;
+}
+
+static void
+audit_import_write(void)
+{
+    if (!audit_import.buf_used)
+        return;
+    audit_segment_write(audit_import.newest, audit_import.buf, audit_import.buf_used);
+    audit_import.buf_used = 0;
+}
+
+static int
+audit_import_step(UNUSED_ARG(void *extra))
+{
+    struct audit_segment *seg;
+    struct audit_record rec;
+    unsigned char buf[AUDIT_MAX_RECORD];
+    char line[MAXLEN * 4];
+    unsigned int len;
+
+    /* Lines logged after the import started went into the store already. */
+    if (ftell(audit_import.file) >= audit_import.end
+        || !fgets(line, sizeof(line), audit_import.file))
+        return 0;
+    if (!audit_import_parse(line, &rec))
+        return 1;
+    len = audit_encode(&rec, buf);
+    seg = audit_import.newest;
+    if ((seg->size + audit_import.buf_used)
+        && (seg->size + audit_import.buf_used + len > audit_conf.segment_size)) {
+        audit_import_write();
+        if (!audit_import_rotate())
+            return 0;
+    }
+    if (audit_import.buf_used + len > AUDIT_IMPORT_BUFFER)
+        audit_import_write();
+    memcpy(audit_import.buf + audit_import.buf_used, buf, len);
+    audit_import.buf_used += len;
+    audit_import.count++;
+    return 1;
+}
+
+static void
+audit_import_done(UNUSED_ARG(void *extra))
+{
+    struct audit_segment *seg;
+    audit_import_func done;
+    unsigned long count, shift;
+    char from[MAXLEN], to[MAXLEN];
+    void *done_extra;
+
+    audit_import_write();
+    count = audit_import.count;
+    done = audit_import.done;
+    done_extra = audit_import.extra;
+    if (!count) {
+        audit_import_free(1);
+        done(count, done_extra);
+        return;
+    }
+
+    /* Renumber the live segments past the imported ones if needed,
+     * newest first so no name is reused before it has been moved. */
+    if (audit_import.newest->seq >= audit_oldest->seq) {
+        shift = audit_import.newest->seq - audit_oldest->seq + 1;
+        for (seg = audit_newest; seg; seg = seg->older) {
+            audit_segment_path(from, sizeof(from), seg->seq);
+            audit_segment_path(to, sizeof(to), seg->seq + shift);
+            if (rename(from, to) < 0)
+                log_module(MAIN_LOG, LOG_ERROR, "Unable to rename audit segment %s: %s", from, strerror(errno));
+            seg->seq += shift;
+        }
+    }
+    for (seg = audit_import.oldest; seg; seg = seg->newer) {
+        audit_import_path(from, sizeof(from), seg->seq);
+        audit_segment_path(to, sizeof(to), seg->seq);
+        if (rename(from, to) < 0)
+            log_module(MAIN_LOG, LOG_ERROR, "Unable to rename audit segment %s: %s", from, strerror(errno));
+    }
+
+    audit_import.newest->newer = audit_oldest;
+    audit_oldest->older = audit_import.newest;
+    audit_oldest = audit_import.oldest;
+    audit_segment_count += audit_import.segment_count;
+    audit_import.oldest = audit_import.newest = NULL;
+    audit_import_free(0);
+    audit_trim();
+    done(count, done_extra);
+}
+
+static void
+audit_import_abandon(void)
+{
+    if (!audit_import.sweep)
+        return;
+    log_module(MAIN_LOG, LOG_WARNING, "Abandoning the audit log import after %lu records.", audit_import.count);
+    sweep_cancel(audit_import.sweep);
+    audit_import_free(1);
+}
+
+enum audit_import_result
+audit_store_import(const char *fname, audit_import_func done, void *extra)
+{
+    FILE *file;
+
+    if (!audit_store_open())
+        return AUDIT_IMPORT_NO_STORE;
+    if (audit_import.sweep)
+        return AUDIT_IMPORT_BUSY;
+    /* Imported records are older than anything stored since the store
+     * was enabled, and may duplicate it, so only fill an empty store. */
+    if (audit_oldest != audit_newest || audit_newest->size || audit_buf_used)
+        return AUDIT_IMPORT_NOT_EMPTY;
+    if (!(file = fopen(fname, "r")))
+        return AUDIT_IMPORT_FAILED;
+    if (fseek(file, 0, SEEK_END) < 0 || (audit_import.end = ftell(file)) < 0) {
+        fclose(file);
+        return AUDIT_IMPORT_FAILED;
+    }
+    rewind(file);
+    audit_import.file = file;
+    if (!audit_import_rotate()) {
+        audit_import_free(1);
+        return AUDIT_IMPORT_FAILED;
+    }
+    audit_import.buf = malloc(AUDIT_IMPORT_BUFFER);
+    audit_import.done = done;
+    audit_import.extra = extra;
+    audit_import.sweep = sweep_job("audit import", audit_import_step, audit_import_done, NULL);
+    sweep_set_slice(audit_import.sweep, 4096, 0);
+    return AUDIT_IMPORT_STARTED;
+}
+
+int
+audit_store_get_stats(struct audit_store_stats *stats)
+{
+    struct audit_segment *seg;
+
+    memset(stats, 0, sizeof(*stats));
+    if (audit_state <= 0)
+        return 0;
+    for (seg = audit_oldest; seg; seg = seg->newer) {
+        stats->segments++;
+        stats->records += seg->records.used;
+        stats->bytes += seg->size;
+        stats->channels += dict_size(seg->channels);
+        stats->accounts += dict_size(seg->accounts);
+        if (!stats->oldest)
+            stats->oldest = seg->first;
+    }
+    return 1;
+}
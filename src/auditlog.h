@@ -0,0 +1,89 @@
+/* auditlog.h - indexed on-disk store for audited commands
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef AUDITLOG_H
+#define AUDITLOG_H
+
+#include "log.h"
+
+/* One audited command.  Optional fields are NULL when absent; records
+ * handed to an audit_walk_func only live until the callback returns. */
+struct audit_record
+{
+    time_t            when;
+    enum log_severity sev;
+    const char        *type;
+    const char        *bot;
+    const char        *channel_name;
+    const char        *user_nick;
+    const char        *user_account;
+    const char        *user_hostmask;
+    const char        *command;
+};
+
+/* Return non-zero to stop the walk. */
+typedef int (*audit_walk_func)(const struct audit_record *rec, void *extra);
+
+struct audit_store_stats
+{
+    unsigned int  segments;
+    unsigned long records;
+    unsigned long bytes;
+    unsigned int  channels;
+    unsigned int  accounts;
+    time_t        oldest;
+};
+
+/* (Re)configures the store; a NULL or empty directory disables it.
+ * audit_store_open() reads the indexes of an existing store, which
+ * takes a while for a big one; it is called again on every use. */
+void audit_store_configure(const char *directory, unsigned long segment_size, unsigned int max_segments, unsigned int buffer_size);
+int audit_store_open(void);
+void audit_store_close(void);
+
+/* Queues rec for writing.  Returns non-zero if it is still waiting in
+ * the buffer, in which case audit_store_flush() must be called soon. */
+int audit_store_append(const struct audit_record *rec);
+void audit_store_flush(void);
+
+/* Visits records from newest to oldest, stopping at the first record
+ * older than min_time or after reading max_read records.  When channel
+ * or account is given, only records with exactly that channel or
+ * account are read from disk.  Returns the number of records read. */
+unsigned int audit_store_walk(const char *channel, const char *account, time_t min_time, unsigned int max_read, audit_walk_func func, void *extra);
+
+/* Called with the number of records once an import has finished. */
+typedef void (*audit_import_func)(unsigned long count, void *extra);
+
+enum audit_import_result {
+    AUDIT_IMPORT_STARTED,
+    AUDIT_IMPORT_NO_STORE,
+    AUDIT_IMPORT_BUSY,
+    AUDIT_IMPORT_NOT_EMPTY,
+    AUDIT_IMPORT_FAILED /* errno says why */
+};
+
+/* Starts copying the audit lines of a text log such as everything.log
+ * into the store in the background.  Only a store that holds no
+ * records yet can be imported into. */
+enum audit_import_result audit_store_import(const char *fname, audit_import_func done, void *extra);
+int audit_store_get_stats(struct audit_store_stats *stats);
+
+#endif /* !defined(AUDITLOG_H) */
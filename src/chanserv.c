@@ -22,13 +22,17 @@
 #include "conf.h"
 #include "global.h"
 #include "gline.h"
+#include "globset.h"
+#include "heap.h"
 #include "ioset.h"
+#include "metrics.h"
 #include "modcmd.h"
 #include "opserv.h" /* for opserv_bad_channel() */
 #include "nickserv.h" /* for oper_outranks() */
 #include "saxdb.h"
 #include "shun.h"
 #include "spamserv.h"
+#include "sweep.h"
 #include "timeq.h"
 
 #define CHANSERV_CONF_NAME  "services/chanserv"
@@ -43,7 +47,6 @@
 #define KEY_ADJUST_DELAY    "adjust_delay"
 #define KEY_CHAN_EXPIRE_FREQ    "chan_expire_freq"
 #define KEY_CHAN_EXPIRE_DELAY   "chan_expire_delay"
-#define KEY_DNR_EXPIRE_FREQ "dnr_expire_freq"
 #define KEY_BAN_TIMEOUT_FREQ    "ban_timeout_freq"
 #define KEY_MAX_CHAN_USERS      "max_chan_users"
 #define KEY_MAX_CHAN_BANS   "max_chan_bans"
@@ -599,6 +602,9 @@ dict_t note_types;
 int off_channel;
 extern struct string_list *autojoin_channels;
 static dict_t plain_dnrs, mask_dnrs, handle_dnrs;
+static struct globset *mask_dnr_set;
+static heap_t dnr_expiry_heap;
+static time_t dnr_expiry_next;
 static struct log_type *CS_LOG;
 struct adduserPending* adduser_pendings = NULL;
 unsigned int adduser_pendings_count = 0;
@@ -612,7 +618,6 @@ static struct
     unsigned long   db_backup_frequency;
     unsigned long   channel_expire_frequency;
     unsigned long      ban_timeout_frequency;
-    unsigned long   dnr_expire_frequency;
 
     long        info_delay;
     unsigned int    adjust_delay;
@@ -1785,72 +1790,132 @@ unregister_channel(struct chanData *channel, const char *reason)
     registered_channels--;
 }
 
-static void
-expire_channels(UNUSED_ARG(void *data))
+static struct sweep *channel_expire_sweep;
+static char channel_expire_reason[INTERVALLEN + 64];
+
+static int
+expire_channel(UNUSED_ARG(const char *key), void *data, UNUSED_ARG(void *extra))
 {
-    struct chanData *channel, *next;
+    struct chanNode *cNode = data;
+    struct chanData *channel = cNode->channel_info;
     struct userData *user;
-    char delay[INTERVALLEN], reason[INTERVALLEN + 64];
 
-    intervalString(delay, chanserv_conf.channel_expire_delay, NULL);
-    sprintf(reason, "Channel registration automatically expired after %s of disuse.", delay);
+    if(!channel)
+        return 0;
 
-    for(channel = channelList; channel; channel = next)
-    {
-    next = channel->next;
+    /* See if the channel can be expired. */
+    if(((now - channel->visited) <= chanserv_conf.channel_expire_delay)
+       || IsProtected(channel))
+        return 0;
 
-        /* See if the channel can be expired. */
-        if(((now - channel->visited) <= chanserv_conf.channel_expire_delay)
-           || IsProtected(channel))
-            continue;
+    /* Make sure there are no high-ranking users still in the channel. */
+    for(user=channel->users; user; user=user->next)
+        if(user->present && (user->access >= UL_PRESENT))
+            break;
+    if(user)
+        return 0;
 
-        /* Make sure there are no high-ranking users still in the channel. */
-        for(user=channel->users; user; user=user->next)
-            if(user->present && (user->access >= UL_PRESENT))
-                break;
-        if(user)
-            continue;
+    /* Unregister the channel */
+    log_module(CS_LOG, LOG_INFO, "(%s) Channel registration expired.", cNode->name);
+    spamserv_cs_unregister(NULL, cNode, expire, NULL);
+    unregister_channel(channel, channel_expire_reason);
+    return 0;
+}
 
-        /* Unregister the channel */
-        log_module(CS_LOG, LOG_INFO, "(%s) Channel registration expired.", channel->channel->name);
-        spamserv_cs_unregister(NULL, channel->channel, expire, NULL);
-        unregister_channel(channel, "registration expired.");
-    }
+static void
+expire_channels_done(UNUSED_ARG(void *extra))
+{
+    channel_expire_sweep = NULL;
+}
+
+static void
+expire_channels_start(void)
+{
+    char delay[INTERVALLEN];
 
+    if(channel_expire_sweep)
+        return;
+    intervalString(delay, chanserv_conf.channel_expire_delay, NULL);
+    sprintf(channel_expire_reason, "Channel registration automatically expired after %s of disuse.", delay);
+    channel_expire_sweep = sweep_dict("chanserv-expire", channels, expire_channel, expire_channels_done, NULL);
+}
+
+static void
+expire_channels(UNUSED_ARG(void *data))
+{
+    expire_channels_start();
     if(chanserv_conf.channel_expire_frequency)
-    timeq_add(now + chanserv_conf.channel_expire_frequency, expire_channels, NULL);
+        timeq_add(now + chanserv_conf.channel_expire_frequency, expire_channels, NULL);
+}
+
+/* DNRs with an expiry time are queued by name in dnr_expiry_heap, and
+ * a single timeq entry is kept for the earliest one.  Removing a DNR
+ * leaves its heap entry behind; expire_dnrs() checks the DNR that is
+ * there now before removing anything. */
+static void expire_dnrs(void *data);
+
+static void
+dnr_expiry_schedule(void)
+{
+    void *key;
+
+    if(!heap_size(dnr_expiry_heap))
+        return;
+    heap_peek(dnr_expiry_heap, &key, NULL);
+    if(dnr_expiry_next && dnr_expiry_next <= (time_t)key)
+        return;
+    if(dnr_expiry_next)
+        timeq_del(dnr_expiry_next, expire_dnrs, NULL, 0);
+    dnr_expiry_next = (time_t)key;
+    timeq_add(dnr_expiry_next, expire_dnrs, NULL);
+}
+
+static void
+dnr_expiry_add(struct do_not_register *dnr)
+{
+    heap_insert(dnr_expiry_heap, (void*)dnr->expires, strdup(dnr->chan_name));
+    dnr_expiry_schedule();
 }
 
 static void
 expire_dnrs(UNUSED_ARG(void *data))
 {
-    dict_iterator_t it, next;
     struct do_not_register *dnr;
+    void *key;
+    char *chan_name;
+    dict_t dict;
 
-    for(it = dict_first(handle_dnrs); it; it = next)
-    {
-        dnr = iter_data(it);
-        next = iter_next(it);
-        if(dnr->expires && dnr->expires <= now)
-            dict_remove(handle_dnrs, dnr->chan_name + 1);
-    }
-    for(it = dict_first(plain_dnrs); it; it = next)
+    dnr_expiry_next = 0;
+    while(heap_size(dnr_expiry_heap))
     {
-        dnr = iter_data(it);
-        next = iter_next(it);
-        if(dnr->expires && dnr->expires <= now)
-            dict_remove(plain_dnrs, dnr->chan_name + 1);
-    }
-    for(it = dict_first(mask_dnrs); it; it = next)
-    {
-        dnr = iter_data(it);
-        next = iter_next(it);
-        if(dnr->expires && dnr->expires <= now)
-            dict_remove(mask_dnrs, dnr->chan_name + 1);
+        heap_peek(dnr_expiry_heap, &key, (void**)&chan_name);
+        if((time_t)key > now)
+            break;
+        heap_pop(dnr_expiry_heap);
+        if(chan_name[0] == '*')
+            dict = handle_dnrs;
+        else if(strpbrk(chan_name, "*?"))
+            dict = mask_dnrs;
+        else
+            dict = plain_dnrs;
+        dnr = dict_find(dict, chan_name + (dict == handle_dnrs), NULL);
+        if(dnr && dnr->expires && dnr->expires <= now)
+        {
+            log_module(CS_LOG, LOG_DEBUG, "Do-not-register entry %s expired.", dnr->chan_name);
+            dict_remove(dict, chan_name + (dict == handle_dnrs));
+        }
+        free(chan_name);
     }
+    dnr_expiry_schedule();
+}
+
+static void
+free_mask_dnr(void *data)
+{
+    struct do_not_register *dnr = data;
 
-    if(chanserv_conf.dnr_expire_frequency)
-        timeq_add(now + chanserv_conf.dnr_expire_frequency, expire_dnrs, NULL);
+    globset_remove(mask_dnr_set, dnr->chan_name);
+    free(dnr);
 }
 
 static int
@@ -1968,49 +2033,62 @@ chanserv_add_dnr(const char *chan_name, const char *setter, time_t expires, cons
     if(dnr->chan_name[0] == '*')
         dict_insert(handle_dnrs, dnr->chan_name+1, dnr);
     else if(strpbrk(dnr->chan_name, "*?"))
+    {
         dict_insert(mask_dnrs, dnr->chan_name, dnr);
+        globset_add(mask_dnr_set, dnr->chan_name, dnr);
+    }
     else
         dict_insert(plain_dnrs, dnr->chan_name, dnr);
+    if(dnr->expires)
+        dnr_expiry_add(dnr);
     return dnr;
 }
 
+static int
+collect_mask_dnr(UNUSED_ARG(const char *glob), void *data, void *extra)
+{
+    struct do_not_register *dnr = data;
+
+    if(!dnr->expires || dnr->expires > now)
+        dnrList_append(extra, dnr);
+    return 0;
+}
+
+static int
+dnr_compare_names(const void *a, const void *b)
+{
+    const struct do_not_register *dnr_a = *(const struct do_not_register**)a;
+    const struct do_not_register *dnr_b = *(const struct do_not_register**)b;
+    return irccasecmp(dnr_a->chan_name, dnr_b->chan_name);
+}
+
 static struct dnrList
 chanserv_find_dnrs(const char *chan_name, const char *handle, unsigned int max)
 {
-    struct dnrList list;
-    dict_iterator_t it, next;
+    struct dnrList list, masks;
     struct do_not_register *dnr;
+    unsigned int ii;
 
     dnrList_init(&list);
 
-    if(handle && (dnr = dict_find(handle_dnrs, handle, NULL)))
-    {
-        if(dnr->expires && dnr->expires <= now)
-            dict_remove(handle_dnrs, handle);
-        else if (list.used < max)
-            dnrList_append(&list, dnr);
-    }
+    /* Expired entries are skipped here; expire_dnrs() removes them. */
+    if(handle && (dnr = dict_find(handle_dnrs, handle, NULL))
+       && (!dnr->expires || dnr->expires > now) && (list.used < max))
+        dnrList_append(&list, dnr);
 
-    if(chan_name && (dnr = dict_find(plain_dnrs, chan_name, NULL)))
-    {
-        if(dnr->expires && dnr->expires <= now)
-            dict_remove(plain_dnrs, chan_name);
-        else if (list.used < max)
-            dnrList_append(&list, dnr);
-    }
-    if(chan_name)
+    if(chan_name && (dnr = dict_find(plain_dnrs, chan_name, NULL))
+       && (!dnr->expires || dnr->expires > now) && (list.used < max))
+        dnrList_append(&list, dnr);
+
+    if(chan_name && (list.used < max))
     {
-        for(it = dict_first(mask_dnrs); it && list.used < max; it = next)
-        {
-            next = iter_next(it);
-            if(!match_ircglob(chan_name, iter_key(it)))
-                continue;
-            dnr = iter_data(it);
-            if(dnr->expires && dnr->expires <= now)
-                dict_remove(mask_dnrs, iter_key(it));
-            else
-                dnrList_append(&list, dnr);
-        }
+        /* Report masks in mask_dnrs order, as a scan of it would. */
+        dnrList_init(&masks);
+        globset_match(mask_dnr_set, chan_name, collect_mask_dnr, &masks);
+        qsort(masks.list, masks.used, sizeof(masks.list[0]), dnr_compare_names);
+        for(ii = 0; (ii < masks.used) && (list.used < max); ii++)
+            dnrList_append(&list, masks.list[ii]);
+        dnrList_clean(&masks);
     }
     return list;
 }
@@ -2068,18 +2146,14 @@ chanserv_is_dnr(const char *chan_name, struct handle_info *handle)
 static unsigned int send_dnrs(struct userNode *user, dict_t dict)
 {
     struct do_not_register *dnr;
-    dict_iterator_t it, next;
+    dict_iterator_t it;
     unsigned int matches = 0;
 
-    for(it = dict_first(dict); it; it = next)
+    for(it = dict_first(dict); it; it = iter_next(it))
     {
         dnr = iter_data(it);
-        next = iter_next(it);
         if(dnr->expires && dnr->expires <= now)
-        {
-            dict_remove(dict, iter_key(it));
             continue;
-        }
         dnr_print_func(dnr, user);
         matches++;
     }
@@ -6054,10 +6128,17 @@ chanserv_support_channels(void)
     return &chanserv_conf.support_channels;
 }
 
+unsigned int
+chanserv_registered_channels(void)
+{
+    return registered_channels;
+}
+
 static CHANSERV_FUNC(cmd_expire)
 {
     int channel_count = registered_channels;
-    expire_channels(NULL);
+    expire_channels_start();
+    sweep_finish(channel_expire_sweep);
     reply("CSMSG_CHANNELS_EXPIRED", channel_count - registered_channels);
     return 1;
 }
@@ -7596,15 +7677,7 @@ static CHANSERV_FUNC(cmd_spin)
     if(!channel)
         return 1;
       
-    int type = 0, lamep = 1;
-    char *tstr;
-
-    tstr = conf_get_data("server/type", RECDB_QSTRING);
-    if(tstr) {
-        type = atoi(tstr);
-        if (type > 6)
-            lamep = 0;
-    }
+    int lamep = server_conf.type <= 6;
 
 
     send_target_message(1, channel->name, chanserv, "CSMSG_SPIN_WHEEL1", user->nick);
@@ -7630,7 +7703,7 @@ static CHANSERV_FUNC(cmd_spin)
     /* connection reset by peer */
     if (!strcasecmp(wheel, "peer")) {
          send_target_message(1, channel->name, chanserv, "CSMSG_SPIN_PEER");
-         if (type < 7)
+         if (server_conf.type < 7)
               irc_kill(chanserv, user, "Connection reset by peer");
          else
               irc_svsquit(chanserv, user, "Connection reset by peer");
@@ -8836,6 +8909,8 @@ static void handle_rename(struct handle_info *handle, const char *old_handle, UN
         dict_remove2(handle_dnrs, old_handle, 1);
         safestrncpy(dnr->chan_name + 1, handle->handle, sizeof(dnr->chan_name) - 1);
         dict_insert(handle_dnrs, dnr->chan_name + 1, dnr);
+        if(dnr->expires)
+            dnr_expiry_add(dnr);
     }
 }
 
@@ -8932,8 +9007,6 @@ chanserv_conf_read(void)
     chanserv_conf.ban_timeout_frequency = str ? ParseInterval(str) : 600;
     str = database_get_data(conf_node, KEY_CHAN_EXPIRE_DELAY, RECDB_QSTRING);
     chanserv_conf.channel_expire_delay = str ? ParseInterval(str) : 86400*30;
-    str = database_get_data(conf_node, KEY_DNR_EXPIRE_FREQ, RECDB_QSTRING);
-    chanserv_conf.dnr_expire_frequency = str ? ParseInterval(str) : 3600;
     str = database_get_data(conf_node, KEY_NODELETE_LEVEL, RECDB_QSTRING);
     chanserv_conf.nodelete_level = str ? atoi(str) : 1;
     str = database_get_data(conf_node, KEY_MAX_CHAN_USERS, RECDB_QSTRING);
@@ -9814,6 +9887,10 @@ static void
 chanserv_db_cleanup(UNUSED_ARG(void *extra)) {
     unsigned int ii;
     unreg_part_func(handle_part, NULL);
+    if(channel_expire_sweep)
+        sweep_cancel(channel_expire_sweep);
+    channel_expire_sweep = NULL;
+    timeq_del(0, expire_dnrs, NULL, TIMEQ_IGNORE_WHEN);
     while(channelList)
         unregister_channel(channelList, "terminating.");
     for(ii = 0; ii < chanserv_conf.support_channels.used; ++ii)
@@ -9822,6 +9899,15 @@ chanserv_db_cleanup(UNUSED_ARG(void *extra)) {
     dict_delete(handle_dnrs);
     dict_delete(plain_dnrs);
     dict_delete(mask_dnrs);
+    globset_delete(mask_dnr_set);
+    while(heap_size(dnr_expiry_heap))
+    {
+        void *chan_name;
+        heap_peek(dnr_expiry_heap, NULL, &chan_name);
+        heap_pop(dnr_expiry_heap);
+        free(chan_name);
+    }
+    heap_delete(dnr_expiry_heap);
     dict_delete(note_types);
     free_string_list(chanserv_conf.eightball);
     free_string_list(chanserv_conf.old_ban_names);
@@ -9845,6 +9931,12 @@ chanserv_db_cleanup(UNUSED_ARG(void *extra)) {
 #define DEFINE_CHANNEL_OPTION(NAME) modcmd_register(chanserv_module, "set "#NAME, chan_opt_##NAME, 1, 0, NULL)
 #define DEFINE_USER_OPTION(NAME) modcmd_register(chanserv_module, "uset "#NAME, user_opt_##NAME, 1, MODCMD_REQUIRE_REGCHAN, NULL)
 
+static double
+chanserv_metric_channels(UNUSED_ARG(void *extra))
+{
+    return registered_channels;
+}
+
 void
 init_chanserv(const char *nick)
 {
@@ -9868,13 +9960,16 @@ init_chanserv(const char *nick)
 
     reg_handle_rename_func(handle_rename, NULL);
     reg_unreg_func(handle_unreg, NULL);
+    metrics_register("x3_registered_channels", "Channels registered with ChanServ.", METRIC_GAUGE, chanserv_metric_channels, NULL);
 
     handle_dnrs = dict_new();
     dict_set_free_data(handle_dnrs, free);
     plain_dnrs = dict_new();
     dict_set_free_data(plain_dnrs, free);
     mask_dnrs = dict_new();
-    dict_set_free_data(mask_dnrs, free);
+    dict_set_free_data(mask_dnrs, free_mask_dnr);
+    mask_dnr_set = globset_new();
+    dnr_expiry_heap = heap_new(ulong_comparator);
 
     reg_svccmd_unbind_func(handle_svccmd_unbind, NULL);
     chanserv_module = module_register("ChanServ", CS_LOG, "chanserv.help", chanserv_expand_variable);
@@ -10050,9 +10145,6 @@ init_chanserv(const char *nick)
     if(chanserv_conf.channel_expire_frequency)
     timeq_add(now + chanserv_conf.channel_expire_frequency, expire_channels, NULL);
 
-    if(chanserv_conf.dnr_expire_frequency)
-        timeq_add(now + chanserv_conf.dnr_expire_frequency, expire_dnrs, NULL);
-
     if(chanserv_conf.ban_timeout_frequency)
         timeq_add(now + chanserv_conf.ban_timeout_frequency, expire_bans, NULL);
 
@@ -216,6 +216,7 @@ struct banData *add_channel_ban(struct chanData *channel, const char *mask, char
 void init_chanserv(const char *nick);
 void del_channel_user(struct userData *user, int do_gc);
 struct channelList *chanserv_support_channels(void);
+unsigned int chanserv_registered_channels(void);
 unsigned short user_level_from_name(const char *name, unsigned short clamp_level);
 struct do_not_register *chanserv_is_dnr(const char *chan_name, struct handle_info *handle);
 int check_user_level(struct chanNode *channel, struct userNode *user, enum levelOption opt, int allow_override, int exempt_owner);
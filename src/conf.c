@@ -21,6 +21,8 @@
 #include "conf.h"
 #include "log.h"
 
+struct server_conf server_conf;
+
 static dict_t conf_db;
 static conf_reload_func *reload_funcs;
 static int num_rfs, size_rfs;
@@ -50,13 +52,32 @@ conf_call_reload_funcs(void)
     for (i=0; i<num_rfs; i++) reload_funcs[i]();
 }
 
+static void
+conf_read_server(struct server_conf *conf)
+{
+    const char *str;
+
+    str = conf_get_data("server/type", RECDB_QSTRING);
+    conf->type = str ? atoi(str) : 0;
+    str = conf_get_data("server/hidden_host_type", RECDB_QSTRING);
+    conf->hidden_host_type = str ? atoi(str) : 1;
+    str = conf_get_data("server/host_in_topic", RECDB_QSTRING);
+    conf->host_in_topic = str ? atoi(str) : 0;
+    str = conf_get_data("server/reliable_clock", RECDB_QSTRING);
+    conf->reliable_clock = str ? enabled_string(str) : 0;
+}
+
 int
 conf_read(const char *conf_file_name)
 {
     dict_t old_conf = conf_db;
+    struct server_conf new_server;
+
     if (!(conf_db = parse_database(conf_file_name))) {
         goto fail;
     }
+    conf_read_server(&new_server);
+    server_conf = new_server;
     if (reload_funcs) {
         conf_call_reload_funcs();
     }
@@ -34,4 +34,16 @@ void *conf_get_data(const char *full_path, enum recdb_type type);
 struct record_data *conf_get_node(const char *full_path);
 const char *conf_enum_root(dict_iterator_f it, void *extra);
 
+/* Parsed copies of "server" settings that are consulted for every
+ * user, burst or topic.  conf_read() rebuilds the whole structure from
+ * the new file before any reload function runs, so readers never see
+ * a mix of old and new values. */
+struct server_conf {
+    int type;
+    int hidden_host_type;
+    int host_in_topic;
+    unsigned int reliable_clock : 1;
+};
+extern struct server_conf server_conf;
+
 #endif
@@ -279,6 +279,23 @@ dict_find(dict_t dict, const char *key, int *found)
     return was_found ? dict->root->data : NULL;
 }
 
+/*
+ *    Find the first entry whose key sorts at or after "key".
+ *    After splaying, the root is either the key itself or one of its
+ *    neighbors, so at most one step along the linked list is needed.
+ */
+dict_iterator_t
+dict_lower_bound(dict_t dict, const char *key)
+{
+    if (!dict || !dict->root || !key)
+        return NULL;
+    verify(dict);
+    dict->root = dict_splay(dict->root, key);
+    if (irccasecmp(key, dict->root->key) <= 0)
+        return dict->root;
+    return dict->root->next;
+}
+
 /*
  *    Delete an entire dictionary.
  */
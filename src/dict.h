@@ -58,6 +58,8 @@ unsigned int dict_size(dict_t dict);
 /* if present!=NULL, then *present=1 iff node was found (if node is
  * not found, return value is NULL, which may be a valid datum) */
 void* dict_find(dict_t dict, const char *key, int *present);
+/* returns the first node whose key is not less than key, or NULL */
+dict_iterator_t dict_lower_bound(dict_t dict, const char *key);
 int dict_remove2(dict_t dict, const char *key, int no_dispose);
 #define dict_remove(DICT, KEY) dict_remove2(DICT, KEY, 0)
 char *dict_sanity_check(dict_t dict);
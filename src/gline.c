@@ -20,8 +20,11 @@
 
 #include "heap.h"
 #include "helpfile.h"
+#include "ioset.h"
 #include "log.h"
+#include "maskindex.h"
 #include "saxdb.h"
+#include "sweep.h"
 #include "timeq.h"
 #include "gline.h"
 
@@ -37,6 +40,9 @@
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #define KEY_REASON "reason"
 #define KEY_EXPIRES "expires"
@@ -45,6 +51,25 @@
 
 static heap_t gline_heap; /* key: expiry time, data: struct gline_entry* */
 static dict_t gline_dict; /* key: target, data: struct gline_entry* */
+static struct mask_index *gline_index; /* wildcard lookups by host part */
+
+/* A burst resends every G-line to one server (or all of them) a slice
+ * at a time, sleeping whenever the uplink's send queue backs up. */
+struct gline_burst {
+    char *server; /* NULL for every server */
+    struct sweep *sweep;
+    struct timeval started;
+    unsigned long sent;
+    unsigned long skipped;
+    unsigned int aborted : 1;
+    struct gline_burst *next;
+};
+
+static struct gline_burst *gline_bursts;
+static struct gline_burst_stats gline_burst_stats;
+static unsigned int gline_burst_sendq = 65536;
+static unsigned long gline_burst_min_lifetime;
+static unsigned int gline_burst_slice = 100;
 
 static int
 gline_comparator(const void *a, const void *b)
@@ -57,6 +82,7 @@ static void
 free_gline_from_dict(void *data)
 {
     struct gline *ent = data;
+    mask_index_remove(gline_index, ent->target);
     free(ent->issuer);
     free(ent->target);
     free(ent->reason);
@@ -149,6 +175,7 @@ gline_add(const char *issuer, const char *target, unsigned long duration, const
         ent->expires = now + duration;
         ent->reason = strdup(reason);
         dict_insert(gline_dict, ent->target, ent);
+        mask_index_add(gline_index, ent->target, ent);
     }
     heap_insert(gline_heap, ent, ent);
     if (!prev_first || (ent->expires < prev_first->expires)) {
@@ -187,7 +214,6 @@ struct gline *
 gline_find(const char *target)
 {
     struct gline *res;
-    dict_iterator_t it;
     char *alt_target;
 
     res = dict_find(gline_dict, target, NULL);
@@ -197,12 +223,9 @@ gline_find(const char *target)
     if ((target[0] == '#') || (target[0] == '&'))
         return NULL;
     else if (target[strcspn(target, "*?")]) {
-        /* Wildcard: do an obnoxiously long search. */
-        for (it = dict_first(gline_dict); it; it = iter_next(it)) {
-            res = iter_data(it);
-            if (match_ircglob(target, res->target))
-                return res;
-        }
+        /* Wildcard: only try the entries whose host part could match. */
+        if ((res = mask_index_find(gline_index, target)))
+            return res;
     }
     /* See if we can resolve the hostname part of the mask. */
     if ((alt_target = gline_alternate_target(target))) {
@@ -213,24 +236,115 @@ gline_find(const char *target)
     return NULL;
 }
 
+static void
+gline_burst_free(struct gline_burst *burst)
+{
+    struct gline_burst **pp;
+
+    for (pp = &gline_bursts; *pp; pp = &(*pp)->next) {
+        if (*pp == burst) {
+            *pp = burst->next;
+            break;
+        }
+    }
+    free(burst->server);
+    free(burst);
+}
+
 static int
-gline_refresh_helper(UNUSED_ARG(void *key), void *data, void *extra)
+gline_burst_entry(UNUSED_ARG(const char *key), void *data, void *extra)
 {
+    struct gline_burst *burst = extra;
     struct gline *ge = data;
-    irc_gline(extra, ge, 0);
+    struct server *srv = NULL;
+
+    if (burst->server && !(srv = GetServerH(burst->server))) {
+        burst->aborted = 1;
+        return 1;
+    }
+    if (ge->expires < (time_t)(now + gline_burst_min_lifetime)) {
+        burst->skipped++;
+    } else {
+        irc_gline(srv, ge, 0);
+        burst->sent++;
+    }
+    if (gline_burst_sendq && socket_io_fd && ioset_send_queued(socket_io_fd) > gline_burst_sendq)
+        sweep_defer(burst->sweep, now + 1);
     return 0;
 }
 
+static void
+gline_burst_done(void *extra)
+{
+    struct gline_burst *burst = extra;
+    struct timeval stop;
+    unsigned long msec;
+
+    gettimeofday(&stop, NULL);
+    msec = (stop.tv_sec - burst->started.tv_sec) * 1000 + (stop.tv_usec - burst->started.tv_usec) / 1000;
+    if (burst->aborted)
+        gline_burst_stats.aborted++;
+    else
+        gline_burst_stats.completed++;
+    gline_burst_stats.sent += burst->sent;
+    gline_burst_stats.skipped += burst->skipped;
+    gline_burst_stats.last_msec = msec;
+    if (msec > gline_burst_stats.max_msec)
+        gline_burst_stats.max_msec = msec;
+    log_module(MAIN_LOG, LOG_INFO, "G-line burst to %s %s: %lu sent, %lu skipped in %lu ms.", burst->server ? burst->server : "all servers", burst->aborted ? "aborted" : "finished", burst->sent, burst->skipped, msec);
+    gline_burst_free(burst);
+}
+
+static void
+gline_burst_start(const char *server)
+{
+    struct gline_burst *burst;
+
+    /* A new burst to the same place replaces one in progress. */
+    for (burst = gline_bursts; burst; burst = burst->next) {
+        if (server ? (burst->server && !irccasecmp(burst->server, server)) : !burst->server) {
+            sweep_cancel(burst->sweep);
+            gline_burst_free(burst);
+            break;
+        }
+    }
+    burst = calloc(1, sizeof(*burst));
+    burst->server = server ? strdup(server) : NULL;
+    gettimeofday(&burst->started, NULL);
+    burst->sweep = sweep_dict("gline burst", gline_dict, gline_burst_entry, gline_burst_done, burst);
+    sweep_set_slice(burst->sweep, gline_burst_slice, SWEEP_DEFAULT_USEC);
+    burst->next = gline_bursts;
+    gline_bursts = burst;
+}
+
 void
 gline_refresh_server(struct server *srv)
 {
-    heap_remove_pred(gline_heap, gline_refresh_helper, srv);
+    gline_burst_start(srv->name);
 }
 
 void
 gline_refresh_all(void)
 {
-    heap_remove_pred(gline_heap, gline_refresh_helper, 0);
+    gline_burst_start(NULL);
+}
+
+void
+gline_burst_configure(unsigned int sendq, unsigned long min_lifetime, unsigned int slice)
+{
+    gline_burst_sendq = sendq;
+    gline_burst_min_lifetime = min_lifetime;
+    gline_burst_slice = slice;
+}
+
+void
+gline_get_burst_stats(struct gline_burst_stats *stats)
+{
+    struct gline_burst *burst;
+
+    *stats = gline_burst_stats;
+    for (burst = gline_bursts; burst; burst = burst->next)
+        stats->active++;
 }
 
 unsigned int
@@ -299,8 +413,13 @@ gline_saxdb_write(struct saxdb_context *ctx)
 static void
 gline_db_cleanup(UNUSED_ARG(void *extra))
 {
+    while (gline_bursts) {
+        sweep_cancel(gline_bursts->sweep);
+        gline_burst_free(gline_bursts);
+    }
     heap_delete(gline_heap);
     dict_delete(gline_dict);
+    mask_index_delete(gline_index);
 }
 
 void
@@ -309,6 +428,7 @@ gline_init(void)
     gline_heap = heap_new(gline_comparator);
     gline_dict = dict_new();
     dict_set_free_data(gline_dict, free_gline_from_dict);
+    gline_index = mask_index_new();
     saxdb_register("gline", gline_saxdb_read, gline_saxdb_write);
     reg_exit_func(gline_db_cleanup, NULL);
 }
@@ -42,12 +42,24 @@ struct gline_discrim {
     time_t min_expire;
 };
 
+struct gline_burst_stats {
+    unsigned int active;
+    unsigned long completed;
+    unsigned long aborted;
+    unsigned long sent;
+    unsigned long skipped;
+    unsigned long last_msec;
+    unsigned long max_msec;
+};
+
 void gline_init(void);
 struct gline *gline_add(const char *issuer, const char *target, unsigned long duration, const char *reason, time_t issued, int announce, int silent);
 struct gline *gline_find(const char *target);
 int gline_remove(const char *target, int announce);
 void gline_refresh_server(struct server *srv);
 void gline_refresh_all(void);
+void gline_burst_configure(unsigned int sendq, unsigned long min_lifetime, unsigned int slice);
+void gline_get_burst_stats(struct gline_burst_stats *stats);
 unsigned int gline_count(void);
 
 typedef void (*gline_search_func)(struct gline *gline, void *extra);
@@ -18,12 +18,14 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
  */
 
+#include "chanserv.h"
 #include "conf.h"
 #include "global.h"
 #include "hash.h"
 #include "modcmd.h"
 #include "nickserv.h"
 #include "saxdb.h"
+#include "sweep.h"
 #include "timeq.h"
 
 #define GLOBAL_CONF_NAME	"services/global"
@@ -35,6 +37,8 @@
 #define KEY_DB_BACKUP_FREQ	"db_backup_freq"
 #define KEY_ANNOUNCEMENTS_DEFAULT "announcements_default"
 #define KEY_NICK		"nick"
+#define KEY_DELIVERY_RATE	"delivery_rate"
+#define KEY_SERVER_MASKS	"server_masks"
 
 /* Message data */
 #define KEY_FLAGS		"flags"
@@ -51,11 +55,15 @@ static const struct message_entry msgtab[] = {
     { "GMSG_INVALID_TARGET", "$b%s$b is an invalid message target." },
     { "GMSG_MESSAGE_REQUIRED", "You $bmust$b provide a message to send." },
     { "GMSG_MESSAGE_SENT", "Message to $b%s$b sent." },
+    { "GMSG_DELIVERY_STARTED", "Delivery of notice %lu to $b%s$b started; use $bLIST$b to follow its progress." },
+    { "GMSG_DELIVERY_FINISHED", "Notice %lu to $b%s$b delivered: %lu notices and %lu server masks in %s." },
+    { "GMSG_DELIVERY_CANCELLED", "Delivery of notice $b%s$b cancelled after %lu notices." },
     { "GMSG_MESSAGE_ADDED", "Message to $b%s$b with ID %ld added." },
     { "GMSG_MESSAGE_DELETED", "Message $b%s$b deleted." },
     { "GMSG_ID_INVALID", "$b%s$b is an invalid message ID." },
     { "GMSG_MESSAGE_COUNT", "$b%d$b messages found." },
     { "GMSG_NO_MESSAGES", "There are no messages for you." },
+    { "GMSG_DELIVERY_HEADER", "$bNotices being delivered:$b" },
     { "GMSG_NOTICE_SOURCE", "Notice to [$b%s$b] from %s:" },
     { "GMSG_MESSAGE_SOURCE", "Notice to [$b%s$b] from %s, posted %s:" },
     //{ "GMSG_MOTD_HEADER", "$b------------- MESSAGE(S) OF THE DAY --------------$b" },
@@ -135,10 +143,52 @@ static long messageCount;
 static time_t last_max_alert;
 static struct log_type *G_LOG;
 
+/* A notice too large to send in one go.  Channel targets are walked
+ * first; user targets are then counted per server so that servers
+ * whose every user is in the audience get a single $server notice,
+ * and the remaining users are sent to individually at no more than
+ * delivery_rate notices per second. */
+enum delivery_phase
+{
+    DELIVERY_CHANNELS,
+    DELIVERY_COUNT,
+    DELIVERY_USERS
+};
+
+struct delivery_server
+{
+    unsigned int audience;
+    unsigned int others;
+    unsigned int collapsed : 1;
+};
+
+struct globalDelivery
+{
+    struct globalMessage		*message;
+    long				targets;
+    char				*requester;
+    struct sweep			*sweep;
+    dict_t				servers;
+    enum delivery_phase			phase;
+
+    unsigned long			total;
+    unsigned long			sent;
+    unsigned long			masks;
+    time_t				started;
+    time_t				window;
+    unsigned int			window_sent;
+
+    struct globalDelivery		*next;
+};
+
+static struct globalDelivery *deliveryList;
+
 static struct
 {
     unsigned long db_backup_frequency;
+    unsigned long delivery_rate;
     unsigned int announcements_default : 1;
+    unsigned int server_masks : 1;
 } global_conf;
 
 #if defined(GCC_VARMACROS)
@@ -351,89 +401,276 @@ notice_target(const char *target, struct globalMessage *message)
     send_target_message(4, target, global, "%s", message->message);
 }
 
+static int
+delivery_wants_user(struct globalDelivery *delivery, struct userNode *user)
+{
+    long flags = delivery->targets;
+    char announce;
+
+    if (user->uplink == self)
+        return 0;
+    if ((flags & MESSAGE_RECIPIENT_AUTHED) && user->handle_info)
+        return 1;
+    if (flags & MESSAGE_RECIPIENT_ANNOUNCE) {
+        announce = user->handle_info ? user->handle_info->announcements : '?';
+        if (announce == 'n')
+            return 0;
+        if ((announce == '?') && !global_conf.announcements_default)
+            return 0;
+        return 1;
+    }
+    return 0;
+}
+
 static void
-message_send(struct globalMessage *message)
+delivery_pace(struct globalDelivery *delivery)
 {
-    struct userNode *user;
-    unsigned long n;
-    dict_iterator_t it;
+    delivery->sent++;
+    if (!global_conf.delivery_rate)
+        return;
+    if (delivery->window != now) {
+        delivery->window = now;
+        delivery->window_sent = 0;
+    }
+    if (++delivery->window_sent >= global_conf.delivery_rate)
+        sweep_defer(delivery->sweep, now + 1);
+}
 
-    if(message->flags & MESSAGE_RECIPIENT_CHANNELS)
-    {
-        dict_iterator_t it;
+static int
+delivery_channel(UNUSED_ARG(const char *key), void *data, void *extra)
+{
+    struct globalDelivery *delivery = extra;
+    struct chanNode *chan = data;
 
-        for (it = dict_first(channels); it; it = iter_next(it)) {
-            struct chanNode *chan = iter_data(it);
+    if (!(delivery->targets & MESSAGE_RECIPIENT_CHANNELS) && !chan->channel_info)
+        return 0;
+    notice_target(chan->name, delivery->message);
+    delivery_pace(delivery);
+    return 0;
+}
 
-            notice_target(chan->name, message);
-        }
+static int
+delivery_count(UNUSED_ARG(const char *key), void *data, void *extra)
+{
+    struct globalDelivery *delivery = extra;
+    struct userNode *user = data;
+    struct delivery_server *ds;
+
+    if (user->uplink == self)
+        return 0;
+    if (!(ds = dict_find(delivery->servers, user->uplink->name, NULL))) {
+        ds = calloc(1, sizeof(*ds));
+        dict_insert(delivery->servers, strdup(user->uplink->name), ds);
     }
+    if (delivery_wants_user(delivery, user))
+        ds->audience++;
+    else
+        ds->others++;
+    return 0;
+}
 
-    if(message->flags & MESSAGE_RECIPIENT_RCHANNELS)
-    {
-        dict_iterator_t it;
+static int
+delivery_user(UNUSED_ARG(const char *key), void *data, void *extra)
+{
+    struct globalDelivery *delivery = extra;
+    struct userNode *user = data;
+    struct delivery_server *ds;
 
-        for (it = dict_first(channels); it; it = iter_next(it)) {
-            struct chanNode *chan = iter_data(it);
+    if (!delivery_wants_user(delivery, user))
+        return 0;
+    ds = dict_find(delivery->servers, user->uplink->name, NULL);
+    if (ds && ds->collapsed)
+        return 0;
+    notice_target(user->nick, delivery->message);
+    delivery_pace(delivery);
+    return 0;
+}
 
-            if (chan->channel_info)
-                notice_target(chan->name, message);
+/* Sends one $server notice to each server whose counted users are all
+ * in the audience, provided nobody has connected to it since it was
+ * counted, and adds everyone else to the total still to be sent. */
+static void
+delivery_collapse(struct globalDelivery *delivery)
+{
+    struct delivery_server *ds;
+    struct server *srv;
+    dict_iterator_t it;
+    char mask[SERVERNAMEMAX+2];
+
+    for (it = dict_first(delivery->servers); it; it = iter_next(it)) {
+        ds = iter_data(it);
+        if (global_conf.server_masks
+            && ds->audience
+            && !ds->others
+            && (srv = GetServerH(iter_key(it)))
+            && (srv->clients == ds->audience)) {
+            snprintf(mask, sizeof(mask), "$%s", srv->name);
+            notice_target(mask, delivery->message);
+            ds->collapsed = 1;
+            delivery->masks++;
+        } else {
+            delivery->total += ds->audience;
         }
     }
+}
 
-    if(message->flags & MESSAGE_RECIPIENT_LUSERS)
-    {
-	notice_target("$*", message);
-	return;
-    }
+static void
+delivery_free(struct globalDelivery *delivery)
+{
+    struct globalDelivery **pp;
 
-    if(message->flags & MESSAGE_RECIPIENT_ANNOUNCE)
-    {
-        char announce;
-
-        for (it = dict_first(clients); it; it = iter_next(it)) {
-            user = iter_data(it);
-            if (user->uplink == self) continue;
-            announce = user->handle_info ? user->handle_info->announcements : '?';
-            if (announce == 'n') continue;
-            if ((announce == '?') && !global_conf.announcements_default) continue;
-            notice_target(user->nick, message);
+    for (pp = &deliveryList; *pp; pp = &(*pp)->next) {
+        if (*pp == delivery) {
+            *pp = delivery->next;
+            break;
         }
     }
+    if (delivery->sweep)
+        sweep_cancel(delivery->sweep);
+    dict_delete(delivery->servers);
+    free(delivery->requester);
+    free(delivery->message->from);
+    free(delivery->message->message);
+    free(delivery->message);
+    free(delivery);
+}
 
-    if(message->flags & MESSAGE_RECIPIENT_OPERS)
-    {
-	for(n = 0; n < curr_opers.used; n++)
-	{
-	    user = curr_opers.list[n];
+static void
+delivery_finish(struct globalDelivery *delivery)
+{
+    struct userNode *requester;
+    char interval[INTERVALLEN];
+
+    intervalString(interval, now - delivery->started, NULL);
+    log_module(G_LOG, LOG_INFO, "Notice %lu to %s delivered: %lu notices and %lu server masks in %s.", delivery->message->id, messageType(delivery->message), delivery->sent, delivery->masks, interval);
+    if (delivery->requester && (requester = GetUserH(delivery->requester))) {
+        intervalString(interval, now - delivery->started, requester->handle_info);
+        global_notice(requester, "GMSG_DELIVERY_FINISHED", delivery->message->id, messageType(delivery->message), delivery->sent, delivery->masks, interval);
+    }
+    delivery->sweep = NULL;
+    delivery_free(delivery);
+}
 
-	    if(user->uplink != self)
-	    {
-		notice_target(user->nick, message);
-	    }
-	}
+static void
+delivery_next_phase(void *extra)
+{
+    struct globalDelivery *delivery = extra;
+
+    delivery->sweep = NULL;
+    switch (delivery->phase) {
+    case DELIVERY_CHANNELS:
+        if (delivery->targets & (MESSAGE_RECIPIENT_ANNOUNCE | MESSAGE_RECIPIENT_AUTHED)) {
+            delivery->phase = DELIVERY_COUNT;
+            delivery->sweep = sweep_dict("global count", clients, delivery_count, delivery_next_phase, delivery);
+            return;
+        }
+        break;
+    case DELIVERY_COUNT:
+        delivery_collapse(delivery);
+        delivery->phase = DELIVERY_USERS;
+        delivery->sweep = sweep_dict("global users", clients, delivery_user, delivery_next_phase, delivery);
+        return;
+    case DELIVERY_USERS:
+        break;
     }
+    delivery_finish(delivery);
+}
 
-    if(message->flags & MESSAGE_RECIPIENT_HELPERS)
-    {
-	for(n = 0; n < curr_helpers.used; n++)
-	{
-	    user = curr_helpers.list[n];
-            if (IsOper(user))
-                continue;
-	    notice_target(user->nick, message);
-	}
+static struct globalDelivery *
+delivery_start(struct globalMessage *message, long targets, const char *requester)
+{
+    struct globalDelivery *delivery;
+    struct globalMessage *copy;
+
+    copy = calloc(1, sizeof(*copy));
+    copy->id = message->id;
+    copy->flags = message->flags;
+    copy->posted = message->posted;
+    memcpy(copy->posted_s, message->posted_s, sizeof(copy->posted_s));
+    copy->from = strdup(message->from);
+    copy->message = strdup(message->message);
+
+    delivery = calloc(1, sizeof(*delivery));
+    delivery->message = copy;
+    delivery->targets = targets;
+    delivery->requester = requester ? strdup(requester) : NULL;
+    delivery->servers = dict_new();
+    dict_set_free_keys(delivery->servers, free);
+    dict_set_free_data(delivery->servers, free);
+    delivery->started = now;
+    delivery->next = deliveryList;
+    deliveryList = delivery;
+
+    if (targets & (MESSAGE_RECIPIENT_CHANNELS | MESSAGE_RECIPIENT_RCHANNELS)) {
+        delivery->phase = DELIVERY_CHANNELS;
+        /* RCHANNELS only goes to the registered channels. */
+        if (targets & MESSAGE_RECIPIENT_CHANNELS)
+            delivery->total = dict_size(channels);
+        else
+            delivery->total = chanserv_registered_channels();
+        delivery->sweep = sweep_dict("global channels", channels, delivery_channel, delivery_next_phase, delivery);
+    } else {
+        delivery->phase = DELIVERY_COUNT;
+        delivery->sweep = sweep_dict("global count", clients, delivery_count, delivery_next_phase, delivery);
     }
+    return delivery;
+}
 
-    if(message->flags & MESSAGE_RECIPIENT_AUTHED)
+static void
+delivery_cancel_all(void)
+{
+    while (deliveryList)
+        delivery_free(deliveryList);
+}
+
+/* Sends the small audiences (opers, helpers, or everyone through a
+ * single $* notice) right away and hands channels and the announce
+ * and authed audiences to a background delivery, which is returned. */
+static struct globalDelivery *
+message_send(struct globalMessage *message, const char *requester)
+{
+    struct userNode *user;
+    unsigned long n;
+    long background;
+
+    background = MESSAGE_RECIPIENT_CHANNELS | MESSAGE_RECIPIENT_RCHANNELS;
+
+    if(message->flags & MESSAGE_RECIPIENT_LUSERS)
     {
-        dict_iterator_t it;
-        for (it = dict_first(clients); it; it = iter_next(it)) {
-            struct userNode *luser = iter_data(it);
-            if (luser->handle_info)
-              notice_target(luser->nick, message);
+	notice_target("$*", message);
+    }
+    else
+    {
+        background |= MESSAGE_RECIPIENT_ANNOUNCE | MESSAGE_RECIPIENT_AUTHED;
+
+        if(message->flags & MESSAGE_RECIPIENT_OPERS)
+        {
+            for(n = 0; n < curr_opers.used; n++)
+            {
+                user = curr_opers.list[n];
+
+                if(user->uplink != self)
+                {
+                    notice_target(user->nick, message);
+                }
+            }
+        }
+
+        if(message->flags & MESSAGE_RECIPIENT_HELPERS)
+        {
+            for(n = 0; n < curr_helpers.used; n++)
+            {
+                user = curr_helpers.list[n];
+                if (IsOper(user))
+                    continue;
+                notice_target(user->nick, message);
+            }
         }
     }
+
+    if(!(message->flags & background))
+        return NULL;
+    return delivery_start(message, message->flags & background, requester);
 }
 
 void
@@ -515,13 +752,14 @@ global_message(long targets, char *text)
     if(!message)
 	return;
 
-    message_send(message);
+    message_send(message, NULL);
     message_del(message);
 }
 
 static GLOBAL_FUNC(cmd_notice)
 {
     struct globalMessage *message = NULL;
+    struct globalDelivery *delivery;
     const char *recipient = NULL, *text;
     char *sender;
     long target = 0;
@@ -567,10 +805,12 @@ static GLOBAL_FUNC(cmd_notice)
 	return 0;
 
     recipient = messageType(message);
-    message_send(message);
+    delivery = message_send(message, user->nick);
+    if(delivery)
+        global_notice(user, "GMSG_DELIVERY_STARTED", delivery->message->id, recipient);
+    else
+        global_notice(user, "GMSG_MESSAGE_SENT", recipient);
     message_del(message);
-
-    global_notice(user, "GMSG_MESSAGE_SENT", recipient);
     return 1;
 }
 
@@ -588,6 +828,72 @@ static GLOBAL_FUNC(cmd_message)
     return 1;
 }
 
+static void
+list_deliveries(struct userNode *user)
+{
+    struct globalDelivery *delivery;
+    struct helpfile_table table;
+    unsigned long remaining;
+    unsigned int nn;
+
+    for(nn=0, delivery = deliveryList; delivery; nn++, delivery=delivery->next) ;
+    table.length = nn+1;
+    table.width = 6;
+    table.flags = TABLE_NO_FREE;
+    table.contents = calloc(table.length, sizeof(char**));
+    table.contents[0] = calloc(table.width, sizeof(char*));
+    table.contents[0][0] = "ID";
+    table.contents[0][1] = "Target";
+    table.contents[0][2] = "Sent";
+    table.contents[0][3] = "Remaining";
+    table.contents[0][4] = "ETA";
+    table.contents[0][5] = "From";
+
+    for(nn=1, delivery = deliveryList; delivery; nn++, delivery = delivery->next)
+    {
+        char buffer[64];
+
+        remaining = delivery->total > delivery->sent ? delivery->total - delivery->sent : 0;
+        table.contents[nn] = calloc(table.width, sizeof(char*));
+        snprintf(buffer, sizeof(buffer), "%lu", delivery->message->id);
+        table.contents[nn][0] = strdup(buffer);
+        table.contents[nn][1] = messageType(delivery->message);
+        if(delivery->masks)
+            snprintf(buffer, sizeof(buffer), "%lu (+%lu servers)", delivery->sent, delivery->masks);
+        else
+            snprintf(buffer, sizeof(buffer), "%lu", delivery->sent);
+        table.contents[nn][2] = strdup(buffer);
+        if(delivery->phase == DELIVERY_USERS || !(delivery->targets & (MESSAGE_RECIPIENT_ANNOUNCE | MESSAGE_RECIPIENT_AUTHED)))
+        {
+            snprintf(buffer, sizeof(buffer), "%lu", remaining);
+            table.contents[nn][3] = strdup(buffer);
+            if(global_conf.delivery_rate)
+                intervalString(buffer, (remaining + global_conf.delivery_rate - 1) / global_conf.delivery_rate, user->handle_info);
+            else
+                strcpy(buffer, "Now.");
+            table.contents[nn][4] = strdup(buffer);
+        }
+        else
+        {
+            table.contents[nn][3] = strdup("Counting");
+            table.contents[nn][4] = strdup("Unknown");
+        }
+        table.contents[nn][5] = delivery->message->from;
+    }
+    global_notice(user, "GMSG_DELIVERY_HEADER");
+    table_send(global, user->nick, 0, NULL, table);
+    for (nn=1; nn<table.length; nn++)
+    {
+        free((char*)table.contents[nn][0]);
+        free((char*)table.contents[nn][2]);
+        free((char*)table.contents[nn][3]);
+        free((char*)table.contents[nn][4]);
+        free(table.contents[nn]);
+    }
+    free(table.contents[0]);
+    free(table.contents);
+}
+
 static GLOBAL_FUNC(cmd_list)
 {
     struct globalMessage *message;
@@ -596,7 +902,10 @@ static GLOBAL_FUNC(cmd_list)
 
     if(!messageList)
     {
-	global_notice(user, "GMSG_NO_MESSAGES");
+        if(deliveryList)
+            list_deliveries(user);
+        else
+            global_notice(user, "GMSG_NO_MESSAGES");
         return 1;
     }
 
@@ -646,12 +955,15 @@ static GLOBAL_FUNC(cmd_list)
     free(table.contents[0]);
     free(table.contents);
 
+    if(deliveryList)
+        list_deliveries(user);
     return 1;
 }
 
 static GLOBAL_FUNC(cmd_remove)
 {
     struct globalMessage *message = NULL;
+    struct globalDelivery *delivery;
     unsigned long id;
 
     assert(argc >= 2);
@@ -667,6 +979,17 @@ static GLOBAL_FUNC(cmd_remove)
 	}
     }
 
+    for(delivery = deliveryList; delivery; delivery = delivery->next)
+    {
+	if(delivery->message->id == id)
+	{
+	    global_notice(user, "GMSG_DELIVERY_CANCELLED", argv[1], delivery->sent);
+	    log_module(G_LOG, LOG_INFO, "Delivery of notice %lu cancelled by %s after %lu notices.", id, user->nick, delivery->sent);
+	    delivery_free(delivery);
+	    return 1;
+	}
+    }
+
     global_notice(user, "GMSG_ID_INVALID", argv[1]);
     return 0;
 }
@@ -769,6 +1092,10 @@ global_conf_read(void)
     global_conf.db_backup_frequency = str ? ParseInterval(str) : 7200;
     str = database_get_data(conf_node, KEY_ANNOUNCEMENTS_DEFAULT, RECDB_QSTRING);
     global_conf.announcements_default = str ? enabled_string(str) : 1;
+    str = database_get_data(conf_node, KEY_DELIVERY_RATE, RECDB_QSTRING);
+    global_conf.delivery_rate = str ? strtoul(str, NULL, 0) : 200;
+    str = database_get_data(conf_node, KEY_SERVER_MASKS, RECDB_QSTRING);
+    global_conf.server_masks = str ? enabled_string(str) : 1;
 
     str = database_get_data(conf_node, KEY_NICK, RECDB_QSTRING);
     if(global && str)
@@ -833,6 +1160,7 @@ global_saxdb_write(struct saxdb_context *ctx)
 static void
 global_db_cleanup(UNUSED_ARG(void *extra))
 {
+    delivery_cancel_all();
     while(messageList)
         message_del(messageList);
 }
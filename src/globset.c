@@ -0,0 +1,259 @@
+/* globset.c - Compiled sets of IRC glob patterns
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "globset.h"
+
+enum globset_kind {
+    GLOBSET_PREFIX,
+    GLOBSET_SUFFIX,
+    GLOBSET_SUBSTRING,
+    GLOBSET_KINDS,
+    GLOBSET_OTHER = GLOBSET_KINDS
+};
+
+struct globset_node {
+    struct globset_node *child;
+    struct globset_node *sibling;
+    const char *glob;
+    void *data;
+    unsigned int seen;
+    char ch;
+};
+
+struct globset_entry {
+    const char *glob;
+    void *data;
+};
+
+struct globset {
+    struct globset_node root[GLOBSET_KINDS];
+    struct globset_entry *other;
+    unsigned int other_used, other_size;
+    unsigned int count;
+    unsigned int generation;
+};
+
+struct globset *
+globset_new(void)
+{
+    return calloc(1, sizeof(struct globset));
+}
+
+static void
+globset_free_nodes(struct globset_node *node)
+{
+    struct globset_node *next;
+
+    for (; node; node = next) {
+        next = node->sibling;
+        globset_free_nodes(node->child);
+        free(node);
+    }
+}
+
+void
+globset_delete(struct globset *set)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < GLOBSET_KINDS; ii++)
+        globset_free_nodes(set->root[ii].child);
+    free(set->other);
+    free(set);
+}
+
+unsigned int
+globset_size(struct globset *set)
+{
+    return set->count;
+}
+
+/* Work out which trie (if any) a glob belongs in, and where its
+ * literal part is. */
+static enum globset_kind
+globset_classify(const char *glob, const char **lit, unsigned int *len)
+{
+    const char *start, *end, *tail;
+
+    for (start = glob; *start == '*'; start++) ;
+    for (end = start; *end && *end != '*' && *end != '?' && *end != '\\'; end++) ;
+    for (tail = end; *tail == '*'; tail++) ;
+    *lit = start;
+    *len = end - start;
+    if (!*len || *tail)
+        return GLOBSET_OTHER;
+    if (start > glob)
+        return (end < tail) ? GLOBSET_SUBSTRING : GLOBSET_SUFFIX;
+    return (end < tail) ? GLOBSET_PREFIX : GLOBSET_OTHER;
+}
+
+static struct globset_node *
+globset_child(struct globset_node *node, char ch)
+{
+    for (node = node->child; node; node = node->sibling)
+        if (node->ch == ch)
+            return node;
+    return NULL;
+}
+
+/* Find (or with create set, make) the node for a glob's literal. */
+static struct globset_node *
+globset_walk(struct globset *set, enum globset_kind kind, const char *lit, unsigned int len, int create)
+{
+    struct globset_node *node, *child;
+    char key[512], *folded;
+    unsigned int ii;
+
+    folded = (len < sizeof(key)) ? key : malloc(len + 1);
+    if (kind == GLOBSET_SUFFIX) {
+        for (ii = 0; ii < len; ii++)
+            folded[ii] = lit[len - ii - 1];
+    } else
+        memcpy(folded, lit, len);
+    folded[len] = '\0';
+    irc_strtolower(folded);
+
+    for (node = &set->root[kind], ii = 0; node && ii < len; ii++, node = child) {
+        if (!(child = globset_child(node, folded[ii])) && create) {
+            child = calloc(1, sizeof(*child));
+            child->ch = folded[ii];
+            child->sibling = node->child;
+            node->child = child;
+        }
+    }
+    if (folded != key)
+        free(folded);
+    return node;
+}
+
+void
+globset_add(struct globset *set, const char *glob, void *data)
+{
+    struct globset_node *node;
+    enum globset_kind kind;
+    const char *lit;
+    unsigned int len;
+
+    kind = globset_classify(glob, &lit, &len);
+    if (kind != GLOBSET_OTHER) {
+        node = globset_walk(set, kind, lit, len, 1);
+        /* "#a*" and "#a**" share a node; the second one goes to the
+         * fallback list. */
+        if (!node->glob || !irccasecmp(node->glob, glob)) {
+            if (!node->glob)
+                set->count++;
+            node->glob = glob;
+            node->data = data;
+            return;
+        }
+    }
+    if (set->other_used == set->other_size) {
+        set->other_size = set->other_size ? set->other_size << 1 : 8;
+        set->other = realloc(set->other, set->other_size * sizeof(set->other[0]));
+    }
+    set->other[set->other_used].glob = glob;
+    set->other[set->other_used].data = data;
+    set->other_used++;
+    set->count++;
+}
+
+int
+globset_remove(struct globset *set, const char *glob)
+{
+    struct globset_node *node;
+    enum globset_kind kind;
+    const char *lit;
+    unsigned int len, ii;
+
+    kind = globset_classify(glob, &lit, &len);
+    if (kind != GLOBSET_OTHER) {
+        node = globset_walk(set, kind, lit, len, 0);
+        if (node && node->glob && !irccasecmp(node->glob, glob)) {
+            /* Empty nodes are left in place for the next glob that
+             * shares the literal. */
+            node->glob = NULL;
+            node->data = NULL;
+            set->count--;
+            return 1;
+        }
+    }
+    for (ii = 0; ii < set->other_used; ii++) {
+        if (irccasecmp(set->other[ii].glob, glob))
+            continue;
+        set->other[ii] = set->other[--set->other_used];
+        set->count--;
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns non-zero if the callback asked to stop. */
+static int
+globset_report(struct globset *set, struct globset_node *node, globset_func func, void *extra, unsigned int *matches)
+{
+    if (node->seen == set->generation)
+        return 0;
+    node->seen = set->generation;
+    (*matches)++;
+    return func && func(node->glob, node->data, extra);
+}
+
+unsigned int
+globset_match(struct globset *set, const char *text, globset_func func, void *extra)
+{
+    struct globset_node *node;
+    char buf[512], *lower;
+    unsigned int len, ii, jj, matches;
+
+    len = strlen(text);
+    lower = (len < sizeof(buf)) ? buf : malloc(len + 1);
+    memcpy(lower, text, len + 1);
+    irc_strtolower(lower);
+    matches = 0;
+    if (!++set->generation)
+        set->generation = 1;
+
+    for (node = &set->root[GLOBSET_PREFIX], ii = 0; ii < len && (node = globset_child(node, lower[ii])); ii++)
+        if (node->glob && globset_report(set, node, func, extra, &matches))
+            goto out;
+
+    for (node = &set->root[GLOBSET_SUFFIX], ii = len; ii > 0 && (node = globset_child(node, lower[ii - 1])); ii--)
+        if (node->glob && globset_report(set, node, func, extra, &matches))
+            goto out;
+
+    for (jj = 0; jj < len; jj++)
+        for (node = &set->root[GLOBSET_SUBSTRING], ii = jj; ii < len && (node = globset_child(node, lower[ii])); ii++)
+            if (node->glob && globset_report(set, node, func, extra, &matches))
+                goto out;
+
+    for (ii = 0; ii < set->other_used; ii++) {
+        if (!match_ircglob(text, set->other[ii].glob))
+            continue;
+        matches++;
+        if (func && func(set->other[ii].glob, set->other[ii].data, extra))
+            break;
+    }
+
+out:
+    if (lower != buf)
+        free(lower);
+    return matches;
+}
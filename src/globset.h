@@ -0,0 +1,47 @@
+/* globset.h - Compiled sets of IRC glob patterns
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef GLOBSET_H
+#define GLOBSET_H
+
+/* A globset answers "which of these globs match this text?" without
+ * trying every glob.  Globs of the form "lit*", "*lit" and "*lit*"
+ * are compiled into prefix, suffix and substring tries; anything
+ * else (?, escapes, more than one literal run) falls back to
+ * match_ircglob().  Matching is case-insensitive in the same way as
+ * match_ircglob().
+ *
+ * The set does not copy the glob strings, so (like dict keys) they
+ * must stay valid until they are removed from the set.
+ */
+
+struct globset;
+
+/* Return non-zero to stop the match early. */
+typedef int (*globset_func)(const char *glob, void *data, void *extra);
+
+struct globset *globset_new(void);
+void globset_delete(struct globset *set);
+void globset_add(struct globset *set, const char *glob, void *data);
+int globset_remove(struct globset *set, const char *glob);
+unsigned int globset_size(struct globset *set);
+unsigned int globset_match(struct globset *set, const char *text, globset_func func, void *extra);
+
+#endif /* ndef GLOBSET_H */
@@ -0,0 +1,236 @@
+#include "globset.h"
+#include "hash.h"
+#include "maskindex.h"
+#include "log.h"
+#include "helpfile.h"
+
+/* Checks that a globset reports exactly the globs that a linear
+ * match_ircglob() scan would, over a fixed list and a random mix.
+ * Then checks that a mask index finds the same mask as a walk over
+ * the masks in dict order would. */
+
+static const char *fixed_globs[] = {
+    "#foo*", "#FOO*", "#foo**", "*bar", "*warez*", "*WaReZ*", "#a?c*",
+    "*", "**", "#exact", "#ab\\*cd", "*x*y*", "#{pipe}*", "*[pipe]",
+    "#*", "*#", "#z*z", "*z*", "#foo", 0
+};
+
+static const char *fixed_texts[] = {
+    "#foo", "#FOObar", "#foobar", "#bar", "#xbar", "#free-warez-here",
+    "#WAREZ", "#abc", "#abcd", "#exact", "#EXACT", "#ab*cd", "#xyzzy",
+    "#[pipe]s", "#{PIPE}", "#", "#z", "#zz", "#zaz", "", 0
+};
+
+struct match_list {
+    const char *globs[256];
+    unsigned int used;
+};
+
+static int
+collect_match(const char *glob, UNUSED_ARG(void *data), void *extra)
+{
+    struct match_list *list = extra;
+    list->globs[list->used++] = glob;
+    return 0;
+}
+
+static int
+check_text(struct globset *set, const char **globs, unsigned int count, const char *text)
+{
+    struct match_list list;
+    unsigned int ii, jj, expected, errors;
+
+    list.used = 0;
+    globset_match(set, text, collect_match, &list);
+    for (ii = expected = errors = 0; ii < count; ii++) {
+        if (!globs[ii])
+            continue;
+        for (jj = 0; jj < list.used && list.globs[jj] != globs[ii]; jj++) ;
+        if (match_ircglob(text, globs[ii])) {
+            expected++;
+            if (jj == list.used) {
+                fprintf(stderr, "%s should have matched glob %s!\n", text, globs[ii]);
+                errors++;
+            }
+        } else if (jj < list.used) {
+            fprintf(stderr, "%s should not have matched glob %s!\n", text, globs[ii]);
+            errors++;
+        }
+    }
+    if (list.used != expected) {
+        fprintf(stderr, "%s matched %u globs, expected %u!\n", text, list.used, expected);
+        errors++;
+    }
+    return errors;
+}
+
+static void
+random_string(char *buf, unsigned int max, int globbing)
+{
+    static const char plain[] = "#abAB[{";
+    static const char wild[] = "#abAB[{**?";
+    unsigned int ii, len = rand() % max;
+
+    for (ii = 0; ii < len; ii++)
+        buf[ii] = globbing ? wild[rand() % (sizeof(wild) - 1)] : plain[rand() % (sizeof(plain) - 1)];
+    buf[ii] = '\0';
+}
+
+static void
+random_part(char *buf, unsigned int len, int globbing)
+{
+    static const char plain[] = "ab.1[{@";
+    static const char wild[] = "ab.1[{@***?\\";
+    unsigned int ii;
+
+    for (ii = 0; ii < len; ii++)
+        buf[ii] = globbing ? wild[rand() % (sizeof(wild) - 1)] : plain[rand() % (sizeof(plain) - 1)];
+    buf[ii] = '\0';
+    /* Escapes must be followed by something. */
+    if (len && buf[len - 1] == '\\')
+        buf[len - 1] = 'a';
+}
+
+/* Mostly user@host shapes, with a few odd ones mixed in.  The odd
+ * ones start with a literal so that a bare "*" does not become the
+ * answer to every lookup. */
+static void
+random_mask(char *buf, unsigned int max, int globbing)
+{
+    unsigned int len, user;
+
+    len = 1 + rand() % (max - 1);
+    random_part(buf, len, globbing);
+    if ((rand() % 16) && len > 2) {
+        user = rand() % (len - 1);
+        for (len = 0; buf[len]; len++)
+            if (buf[len] == '@')
+                buf[len] = 'b';
+        buf[user] = '@';
+    } else {
+        buf[0] = 'b';
+    }
+}
+
+static int
+check_masks(void)
+{
+    static char masks[400][12];
+    struct mask_index *idx;
+    const char *expected, *found;
+    char text[12];
+    unsigned int ii, jj, count, errors = 0;
+
+    idx = mask_index_new();
+    for (count = 0; count < ArrayLength(masks); count++) {
+        random_mask(masks[count], sizeof(masks[count]), 1);
+        mask_index_add(idx, masks[count], masks[count]);
+        for (ii = 0; ii < count; ii++)
+            if (masks[ii][0] && !irccasecmp(masks[ii], masks[count]))
+                masks[ii][0] = '\0';
+    }
+    for (ii = 0; ii < count; ii += 3) {
+        if (masks[ii][0])
+            mask_index_remove(idx, masks[ii]);
+        masks[ii][0] = '\0';
+    }
+    for (ii = 0; ii < 50000; ii++) {
+        random_mask(text, sizeof(text), ii & 1);
+        expected = NULL;
+        for (jj = 0; jj < count; jj++)
+            if (masks[jj][0]
+                && (!expected || irccasecmp(masks[jj], expected) < 0)
+                && match_ircglob(text, masks[jj]))
+                expected = masks[jj];
+        found = mask_index_find(idx, text);
+        if (found != expected) {
+            fprintf(stderr, "%s found mask %s, expected %s!\n", text, found ? found : "(none)", expected ? expected : "(none)");
+            errors++;
+        }
+    }
+    mask_index_delete(idx);
+    return errors;
+}
+
+int
+main(UNUSED_ARG(int argc), UNUSED_ARG(char *argv[]))
+{
+    static char random_globs[200][8];
+    const char *globs[200];
+    struct globset *set;
+    char text[12];
+    unsigned int ii, count, errors = 0;
+
+    tools_init();
+    srand(1);
+
+    /* Duplicates (by irccasecmp) replace each other, like dict keys. */
+    set = globset_new();
+    for (count = 0; fixed_globs[count]; count++) {
+        globs[count] = fixed_globs[count];
+        globset_add(set, globs[count], NULL);
+    }
+    globset_remove(set, "#FOO*");
+    globs[0] = globs[1] = NULL;
+    globset_remove(set, "*WaReZ*");
+    globs[4] = globs[5] = NULL;
+    for (ii = 0; fixed_texts[ii]; ii++)
+        errors += check_text(set, globs, count, fixed_texts[ii]);
+    if (globset_size(set) != count - 4) {
+        fprintf(stderr, "globset has %u entries, expected %u!\n", globset_size(set), count - 4);
+        errors++;
+    }
+    globset_delete(set);
+
+    set = globset_new();
+    for (count = 0; count < ArrayLength(random_globs); count++) {
+        random_string(random_globs[count], sizeof(random_globs[count]), 1);
+        for (ii = 0; ii < count && (!globs[ii] || irccasecmp(globs[ii], random_globs[count])); ii++) ;
+        globs[count] = (ii < count) ? NULL : random_globs[count];
+        if (globs[count])
+            globset_add(set, globs[count], NULL);
+    }
+    for (ii = 0; ii < count; ii += 3) {
+        if (globs[ii])
+            globset_remove(set, globs[ii]);
+        globs[ii] = NULL;
+    }
+    for (ii = 0; ii < 20000; ii++) {
+        random_string(text, sizeof(text), 0);
+        errors += check_text(set, globs, count, text);
+    }
+    globset_delete(set);
+
+    errors += check_masks();
+    if (errors)
+        fprintf(stderr, "%u globset errors.\n", errors);
+    return errors ? 1 : 0;
+}
+
+/* because tools.c likes to log stuff.. */
+void
+log_module(UNUSED_ARG(struct log_type *type), UNUSED_ARG(enum log_severity sev), const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    vfprintf(stderr, format, va);
+    va_end(va);
+}
+
+const char *
+language_find_message(UNUSED_ARG(struct language *lang), UNUSED_ARG(const char *msgid))
+{
+    return "Stub -- Not implemented.";
+}
+
+/* Things tools.c refers to that the real services would provide. */
+struct log_type *MAIN_LOG;
+struct language *lang_C;
+const char *hidden_host_suffix;
+
+/* tools.c looks up channels for extended bans. */
+struct chanNode *
+GetChannel(UNUSED_ARG(const char *name))
+{
+    return NULL;
+}
@@ -22,6 +22,7 @@
 #include "global.h"
 #include "hash.h"
 #include "log.h"
+#include "metrics.h"
 
 #if defined(HAVE_LIBGEOIP)&&defined(HAVE_GEOIP_H)&&defined(HAVE_GEOIPCITY_H)
 #include <GeoIP.h>
@@ -41,6 +42,24 @@ struct userList curr_opers;
 
 static void hash_cleanup(void *extra);
 
+static double
+hash_metric_dict_size(void *extra)
+{
+    return dict_size(*(dict_t*)extra);
+}
+
+static double
+hash_metric_opers(UNUSED_ARG(void *extra))
+{
+    return curr_opers.used;
+}
+
+static double
+hash_metric_invisible(UNUSED_ARG(void *extra))
+{
+    return invis_clients;
+}
+
 void init_structs(void)
 {
     channels = dict_new();
@@ -48,6 +67,11 @@ void init_structs(void)
     servers = dict_new();
     userList_init(&curr_opers);
     reg_exit_func(hash_cleanup, NULL);
+    metrics_register("x3_users", "Users on the network.", METRIC_GAUGE, hash_metric_dict_size, &clients);
+    metrics_register("x3_users_invisible", "Users on the network with umode +i.", METRIC_GAUGE, hash_metric_invisible, NULL);
+    metrics_register("x3_opers", "IRC operators on the network.", METRIC_GAUGE, hash_metric_opers, NULL);
+    metrics_register("x3_channels", "Channels on the network.", METRIC_GAUGE, hash_metric_dict_size, &channels);
+    metrics_register("x3_servers", "Servers on the network.", METRIC_GAUGE, hash_metric_dict_size, &servers);
 }
 
 int userList_contains(struct userList *list, struct userNode *user)
@@ -64,23 +88,27 @@ int userList_contains(struct userList *list, struct userNode *user)
 
 server_link_func_t *slf_list;
 void **slf_list_extra;
+struct profile_site **slf_list_site;
 unsigned int slf_size = 0, slf_used = 0;
 
 void
-reg_server_link_func(server_link_func_t handler, void *extra)
+reg_server_link_func_named(server_link_func_t handler, void *extra, const char *name)
 {
     if (slf_used == slf_size) {
         if (slf_size) {
             slf_size <<= 1;
             slf_list = realloc(slf_list, slf_size*sizeof(server_link_func_t));
             slf_list_extra = realloc(slf_list_extra, slf_size*sizeof(void*));
+            slf_list_site = realloc(slf_list_site, slf_size*sizeof(slf_list_site[0]));
         } else {
             slf_size = 8;
             slf_list = malloc(slf_size*sizeof(server_link_func_t));
             slf_list_extra = malloc(slf_size*sizeof(void*));
+            slf_list_site = malloc(slf_size*sizeof(slf_list_site[0]));
         }
     }
     slf_list[slf_used] = handler;
+    slf_list_site[slf_used] = profile_site(name);
     slf_list_extra[slf_used++] = extra;
 }
 
@@ -91,7 +119,7 @@ call_server_link_funcs(struct server *server)
 
     for (i = 0; i < slf_used; ++i)
     {
-        slf_list[i](server, slf_list_extra[i]);
+        PROFILE_CALL(slf_list_site[i], slf_list[i](server, slf_list_extra[i]));
     }
 }
 
@@ -103,23 +131,27 @@ GetServerH(const char *name)
 
 sasl_input_func_t *sif_list;
 void **sif_list_extra;
+struct profile_site **sif_list_site;
 unsigned int sif_size = 0, sif_used = 0;
 
 void
-reg_sasl_input_func(sasl_input_func_t handler, void *extra)
+reg_sasl_input_func_named(sasl_input_func_t handler, void *extra, const char *name)
 {
     if (sif_used == sif_size) {
         if (sif_size) {
             sif_size <<= 1;
             sif_list = realloc(sif_list, sif_size*sizeof(new_user_func_t));
             sif_list_extra = realloc(sif_list_extra, sif_size*sizeof(void*));
+            sif_list_site = realloc(sif_list_site, sif_size*sizeof(sif_list_site[0]));
         } else {
             sif_size = 8;
             sif_list = malloc(sif_size*sizeof(new_user_func_t));
             sif_list_extra = malloc(sif_size*sizeof(void*));
+            sif_list_site = malloc(sif_size*sizeof(sif_list_site[0]));
         }
     }
     sif_list[sif_used] = handler;
+    sif_list_site[sif_used] = profile_site(name);
     sif_list_extra[sif_used++] = extra;
 }
 
@@ -130,7 +162,7 @@ call_sasl_input_func(struct server* source ,const char *identifier, const char *
 
     for (i = 0; i < sif_used; ++i)
     {
-        sif_list[i](source, identifier, subcmd, data, ext, sif_list_extra[i]);
+        PROFILE_CALL(sif_list_site[i], sif_list[i](source, identifier, subcmd, data, ext, sif_list_extra[i]));
     }
 }
 
@@ -144,28 +176,33 @@ unreg_sasl_input_func(sasl_input_func_t handler, void *extra)
     if (i == sif_used) return;
     memmove(sif_list+i, sif_list+i+1, (sif_used-i-1)*sizeof(sif_list[0]));
     memmove(sif_list_extra+i, sif_list_extra+i+1, (sif_used-i-1)*sizeof(sif_list_extra[0]));
+    memmove(sif_list_site+i, sif_list_site+i+1, (sif_used-i-1)*sizeof(sif_list_site[0]));
     sif_used--;
 }
 
 new_user_func_t *nuf_list;
 void **nuf_list_extra;
+struct profile_site **nuf_list_site;
 unsigned int nuf_size = 0, nuf_used = 0;
 
 void
-reg_new_user_func(new_user_func_t handler, void *extra)
+reg_new_user_func_named(new_user_func_t handler, void *extra, const char *name)
 {
     if (nuf_used == nuf_size) {
         if (nuf_size) {
             nuf_size <<= 1;
             nuf_list = realloc(nuf_list, nuf_size*sizeof(new_user_func_t));
             nuf_list_extra = realloc(nuf_list_extra, nuf_size*sizeof(void*));
+            nuf_list_site = realloc(nuf_list_site, nuf_size*sizeof(nuf_list_site[0]));
         } else {
             nuf_size = 8;
             nuf_list = malloc(nuf_size*sizeof(new_user_func_t));
             nuf_list_extra = malloc(nuf_size*sizeof(void*));
+            nuf_list_site = malloc(nuf_size*sizeof(nuf_list_site[0]));
         }
     }
     nuf_list[nuf_used] = handler;
+    nuf_list_site[nuf_used] = profile_site(name);
     nuf_list_extra[nuf_used++] = extra;
 }
 
@@ -176,52 +213,60 @@ call_new_user_funcs(struct userNode* user)
 
     for (i = 0; i < nuf_used && !(user->dead); ++i)
     {
-        nuf_list[i](user, nuf_list_extra[i]);
+        PROFILE_CALL(nuf_list_site[i], nuf_list[i](user, nuf_list_extra[i]));
     }
 }
 
 static nick_change_func_t *ncf2_list;
 static void **ncf2_list_extra;
+static struct profile_site **ncf2_list_site;
 static unsigned int ncf2_size = 0, ncf2_used = 0;
 
 void
-reg_nick_change_func(nick_change_func_t handler, void *extra)
+reg_nick_change_func_named(nick_change_func_t handler, void *extra, const char *name)
 {
     if (ncf2_used == ncf2_size) {
         if (ncf2_size) {
             ncf2_size <<= 1;
             ncf2_list = realloc(ncf2_list, ncf2_size*sizeof(nick_change_func_t));
             ncf2_list_extra = realloc(ncf2_list_extra, ncf2_size*sizeof(void*));
+            ncf2_list_site = realloc(ncf2_list_site, ncf2_size*sizeof(ncf2_list_site[0]));
         } else {
             ncf2_size = 8;
             ncf2_list = malloc(ncf2_size*sizeof(nick_change_func_t));
             ncf2_list_extra = malloc(ncf2_size*sizeof(void*));
+            ncf2_list_site = malloc(ncf2_size*sizeof(ncf2_list_site[0]));
         }
     }
     ncf2_list[ncf2_used] = handler;
+    ncf2_list_site[ncf2_used] = profile_site(name);
     ncf2_list_extra[ncf2_used++] = extra;
 }
 
 
 del_user_func_t *duf_list;
 void **duf_list_extra;
+struct profile_site **duf_list_site;
 unsigned int duf_size = 0, duf_used = 0;
 
 void
-reg_del_user_func(del_user_func_t handler, void *extra)
+reg_del_user_func_named(del_user_func_t handler, void *extra, const char *name)
 {
     if (duf_used == duf_size) {
         if (duf_size) {
             duf_size <<= 1;
             duf_list = realloc(duf_list, duf_size*sizeof(del_user_func_t));
             duf_list_extra = realloc(duf_list_extra, duf_size*sizeof(void*));
+            duf_list_site = realloc(duf_list_site, duf_size*sizeof(duf_list_site[0]));
         } else {
             duf_size = 8;
             duf_list = malloc(duf_size*sizeof(del_user_func_t));
             duf_list_extra = malloc(duf_size*sizeof(void*));
+            duf_list_site = malloc(duf_size*sizeof(duf_list_site[0]));
         }
     }
     duf_list[duf_used] = handler;
+    duf_list_site[duf_used] = profile_site(name);
     duf_list_extra[duf_used++] = extra;
 }
 
@@ -232,7 +277,7 @@ call_del_user_funcs(struct userNode *user, struct userNode *killer, const char *
 
     for (i = 0; i < duf_used; ++i)
     {
-        duf_list[i](user, killer, why, duf_list_extra[i]);
+        PROFILE_CALL(duf_list_site[i], duf_list[i](user, killer, why, duf_list_extra[i]));
     }
 }
 
@@ -246,6 +291,7 @@ unreg_del_user_func(del_user_func_t handler, void *extra)
     if (i == duf_used) return;
     memmove(duf_list+i, duf_list+i+1, (duf_used-i-1)*sizeof(duf_list[0]));
     memmove(duf_list_extra+i, duf_list_extra+i+1, (duf_used-i-1)*sizeof(duf_list_extra[0]));
+    memmove(duf_list_site+i, duf_list_site+i+1, (duf_used-i-1)*sizeof(duf_list_site[0]));
     duf_used--;
 }
 
@@ -298,7 +344,7 @@ NickChange(struct userNode* user, const char *new_nick, int no_announce)
      * place because that is slightly more useful.
      */
     for (nn=0; (nn<ncf2_used) && !user->dead; nn++)
-        ncf2_list[nn](user, old_nick, ncf2_list_extra[nn]);
+        PROFILE_CALL(ncf2_list_site[nn], ncf2_list[nn](user, old_nick, ncf2_list_extra[nn]));
     user->timestamp = now;
     if (IsLocal(user) && !no_announce)
         irc_nick(user, old_nick);
@@ -333,7 +379,7 @@ SVSNickChange(struct userNode* user, const char *new_nick)
      * place because that is slightly more useful.
      */
     for (nn=0; (nn<ncf2_used) && !user->dead; nn++)
-        ncf2_list[nn](user, old_nick, ncf2_list_extra[nn]);
+        PROFILE_CALL(ncf2_list_site[nn], ncf2_list[nn](user, old_nick, ncf2_list_extra[nn]));
     user->timestamp = now;
 
     free(old_nick);
@@ -346,14 +392,16 @@ GetUserH(const char *nick)
 }
 
 static account_func_t account_func;
+static struct profile_site *account_func_site;
 
 void
-reg_account_func(account_func_t handler)
+reg_account_func_named(account_func_t handler, const char *name)
 {
     if (account_func) {
         log_module(MAIN_LOG, LOG_WARNING, "Reregistering ACCOUNT handler.");
     }
     account_func = handler;
+    account_func_site = profile_site(name);
 }
 
 void
@@ -367,7 +415,7 @@ call_account_func(struct userNode *user, const char *stamp)
        P10 Protocol violation if (user->modes & FLAGS_STAMPED) here.
     */
     if (account_func)
-        account_func(user, stamp);
+        PROFILE_CALL(account_func_site, account_func(user, stamp));
 
 #ifdef WITH_PROTOCOL_P10
     /* Mark the user so we don't stamp it again. */
@@ -450,45 +498,53 @@ set_geoip_info(struct userNode *user)
 
 static new_channel_func_t *ncf_list;
 static void **ncf_list_extra;
+static struct profile_site **ncf_list_site;
 static unsigned int ncf_size = 0, ncf_used = 0;
 
 void
-reg_new_channel_func(new_channel_func_t handler, void *extra)
+reg_new_channel_func_named(new_channel_func_t handler, void *extra, const char *name)
 {
     if (ncf_used == ncf_size) {
 	if (ncf_size) {
 	    ncf_size <<= 1;
 	    ncf_list = realloc(ncf_list, ncf_size*sizeof(ncf_list[0]));
         ncf_list_extra = realloc(ncf_list_extra, ncf_size*sizeof(void*));
+        ncf_list_site = realloc(ncf_list_site, ncf_size*sizeof(ncf_list_site[0]));
 	} else {
 	    ncf_size = 8;
 	    ncf_list = malloc(ncf_size*sizeof(ncf_list[0]));
         ncf_list_extra = malloc(ncf_size*sizeof(void*));
+        ncf_list_site = malloc(ncf_size*sizeof(ncf_list_site[0]));
 	}
     }
     ncf_list[ncf_used] = handler;
+    ncf_list_site[ncf_used] = profile_site(name);
     ncf_list_extra[ncf_used++] = extra;
 }
 
 static join_func_t *jf_list;
 static void **jf_list_extra;
+static struct profile_site **jf_list_site;
 static unsigned int jf_size = 0, jf_used = 0;
 
 void
-reg_join_func(join_func_t handler, void *extra)
+reg_join_func_named(join_func_t handler, void *extra, const char *name)
 {
     if (jf_used == jf_size) {
 	if (jf_size) {
 	    jf_size <<= 1;
 	    jf_list = realloc(jf_list, jf_size*sizeof(join_func_t));
         jf_list_extra = realloc(jf_list_extra, jf_size*sizeof(void*));
+        jf_list_site = realloc(jf_list_site, jf_size*sizeof(jf_list_site[0]));
 	} else {
 	    jf_size = 8;
 	    jf_list = malloc(jf_size*sizeof(join_func_t));
         jf_list_extra = malloc(jf_size*sizeof(void*));
+        jf_list_site = malloc(jf_size*sizeof(jf_list_site[0]));
 	}
     }
     jf_list[jf_used] = handler;
+    jf_list_site[jf_used] = profile_site(name);
     jf_list_extra[jf_used++] = extra;
 }
 
@@ -603,7 +659,7 @@ AddChannel(const char *name, time_t time_, const char *modes, char *banlist, cha
     /* if it's a new or updated channel, make callbacks */
     if (rel_age > 0)
         for (nn=0; nn<ncf_used; nn++)
-            ncf_list[nn](cNode, ncf_list_extra[nn]);
+            PROFILE_CALL(ncf_list_site[nn], ncf_list[nn](cNode, ncf_list_extra[nn]));
 
     /* go through list of bans and add each one */
     if (banlist && (rel_age >= 0)) {
@@ -644,23 +700,27 @@ AddChannel(const char *name, time_t time_, const char *modes, char *banlist, cha
 
 static del_channel_func_t *dcf_list;
 static void **dcf_list_extra;
+static struct profile_site **dcf_list_site;
 static unsigned int dcf_size = 0, dcf_used = 0;
 
 void
-reg_del_channel_func(del_channel_func_t handler, void *extra)
+reg_del_channel_func_named(del_channel_func_t handler, void *extra, const char *name)
 {
     if (dcf_used == dcf_size) {
 	if (dcf_size) {
 	    dcf_size <<= 1;
 	    dcf_list = realloc(dcf_list, dcf_size*sizeof(dcf_list[0]));
         dcf_list_extra = realloc(dcf_list_extra, dcf_size*sizeof(void*));
+        dcf_list_site = realloc(dcf_list_site, dcf_size*sizeof(dcf_list_site[0]));
 	} else {
 	    dcf_size = 8;
 	    dcf_list = malloc(dcf_size*sizeof(dcf_list[0]));
         dcf_list_extra = malloc(dcf_size*sizeof(dcf_list_extra[0]));
+        dcf_list_site = malloc(dcf_size*sizeof(dcf_list_site[0]));
 	}
     }
     dcf_list[dcf_used] = handler;
+    dcf_list_site[dcf_used] = profile_site(name);
     dcf_list_extra[dcf_used++] = extra;
 }
 
@@ -691,7 +751,7 @@ DelChannel(struct chanNode *channel)
     channel->exemptlist.used = 0;
 
     for (n=0; n<dcf_used; n++)
-        dcf_list[n](channel, dcf_list_extra[n]);
+        PROFILE_CALL(dcf_list_site[n], dcf_list[n](channel, dcf_list_extra[n]));
 
     modeList_clean(&channel->members);
     banList_clean(&channel->banlist);
@@ -704,6 +764,7 @@ AddChannelUser(struct userNode *user, struct chanNode* channel)
 {
 	struct modeNode *mNode;
 	unsigned int n;
+	int res;
 
 	mNode = GetUserMode(channel, user);
 	if (mNode)
@@ -739,7 +800,8 @@ AddChannelUser(struct userNode *user, struct chanNode* channel)
         for (n=0; (n<jf_used) && !user->dead; n++) {
             /* Callbacks return true if they kick or kill the user,
              * and we can continue without removing mNode. */
-            if (jf_list[n](mNode, jf_list_extra[n]))
+            PROFILE_CALL(jf_list_site[n], res = jf_list[n](mNode, jf_list_extra[n]));
+            if (res)
                 return NULL;
         }
 
@@ -748,23 +810,27 @@ AddChannelUser(struct userNode *user, struct chanNode* channel)
 
 static part_func_t *pf_list;
 static void **pf_list_extra;
+static struct profile_site **pf_list_site;
 static unsigned int pf_size = 0, pf_used = 0;
 
 void
-reg_part_func(part_func_t handler, void *extra)
+reg_part_func_named(part_func_t handler, void *extra, const char *name)
 {
     if (pf_used == pf_size) {
 	if (pf_size) {
 	    pf_size <<= 1;
 	    pf_list = realloc(pf_list, pf_size*sizeof(part_func_t));
         pf_list_extra = realloc(pf_list_extra, pf_size*sizeof(void*));
+        pf_list_site = realloc(pf_list_site, pf_size*sizeof(pf_list_site[0]));
 	} else {
 	    pf_size = 8;
 	    pf_list = malloc(pf_size*sizeof(part_func_t));
         pf_list_extra = malloc(pf_size*sizeof(void*));
+        pf_list_site = malloc(pf_size*sizeof(pf_list_site[0]));
 	}
     }
     pf_list[pf_used] = handler;
+    pf_list_site[pf_used] = profile_site(name);
     pf_list_extra[pf_used++] = extra;
 }
 
@@ -779,6 +845,7 @@ unreg_part_func(part_func_t handler, void *extra)
         return;
     memmove(pf_list+i, pf_list+i+1, (pf_used-i-1)*sizeof(pf_list[0]));
     memmove(pf_list_extra+i, pf_list_extra+i+1, (pf_used-i-1)*sizeof(pf_list_extra[0]));
+    memmove(pf_list_site+i, pf_list_site+i+1, (pf_used-i-1)*sizeof(pf_list_site[0]));
     pf_used--;
 }
 
@@ -819,7 +886,7 @@ DelChannelUser(struct userNode* user, struct chanNode* channel, const char *reas
 
     /* make callbacks */
     for (n=0; n<pf_used; n++)
-	pf_list[n](mNode, reason, pf_list_extra[n]);
+	PROFILE_CALL(pf_list_site[n], pf_list[n](mNode, reason, pf_list_extra[n]));
 
     /* free memory */
     free(mNode);
@@ -832,6 +899,7 @@ DelChannelUser(struct userNode* user, struct chanNode* channel, const char *reas
 
 static kick_func_t *kf_list;
 static void **kf_list_extra;
+static struct profile_site **kf_list_site;
 static unsigned int kf_size = 0, kf_used = 0;
 
 void
@@ -844,7 +912,7 @@ KickChannelUser(struct userNode* target, struct chanNode* channel, struct userNo
 
     /* This may break things, but lets see.. -Rubin */
     for (n=0; n<kf_used; n++)
-        kf_list[n](kicker, target, channel, kf_list_extra[n]);
+        PROFILE_CALL(kf_list_site[n], kf_list[n](kicker, target, channel, kf_list_extra[n]));
 
     /* don't remove them from the channel, since the server will send a PART */
     irc_kick(kicker, target, channel, why);
@@ -858,20 +926,23 @@ KickChannelUser(struct userNode* target, struct chanNode* channel, struct userNo
 }
 
 void
-reg_kick_func(kick_func_t handler, void *extra)
+reg_kick_func_named(kick_func_t handler, void *extra, const char *name)
 {
     if (kf_used == kf_size) {
 	if (kf_size) {
 	    kf_size <<= 1;
 	    kf_list = realloc(kf_list, kf_size*sizeof(kick_func_t));
         kf_list_extra = realloc(kf_list_extra, kf_size*sizeof(void*));
+        kf_list_site = realloc(kf_list_site, kf_size*sizeof(kf_list_site[0]));
 	} else {
 	    kf_size = 8;
 	    kf_list = malloc(kf_size*sizeof(kick_func_t));
         kf_list_extra = malloc(kf_size*sizeof(void*));
+        kf_list_site = malloc(kf_size*sizeof(kf_list_site[0]));
 	}
     }
     kf_list[kf_used] = handler;
+    kf_list_site[kf_used] = profile_site(name);
     kf_list_extra[kf_used++] = extra;
 }
 
@@ -889,7 +960,7 @@ ChannelUserKicked(struct userNode* kicker, struct userNode* victim, struct chanN
         mn->idle_since = now;
 
     for (n=0; n<kf_used; n++)
-	kf_list[n](kicker, victim, channel, kf_list_extra[n]);
+	PROFILE_CALL(kf_list_site[n], kf_list[n](kicker, victim, channel, kf_list_extra[n]));
 
     DelChannelUser(victim, channel, 0, 0);
 
@@ -919,23 +990,27 @@ int ChannelExemptExists(struct chanNode *channel, const char *exempt)
 
 static topic_func_t *tf_list;
 static void **tf_list_extra;
+static struct profile_site **tf_list_site;
 static unsigned int tf_size = 0, tf_used = 0;
 
 void
-reg_topic_func(topic_func_t handler, void *extra)
+reg_topic_func_named(topic_func_t handler, void *extra, const char *name)
 {
     if (tf_used == tf_size) {
 	if (tf_size) {
 	    tf_size <<= 1;
 	    tf_list = realloc(tf_list, tf_size*sizeof(topic_func_t));
         tf_list_extra = realloc(tf_list_extra, tf_size*sizeof(void*));
+        tf_list_site = realloc(tf_list_site, tf_size*sizeof(tf_list_site[0]));
 	} else {
 	    tf_size = 8;
 	    tf_list = malloc(tf_size*sizeof(topic_func_t));
         tf_list_extra = malloc(tf_size*sizeof(void*));
+        tf_list_site = malloc(tf_size*sizeof(tf_list_site[0]));
 	}
     }
     tf_list[tf_used] = handler;
+    tf_list_site[tf_used] = profile_site(name);
     tf_list_extra[tf_used++] = extra;
 }
 
@@ -945,6 +1020,7 @@ SetChannelTopic(struct chanNode *channel, struct userNode *service, struct userN
     unsigned int n;
     struct modeNode *mn;
     char old_topic[TOPICLEN+1];
+    int res;
 
     safestrncpy(old_topic, channel->topic, sizeof(old_topic));
     safestrncpy(channel->topic, topic, sizeof(channel->topic));
@@ -963,13 +1039,15 @@ SetChannelTopic(struct chanNode *channel, struct userNode *service, struct userN
          * so don't call the tf_list functions. */
 	irc_topic(service, user, channel, topic);
     } else {
-	for (n=0; n<tf_used; n++)
+	for (n=0; n<tf_used; n++) {
             /* A topic change handler can return non-zero to indicate
              * that it has reverted the topic change, and that further
              * hooks should not be called.
              */
-	    if (tf_list[n](user, channel, old_topic, tf_list_extra[n]))
+	    PROFILE_CALL(tf_list_site[n], res = tf_list[n](user, channel, old_topic, tf_list_extra[n]));
+            if (res)
                 break;
+        }
     }
 }
 
@@ -1059,22 +1137,32 @@ hash_cleanup(UNUSED_ARG(void *extra))
 
     free(slf_list);
     free(slf_list_extra);
+    free(slf_list_site);
     free(nuf_list);
     free(nuf_list_extra);
+    free(nuf_list_site);
     free(ncf2_list);
     free(ncf2_list_extra);
+    free(ncf2_list_site);
     free(duf_list);
     free(duf_list_extra);
+    free(duf_list_site);
     free(ncf_list);
     free(ncf_list_extra);
+    free(ncf_list_site);
     free(jf_list);
     free(jf_list_extra);
+    free(jf_list_site);
     free(dcf_list);
     free(dcf_list_extra);
+    free(dcf_list_site);
     free(pf_list);
     free(pf_list_extra);
+    free(pf_list_site);
     free(kf_list);
     free(kf_list_extra);
+    free(kf_list_site);
     free(tf_list);
     free(tf_list_extra);
+    free(tf_list_site);
 }
@@ -24,6 +24,7 @@
 #include "common.h"
 #include "dict.h"
 #include "policer.h"
+#include "profile.h"
 
 #define MODE_CHANOP		0x00000001 /* +o USER */
 #define MODE_VOICE		0x00000002 /* +v USER */
@@ -390,41 +391,52 @@ struct modeNode* GetUserMode(struct chanNode* channel, struct userNode* user);
 int userList_contains(struct userList *list, struct userNode *user);
 unsigned int IsUserP(struct userNode *user);
 
+/* The reg_*_func() macros label each callback with its name and the
+ * file that registered it, for the profiler (see profile.h). */
 typedef int (*server_link_func_t) (struct server *server, void *extra);
-void reg_server_link_func(server_link_func_t handler, void *extra);
+void reg_server_link_func_named(server_link_func_t handler, void *extra, const char *name);
+#define reg_server_link_func(HANDLER, EXTRA) reg_server_link_func_named((HANDLER), (EXTRA), PROFILE_NAME("link", HANDLER))
 void call_server_link_funcs(struct server *server);
 
 typedef void (*sasl_input_func_t) (struct server* source ,const char *identifier, const char *subcmd, const char *data, const char *ext, void *extra);
-void reg_sasl_input_func(sasl_input_func_t handler, void *extra);
+void reg_sasl_input_func_named(sasl_input_func_t handler, void *extra, const char *name);
+#define reg_sasl_input_func(HANDLER, EXTRA) reg_sasl_input_func_named((HANDLER), (EXTRA), PROFILE_NAME("sasl", HANDLER))
 void call_sasl_input_func(struct server* source ,const char *identifier, const char *subcmd, const char *data, const char *ext);
 void unreg_sasl_input_func(sasl_input_func_t handler, void *extra);
 
 typedef int (*new_user_func_t) (struct userNode *user, void *extra);
-void reg_new_user_func(new_user_func_t handler, void *extra);
+void reg_new_user_func_named(new_user_func_t handler, void *extra, const char *name);
+#define reg_new_user_func(HANDLER, EXTRA) reg_new_user_func_named((HANDLER), (EXTRA), PROFILE_NAME("new_user", HANDLER))
 void call_new_user_funcs(struct userNode *user);
 typedef void (*del_user_func_t) (struct userNode *user, struct userNode *killer, const char *why, void *extra);
-void reg_del_user_func(del_user_func_t handler, void *extra);
+void reg_del_user_func_named(del_user_func_t handler, void *extra, const char *name);
+#define reg_del_user_func(HANDLER, EXTRA) reg_del_user_func_named((HANDLER), (EXTRA), PROFILE_NAME("del_user", HANDLER))
 void call_del_user_funcs(struct userNode *user, struct userNode *killer, const char *why);
 void unreg_del_user_func(del_user_func_t handler, void *extra);
 void ReintroduceUser(struct userNode* user);
 typedef void (*nick_change_func_t)(struct userNode *user, const char *old_nick, void *extra);
-void reg_nick_change_func(nick_change_func_t handler, void *extra);
+void reg_nick_change_func_named(nick_change_func_t handler, void *extra, const char *name);
+#define reg_nick_change_func(HANDLER, EXTRA) reg_nick_change_func_named((HANDLER), (EXTRA), PROFILE_NAME("nick_change", HANDLER))
 void NickChange(struct userNode* user, const char *new_nick, int no_announce);
 void SVSNickChange(struct userNode* user, const char *new_nick);
 
 typedef void (*account_func_t) (struct userNode *user, const char *stamp);
-void reg_account_func(account_func_t handler);
+void reg_account_func_named(account_func_t handler, const char *name);
+#define reg_account_func(HANDLER) reg_account_func_named((HANDLER), PROFILE_NAME("account", HANDLER))
 void call_account_func(struct userNode *user, const char *stamp);
 void StampUser(struct userNode *user, const char *stamp, time_t timestamp);
 void assign_fakehost(struct userNode *user, const char *host, int announce);
 void set_geoip_info(struct userNode *user);
 
 typedef void (*new_channel_func_t) (struct chanNode *chan, void *extra);
-void reg_new_channel_func(new_channel_func_t handler, void *extra);
+void reg_new_channel_func_named(new_channel_func_t handler, void *extra, const char *name);
+#define reg_new_channel_func(HANDLER, EXTRA) reg_new_channel_func_named((HANDLER), (EXTRA), PROFILE_NAME("new_channel", HANDLER))
 typedef int (*join_func_t) (struct modeNode *mNode, void *extra);
-void reg_join_func(join_func_t handler, void *extra);
+void reg_join_func_named(join_func_t handler, void *extra, const char *name);
+#define reg_join_func(HANDLER, EXTRA) reg_join_func_named((HANDLER), (EXTRA), PROFILE_NAME("join", HANDLER))
 typedef void (*del_channel_func_t) (struct chanNode *chan, void *extra);
-void reg_del_channel_func(del_channel_func_t handler, void *extra);
+void reg_del_channel_func_named(del_channel_func_t handler, void *extra, const char *name);
+#define reg_del_channel_func(HANDLER, EXTRA) reg_del_channel_func_named((HANDLER), (EXTRA), PROFILE_NAME("del_channel", HANDLER))
 
 struct chanNode* AddChannel(const char *name, time_t time_, const char *modes, char *banlist, char *exemptlist);
 void LockChannel(struct chanNode *channel);
@@ -433,20 +445,23 @@ void UnlockChannel(struct chanNode *channel);
 struct modeNode* AddChannelUser(struct userNode* user, struct chanNode* channel);
 
 typedef void (*part_func_t) (struct modeNode *mn, const char *reason, void *extra);
-void reg_part_func(part_func_t handler, void *extra);
+void reg_part_func_named(part_func_t handler, void *extra, const char *name);
+#define reg_part_func(HANDLER, EXTRA) reg_part_func_named((HANDLER), (EXTRA), PROFILE_NAME("part", HANDLER))
 void unreg_part_func(part_func_t handler, void *extra);
 void DelChannelUser(struct userNode* user, struct chanNode* channel, const char *reason, int deleting);
 void KickChannelUser(struct userNode* target, struct chanNode* channel, struct userNode *kicker, const char *why);
 
 typedef void (*kick_func_t) (struct userNode *kicker, struct userNode *user, struct chanNode *chan, void *extra);
-void reg_kick_func(kick_func_t handler, void *extra);
+void reg_kick_func_named(kick_func_t handler, void *extra, const char *name);
+#define reg_kick_func(HANDLER, EXTRA) reg_kick_func_named((HANDLER), (EXTRA), PROFILE_NAME("kick", HANDLER))
 void ChannelUserKicked(struct userNode* kicker, struct userNode* victim, struct chanNode* channel);
 
 int ChannelBanExists(struct chanNode *channel, const char *ban);
 int ChannelExemptExists(struct chanNode *channel, const char *exempt);
 
 typedef int (*topic_func_t)(struct userNode *who, struct chanNode *chan, const char *old_topic, void *extra);
-void reg_topic_func(topic_func_t handler, void *extra);
+void reg_topic_func_named(topic_func_t handler, void *extra, const char *name);
+#define reg_topic_func(HANDLER, EXTRA) reg_topic_func_named((HANDLER), (EXTRA), PROFILE_NAME("topic", HANDLER))
 void SetChannelTopic(struct chanNode *channel, struct userNode *service, struct userNode *user, const char *topic, int announce);
 struct userNode *IsInChannel(struct chanNode *channel, struct userNode *user);
 
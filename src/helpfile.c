@@ -274,6 +274,32 @@ int strlen_vis(char *str)
     return count;
 }
 
+char *
+table_alloc_cells(struct helpfile_table *table, unsigned int rows) {
+    unsigned int ii;
+
+    table->length = rows + 1;
+    table->contents = calloc(table->length, sizeof(table->contents[0]));
+    for (ii = 0; ii < table->length; ii++)
+        table->contents[ii] = calloc(table->width, sizeof(table->contents[0][0]));
+    return malloc((rows ? rows : 1) * table->width * TABLE_CELL_SIZE);
+}
+
+/* Formats the body cell at row (1 being the first row after the
+ * headers) and col into its buffer and puts it in the table. */
+const char *
+table_cell_printf(struct helpfile_table *table, char *cells, unsigned int row, unsigned int col, const char *format, ...) {
+    char *cell;
+    va_list args;
+
+    cell = cells + ((row - 1) * table->width + col) * TABLE_CELL_SIZE;
+    va_start(args, format);
+    vsnprintf(cell, TABLE_CELL_SIZE, format, args);
+    va_end(args);
+    table->contents[row][col] = cell;
+    return cell;
+}
+
 void
 table_send(struct userNode *from, const char *to, unsigned int size, irc_send_func irc_send, struct helpfile_table table) {
     unsigned int ii, jj, len, nreps, reps, tot_width, pos, spaces, *max_width;
@@ -88,6 +88,14 @@ int send_help_brief(struct userNode *dest, struct userNode *src, struct helpfile
  * irc_send is either irc_privmsg or irc_notice; NULL means figure it out. */
 void table_send(struct userNode *from, const char *to, unsigned int size, irc_send_func irc_send, struct helpfile_table table);
 
+/* Tables of numbers format each cell into a fixed-size buffer.
+ * table_alloc_cells() allocates table->contents for a header row and
+ * rows more (table->width must be set) and returns the buffers for
+ * the body cells; free them once the table has been sent. */
+#define TABLE_CELL_SIZE 64
+char *table_alloc_cells(struct helpfile_table *table, unsigned int rows);
+const char *table_cell_printf(struct helpfile_table *table, char *cells, unsigned int row, unsigned int col, const char *format, ...) PRINTF_LIKE(5, 6);
+
 #if defined(GCC_VARMACROS)
 # define send_channel_message(CHANNEL, ARGS...) send_target_message(5, (CHANNEL)->name, ARGS)
 # define send_channel_notice(CHANNEL, ARGS...) send_target_message(4, (CHANNEL)->name, ARGS)
@@ -0,0 +1,98 @@
+/* histogram.c - Fixed-bucket latency histograms
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "histogram.h"
+
+#define SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+
+static unsigned int
+histogram_bucket(unsigned long value)
+{
+    unsigned int shift;
+
+    if (value > 0xffffffffUL)
+        value = 0xffffffffUL;
+    if (value < SUB_COUNT)
+        return value;
+    for (shift = 0; (value >> shift) >= 2 * SUB_COUNT; shift++) ;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (SUB_COUNT - 1));
+}
+
+unsigned long
+histogram_bucket_max(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < SUB_COUNT)
+        return bucket;
+    shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return (((unsigned long)(SUB_COUNT + (bucket & (SUB_COUNT - 1))) + 1) << shift) - 1;
+}
+
+void
+histogram_add(struct histogram *hist, unsigned long value)
+{
+    hist->buckets[histogram_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+unsigned long
+histogram_percentile(const struct histogram *hist, double fraction)
+{
+    unsigned long seen, wanted, limit;
+    unsigned int ii;
+
+    if (!hist->count)
+        return 0;
+    wanted = (unsigned long)(fraction * hist->count + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+    for (ii = seen = 0; ii < HISTOGRAM_BUCKETS; ii++) {
+        seen += hist->buckets[ii];
+        if (seen >= wanted) {
+            limit = histogram_bucket_max(ii);
+            return (limit < hist->max) ? limit : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void
+histogram_merge(struct histogram *dest, const struct histogram *src)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < HISTOGRAM_BUCKETS; ii++)
+        dest->buckets[ii] += src->buckets[ii];
+    dest->count += src->count;
+    dest->sum += src->sum;
+    if (src->max > dest->max)
+        dest->max = src->max;
+}
+
+void
+histogram_clear(struct histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
@@ -0,0 +1,52 @@
+/* histogram.h - Fixed-bucket latency histograms
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/* Log-linear histograms in the style of HdrHistogram: every power of
+ * two is split into 2^HISTOGRAM_SUB_BITS equal buckets, so a bucket is
+ * never wider than 1/8 of the values it holds.  Values are unsigned
+ * 32-bit quantities (normally microseconds); larger values are
+ * clamped.  Adding a value is a few shifts and an increment, and the
+ * whole structure is a fixed size that can be embedded or calloc()ed.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS  ((32 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+    unsigned long count;
+    unsigned long max;
+    double sum;
+    unsigned int buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_add(struct histogram *hist, unsigned long value);
+/* Returns (an upper bound for) the value below which the given fraction
+ * (0.0 to 1.0) of samples fall, or 0 if the histogram is empty. */
+unsigned long histogram_percentile(const struct histogram *hist, double fraction);
+void histogram_merge(struct histogram *dest, const struct histogram *src);
+void histogram_clear(struct histogram *hist);
+
+/* Bucket boundaries, for exporting the distribution. */
+unsigned long histogram_bucket_max(unsigned int bucket);
+
+#endif /* !defined(HISTOGRAM_H) */
@@ -22,6 +22,7 @@
 #include "common.h"
 #include "hash.h"
 #include "hosthiding.h"
+#include "metrics.h"
 
  /* The implementation here was originally done by Gary S. Brown.  I have
     borrowed the tables directly, and made some minor changes to the
@@ -67,10 +68,33 @@
   /*                                                                        */
   /*  --------------------------------------------------------------------  */
 
-/* Set only once */
 static int KEY;
 static int KEY2;
 static int KEY3;
+static int keys_loaded;
+
+/* Clones from one address (and users of one ISP) keep asking for the
+ * same virtual hosts, so results are remembered in a bounded LRU.  The
+ * lookup must be exact: the suffix copied into a virtual host keeps
+ * the case of the real hostname, so a dict (which folds case) will not
+ * do; a small chained hash table over crc32() is used instead. */
+struct virt_entry {
+  struct virt_entry *hnext;
+  struct virt_entry *prev;
+  struct virt_entry *next;
+  unsigned long hash;
+  char virt[HOSTLEN + 1];
+  char key[1];
+};
+
+static struct virt_entry **virt_buckets;
+static struct virt_entry *virt_head;
+static struct virt_entry *virt_tail;
+static unsigned int virt_nbuckets;
+static unsigned int virt_count;
+static unsigned int virt_capacity = 4096;
+static unsigned long virt_hits;
+static unsigned long virt_misses;
 
 static unsigned long crc32_tab[] = {
   0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -157,26 +181,179 @@ str2arr (char **pparv, char *string, char *delim)
   return pparc;
 }
 
-int
-check_keys()
+static void
+virt_cache_unlink(struct virt_entry *ent)
 {
-  char *data;
+  struct virt_entry **pp;
+
+  for (pp = &virt_buckets[ent->hash & (virt_nbuckets - 1)]; *pp != ent; pp = &(*pp)->hnext) ;
+  *pp = ent->hnext;
+  if (ent->prev)
+    ent->prev->next = ent->next;
+  else
+    virt_head = ent->next;
+  if (ent->next)
+    ent->next->prev = ent->prev;
+  else
+    virt_tail = ent->prev;
+  virt_count--;
+  free(ent);
+}
 
-  if (!KEY) {
-    data = conf_get_data("server/key1", RECDB_QSTRING);
-    KEY = data ? atoi(data) : 45432;
+static void
+virt_cache_flush(void)
+{
+  while (virt_tail)
+    virt_cache_unlink(virt_tail);
+}
+
+/* Builds the cache key for one kind of virtual host and returns its
+ * hash, or 0 (and an empty key) if the names do not fit. */
+static unsigned long
+virt_cache_key(char *key, unsigned int size, char kind, const char *curr, const char *host)
+{
+  unsigned int len, clen, hlen;
+
+  clen = strlen(curr);
+  hlen = strlen(host);
+  if (clen + hlen + 3 > size) {
+    key[0] = '\0';
+    return 0;
   }
+  key[0] = kind;
+  memcpy(key + 1, curr, clen);
+  key[clen + 1] = ' ';
+  memcpy(key + clen + 2, host, hlen + 1);
+  len = clen + hlen + 2;
+  return crc32((unsigned char *)key, len);
+}
 
-  if (!KEY2) {
-    data = conf_get_data("server/key2", RECDB_QSTRING);
-    KEY2 = data ? atoi(data) : 76934;
+static const char *
+virt_cache_find(const char *key, unsigned long hash)
+{
+  struct virt_entry *ent;
+
+  if (!virt_capacity || !key[0])
+    return NULL;
+  if (virt_nbuckets) {
+    for (ent = virt_buckets[hash & (virt_nbuckets - 1)]; ent; ent = ent->hnext) {
+      if (ent->hash != hash || strcmp(ent->key, key))
+        continue;
+      if (ent != virt_head) {
+        ent->prev->next = ent->next;
+        if (ent->next)
+          ent->next->prev = ent->prev;
+        else
+          virt_tail = ent->prev;
+        ent->prev = NULL;
+        ent->next = virt_head;
+        virt_head->prev = ent;
+        virt_head = ent;
+      }
+      virt_hits++;
+      return ent->virt;
+    }
   }
+  virt_misses++;
+  return NULL;
+}
 
-  if (!KEY3) {
-    data = conf_get_data("server/key3", RECDB_QSTRING);
-    KEY3 = data ? atoi(data) : 98336;
+static void
+virt_cache_add(const char *key, unsigned long hash, const char *virt)
+{
+  struct virt_entry *ent;
+  unsigned int len;
+
+  if (!virt_capacity || !key[0])
+    return;
+  if (!virt_nbuckets) {
+    for (virt_nbuckets = 16; virt_nbuckets < virt_capacity; virt_nbuckets <<= 1) ;
+    virt_buckets = calloc(virt_nbuckets, sizeof(virt_buckets[0]));
   }
+  while (virt_count >= virt_capacity)
+    virt_cache_unlink(virt_tail);
+  len = strlen(key);
+  ent = malloc(sizeof(*ent) + len);
+  memcpy(ent->key, key, len + 1);
+  safestrncpy(ent->virt, virt, sizeof(ent->virt));
+  ent->hash = hash;
+  ent->hnext = virt_buckets[hash & (virt_nbuckets - 1)];
+  virt_buckets[hash & (virt_nbuckets - 1)] = ent;
+  ent->prev = NULL;
+  ent->next = virt_head;
+  if (virt_head)
+    virt_head->prev = ent;
+  else
+    virt_tail = ent;
+  virt_head = ent;
+  virt_count++;
+}
+
+/* Changes how many virtual hosts are remembered; 0 disables the cache. */
+void
+hosthiding_set_cache_size(unsigned int size)
+{
+  if (size == virt_capacity)
+    return;
+  virt_cache_flush();
+  free(virt_buckets);
+  virt_buckets = NULL;
+  virt_nbuckets = 0;
+  virt_capacity = size;
+}
+
+void
+hosthiding_cache_stats(unsigned int *count, unsigned long *hits, unsigned long *misses)
+{
+  *count = virt_count;
+  *hits = virt_hits;
+  *misses = virt_misses;
+}
+
+static void
+hosthiding_conf_read(void)
+{
+  char *data;
+  int key1, key2, key3;
+
+  data = conf_get_data("server/key1", RECDB_QSTRING);
+  key1 = data ? atoi(data) : 45432;
+  data = conf_get_data("server/key2", RECDB_QSTRING);
+  key2 = data ? atoi(data) : 76934;
+  data = conf_get_data("server/key3", RECDB_QSTRING);
+  key3 = data ? atoi(data) : 98336;
+  data = conf_get_data("server/hidden_host_cache", RECDB_QSTRING);
+  hosthiding_set_cache_size(data ? strtoul(data, NULL, 0) : 4096);
+
+  /* Every remembered virtual host was made with the old keys. */
+  if (key1 != KEY || key2 != KEY2 || key3 != KEY3)
+    virt_cache_flush();
+  KEY = key1;
+  KEY2 = key2;
+  KEY3 = key3;
+  keys_loaded = 1;
+}
+
+static double
+hosthiding_metric_cached(UNUSED_ARG(void *extra))
+{
+  return virt_count;
+}
+
+void
+hosthiding_init(void)
+{
+  conf_register_reload(hosthiding_conf_read);
+  metrics_register("x3_hidden_host_cache_entries", "Virtual hosts remembered by the hidden host cache.", METRIC_GAUGE, hosthiding_metric_cached, NULL);
+  metrics_register_ulong("x3_hidden_host_cache_hits_total", "Virtual hosts found in the hidden host cache.", METRIC_COUNTER, &virt_hits);
+  metrics_register_ulong("x3_hidden_host_cache_misses_total", "Virtual hosts that had to be computed.", METRIC_COUNTER, &virt_misses);
+}
 
+int
+check_keys()
+{
+  if (!keys_loaded)
+    hosthiding_conf_read();
   return 0;
 }
 
@@ -187,10 +364,19 @@ make_virthost (char *curr, char *host, char *virt)
   char *parv[HOSTLEN + 1], *parv2[HOSTLEN + 1], s[HOSTLEN + 1], s2[HOSTLEN + 2];
   int parc = 0, parc2 = 0, len = 0;
   unsigned int hash[8];
+  unsigned long hash_key;
+  const char *cached;
+  char key[2 * HOSTLEN + 4];
 
   if ((strlen(host) < 3) || (strlen(curr) < 3))
     return;
 
+  hash_key = virt_cache_key(key, sizeof(key), 'h', curr, host);
+  if ((cached = virt_cache_find(key, hash_key))) {
+    safestrncpy (virt, cached, HOSTLEN);
+    return;
+  }
+
   strncpy (s, curr, HOSTLEN);
   strncpy (s2, host, HOSTLEN);
 
@@ -239,6 +425,7 @@ make_virthost (char *curr, char *host, char *virt)
                hash[0], hash[1]);
     }
   }
+  virt_cache_add(key, hash_key, mask);
   safestrncpy (virt, mask, HOSTLEN);
   return;
 }
@@ -250,10 +437,19 @@ make_virtip (char *curr, char *host, char *virt)
   char *parv[HOSTLEN + 1], *parv2[HOSTLEN + 1], s[HOSTLEN + 1], s2[HOSTLEN + 2];
   int parc = 0, parc2 = 0, len = 0;
   unsigned int hash[8];
+  unsigned long hash_key;
+  const char *cached;
+  char key[2 * HOSTLEN + 4];
 
   if ((strlen(host) < 3) || (strlen(curr) < 3))
     return;
 
+  hash_key = virt_cache_key(key, sizeof(key), 'i', curr, host);
+  if ((cached = virt_cache_find(key, hash_key))) {
+    safestrncpy(virt, cached, SOCKIPLEN + 30);
+    return;
+  }
+
   strncpy (s, curr, HOSTLEN);
   strncpy (s2, host, HOSTLEN);
 
@@ -285,6 +481,7 @@ make_virtip (char *curr, char *host, char *virt)
             parv2[parc2 - 1]);
   }
 
+  virt_cache_add(key, hash_key, mask);
   safestrncpy(virt, mask, SOCKIPLEN + 30);
   return;
 }
@@ -297,10 +494,19 @@ make_ipv6virthost (char *curr, char *host, char *new)
     s2[HOSTLEN + 2], s3[HOSTLEN + 2];
   int parc = 0, parc2 = 0;
   unsigned int hash[8];
+  unsigned long hash_key;
+  const char *cached;
+  char key[2 * HOSTLEN + 4];
 
   if ((strlen(host) < 3) || (strlen(curr) < 3))
     return;
 
+  hash_key = virt_cache_key(key, sizeof(key), '6', curr, host);
+  if ((cached = virt_cache_find(key, hash_key))) {
+    strncpy (new, cached, HOSTLEN);
+    return;
+  }
+
   strncpy (s, curr, HOSTLEN);
   strncpy (s2, host, HOSTLEN);
 
@@ -356,6 +562,7 @@ make_ipv6virthost (char *curr, char *host, char *new)
              hash[6] / 10000, hash[7] / 10000);
   }
 
+  virt_cache_add(key, hash_key, mask);
   strncpy (new, mask, HOSTLEN);
   return;
 }
@@ -30,6 +30,10 @@ extern unsigned long crc32 (const unsigned char *, unsigned int);
 extern void make_virthost (char *curr, char *host, char *virt);
 extern void make_virtip (char *curr, char *host, char *virt);
 
+extern void hosthiding_init (void);
+extern void hosthiding_set_cache_size (unsigned int size);
+extern void hosthiding_cache_stats (unsigned int *count, unsigned long *hits, unsigned long *misses);
+
 /* IPv6 Stuff */
 extern void ip62arr (char *, char *);
 extern void make_ipv6virthost (char *curr, char *host, char *new);
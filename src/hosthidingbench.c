@@ -0,0 +1,221 @@
+#include "common.h"
+#include "conf.h"
+#include "hash.h"
+#include "helpfile.h"
+#include "hosthiding.h"
+#include "log.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* Drives connections through the virtual host generator with and
+ * without its cache:
+ *
+ *   hosthidingbench [connections] [hosts] [cache size]
+ *
+ * Connecting hosts follow a skewed distribution, so that a few hosts
+ * bring many clones, and are a mix of ISP reverse DNS names, bare IPv4
+ * addresses and IPv6 hosts.  Every cached result must equal the
+ * uncached one, including after the hiding keys change. */
+
+#define ISPS 40
+
+struct host {
+    char ip[HOSTLEN + 1];
+    char name[HOSTLEN + 1];
+    char virtip[SOCKIPLEN + 30];
+    char virthost[HOSTLEN + 1];
+    unsigned int ipv6 : 1;
+};
+
+static struct host *hosts;
+static unsigned int *order;
+static const char *key1 = "45432";
+static conf_reload_func reload_func;
+
+static void
+make_hosts(unsigned int count)
+{
+    static const char *tlds[] = { "net", "com", "de", "co.uk", "com.br", "fr" };
+    static const char *pools[] = { "dsl", "cable", "dyn", "pool", "res", "fiber" };
+    unsigned int ii, isp, kind, b, c, d;
+
+    hosts = calloc(count, sizeof(hosts[0]));
+    for (ii = 0; ii < count; ii++) {
+        struct host *h = &hosts[ii];
+        isp = rand() % ISPS;
+        kind = rand() % 10;
+        if (kind < 8) {
+            b = rand() % 256;
+            c = rand() % 256;
+            d = 1 + rand() % 254;
+            snprintf(h->ip, sizeof(h->ip), "%u.%u.%u.%u", 1 + isp * 5, b, c, d);
+            if (kind < 6)
+                snprintf(h->name, sizeof(h->name), "%s-%u-%u-%u-%u.%s%u.isp%u.%s",
+                         pools[isp % 6], 1 + isp * 5, b, c, d, pools[rand() % 6], rand() % 20, isp, tlds[isp % 6]);
+            else
+                strcpy(h->name, h->ip);
+        } else {
+            h->ipv6 = 1;
+            snprintf(h->ip, sizeof(h->ip), "2001:db8:%x:%x::%x", isp, rand() % 65536, 1 + rand() % 65535);
+            if (kind == 8)
+                snprintf(h->name, sizeof(h->name), "host%u.v6.isp%u.%s", rand() % 1000, isp, tlds[isp % 6]);
+            else
+                strcpy(h->name, h->ip);
+        }
+    }
+}
+
+/* Skewed towards low host numbers: a few hosts account for most
+ * connections, and most hosts connect only once or twice. */
+static void
+make_order(unsigned int connections, unsigned int count)
+{
+    unsigned int ii;
+    double u;
+
+    order = calloc(connections, sizeof(order[0]));
+    for (ii = 0; ii < connections; ii++) {
+        u = rand() / (RAND_MAX + 1.0);
+        order[ii] = (unsigned int)(count * u * u * u);
+    }
+}
+
+static void
+virtualize(struct host *h, char *virtip, char *virthost)
+{
+    virtip[0] = virthost[0] = '\0';
+    if (h->ipv6) {
+        make_ipv6virthost(h->ip, h->name, virthost);
+    } else {
+        make_virtip(h->ip, h->ip, virtip);
+        make_virthost(h->ip, h->name, virthost);
+    }
+}
+
+/* Runs every connection; the first pass records each host's answer and
+ * later passes must reproduce it. */
+static unsigned int
+run(unsigned int connections, int record, double *secs)
+{
+    struct timeval start, stop;
+    char virtip[SOCKIPLEN + 30], virthost[HOSTLEN + 1];
+    unsigned int ii, errors = 0;
+    struct host *h;
+
+    gettimeofday(&start, NULL);
+    for (ii = 0; ii < connections; ii++) {
+        h = &hosts[order[ii]];
+        virtualize(h, virtip, virthost);
+        if (record && !h->virthost[0]) {
+            strcpy(h->virtip, virtip);
+            strcpy(h->virthost, virthost);
+        } else if (strcmp(h->virtip, virtip) || strcmp(h->virthost, virthost)) {
+            if (errors++ < 5)
+                fprintf(stderr, "mismatch for %s (%s): %s/%s, expected %s/%s\n", h->name, h->ip, virtip, virthost, h->virtip, h->virthost);
+        }
+    }
+    gettimeofday(&stop, NULL);
+    *secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+    return errors;
+}
+
+static void
+report(const char *what, unsigned int connections, double secs)
+{
+    unsigned long hits, misses;
+    unsigned int count;
+
+    hosthiding_cache_stats(&count, &hits, &misses);
+    printf("%-28s %8.3f s  %7.0f ns/connection  (%u cached, %lu hits, %lu misses)\n",
+           what, secs, secs * 1e9 / connections, count, hits, misses);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int connections, count, size, ii, errors;
+    double secs;
+
+    connections = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    count = (argc > 2) ? strtoul(argv[2], NULL, 0) : 10000;
+    size = (argc > 3) ? strtoul(argv[3], NULL, 0) : 4096;
+    if (!count)
+        count = 1;
+
+    srand(1);
+    tools_init();
+    hosthiding_init();
+    make_hosts(count);
+    make_order(connections, count);
+
+    hosthiding_set_cache_size(0);
+    errors = run(connections, 1, &secs);
+    report("uncached", connections, secs);
+
+    hosthiding_set_cache_size(size);
+    errors += run(connections, 0, &secs);
+    report("cached", connections, secs);
+
+    /* New keys must not be answered from the old cache. */
+    key1 = "12345";
+    reload_func();
+    hosthiding_set_cache_size(0);
+    for (ii = 0; ii < count; ii++)
+        hosts[ii].virthost[0] = '\0';
+    errors += run(connections, 1, &secs);
+    report("uncached, new keys", connections, secs);
+    hosthiding_set_cache_size(size);
+    errors += run(connections, 0, &secs);
+    report("cached, new keys", connections, secs);
+
+    if (errors)
+        fprintf(stderr, "%u mismatches between cached and uncached results.\n", errors);
+    free(order);
+    free(hosts);
+    return errors ? 1 : 0;
+}
+
+void *
+conf_get_data(const char *full_path, UNUSED_ARG(enum recdb_type type))
+{
+    if (!strcmp(full_path, "server/key1"))
+        return (void*)key1;
+    return NULL;
+}
+
+void
+conf_register_reload(conf_reload_func crf)
+{
+    reload_func = crf;
+    crf();
+}
+
+/* because tools.c likes to log stuff.. */
+void
+log_module(UNUSED_ARG(struct log_type *type), UNUSED_ARG(enum log_severity sev), const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    vfprintf(stderr, format, va);
+    va_end(va);
+}
+
+const char *
+language_find_message(UNUSED_ARG(struct language *lang), UNUSED_ARG(const char *msgid))
+{
+    return "Stub -- Not implemented.";
+}
+
+/* Things tools.c refers to that the real services would provide. */
+struct log_type *MAIN_LOG;
+struct language *lang_C;
+const char *hidden_host_suffix;
+
+/* tools.c looks up channels for extended bans. */
+struct chanNode *
+GetChannel(UNUSED_ARG(const char *name))
+{
+    return NULL;
+}
@@ -21,6 +21,7 @@
 #include "ioset-impl.h"
 #include "common.h"
 #include "log.h"
+#include "profile.h"
 
 #ifdef HAVE_SYS_EPOLL_H
 # include <sys/epoll.h>
@@ -104,6 +105,7 @@ ioset_epoll_loop(struct timeval *timeout)
 
     res = epoll_wait(epoll_fd, evts, ArrayLength(evts), msec);
     now = time(NULL) + clock_skew;
+    profile_loop_woke();
     if (res < 0) {
         if (errno != EINTR) {
             log_module(MAIN_LOG, LOG_ERROR, "epoll_wait() error %d: %s", errno, strerror(errno));
@@ -21,6 +21,7 @@
 #include "ioset-impl.h"
 #include "common.h"
 #include "log.h"
+#include "profile.h"
 
 #ifdef HAVE_SYS_EVENT_H
 # include <sys/event.h>
@@ -118,6 +119,7 @@ ioset_kevent_loop(struct timeval *timeout)
 	return 1;
     }
     now = time(NULL) + clock_skew;
+    profile_loop_woke();
 
     /* Process the events we got. */
     for (ii = 0; ii < res; ++ii) {
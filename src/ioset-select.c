@@ -21,6 +21,7 @@
 #include "ioset-impl.h"
 #include "common.h"
 #include "log.h"
+#include "profile.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -134,6 +135,7 @@ ioset_select_loop(struct timeval *timeout)
     select_result = select(max_fd + 1, &read_fds, &write_fds, NULL, timeout);
     debug_fdsets("After select", max_fd+1, &read_fds, &write_fds, &except_fds, timeout);
     now = time(NULL) + clock_skew;
+    profile_loop_woke();
     if (select_result < 0) {
         if (errno != EINTR) {
             log_module(MAIN_LOG, LOG_ERROR, "select() error %d: %s", errno, strerror(errno));
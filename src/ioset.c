@@ -20,7 +20,10 @@
 
 #include "ioset-impl.h"
 #include "log.h"
+#include "metrics.h"
+#include "profile.h"
 #include "timeq.h"
+#include "sweep.h"
 #include "saxdb.h"
 #include "conf.h"
 
@@ -139,6 +142,24 @@ extern struct io_engine io_engine_epoll;
 extern struct io_engine io_engine_win32;
 extern struct io_engine io_engine_select;
 
+static double
+ioset_metric_uplink_sendq(UNUSED_ARG(void *extra))
+{
+    return socket_io_fd ? ioq_used(&socket_io_fd->send) : 0;
+}
+
+static double
+ioset_metric_timeq(UNUSED_ARG(void *extra))
+{
+    return timeq_size();
+}
+
+static double
+ioset_metric_sweeps(UNUSED_ARG(void *extra))
+{
+    return sweep_pending();
+}
+
 void
 ioset_init(void)
 {
@@ -167,6 +188,9 @@ ioset_init(void)
     else
         log_module(MAIN_LOG, LOG_FATAL, "No usable I/O engine found.");
     log_module(MAIN_LOG, LOG_DEBUG, "Using %s I/O engine.", engine->name);
+    metrics_register("x3_uplink_sendq_bytes", "Bytes queued for the uplink.", METRIC_GAUGE, ioset_metric_uplink_sendq, NULL);
+    metrics_register("x3_timeq_events", "Events waiting in the timeq.", METRIC_GAUGE, ioset_metric_timeq, NULL);
+    metrics_register("x3_sweeps_pending", "Background sweeps waiting for a slice.", METRIC_GAUGE, ioset_metric_sweeps, NULL);
 }
 
 void
@@ -349,6 +373,8 @@ ioset_try_write(struct io_fd *fd) {
         if (fd->send.get == fd->send.size)
             fd->send.get = 0;
         engine->update(fd);
+        if (fd->close_after_send && fd->send.get == fd->send.put)
+            ioset_close(fd, 1);
     }
 }
 
@@ -356,6 +382,7 @@ void
 ioset_close(struct io_fd *fdp, int os_close) {
     if (!fdp)
         return;
+    fdp->close_after_send = 0;
     if (active_fd == fdp)
         active_fd = NULL;
     if (fdp->destroy_cb)
@@ -393,6 +420,14 @@ ioset_close(struct io_fd *fdp, int os_close) {
     free(fdp);
 }
 
+void
+ioset_close_after_send(struct io_fd *fd) {
+    if (fd->send.get == fd->send.put)
+        ioset_close(fd, 1);
+    else
+        fd->close_after_send = 1;
+}
+
 static void
 ioset_accept(struct io_fd *listener)
 {
@@ -529,6 +564,7 @@ ioset_events(struct io_fd *fd, int readable, int writable)
 {
     if (!fd || (!readable && !writable))
         return;
+    profile_loop_event();
     active_fd = fd;
     switch (fd->state) {
     case IO_CLOSED:
@@ -575,7 +611,6 @@ ioset_events(struct io_fd *fd, int readable, int writable)
 
 void
 ioset_run(void) {
-    extern struct io_fd *socket_io_fd;
     struct timeval timeout;
     time_t wakey;
 
@@ -585,7 +620,7 @@ ioset_run(void) {
 
         /* How long to sleep? (fill in select_timeout) */
         wakey = timeq_next();
-        if (wakey < now)
+        if (wakey < now || sweep_pending())
             timeout.tv_sec = 0;
         else
             timeout.tv_sec = wakey - now;
@@ -596,6 +631,8 @@ ioset_run(void) {
 
         /* Call any timeq events we need to call. */
         timeq_run();
+        /* Give background sweeps their slice of this pass. */
+        sweep_run();
         if (do_write_dbs) {
             saxdb_write_all(NULL);
             do_write_dbs = 0;
@@ -608,6 +645,11 @@ ioset_run(void) {
     }
 }
 
+unsigned int
+ioset_send_queued(const struct io_fd *fd) {
+    return ioq_used(&fd->send);
+}
+
 void
 ioset_write(struct io_fd *fd, const char *buf, unsigned int nbw) {
     unsigned int avail;
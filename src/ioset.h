@@ -36,6 +36,7 @@ struct io_fd {
     void *data;
     enum { IO_CLOSED, IO_LISTENING, IO_CONNECTING, IO_CONNECTED } state;
     unsigned int line_reads : 1;
+    unsigned int close_after_send : 1;
     int line_len;
     struct ioq send;
     struct ioq recv;
@@ -55,8 +56,11 @@ void ioset_update(struct io_fd *fd);
 void ioset_run(void);
 void ioset_write(struct io_fd *fd, const char *buf, unsigned int nbw);
 int ioset_printf(struct io_fd *fd, const char *fmt, ...) PRINTF_LIKE(2, 3);
+unsigned int ioset_send_queued(const struct io_fd *fd);
 int ioset_line_read(struct io_fd *fd, char *buf, int maxlen);
 void ioset_close(struct io_fd *fd, int os_close);
+/* Closes the fd once everything queued on it has been sent. */
+void ioset_close_after_send(struct io_fd *fd);
 void ioset_cleanup(void);
 void ioset_set_time(unsigned long new_now);
 
@@ -18,11 +18,17 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
  */
 
+#include "auditlog.h"
 #include "conf.h"
 #include "log.h"
 #include "helpfile.h" /* send_message, message_register, etc */
 #include "modcmd.h"
 #include "nickserv.h"
+#include "timeq.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
 
 #define Block  4096
 #define MAXLOGSEARCHLENGTH 10000
@@ -80,8 +86,27 @@ static struct dict *log_types;
 static struct log_type *log_default;
 static int log_inited, log_debugged;
 
+/* File destinations collect lines in a buffer that is written out in
+ * one go once it is half full, or flush_interval after the first line
+ * went in, so a busy log costs one write() per batch instead of one
+ * per line.  Lines below LOG_WARNING are dropped (and counted) if the
+ * buffer cannot be drained. */
+static unsigned int log_buffer_size = 65536;
+static unsigned long log_flush_interval = 1;
+static unsigned long log_fsync_interval;
+static int log_flush_scheduled;
+static time_t log_last_fsync;
+static struct logDestination *sync_log;
+static struct string_buffer log_stamp;
+static time_t log_stamp_when;
+
 DEFINE_LIST(logList, struct logDestination*)
 static void log_format_audit(struct logEntry *entry);
+static void log_format_audit_line(struct string_buffer *sbuf, time_t when, const char *bot, const char *channel_name, const char *nick, const char *hostmask, const char *account, const char *command);
+static void log_files_resize(void);
+static void log_schedule_flush(void);
+static void ldFile_reopen(struct logDestination *dest_);
+static void ldFile_close(struct logDestination *dest_);
 static const struct message_entry msgtab[] = {
     { "MSG_INVALID_FACILITY", "$b%s$b is an invalid log facility." },
     { "MSG_INVALID_SEVERITY", "$b%s$b is an invalid severity level." },
@@ -241,9 +266,16 @@ cleanup_logs(UNUSED_ARG(void *extra))
 {
 
     close_logs();
+    if (sync_log) {
+        ldFile_close(sync_log);
+        sync_log = NULL;
+    }
+    audit_store_configure(NULL, 0, 0, 0);
     dict_delete(log_types);
     dict_delete(log_dests);
     dict_delete(log_dest_types);
+    free(log_stamp.list);
+    memset(&log_stamp, 0, sizeof(log_stamp));
 }
 
 static enum log_severity
@@ -364,7 +396,9 @@ log_conf_read(void)
     const char *sep;
     struct log_type *type;
     enum log_severity sev;
-    unsigned int ii;
+    unsigned int ii, audit_segments;
+    unsigned long audit_segment_size;
+    const char *audit_dir;
 
     close_logs();
     dict_delete(log_dests);
@@ -372,10 +406,29 @@ log_conf_read(void)
     log_dests = dict_new();
     dict_set_free_keys(log_dests, free);
 
+    log_buffer_size = 65536;
+    log_flush_interval = 1;
+    log_fsync_interval = 0;
+    audit_dir = NULL;
+    audit_segment_size = 16777216;
+    audit_segments = 64;
     rd = conf_get_node("logs");
     if (rd && (rd->type == RECDB_OBJECT)) {
         for (it = dict_first(rd->d.object); it; it = iter_next(it)) {
-            if ((sep = strchr(iter_key(it), '.'))) {
+            rd2 = iter_data(it);
+            if (!irccasecmp(iter_key(it), "buffer_size") && (rd2->type == RECDB_QSTRING)) {
+                log_buffer_size = strtoul(rd2->d.qstring, NULL, 0);
+            } else if (!irccasecmp(iter_key(it), "flush_interval") && (rd2->type == RECDB_QSTRING)) {
+                log_flush_interval = ParseInterval(rd2->d.qstring);
+            } else if (!irccasecmp(iter_key(it), "fsync_interval") && (rd2->type == RECDB_QSTRING)) {
+                log_fsync_interval = ParseInterval(rd2->d.qstring);
+            } else if (!irccasecmp(iter_key(it), "audit_store") && (rd2->type == RECDB_QSTRING)) {
+                audit_dir = rd2->d.qstring;
+            } else if (!irccasecmp(iter_key(it), "audit_segment_size") && (rd2->type == RECDB_QSTRING)) {
+                audit_segment_size = strtoul(rd2->d.qstring, NULL, 0);
+            } else if (!irccasecmp(iter_key(it), "audit_segments") && (rd2->type == RECDB_QSTRING)) {
+                audit_segments = strtoul(rd2->d.qstring, NULL, 0);
+            } else if ((sep = strchr(iter_key(it), '.'))) {
                 struct logList logList;
                 char sevset[LOG_NUM_SEVERITIES];
                 struct string_list *slist;
@@ -404,6 +457,10 @@ log_conf_read(void)
             }
         }
     }
+    log_files_resize();
+    audit_store_configure(audit_dir, audit_segment_size, audit_segments, log_buffer_size);
+    /* Scan the store now rather than stalling the first search. */
+    audit_store_open();
     if (log_debugged)
         log_debug();
 }
@@ -434,6 +491,8 @@ log_reopen(void)
         struct logDestination *ld = iter_data(it);
         ld->vtbl->reopen(ld);
     }
+    if (sync_log)
+        ldFile_reopen(sync_log);
 }
 
 struct log_type *
@@ -478,6 +537,7 @@ void
 log_audit(struct log_type *type, enum log_severity sev, struct userNode *user, struct userNode *bot, const char *channel_name, unsigned int flags, const char *command)
 {
     struct logEntry *entry;
+    struct audit_record rec;
     unsigned int size, ii;
     char *str_next;
 
@@ -530,6 +590,19 @@ log_audit(struct log_type *type, enum log_severity sev, struct userNode *user, s
     /* fill in the default text for the event */
     log_format_audit(entry);
 
+    /* keep a permanent copy for LAST and LOG searches */
+    rec.when = entry->time;
+    rec.sev = sev;
+    rec.type = type->name;
+    rec.bot = bot->nick;
+    rec.channel_name = entry->channel_name;
+    rec.user_nick = entry->user_nick;
+    rec.user_account = entry->user_account;
+    rec.user_hostmask = entry->user_hostmask;
+    rec.command = entry->command;
+    if (audit_store_append(&rec))
+        log_schedule_flush();
+
     /* insert into the linked list */
     entry->next = 0;
     entry->prev = type->log_newest;
@@ -587,11 +660,17 @@ log_module(struct log_type *type, enum log_severity sev, const char *format, ...
         return;
     if (type->depth)
         return;
-    ++type->depth;
     if (sev > LOG_FATAL) {
         log_module(MAIN_LOG, LOG_ERROR, "Illegal log_module severity %d", sev);
         return;
     }
+    /* Do not bother formatting a message nobody will see. */
+    if (log_inited
+        && (sev != LOG_FATAL)
+        && !type->logs[sev].used
+        && !log_default->logs[sev].used)
+        return;
+    ++type->depth;
     va_start(args, format);
     vsnprintf(msgbuf, sizeof(msgbuf), format, args);
     va_end(args);
@@ -610,6 +689,7 @@ log_module(struct log_type *type, enum log_severity sev, const char *format, ...
     }
     --type->depth;
     if (sev == LOG_FATAL) {
+        log_flush();
         assert(0 && "fatal message logged");
         _exit(1);
     }
@@ -739,12 +819,65 @@ log_report_entry(struct logEntry *match, void *extra)
     send_message_type(4, rpt->user, rpt->reporter, "%s", match->default_desc);
 }
 
+struct log_store_search {
+    struct logSearch *discrim;
+    entry_search_func esf;
+    void *data;
+    unsigned int matched;
+};
+
+static int
+log_store_search_func(const struct audit_record *rec, void *extra)
+{
+    struct log_store_search *search = extra;
+    struct string_buffer sbuf;
+    struct logEntry entry;
+
+    if (search->discrim->type && irccasecmp(rec->type, search->discrim->type->name))
+        return 0;
+    memset(&entry, 0, sizeof(entry));
+    entry.time = rec->when;
+    entry.slvl = rec->sev;
+    entry.bot = GetUserH(rec->bot);
+    entry.channel_name = (char*)rec->channel_name;
+    entry.user_nick = (char*)rec->user_nick;
+    entry.user_account = (char*)rec->user_account;
+    entry.user_hostmask = (char*)rec->user_hostmask;
+    entry.command = (char*)rec->command;
+    if (!entry_match(search->discrim, &entry))
+        return 0;
+    memset(&sbuf, 0, sizeof(sbuf));
+    log_format_audit_line(&sbuf, rec->when, rec->bot, rec->channel_name, rec->user_nick, rec->user_hostmask, rec->user_account, rec->command);
+    entry.default_desc = sbuf.list;
+    search->esf(&entry, search->data);
+    free(sbuf.list);
+    return ++search->matched >= search->discrim->limit;
+}
+
 unsigned int
 log_entry_search(struct logSearch *discrim, entry_search_func esf, void *data)
 {
     unsigned int matched = 0;
-
-    if (discrim->type) {
+    const char *account;
+
+    /* Searches that name one channel or account are answered from the
+     * audit store's indexes, newest first, reading at most
+     * MAXLOGSEARCHLENGTH records.  Anything else would have to
+     * read the whole store, so it only looks at the recent entries kept
+     * in memory. */
+    account = discrim->masks.user_account;
+    if (account && strpbrk(account, "*?"))
+        account = NULL;
+    if ((discrim->masks.channel_name || account) && audit_store_open()) {
+        struct log_store_search search;
+
+        search.discrim = discrim;
+        search.esf = esf;
+        search.data = data;
+        search.matched = 0;
+        audit_store_walk(discrim->masks.channel_name, account, discrim->min_time, MAXLOGSEARCHLENGTH, log_store_search_func, &search);
+        return search.matched;
+    } else if (discrim->type) {
         static volatile struct logEntry *last;
         struct logEntry *entry;
 
@@ -788,29 +921,35 @@ log_format_timestamp(unsigned long when, struct string_buffer *sbuf)
 }
 
 static void
-log_format_audit(struct logEntry *entry)
+log_format_audit_line(struct string_buffer *sbuf, time_t when, const char *bot, const char *channel_name, const char *nick, const char *hostmask, const char *account, const char *command)
 {
-    struct string_buffer sbuf;
-    memset(&sbuf, 0, sizeof(sbuf));
-    log_format_timestamp(entry->time, &sbuf);
-    string_buffer_append_string(&sbuf, " (");
-    string_buffer_append_string(&sbuf, entry->bot->nick);
-    if (entry->channel_name) {
-        string_buffer_append(&sbuf, ':');
-        string_buffer_append_string(&sbuf, entry->channel_name);
+    log_format_timestamp(when, sbuf);
+    string_buffer_append_string(sbuf, " (");
+    string_buffer_append_string(sbuf, bot);
+    if (channel_name) {
+        string_buffer_append(sbuf, ':');
+        string_buffer_append_string(sbuf, channel_name);
     }
-    string_buffer_append_string(&sbuf, ") [");
-    string_buffer_append_string(&sbuf, entry->user_nick);
-    if (entry->user_hostmask) {
-        string_buffer_append(&sbuf, '!');
-        string_buffer_append_string(&sbuf, entry->user_hostmask);
+    string_buffer_append_string(sbuf, ") [");
+    string_buffer_append_string(sbuf, nick);
+    if (hostmask) {
+        string_buffer_append(sbuf, '!');
+        string_buffer_append_string(sbuf, hostmask);
     }
-    if (entry->user_account) {
-        string_buffer_append(&sbuf, ':');
-        string_buffer_append_string(&sbuf, entry->user_account);
+    if (account) {
+        string_buffer_append(sbuf, ':');
+        string_buffer_append_string(sbuf, account);
     }
-    string_buffer_append_string(&sbuf, "]: ");
-    string_buffer_append_string(&sbuf, entry->command);
+    string_buffer_append_string(sbuf, "]: ");
+    string_buffer_append_string(sbuf, command);
+}
+
+static void
+log_format_audit(struct logEntry *entry)
+{
+    struct string_buffer sbuf;
+    memset(&sbuf, 0, sizeof(sbuf));
+    log_format_audit_line(&sbuf, entry->time, entry->bot->nick, entry->channel_name, entry->user_nick, entry->user_hostmask, entry->user_account, entry->command);
     entry->default_desc = strdup(sbuf.list);
     free(sbuf.list);
 }
@@ -832,31 +971,202 @@ ldNop_replay(UNUSED_ARG(struct logDestination *self_), UNUSED_ARG(struct log_typ
 struct logDest_file {
     struct logDestination base;
     char *fname;
-    FILE *output;
+    FILE *output; /* only for std: destinations */
+    int fd;
+    char *buf;
+    unsigned int buf_size;
+    unsigned int buf_used;
+    unsigned int dirty : 1; /* written since the last fsync() */
+    unsigned long lines;
+    unsigned long bytes;
+    unsigned long writes;
+    unsigned long dropped;
+    struct logDest_file *next_file;
 };
 static struct logDest_vtable ldFile_vtbl;
+static struct logDest_file *log_files;
 
-static struct logDestination *
-ldFile_open(const char *args) {
+/* Most lines in a busy log share their timestamp with the last one. */
+static const char *
+log_timestamp(time_t when)
+{
+    if (!log_stamp.list || when != log_stamp_when) {
+        log_format_timestamp(when, &log_stamp);
+        log_stamp_when = when;
+    }
+    return log_stamp.list;
+}
+
+/* Write out everything buffered for a file; returns zero if some of
+ * it could not be written. */
+static int
+ldFile_flush(struct logDest_file *dest)
+{
+    int res;
+
+    while (dest->buf_used > 0) {
+        res = write(dest->fd, dest->buf, dest->buf_used);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return 0;
+        dest->writes++;
+        dest->dirty = 1;
+        dest->buf_used -= res;
+        memmove(dest->buf, dest->buf + res, dest->buf_used);
+    }
+    return 1;
+}
+
+static void
+log_flush_cb(UNUSED_ARG(void *data))
+{
+    struct logDest_file *dest;
+    int sync;
+
+    log_flush_scheduled = 0;
+    sync = log_fsync_interval && (now >= log_last_fsync + (time_t)log_fsync_interval);
+    for (dest = log_files; dest; dest = dest->next_file) {
+        ldFile_flush(dest);
+        if (sync && dest->dirty) {
+            fsync(dest->fd);
+            dest->dirty = 0;
+        }
+    }
+    audit_store_flush();
+    if (sync)
+        log_last_fsync = now;
+}
+
+static void
+log_schedule_flush(void)
+{
+    if (!log_flush_scheduled) {
+        timeq_add(now + log_flush_interval, log_flush_cb, NULL);
+        log_flush_scheduled = 1;
+    }
+}
+
+void
+log_flush(void)
+{
+    struct logDest_file *dest;
+
+    for (dest = log_files; dest; dest = dest->next_file)
+        ldFile_flush(dest);
+    audit_store_flush();
+}
+
+/* Flush every file and drop buffers that are not the configured size;
+ * they are allocated again by the next write. */
+static void
+log_files_resize(void)
+{
+    struct logDest_file *dest;
+
+    for (dest = log_files; dest; dest = dest->next_file) {
+        ldFile_flush(dest);
+        if (dest->buf_size != log_buffer_size && !dest->buf_used) {
+            free(dest->buf);
+            dest->buf = NULL;
+            dest->buf_size = 0;
+        }
+    }
+}
+
+static void
+ldFile_write(struct logDest_file *dest, enum log_severity sev, const char *text, unsigned int len)
+{
+    if (!dest->buf && log_buffer_size) {
+        dest->buf_size = log_buffer_size;
+        dest->buf = malloc(dest->buf_size);
+    }
+    if ((dest->buf_used + len > dest->buf_size)
+        && (!ldFile_flush(dest) || (len > dest->buf_size))) {
+        /* If the buffer cannot be drained, keep the important lines
+         * (writing them straight out) and drop the chatter. */
+        if (dest->buf_used && (sev < LOG_WARNING)) {
+            dest->dropped++;
+            return;
+        }
+        if (write(dest->fd, text, len) > 0) {
+            dest->writes++;
+            dest->dirty = 1;
+        }
+        dest->lines++;
+        dest->bytes += len;
+        return;
+    }
+    memcpy(dest->buf + dest->buf_used, text, len);
+    dest->buf_used += len;
+    dest->lines++;
+    dest->bytes += len;
+    if (dest->buf_used >= dest->buf_size / 2)
+        ldFile_flush(dest);
+    else
+        log_schedule_flush();
+}
+
+static void
+ldFile_printf(struct logDest_file *dest, enum log_severity sev, const char *format, ...)
+{
+    char line[MAXLEN * 2];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if ((unsigned int)len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    ldFile_write(dest, sev, line, len);
+}
+
+static struct logDest_file *
+ldFile_new(const char *fname)
+{
     struct logDest_file *ld;
+
     ld = calloc(1, sizeof(*ld));
     ld->base.vtbl = &ldFile_vtbl;
-    ld->fname = strdup(args);
-    ld->output = fopen(ld->fname, "a");
-    return &ld->base;
+    ld->fname = strdup(fname);
+    ld->fd = open(ld->fname, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    ld->next_file = log_files;
+    log_files = ld;
+    return ld;
+}
+
+static struct logDestination *
+ldFile_open(const char *args) {
+    return &ldFile_new(args)->base;
 }
 
 static void
 ldFile_reopen(struct logDestination *dest_) {
     struct logDest_file *dest = (struct logDest_file*)dest_;
-    fclose(dest->output);
-    dest->output = fopen(dest->fname, "a");
+    ldFile_flush(dest);
+    close(dest->fd);
+    dest->fd = open(dest->fname, O_WRONLY | O_APPEND | O_CREAT, 0666);
 }
 
 static void
 ldFile_close(struct logDestination *dest_) {
     struct logDest_file *dest = (struct logDest_file*)dest_;
-    fclose(dest->output);
+    struct logDest_file **pp;
+
+    ldFile_flush(dest);
+    for (pp = &log_files; *pp; pp = &(*pp)->next_file) {
+        if (*pp == dest) {
+            *pp = dest->next_file;
+            break;
+        }
+    }
+    close(dest->fd);
+    free(dest->buf);
     free(dest->fname);
     free(dest);
 }
@@ -864,34 +1174,39 @@ ldFile_close(struct logDestination *dest_) {
 static void
 ldFile_audit(struct logDestination *dest_, UNUSED_ARG(struct log_type *type), struct logEntry *entry) {
     struct logDest_file *dest = (struct logDest_file*)dest_;
-    fputs(entry->default_desc, dest->output);
-    fputc('\n', dest->output);
-    fflush(dest->output);
+    ldFile_printf(dest, entry->slvl, "%s\n", entry->default_desc);
 }
 
 static void
 ldFile_replay(struct logDestination *dest_, UNUSED_ARG(struct log_type *type), int is_write, const char *line) {
     struct logDest_file *dest = (struct logDest_file*)dest_;
-    struct string_buffer sbuf;
-    memset(&sbuf, 0, sizeof(sbuf));
-    log_format_timestamp(now, &sbuf);
-    string_buffer_append_string(&sbuf, is_write ? "W: " : "   ");
-    string_buffer_append_string(&sbuf, line);
-    fputs(sbuf.list, dest->output);
-    fputc('\n', dest->output);
-    free(sbuf.list);
-    fflush(dest->output);
+    ldFile_printf(dest, LOG_REPLAY, "%s%s%s\n", log_timestamp(now), is_write ? "W: " : "   ", line);
 }
 
 static void
 ldFile_module(struct logDestination *dest_, struct log_type *type, enum log_severity sev, const char *message) {
     struct logDest_file *dest = (struct logDest_file*)dest_;
-    struct string_buffer sbuf;
-    memset(&sbuf, 0, sizeof(sbuf));
-    log_format_timestamp(now, &sbuf);
-    fprintf(dest->output, "%s (%s:%s) %s\n", sbuf.list, type->name, log_severity_names[sev], message);
-    free(sbuf.list);
-    fflush(dest->output);
+    ldFile_printf(dest, sev, "%s (%s:%s) %s\n", log_timestamp(now), type->name, log_severity_names[sev], message);
+}
+
+unsigned int
+log_get_file_stats(struct log_file_stats *out, unsigned int max)
+{
+    struct logDest_file *dest;
+    unsigned int count;
+
+    for (count = 0, dest = log_files; dest; dest = dest->next_file, count++) {
+        if (count >= max)
+            continue;
+        out[count].name = dest->fname;
+        out[count].lines = dest->lines;
+        out[count].bytes = dest->bytes;
+        out[count].writes = dest->writes;
+        out[count].dropped = dest->dropped;
+        out[count].buffered = dest->buf_used;
+        out[count].buffer_size = dest->buf_size;
+    }
+    return count;
 }
 
 static struct logDest_vtable ldFile_vtbl = {
@@ -933,6 +1248,14 @@ ldStd_close(struct logDestination *dest_) {
     free(dest);
 }
 
+static void
+ldStd_audit(struct logDestination *dest_, UNUSED_ARG(struct log_type *type), struct logEntry *entry) {
+    struct logDest_file *dest = (struct logDest_file*)dest_;
+    fputs(entry->default_desc, dest->output);
+    fputc('\n', dest->output);
+    fflush(dest->output);
+}
+
 static void
 ldStd_replay(struct logDestination *dest_, UNUSED_ARG(struct log_type *type), int is_write, const char *line) {
     struct logDest_file *dest = (struct logDest_file*)dest_;
@@ -950,7 +1273,7 @@ static struct logDest_vtable ldStd_vtbl = {
     ldStd_open,
     ldNop_reopen,
     ldStd_close,
-    ldFile_audit,
+    ldStd_audit,
     ldStd_replay,
     ldStd_module
 };
@@ -1031,7 +1354,6 @@ void SyncLog(char *fmt,...)
   va_list args;
   char buff[MAXLEN*4];
   char *tmp;
-  FILE *LogFile;
 
   va_start(args, fmt);
   vsnprintf(buff, MAXLEN, fmt, args);
@@ -1046,12 +1368,10 @@ void SyncLog(char *fmt,...)
       *tmp = ' ';
   }
 
-  if((LogFile = fopen("sync.log", "a")))
-  {
-    fprintf(LogFile, "%s: %s\n", time2str(time(NULL)), buff);
-    fclose(LogFile);
-  }
-
+  /* Kept open and buffered like the other log files. */
+  if (!sync_log)
+    sync_log = &ldFile_new("sync.log")->base;
+  ldFile_printf((struct logDest_file*)sync_log, LOG_INFO, "%s: %s\n", time2str(time(NULL)), buff);
 }
 
 int parselog(char *LogLine, struct userNode *user, struct chanNode *cptr, char *chan, char *nuh, char *command, char *rest)
@@ -1198,6 +1518,33 @@ int parselog(char *LogLine, struct userNode *user, struct chanNode *cptr, char *
 
 }
 
+struct log_last_search {
+   struct userNode *user;
+   struct chanNode *cptr;
+   char *chan;
+   char *nuh;
+   char *command;
+   char *rest;
+   int maxlines;
+   int line;
+};
+
+static int
+log_last_func(const struct audit_record *rec, void *extra)
+{
+   struct log_last_search *last = extra;
+   struct string_buffer sbuf;
+   int found;
+
+   memset(&sbuf, 0, sizeof(sbuf));
+   log_format_audit_line(&sbuf, rec->when, rec->bot, rec->channel_name, rec->user_nick, rec->user_hostmask, rec->user_account, rec->command);
+   found = parselog(sbuf.list, last->user, last->cptr, last->chan, last->nuh, last->command, last->rest);
+   free(sbuf.list);
+   if (found)
+      last->line++;
+   return last->line >= last->maxlines;
+}
+
 int ShowLog(struct userNode *user, struct chanNode *cptr, char *chan, char *nuh, char *command, char *rest, int maxlines)
 {
    FILE *TheFile;
@@ -1208,6 +1555,31 @@ int ShowLog(struct userNode *user, struct chanNode *cptr, char *chan, char *nuh,
    char Buff[Block+1] = "", PrevBuff[Block+1] = "";
    char LogLine[(Block+1)*2] = ""; /* To hold our exported results. */
 
+   if(audit_store_open())
+   {
+       struct log_last_search last;
+       unsigned int searched;
+
+       last.user = user;
+       last.cptr = cptr;
+       last.chan = chan;
+       last.nuh = nuh;
+       last.command = command;
+       last.rest = rest;
+       last.maxlines = maxlines;
+       last.line = 0;
+       send_message(user, chanserv, "LAST_COMMAND_LOG", cptr->name);
+       send_message(user, chanserv, "LAST_LINE");
+       searched = audit_store_walk(cptr->name, NULL, 0, MAXLOGSEARCHLENGTH, log_last_func, &last);
+       if(last.line >= maxlines)
+          send_message(user, chanserv, "LAST_STOPPING_AT", maxlines);
+       else if(searched >= MAXLOGSEARCHLENGTH)
+          send_message(user, chanserv, "LAST_MAX_AGE");
+       else
+          send_message(user, chanserv, "LAST_END_OF_LOG", last.line);
+       return 1;
+   }
+
    if(!(TheFile = fopen(AccountingLog, "r")))
    {
        send_message(user, chanserv, "LAST_ERROR", AccountingLog, strerror(errno));
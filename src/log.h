@@ -53,6 +53,21 @@ void log_audit(struct log_type *type, enum log_severity sev, struct userNode *us
 /* constraint for log_module: sev < LOG_COMMAND */
 void log_module(struct log_type *type, enum log_severity sev, const char *format, ...) PRINTF_LIKE(3, 4);
 void log_replay(struct log_type *type, int is_write, const char *line);
+/* write out anything the file logs are holding */
+void log_flush(void);
+
+struct log_file_stats {
+    const char *name;
+    unsigned long lines;
+    unsigned long bytes;
+    unsigned long writes;
+    unsigned long dropped;
+    unsigned int buffered;
+    unsigned int buffer_size;
+};
+
+/* Fills in up to max entries; returns the number of open log files. */
+unsigned int log_get_file_stats(struct log_file_stats *out, unsigned int max);
 
 /* Log searching functions - ONLY searches log_audit'ed data */
 
@@ -19,18 +19,42 @@
  */
 
 #include "ioset.h"
-
-static void mail_println(const char *fmt, ...);
+#include "metrics.h"
+#include "timeq.h"
 
 #include "mail-common.c"
 
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#define KEY_QUEUE    "queue"
+#define KEY_TO       "to"
+#define KEY_NAME     "name"
+#define KEY_SUBJECT  "subject"
+#define KEY_MESSAGE  "message"
+#define KEY_QUEUED   "queued"
+#define KEY_ATTEMPTS "attempts"
+
+/* Replies a session may be waiting for; with PIPELINING, one
+ * message's body and the next one's envelope can be outstanding. */
+#define SMTP_MAX_EXPECT 8
+#define SMTP_LATENCY_SAMPLES 256
+
+struct smtp_session;
+
 struct pending_mail {
-    const char *from;
     const char *to_name;
     const char *to_email;
     const char *subject;
-    const char *body;
-    int first_time;
+    const char *message; /* headers and body; dot-stuffed, CRLF line ends */
+    unsigned int message_len;
+    unsigned long id;
+    struct smtp_session *session; /* non-NULL while being sent */
+    struct timeval queued;
+    time_t next_attempt;
+    unsigned int attempts;
+    short failed; /* first error code in the current transaction */
 };
 
 DECLARE_LIST(mail_queue, struct pending_mail *);
@@ -39,14 +63,9 @@ enum smtp_socket_state {
     CLOSED, /* no connection active */
     CONNECTING, /* initial connection in progress */
     WAITING_GREETING, /* waiting for server to send 220 <whatever> */
-    IDLE, /* between messages, waiting to see if we get a new one soon */
     SENT_EHLO, /* sent EHLO <ourname>, waiting for response */
     SENT_HELO, /* sent HELO <ourname>, waiting for response */
-    SENT_MAIL_FROM, /* sent MAIL FROM:<address>, waiting for response */
-    SENT_RCPT_TO, /* sent RCPT TO:<address>, waiting for response */
-    SENT_DATA, /* sent DATA, waiting for response */
-    SENT_BODY, /* sent message body, waiting for response */
-    SENT_RSET, /* sent RSET, waiting for response */
+    READY, /* greeted; sending mail or idle between messages */
     SENT_QUIT, /* asked server to close connection, waiting for response */
 };
 
@@ -54,34 +73,85 @@ static const char * const smtp_state_names[] = {
     "closed",
     "connecting",
     "greeting",
-    "idle",
     "ehlo",
     "helo",
-    "mail-from",
-    "rcpt-to",
-    "data",
-    "body",
-    "rset",
+    "ready",
     "quit",
 };
 
-static struct pending_mail *active_mail;
+enum smtp_reply {
+    REPLY_MAIL_FROM,
+    REPLY_RCPT_TO,
+    REPLY_DATA,
+    REPLY_BODY,
+    REPLY_RSET,
+};
+
+static const char * const smtp_reply_names[] = {
+    "MAIL FROM",
+    "RCPT TO",
+    "DATA",
+    "end of data",
+    "RSET",
+};
+
+struct smtp_expect {
+    enum smtp_reply reply;
+    struct pending_mail *mail;
+};
+
+struct smtp_session {
+    struct io_fd *fd;
+    enum smtp_socket_state state;
+    unsigned int pipelining : 1;
+    struct smtp_expect expect[SMTP_MAX_EXPECT];
+    unsigned int expect_head;
+    unsigned int expect_used;
+    time_t idle_since;
+};
+
+DECLARE_LIST(smtp_session_list, struct smtp_session *);
+
+static const struct message_entry smtp_msgtab[] = {
+    { "SMTPMSG_STATS_QUEUE", "$b%u$b messages queued: %u being sent, %u waiting to retry.  %u of %u SMTP sessions open (%u pipelining)." },
+    { "SMTPMSG_STATS_TOTALS", "Since startup: %lu sent, %lu deferred for retry, %lu bounced, %lu given up after %u attempts." },
+    { "SMTPMSG_STATS_LATENCY", "Send latency over the last %u messages: median %lums, 90th percentile %lums, max %lums." },
+    { NULL, NULL }
+};
+
 static struct log_type *MAIL_LOG;
-static struct io_fd *smtp_fd;
-static enum smtp_socket_state smtp_state;
 static struct mail_queue mail_queue;
+static struct smtp_session_list smtp_sessions;
+static unsigned long mail_next_id;
+static time_t smtp_connect_retry; /* open no new sessions before this */
+
+static struct {
+    unsigned long sent;
+    unsigned long deferred;
+    unsigned long bounced;
+    unsigned long expired;
+    unsigned long latency[SMTP_LATENCY_SAMPLES];
+    unsigned int latency_used;
+    unsigned int latency_pos;
+} smtp_stats;
 
 static struct {
     const char *smtp_server;
-    const char *smtp_service;
+    unsigned int smtp_port;
     const char *smtp_myname;
     const char *smtp_from;
+    unsigned int max_sessions;
+    unsigned long idle_timeout;
+    unsigned long retry_delay;
+    unsigned int max_attempts;
+    int pipelining;
     int enabled;
 } smtp_conf;
 
 DEFINE_LIST(mail_queue, struct pending_mail *)
+DEFINE_LIST(smtp_session_list, struct smtp_session *)
 
-static void mail_println(const char *fmt, ...)
+static void smtp_println(struct smtp_session *session, const char *fmt, ...)
 {
     char tmpbuf[1024];
     va_list ap;
@@ -94,7 +164,7 @@ static void mail_println(const char *fmt, ...)
     {
         tmpbuf[res++] = '\r';
         tmpbuf[res++] = '\n';
-        ioset_write(smtp_fd, tmpbuf, res);
+        ioset_write(session->fd, tmpbuf, res);
     }
 }
 
@@ -104,25 +174,61 @@ static void mail_smtp_read_config(void)
     const char *str;
 
     memset(&smtp_conf, 0, sizeof(smtp_conf));
+    smtp_conf.smtp_port = 25;
+    smtp_conf.max_sessions = 4;
+    smtp_conf.idle_timeout = 60;
+    smtp_conf.retry_delay = 60;
+    smtp_conf.max_attempts = 6;
+    smtp_conf.pipelining = 1;
     conf_node = conf_get_data("mail", RECDB_OBJECT);
     if (!conf_node)
         return;
-    str = database_get_data(conf_node, "enabled", RECDB_QSTRING);
+    str = database_get_data(conf_node, "enable", RECDB_QSTRING);
+    if (!str)
+        str = database_get_data(conf_node, "enabled", RECDB_QSTRING);
     smtp_conf.enabled = (str != NULL) && enabled_string(str);
     smtp_conf.smtp_server = database_get_data(conf_node, "smtp_server", RECDB_QSTRING);
     if (!smtp_conf.smtp_server)
 	log_module(MAIL_LOG, LOG_FATAL, "No mail smtp_server configuration setting.");
     str = database_get_data(conf_node, "smtp_service", RECDB_QSTRING);
-    if (!str) str = "25";
-    smtp_conf.smtp_service = str;
+    if (str && isdigit(*str)) {
+        smtp_conf.smtp_port = strtoul(str, NULL, 10);
+    } else if (str) {
+        struct servent *se = getservbyname(str, "tcp");
+        if (se)
+            smtp_conf.smtp_port = ntohs(se->s_port);
+        else
+            log_module(MAIL_LOG, LOG_ERROR, "Unknown mail smtp_service %s; using port 25.", str);
+    }
     smtp_conf.smtp_myname = database_get_data(conf_node, "smtp_myname", RECDB_QSTRING);
     /* myname defaults to [ip.v4.add.r] */
     smtp_conf.smtp_from = database_get_data(conf_node, "from_address", RECDB_QSTRING);
     if (!smtp_conf.smtp_from)
 	log_module(MAIL_LOG, LOG_FATAL, "No mail from_address configuration setting.");
+    str = database_get_data(conf_node, "smtp_sessions", RECDB_QSTRING);
+    if (str)
+        smtp_conf.max_sessions = strtoul(str, NULL, 0);
+    if (smtp_conf.max_sessions < 1)
+        smtp_conf.max_sessions = 1;
+    str = database_get_data(conf_node, "smtp_idle_timeout", RECDB_QSTRING);
+    if (str)
+        smtp_conf.idle_timeout = ParseInterval(str);
+    str = database_get_data(conf_node, "smtp_retry_delay", RECDB_QSTRING);
+    if (str)
+        smtp_conf.retry_delay = ParseInterval(str);
+    if (smtp_conf.retry_delay < 1)
+        smtp_conf.retry_delay = 1;
+    str = database_get_data(conf_node, "smtp_max_attempts", RECDB_QSTRING);
+    if (str)
+        smtp_conf.max_attempts = strtoul(str, NULL, 0);
+    if (smtp_conf.max_attempts < 1)
+        smtp_conf.max_attempts = 1;
+    str = database_get_data(conf_node, "smtp_pipelining", RECDB_QSTRING);
+    if (str)
+        smtp_conf.pipelining = enabled_string(str);
 }
 
-static void smtp_fill_name(char *namebuf, size_t buflen)
+static void smtp_fill_name(struct smtp_session *session, char *namebuf, size_t buflen)
 {
     char sockaddr[128];
     struct sockaddr *sa;
@@ -131,7 +237,7 @@ static void smtp_fill_name(char *namebuf, size_t buflen)
 
     sa = (void*)sockaddr;
     sa_len = sizeof(sockaddr);
-    res = getsockname(smtp_fd->fd, sa, &sa_len);
+    res = getsockname(session->fd->fd, sa, &sa_len);
     if (res < 0) {
         log_module(MAIL_LOG, LOG_ERROR, "Unable to get SMTP socket name: %s", strerror(errno));
         namebuf[0] = '\0';
@@ -142,170 +248,314 @@ static void smtp_fill_name(char *namebuf, size_t buflen)
     }
 }
 
-static void smtp_handle_greeting(const char *linebuf, short code)
+static void smtp_kick_cb(void *data);
+
+static struct pending_mail *smtp_mail_alloc(const char *to_name, const char *to_email, const char *subject, const char *message, unsigned int message_len)
+{
+    struct pending_mail *new_mail;
+    char *pos;
+    size_t to_name_len;
+    size_t to_email_len;
+    size_t subj_len;
+
+    to_name_len = strlen(to_name) + 1;
+    to_email_len = strlen(to_email) + 1;
+    subj_len = strlen(subject) + 1;
+    new_mail = calloc(1, sizeof(*new_mail) + to_name_len + to_email_len + subj_len + message_len + 1);
+    pos = (char*)(new_mail + 1);
+    new_mail->to_name = memcpy(pos, to_name, to_name_len), pos += to_name_len;
+    new_mail->to_email = memcpy(pos, to_email, to_email_len), pos += to_email_len;
+    new_mail->subject = memcpy(pos, subject, subj_len), pos += subj_len;
+    new_mail->message = memcpy(pos, message, message_len), pos += message_len;
+    *pos = '\0';
+    new_mail->message_len = message_len;
+    new_mail->id = ++mail_next_id;
+    gettimeofday(&new_mail->queued, NULL);
+    new_mail->next_attempt = now;
+    return new_mail;
+}
+
+static void smtp_mail_free(struct pending_mail *mail)
+{
+    mail_queue_remove(&mail_queue, mail);
+    free(mail);
+}
+
+static void smtp_mail_sent(struct pending_mail *mail)
+{
+    struct timeval tv;
+    unsigned long msec;
+
+    gettimeofday(&tv, NULL);
+    msec = (tv.tv_sec - mail->queued.tv_sec) * 1000 + (tv.tv_usec - mail->queued.tv_usec) / 1000;
+    smtp_stats.latency[smtp_stats.latency_pos] = msec;
+    smtp_stats.latency_pos = (smtp_stats.latency_pos + 1) % SMTP_LATENCY_SAMPLES;
+    if (smtp_stats.latency_used < SMTP_LATENCY_SAMPLES)
+        smtp_stats.latency_used++;
+    smtp_stats.sent++;
+    log_module(MAIL_LOG, LOG_INFO, "Sent mail to %s <%s>: %s", mail->to_name, mail->to_email, mail->subject);
+    smtp_mail_free(mail);
+}
+
+/* Bounce a mail on a permanent error; otherwise put it back on the
+ * queue to be retried later, unless it has run out of attempts. */
+static void smtp_mail_failed(struct pending_mail *mail, short code)
+{
+    unsigned long delay;
+    unsigned int shift;
+
+    mail->session = NULL;
+    if (code >= 500) {
+        log_module(MAIL_LOG, LOG_ERROR, "Mail to %s <%s> bounced with code %d: %s", mail->to_name, mail->to_email, code, mail->subject);
+        smtp_stats.bounced++;
+        smtp_mail_free(mail);
+        return;
+    }
+    if (mail->attempts >= smtp_conf.max_attempts) {
+        log_module(MAIL_LOG, LOG_ERROR, "Giving up on mail to %s <%s> after %u attempts: %s", mail->to_name, mail->to_email, mail->attempts, mail->subject);
+        smtp_stats.expired++;
+        smtp_mail_free(mail);
+        return;
+    }
+    shift = mail->attempts > 0 ? mail->attempts - 1 : 0;
+    delay = smtp_conf.retry_delay << (shift < 10 ? shift : 10);
+    mail->next_attempt = now + delay;
+    smtp_stats.deferred++;
+    log_module(MAIL_LOG, LOG_WARNING, "Mail to %s <%s> deferred for %lu seconds (code %d, attempt %u).", mail->to_name, mail->to_email, delay, code, mail->attempts);
+    timeq_add(mail->next_attempt, smtp_kick_cb, NULL);
+}
+
+static struct pending_mail *smtp_next_mail(void)
+{
+    struct pending_mail *mail;
+    unsigned int ii;
+
+    for (ii = 0; ii < mail_queue.used; ++ii) {
+        mail = mail_queue.list[ii];
+        if (!mail->session && mail->next_attempt <= now)
+            return mail;
+    }
+    return NULL;
+}
+
+static void smtp_expect(struct smtp_session *session, enum smtp_reply reply, struct pending_mail *mail)
+{
+    struct smtp_expect *expect;
+
+    assert(session->expect_used < SMTP_MAX_EXPECT);
+    expect = &session->expect[(session->expect_head + session->expect_used++) % SMTP_MAX_EXPECT];
+    expect->reply = reply;
+    expect->mail = mail;
+}
+
+static int smtp_expecting(struct smtp_session *session, struct pending_mail *mail)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < session->expect_used; ++ii)
+        if (session->expect[(session->expect_head + ii) % SMTP_MAX_EXPECT].mail == mail)
+            return 1;
+    return 0;
+}
+
+static void smtp_quit(struct smtp_session *session)
+{
+    smtp_println(session, "QUIT");
+    session->state = SENT_QUIT;
+}
+
+static void smtp_idle_cb(void *data)
+{
+    struct smtp_session *session = data;
+
+    if (session->state == READY
+        && !session->expect_used
+        && session->idle_since
+        && session->idle_since + (time_t)smtp_conf.idle_timeout <= now)
+        smtp_quit(session);
+}
+
+/* Start sending the next waiting mail, if the session can take it.
+ * Without PIPELINING each command waits for the previous reply; with
+ * it, the envelope goes out in one write, right behind the previous
+ * message's body. */
+static void smtp_session_dispatch(struct smtp_session *session)
+{
+    struct pending_mail *mail;
+
+    if (session->state != READY)
+        return;
+    if (session->expect_used
+        && !(session->pipelining && session->expect_used == 1
+             && session->expect[session->expect_head].reply == REPLY_BODY))
+        return;
+    mail = smtp_next_mail();
+    if (!mail) {
+        if (session->expect_used || session->idle_since)
+            return;
+        if (!smtp_conf.idle_timeout) {
+            smtp_quit(session);
+            return;
+        }
+        session->idle_since = now;
+        timeq_add(now + smtp_conf.idle_timeout, smtp_idle_cb, session);
+        return;
+    }
+    session->idle_since = 0;
+    mail->session = session;
+    mail->attempts++;
+    mail->failed = 0;
+    smtp_println(session, "MAIL FROM:<%s>", smtp_conf.smtp_from);
+    smtp_expect(session, REPLY_MAIL_FROM, mail);
+    if (session->pipelining) {
+        smtp_println(session, "RCPT TO:<%s>", mail->to_email);
+        smtp_expect(session, REPLY_RCPT_TO, mail);
+        smtp_println(session, "DATA");
+        smtp_expect(session, REPLY_DATA, mail);
+    }
+}
+
+static void smtp_handle_greeting(struct smtp_session *session, const char *linebuf, short code)
 {
     if (linebuf[3] == '-') {
 	return;
     } else if (code >= 500) {
 	log_module(MAIL_LOG, LOG_ERROR, "SMTP server error on connection: %s", linebuf);
-        ioset_close(smtp_fd, 1);
+        ioset_close(session->fd, 1);
     } else if (code >= 400) {
 	log_module(MAIL_LOG, LOG_WARNING, "SMTP server error on connection: %s", linebuf);
-        ioset_close(smtp_fd, 1);
+        ioset_close(session->fd, 1);
     } else {
 	if (smtp_conf.smtp_myname) {
-            mail_println("EHLO %s", smtp_conf.smtp_myname);
+            smtp_println(session, "EHLO %s", smtp_conf.smtp_myname);
         } else {
             char namebuf[64];
-            smtp_fill_name(namebuf, sizeof(namebuf));
-            mail_println("EHLO [%s]", namebuf);
+            smtp_fill_name(session, namebuf, sizeof(namebuf));
+            smtp_println(session, "EHLO [%s]", namebuf);
         }
-        smtp_state = SENT_EHLO;
+        session->state = SENT_EHLO;
     }
 }
 
-static void discard_mail(void)
-{
-    mail_queue_remove(&mail_queue, active_mail);
-    free(active_mail);
-    active_mail = NULL;
-    mail_println("RSET");
-    smtp_state = SENT_RSET;
-}
-
-static void smtp_idle_work(void)
-{
-    if ((smtp_state != IDLE) || (mail_queue.used == 0))
-        return;
-    active_mail = mail_queue.list[0];
-    mail_println("MAIL FROM:<%s>", smtp_conf.smtp_from);
-    smtp_state = SENT_MAIL_FROM;
-}
-
-static void smtp_handle_ehlo(const char *linebuf, short code)
+static void smtp_handle_ehlo(struct smtp_session *session, const char *linebuf, short code)
 {
+    if (code < 400 && !irccasecmp(linebuf + 4, "PIPELINING"))
+        session->pipelining = smtp_conf.pipelining;
     if (linebuf[3] == '-') {
 	return;
     } else if (code >= 500) {
 	log_module(MAIL_LOG, LOG_DEBUG, "Falling back from EHLO to HELO");
 	if (smtp_conf.smtp_myname) {
-            mail_println("HELO %s", smtp_conf.smtp_myname);
+            smtp_println(session, "HELO %s", smtp_conf.smtp_myname);
         } else {
             char namebuf[64];
-            smtp_fill_name(namebuf, sizeof(namebuf));
-            mail_println("HELO [%s]", namebuf);
+            smtp_fill_name(session, namebuf, sizeof(namebuf));
+            smtp_println(session, "HELO [%s]", namebuf);
         }
-        smtp_state = SENT_HELO;
+        session->state = SENT_HELO;
     } else if (code >= 400) {
         log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after EHLO: %s", linebuf);
-        ioset_close(smtp_fd, 1);
+        ioset_close(session->fd, 1);
     } else {
-        smtp_state = IDLE;
-        smtp_idle_work();
+        session->state = READY;
+        smtp_session_dispatch(session);
     }
 }
 
-static void smtp_handle_helo(const char *linebuf, short code)
+static void smtp_handle_helo(struct smtp_session *session, const char *linebuf, short code)
 {
     if (linebuf[3] == '-') {
 	return;
-    } else if (code >= 500) {
-	log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after HELO: %s", linebuf);
-        ioset_close(smtp_fd, 1);
     } else if (code >= 400) {
         log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after HELO: %s", linebuf);
-        ioset_close(smtp_fd, 1);
+        ioset_close(session->fd, 1);
     } else {
-        smtp_state = IDLE;
-        smtp_idle_work();
+        session->state = READY;
+        smtp_session_dispatch(session);
     }
 }
 
-static void smtp_handle_mail_from(const char *linebuf, short code)
+/* Handle the reply to the oldest outstanding command. */
+static void smtp_handle_reply(struct smtp_session *session, const char *linebuf, short code)
 {
-    assert(active_mail != NULL);
-    if (linebuf[3] == '-') {
-        return;
-    } else if (code >= 500) {
-        log_module(MAIL_LOG, LOG_ERROR, "SMTP server error after MAIL FROM: %s", linebuf);
-        discard_mail();
-    } else if (code >= 400) {
-        log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after MAIL FROM: %s", linebuf);
-    } else {
-        mail_println("RCPT TO:<%s>", active_mail->to_email);
-        smtp_state = SENT_RCPT_TO;
-    }
-}
+    struct smtp_expect expect;
+    struct pending_mail *mail;
 
-static void smtp_handle_rcpt_to(const char *linebuf, short code)
-{
-    assert(active_mail != NULL);
-    if (linebuf[3] == '-') {
+    if (linebuf[3] == '-')
         return;
-    } else if (code >= 500) {
-        log_module(MAIL_LOG, LOG_ERROR, "SMTP server error after RCPT TO: %s", linebuf);
-        discard_mail();
-    } else if (code >= 400) {
-        log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after RCPT TO: %s", linebuf);
-    } else {
-        mail_println("DATA");
-        smtp_state = SENT_DATA;
-    }
-}
-
-static void smtp_handle_data(const char *linebuf, short code)
-{
-    assert(active_mail != NULL);
-    if (linebuf[3] == '-') {
+    if (!session->expect_used) {
+        log_module(MAIL_LOG, LOG_WARNING, "Unexpected SMTP reply: %s", linebuf);
         return;
-    } else if (code >= 500) {
-        log_module(MAIL_LOG, LOG_ERROR, "SMTP server error after DATA: %s", linebuf);
-        discard_mail();
-    } else if (code >= 400) {
-        log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after DATA: %s", linebuf);
-    } else {
-        /* TODO: print the mail contents properly */
-        smtp_state = SENT_BODY;
     }
-}
+    expect = session->expect[session->expect_head];
+    session->expect_head = (session->expect_head + 1) % SMTP_MAX_EXPECT;
+    session->expect_used--;
+    mail = expect.mail;
+    if (code >= 400 && mail && !mail->failed) {
+        log_module(MAIL_LOG, (code >= 500 ? LOG_ERROR : LOG_WARNING), "SMTP server error after %s for mail to <%s>: %s", smtp_reply_names[expect.reply], mail->to_email, linebuf);
+        mail->failed = code;
+    }
 
-static void smtp_handle_body(const char *linebuf, short code)
-{
-    assert(active_mail != NULL);
-    if (linebuf[3] == '-') {
-        return;
-    } else if (code >= 500) {
-        log_module(MAIL_LOG, LOG_ERROR, "SMTP server error after DATA: %s", linebuf);
-        discard_mail();
-    } else if (code >= 400) {
-        log_module(MAIL_LOG, LOG_WARNING, "SMTP server error after DATA: %s", linebuf);
-    } else {
-        log_module(MAIL_LOG, LOG_INFO, "Sent mail to %s <%s>: %s", active_mail->to_name, active_mail->to_email, active_mail->subject);
-        mail_queue_remove(&mail_queue, active_mail);
-        free(active_mail);
-        active_mail = NULL;
-        smtp_state = IDLE;
-        if (mail_queue.used > 0)
-            smtp_idle_work();
+    switch (expect.reply) {
+    case REPLY_MAIL_FROM:
+        if (!mail->failed && !session->pipelining) {
+            smtp_println(session, "RCPT TO:<%s>", mail->to_email);
+            smtp_expect(session, REPLY_RCPT_TO, mail);
+        }
+        break;
+    case REPLY_RCPT_TO:
+        if (!mail->failed && !session->pipelining) {
+            smtp_println(session, "DATA");
+            smtp_expect(session, REPLY_DATA, mail);
+        }
+        break;
+    case REPLY_DATA:
+        if (code != 354) {
+            if (!mail->failed)
+                mail->failed = code;
+        } else if (mail->failed) {
+            /* There is no clean way to abandon the message now. */
+            log_module(MAIL_LOG, LOG_WARNING, "SMTP server accepted DATA for a failed transaction; closing connection.");
+            ioset_close(session->fd, 1);
+            return;
+        } else {
+            ioset_write(session->fd, mail->message, mail->message_len);
+            ioset_write(session->fd, ".\r\n", 3);
+            smtp_expect(session, REPLY_BODY, mail);
+        }
+        break;
+    case REPLY_BODY:
+        if (!mail->failed) {
+            smtp_mail_sent(mail);
+            mail = NULL;
+        }
+        break;
+    case REPLY_RSET:
+        break;
     }
-}
 
-static void smtp_handle_rset(const char *linebuf, short code)
-{
-    assert(active_mail != NULL);
-    smtp_state = IDLE;
-    if (mail_queue.used > 0)
-        smtp_idle_work();
-    (void)linebuf; (void)code;
+    /* Once the server has answered everything we sent for a failed
+     * mail, requeue or bounce it; unless the failure came at the end
+     * of the data, the transaction must be reset too. */
+    if (mail && mail->failed && !smtp_expecting(session, mail)) {
+        smtp_mail_failed(mail, mail->failed);
+        if (expect.reply != REPLY_BODY) {
+            smtp_println(session, "RSET");
+            smtp_expect(session, REPLY_RSET, NULL);
+        }
+    }
+    smtp_session_dispatch(session);
 }
 
 static void mail_readable(struct io_fd *fd)
 {
+    struct smtp_session *session;
     char linebuf[1024];
     int nbr;
     short code;
 
-    assert(fd == smtp_fd);
+    session = fd->data;
+    assert(session->fd == fd);
 
     /* Try to read a line from the socket. */
     nbr = ioset_line_read(fd, linebuf, sizeof(linebuf));
@@ -319,27 +569,27 @@ static void mail_readable(struct io_fd *fd)
         return;
     } else if ((size_t)nbr > sizeof(linebuf)) {
         log_module(MAIL_LOG, LOG_WARNING, "Got %u-byte line from server, truncating to 1024 bytes.", nbr);
-        nbr = sizeof(linebuf);
-        linebuf[nbr - 1] = '\0';
     }
 
     /* Trim CRLF at end of line */
-    while (linebuf[nbr - 1] == '\r' || linebuf[nbr - 1] == '\n')
+    nbr = strlen(linebuf);
+    while (nbr > 0 && (linebuf[nbr - 1] == '\r' || linebuf[nbr - 1] == '\n'))
         linebuf[--nbr] = '\0';
 
     /* Check that the input line looks reasonable. */
-    if (!isdigit(linebuf[0]) || !isdigit(linebuf[1]) || !isdigit(linebuf[2])
-        || (linebuf[3] != ' ' && linebuf[3] != '-'))
+    if (nbr < 3 || !isdigit(linebuf[0]) || !isdigit(linebuf[1]) || !isdigit(linebuf[2])
+        || (linebuf[3] != ' ' && linebuf[3] != '-' && linebuf[3] != '\0'))
     {
         log_module(MAIL_LOG, LOG_ERROR, "Got malformed SMTP line: %s", linebuf);
+        return;
     }
     code = strtoul(linebuf, NULL, 10);
 
     /* Log it at debug level. */
-    log_module(MAIL_LOG, LOG_REPLAY, "S[%s]: %s", smtp_state_names[smtp_state], linebuf);
+    log_module(MAIL_LOG, LOG_REPLAY, "S[%s]: %s", smtp_state_names[session->state], linebuf);
 
     /* Dispatch line based on connection's current state. */
-    switch (smtp_state)
+    switch (session->state)
     {
     case CLOSED:
 	log_module(MAIL_LOG, LOG_ERROR, "Unexpectedly got readable callback when SMTP in CLOSED state.");
@@ -348,103 +598,368 @@ static void mail_readable(struct io_fd *fd)
 	log_module(MAIL_LOG, LOG_ERROR, "Unexpectedly got readable callback when SMTP in CONNECTING state.");
 	break;
     case WAITING_GREETING:
-	smtp_handle_greeting(linebuf, code);
+	smtp_handle_greeting(session, linebuf, code);
 	break;
     case SENT_EHLO:
-	smtp_handle_ehlo(linebuf, code);
+	smtp_handle_ehlo(session, linebuf, code);
 	break;
     case SENT_HELO:
-	smtp_handle_helo(linebuf, code);
-	break;
-    case SENT_MAIL_FROM:
-	smtp_handle_mail_from(linebuf, code);
-	break;
-    case SENT_RCPT_TO:
-	smtp_handle_rcpt_to(linebuf, code);
+	smtp_handle_helo(session, linebuf, code);
 	break;
-    case SENT_DATA:
-	smtp_handle_data(linebuf, code);
+    case READY:
+	smtp_handle_reply(session, linebuf, code);
 	break;
-    case SENT_BODY:
-	smtp_handle_body(linebuf, code);
-	break;
-    case SENT_RSET:
-	smtp_handle_rset(linebuf, code);
-	break;
-    case IDLE:
     case SENT_QUIT:
-	/* there's not much we can do to sensibly handle these cases */
+        if (linebuf[3] != '-')
+            ioset_close(fd, 1);
 	break;
     }
 }
 
 static void mail_destroyed(struct io_fd *fd)
 {
-    assert(smtp_fd == fd);
-    smtp_state = CLOSED;
-    smtp_fd = NULL;
-    (void)fd; /* in case NDEBUG causes assert() to be empty */
+    struct smtp_session *session;
+    struct pending_mail *mail;
+    unsigned int ii;
+
+    session = fd->data;
+    assert(session->fd == fd);
+    /* A session that never got going counts as a failed connection. */
+    if (session->state < READY) {
+        smtp_connect_retry = now + smtp_conf.retry_delay;
+        timeq_add(smtp_connect_retry, smtp_kick_cb, NULL);
+    }
+    /* Anything still in flight goes back on the queue. */
+    for (ii = 0; ii < mail_queue.used; ) {
+        mail = mail_queue.list[ii];
+        if (mail->session == session) {
+            smtp_mail_failed(mail, mail->failed);
+            if (ii < mail_queue.used && mail_queue.list[ii] != mail)
+                continue;
+        }
+        ii++;
+    }
+    timeq_del(0, smtp_idle_cb, session, TIMEQ_IGNORE_WHEN);
+    smtp_session_list_remove(&smtp_sessions, session);
+    free(session);
+    /* Reconnect from the main loop if there is more to send. */
+    if (mail_queue.used)
+        timeq_add(now, smtp_kick_cb, NULL);
 }
 
 static void mail_connected(struct io_fd *fd, int error)
 {
+    struct smtp_session *session;
+
+    session = fd->data;
+    session->fd = fd;
+    fd->destroy_cb = mail_destroyed;
     if (error)
     {
         log_module(MAIL_LOG, LOG_ERROR, "Unable to connect to SMTP server: %s", strerror(error));
-        smtp_state = CLOSED;
-        smtp_fd = NULL;
+        ioset_close(fd, 1);
         return;
     }
 
     fd->line_reads = 1;
     fd->readable_cb = mail_readable;
-    fd->destroy_cb = mail_destroyed;
-    smtp_state = WAITING_GREETING;
+    session->state = WAITING_GREETING;
+}
+
+static int smtp_session_open(void)
+{
+    struct smtp_session *session;
+    struct io_fd *fd;
+
+    session = calloc(1, sizeof(*session));
+    session->state = CONNECTING;
+    smtp_session_list_append(&smtp_sessions, session);
+    fd = ioset_connect(NULL, 0, smtp_conf.smtp_server, smtp_conf.smtp_port, 0, session, mail_connected);
+    if (!fd) {
+        /* mail_destroyed() has not run, since there was no io_fd. */
+        smtp_session_list_remove(&smtp_sessions, session);
+        free(session);
+        smtp_connect_retry = now + smtp_conf.retry_delay;
+        timeq_add(smtp_connect_retry, smtp_kick_cb, NULL);
+        return 0;
+    }
+    session->fd = fd;
+    return 1;
+}
+
+/* Hand waiting mail to idle sessions, and open more sessions (up to
+ * the limit) if there is still mail waiting. */
+static void smtp_kick(void)
+{
+    unsigned int ii, waiting, opening;
+
+    for (ii = 0; ii < smtp_sessions.used; ++ii)
+        smtp_session_dispatch(smtp_sessions.list[ii]);
+    for (ii = waiting = 0; ii < mail_queue.used; ++ii)
+        if (!mail_queue.list[ii]->session && mail_queue.list[ii]->next_attempt <= now)
+            waiting++;
+    for (ii = opening = 0; ii < smtp_sessions.used; ++ii)
+        if (smtp_sessions.list[ii]->state < READY)
+            opening++;
+    while (waiting > opening
+           && smtp_sessions.used < smtp_conf.max_sessions
+           && smtp_connect_retry <= now
+           && smtp_session_open())
+        opening++;
+}
+
+static void smtp_kick_cb(UNUSED_ARG(void *data))
+{
+    smtp_kick();
+}
+
+/* Append one line of the message, escaping a leading dot. */
+static void smtp_append_line(struct string_buffer *buf, int stuff, const char *line, unsigned int len)
+{
+    if (stuff)
+        string_buffer_append(buf, ' ');
+    else if (len > 0 && line[0] == '.')
+        string_buffer_append(buf, '.');
+    string_buffer_append_substring(buf, line, len);
+    string_buffer_append_substring(buf, "\r\n", 2);
+}
+
+/* This appends the given "paragraph" as flowed text, as defined in
+ * RFC 2646, the same way the sendmail back-end does.
+ */
+static void smtp_append_flowed(struct string_buffer *buf, const char *para)
+{
+    const char *eol = strchr(para, '\n');
+    unsigned int shift;
+    unsigned int pos;
+
+    while (*para) {
+        /* Do we need to space-stuff the line? */
+        shift = (*para == ' ') || (*para == '>') || !strncmp(para, "From ", 5);
+        /* How much can we put on this line? */
+        if (!eol && (strlen(para) < (80 - shift))) {
+            /* End of paragraph; can put on one line. */
+            smtp_append_line(buf, shift, para, strlen(para));
+            break;
+        } else if (eol && (eol < para + (80 - shift))) {
+            /* Newline inside paragraph, no need to wrap. */
+            smtp_append_line(buf, shift, para, eol - para);
+            para = eol + 1;
+        } else {
+            /* Need to wrap.  Where's the last space in the line? */
+            for (pos=72-shift; pos && (para[pos] != ' '); pos--) ;
+            /* If we didn't find a space, look ahead instead. */
+            if (pos == 0) pos = strcspn(para, " \n");
+            if (para[pos] == ' ') {
+                smtp_append_line(buf, shift, para, pos + 1);
+                para += pos + 1;
+            } else {
+                smtp_append_line(buf, shift, para, pos);
+                para += pos + (para[pos] != '\0');
+            }
+        }
+        if (eol && (eol < para)) eol = strchr(para, '\n');
+    }
 }
 
 void
 mail_send(struct userNode *from, struct handle_info *to, const char *subject, const char *body, int first_time)
 {
     struct pending_mail *new_mail;
-    char *pos;
-    size_t from_len;
-    size_t to_name_len;
-    size_t to_email_len;
-    size_t subj_len;
-    size_t body_len;
+    struct string_list *extras;
+    struct string_buffer buf;
+    const char *str;
+    unsigned int nn;
+    char date[64];
 
-    /* Build a new pending_mail structure. */
-    from_len = strlen(from->nick) + 1;
-    to_name_len = strlen(to->handle) + 1;
-    to_email_len = strlen(to->email_addr) + 1;
-    subj_len = strlen(subject) + 1;
-    body_len = strlen(body) + 1;
-    new_mail = malloc(sizeof(*new_mail) + from_len + to_name_len + to_email_len + subj_len + body_len);
-    pos = (char*)(new_mail + 1);
-    new_mail->from = memcpy(pos, from->nick, from_len), pos += from_len;
-    new_mail->to_name = memcpy(pos, to->handle, to_name_len), pos += to_name_len;
-    new_mail->to_email = memcpy(pos, to->email_addr, to_email_len), pos += to_email_len;
-    new_mail->subject = memcpy(pos, subject, subj_len), pos += subj_len;
-    new_mail->body = memcpy(pos, body, body_len), pos += body_len;
-    new_mail->first_time = first_time;
+    if (!smtp_conf.enabled)
+        return;
+
+    /* Build the message: headers first. */
+    string_buffer_init(&buf);
+    extras = conf_get_data("mail/extra_headers", RECDB_STRING_LIST);
+    if (extras) {
+        for (nn=0; nn<extras->used; nn++)
+            string_buffer_append_printf(&buf, "%s\r\n", extras->list[nn]);
+    }
+    if (!(str = conf_get_data("mail/charset", RECDB_QSTRING))) str = "us-ascii";
+    string_buffer_append_printf(&buf, "Content-Type: text/plain; charset=%s; format=flowed\r\n", str);
+    string_buffer_append_printf(&buf, "From: %s <%s>\r\n", from->nick, smtp_conf.smtp_from);
+    string_buffer_append_printf(&buf, "To: \"%s\" <%s>\r\n", to->handle, to->email_addr);
+    string_buffer_append_printf(&buf, "Subject: %s\r\n", subject);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S +0000", gmtime(&now));
+    string_buffer_append_printf(&buf, "Date: %s\r\n", date);
+    str = strchr(smtp_conf.smtp_from, '@');
+    string_buffer_append_printf(&buf, "Message-ID: <%lu.%lu@%s>\r\n", (unsigned long)now, mail_next_id + 1, str ? str + 1 : "localhost");
+    string_buffer_append_substring(&buf, "\r\n", 2);
+
+    /* Then the body, with any configured prefix and suffix. */
+    extras = conf_get_data((first_time?"mail/body_prefix_first":"mail/body_prefix"), RECDB_STRING_LIST);
+    if (extras) {
+        for (nn=0; nn<extras->used; nn++)
+            smtp_append_flowed(&buf, extras->list[nn]);
+        string_buffer_append_substring(&buf, "\r\n", 2);
+    }
+    smtp_append_flowed(&buf, body);
+    extras = conf_get_data((first_time?"mail/body_suffix_first":"mail/body_suffix"), RECDB_STRING_LIST);
+    if (extras) {
+        string_buffer_append_substring(&buf, "\r\n", 2);
+        for (nn=0; nn<extras->used; nn++)
+            smtp_append_flowed(&buf, extras->list[nn]);
+    }
 
-    /* Stick the structure onto the pending list and ask for a transmit. */
+    /* Stick the mail onto the queue and see who can send it. */
+    new_mail = smtp_mail_alloc(to->handle, to->email_addr, subject, buf.list, buf.used);
+    string_buffer_clean(&buf);
     mail_queue_append(&mail_queue, new_mail);
+    smtp_kick();
+}
 
-    /* Initiate a mail connection if necessary; otherwise, poke an idle one. */
-    if (!smtp_fd) {
-        smtp_state = CONNECTING;
-        smtp_fd = ioset_connect(NULL, 0, smtp_conf.smtp_server, strtoul(smtp_conf.smtp_service, NULL, 10), 0, NULL, mail_connected);
-    } else if (smtp_state == IDLE) {
-        smtp_idle_work();
+/* The queue is written out with the other databases, so mail that
+ * has not been sent yet survives a restart.  Anything in flight when
+ * we stop is written too, so it may be delivered twice. */
+static int
+smtp_saxdb_read(struct dict *db)
+{
+    struct pending_mail *mail;
+    dict_iterator_t it;
+    dict_t queue, rec;
+    const char *to, *name, *subject, *message, *str;
+
+    queue = database_get_data(db, KEY_QUEUE, RECDB_OBJECT);
+    if (!queue)
+        return 0;
+    for (it = dict_first(queue); it; it = iter_next(it)) {
+        rec = GET_RECORD_OBJECT((struct record_data*)iter_data(it));
+        if (!rec)
+            continue;
+        to = database_get_data(rec, KEY_TO, RECDB_QSTRING);
+        name = database_get_data(rec, KEY_NAME, RECDB_QSTRING);
+        subject = database_get_data(rec, KEY_SUBJECT, RECDB_QSTRING);
+        message = database_get_data(rec, KEY_MESSAGE, RECDB_QSTRING);
+        if (!to || !message) {
+            log_module(MAIL_LOG, LOG_ERROR, "Dropping spooled mail %s with no recipient or message.", iter_key(it));
+            continue;
+        }
+        mail = smtp_mail_alloc(name ? name : to, to, subject ? subject : "", message, strlen(message));
+        str = database_get_data(rec, KEY_QUEUED, RECDB_QSTRING);
+        if (str)
+            mail->queued.tv_sec = strtoul(str, NULL, 0);
+        str = database_get_data(rec, KEY_ATTEMPTS, RECDB_QSTRING);
+        if (str)
+            mail->attempts = strtoul(str, NULL, 0);
+        mail_queue_append(&mail_queue, mail);
     }
+    if (mail_queue.used) {
+        log_module(MAIL_LOG, LOG_INFO, "Loaded %u queued mails from the spool.", mail_queue.used);
+        timeq_add(now, smtp_kick_cb, NULL);
+    }
+    return 0;
+}
+
+static int
+smtp_saxdb_write(struct saxdb_context *ctx)
+{
+    struct pending_mail *mail;
+    unsigned int ii;
+    char id[16];
+
+    saxdb_start_record(ctx, KEY_QUEUE, 1);
+    for (ii = 0; ii < mail_queue.used; ++ii) {
+        mail = mail_queue.list[ii];
+        snprintf(id, sizeof(id), "%lu", mail->id);
+        saxdb_start_record(ctx, id, 0);
+        saxdb_write_string(ctx, KEY_TO, mail->to_email);
+        saxdb_write_string(ctx, KEY_NAME, mail->to_name);
+        saxdb_write_string(ctx, KEY_SUBJECT, mail->subject);
+        saxdb_write_string(ctx, KEY_MESSAGE, mail->message);
+        saxdb_write_int(ctx, KEY_QUEUED, mail->queued.tv_sec);
+        saxdb_write_int(ctx, KEY_ATTEMPTS, mail->attempts);
+        saxdb_end_record(ctx);
+    }
+    saxdb_end_record(ctx);
+    return 0;
+}
+
+static int
+smtp_latency_compare(const void *a_, const void *b_)
+{
+    unsigned long a = *(const unsigned long*)a_, b = *(const unsigned long*)b_;
+    return a < b ? -1 : a > b;
+}
+
+static MODCMD_FUNC(cmd_stats_mailqueue) {
+    unsigned long latency[SMTP_LATENCY_SAMPLES];
+    unsigned int ii, sending, waiting, pipelining, count;
+
+    for (ii = sending = waiting = 0; ii < mail_queue.used; ++ii) {
+        if (mail_queue.list[ii]->session)
+            sending++;
+        else if (mail_queue.list[ii]->next_attempt > now)
+            waiting++;
+    }
+    for (ii = pipelining = 0; ii < smtp_sessions.used; ++ii)
+        if (smtp_sessions.list[ii]->pipelining)
+            pipelining++;
+    reply("SMTPMSG_STATS_QUEUE", mail_queue.used, sending, waiting, smtp_sessions.used, smtp_conf.max_sessions, pipelining);
+    reply("SMTPMSG_STATS_TOTALS", smtp_stats.sent, smtp_stats.deferred, smtp_stats.bounced, smtp_stats.expired, smtp_conf.max_attempts);
+    count = smtp_stats.latency_used;
+    if (count) {
+        memcpy(latency, smtp_stats.latency, count * sizeof(latency[0]));
+        qsort(latency, count, sizeof(latency[0]), smtp_latency_compare);
+        reply("SMTPMSG_STATS_LATENCY", count, latency[count / 2], latency[count * 9 / 10], latency[count - 1]);
+    }
+    return 1;
+}
+
+static void
+mail_smtp_cleanup(UNUSED_ARG(void *extra))
+{
+    struct smtp_session *session;
+
+    while (smtp_sessions.used) {
+        session = smtp_sessions.list[0];
+        session->fd->destroy_cb = NULL;
+        ioset_close(session->fd, 1);
+        timeq_del(0, smtp_idle_cb, session, TIMEQ_IGNORE_WHEN);
+        smtp_session_list_remove(&smtp_sessions, session);
+        free(session);
+    }
+    smtp_session_list_clean(&smtp_sessions);
+    while (mail_queue.used)
+        smtp_mail_free(mail_queue.list[0]);
+    mail_queue_clean(&mail_queue);
+    timeq_del(0, smtp_kick_cb, NULL, TIMEQ_IGNORE_WHEN | TIMEQ_IGNORE_DATA);
+}
+
+static double
+smtp_metric_queue(UNUSED_ARG(void *extra))
+{
+    return mail_queue.used;
+}
+
+static double
+smtp_metric_sessions(UNUSED_ARG(void *extra))
+{
+    return smtp_sessions.used;
 }
 
 void
 mail_init(void)
 {
-    smtp_state = CLOSED;
     MAIL_LOG = log_register_type("mail", "file:mail.log");
+    mail_queue_init(&mail_queue);
+    smtp_session_list_init(&smtp_sessions);
     mail_common_init();
+    reg_exit_func(mail_smtp_cleanup, NULL);
     conf_register_reload(mail_smtp_read_config);
+    metrics_register("x3_mail_queued", "Messages waiting to be sent.", METRIC_GAUGE, smtp_metric_queue, NULL);
+    metrics_register("x3_mail_smtp_sessions", "Open SMTP sessions.", METRIC_GAUGE, smtp_metric_sessions, NULL);
+    metrics_register_ulong("x3_mail_sent_total", "Messages accepted by the SMTP server.", METRIC_COUNTER, &smtp_stats.sent);
+    metrics_register_ulong("x3_mail_deferred_total", "Delivery attempts that will be retried.", METRIC_COUNTER, &smtp_stats.deferred);
+    metrics_register_ulong("x3_mail_bounced_total", "Messages rejected by the SMTP server.", METRIC_COUNTER, &smtp_stats.bounced);
+    metrics_register_ulong("x3_mail_expired_total", "Messages dropped after retrying too long.", METRIC_COUNTER, &smtp_stats.expired);
+    saxdb_register("MailQueue", smtp_saxdb_read, smtp_saxdb_write);
+    modcmd_register(mail_module, "stats mailqueue", cmd_stats_mailqueue, 0, 0, "flags", "+oper", NULL);
+    message_register_table(smtp_msgtab);
 }
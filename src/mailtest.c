@@ -0,0 +1,697 @@
+#include "common.h"
+#include "conf.h"
+#include "helpfile.h"
+#include "ioset.h"
+#include "log.h"
+#include "mail.h"
+#include "modcmd.h"
+#include "nickserv.h"
+#include "saxdb.h"
+#include "teststubs.h"
+#include "timeq.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+/* Runs the SMTP mail back-end against a sink server on a loopback
+ * port:
+ *
+ *   mailtest [messages] [delay-ms]
+ *
+ * The sink answers every command after delay-ms, as a distant mail
+ * server would.  The first round sends over a single session without
+ * PIPELINING, the second over a pool of sessions with it, so the
+ * second should finish several times faster.  The sink defers the
+ * first delivery to any address containing "retry" and rejects any
+ * address containing "bounce"; the third round checks that the first
+ * is retried and the second dropped.  The last round writes the
+ * queue to the spool, throws the queue away, reads the spool back
+ * and delivers it.  Exits non-zero if any mail goes missing. */
+
+#define MAX_CONNS    64
+#define MAX_PENDING  64
+
+struct line_buffer {
+    char data[8192];
+    unsigned int used;
+};
+
+struct sink_reply {
+    unsigned long due;
+    char text[128];
+    int close;
+};
+
+struct sink_conn {
+    int fd;
+    int in_data;
+    int rcpt_ok;
+    char rcpt[128];
+    unsigned int body_lines;
+    struct line_buffer in;
+    struct sink_reply replies[MAX_PENDING];
+    unsigned int reply_count;
+};
+
+static struct sink_conn sink_conns[MAX_CONNS];
+static int sink_listen_fd;
+static unsigned int sink_delay;
+static int sink_pipelining = 1;
+static unsigned int sink_max_inflight;
+
+static struct {
+    unsigned int connections;
+    unsigned int delivered;
+    unsigned int deferred;
+    unsigned int rejected;
+    unsigned int unstuffed;
+} sink_stats;
+
+static dict_t sink_retried;
+
+/* The client side of the stand-in ioset. */
+static struct io_fd *client_fds[MAX_CONNS];
+static struct line_buffer client_in[MAX_CONNS];
+static int client_eof[MAX_CONNS];
+
+static time_t time_offset;
+static saxdb_reader_func_t *spool_reader;
+static saxdb_writer_func_t *spool_writer;
+static modcmd_func_t *stats_func;
+static const struct message_entry *msgtabs[8];
+static unsigned int msgtab_count;
+
+static unsigned long
+msec_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+sink_reply(struct sink_conn *conn, const char *text, int close_after)
+{
+    struct sink_reply *reply;
+    unsigned long due;
+
+    if (conn->reply_count == MAX_PENDING)
+        return;
+    due = msec_now() + sink_delay;
+    reply = &conn->replies[conn->reply_count++];
+    reply->due = due;
+    reply->close = close_after;
+    snprintf(reply->text, sizeof(reply->text), "%s\r\n", text);
+    if (conn->reply_count > sink_max_inflight)
+        sink_max_inflight = conn->reply_count;
+}
+
+static void
+sink_close(struct sink_conn *conn)
+{
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+static void
+sink_line(struct sink_conn *conn, char *line)
+{
+    if (conn->in_data) {
+        if (!strcmp(line, ".")) {
+            conn->in_data = 0;
+            sink_stats.delivered++;
+            sink_reply(conn, "250 OK", 0);
+        } else {
+            conn->body_lines++;
+            if (!strcmp(line, "..hidden"))
+                sink_stats.unstuffed++;
+        }
+        return;
+    }
+    if (!strncasecmp(line, "EHLO ", 5)) {
+        sink_reply(conn, "250-sink.test", 0);
+        if (sink_pipelining)
+            sink_reply(conn, "250-PIPELINING", 0);
+        sink_reply(conn, "250 8BITMIME", 0);
+    } else if (!strncasecmp(line, "HELO ", 5)) {
+        sink_reply(conn, "250 sink.test", 0);
+    } else if (!strncasecmp(line, "MAIL FROM:", 10)) {
+        conn->rcpt_ok = 0;
+        sink_reply(conn, "250 OK", 0);
+    } else if (!strncasecmp(line, "RCPT TO:", 8)) {
+        safestrncpy(conn->rcpt, line + 8, sizeof(conn->rcpt));
+        if (strstr(line, "bounce")) {
+            sink_stats.rejected++;
+            sink_reply(conn, "550 No such user", 0);
+        } else if (strstr(line, "retry") && !dict_find(sink_retried, conn->rcpt, NULL)) {
+            dict_insert(sink_retried, strdup(conn->rcpt), "");
+            sink_stats.deferred++;
+            sink_reply(conn, "451 Try again later", 0);
+        } else {
+            conn->rcpt_ok = 1;
+            sink_reply(conn, "250 OK", 0);
+        }
+    } else if (!strcasecmp(line, "DATA")) {
+        if (conn->rcpt_ok) {
+            conn->in_data = 1;
+            sink_reply(conn, "354 Go ahead", 0);
+        } else {
+            sink_reply(conn, "554 No valid recipients", 0);
+        }
+    } else if (!strcasecmp(line, "RSET")) {
+        conn->rcpt_ok = 0;
+        sink_reply(conn, "250 OK", 0);
+    } else if (!strcasecmp(line, "QUIT")) {
+        sink_reply(conn, "221 Bye", 1);
+    } else {
+        sink_reply(conn, "500 What?", 0);
+    }
+}
+
+/* Split complete lines out of a buffer; returns the length of the
+ * line (including its newline) or zero if there is none yet. */
+static unsigned int
+buffer_line(struct line_buffer *buf, char *dest, unsigned int max)
+{
+    char *eol;
+    unsigned int len, copy;
+
+    eol = memchr(buf->data, '\n', buf->used);
+    if (!eol)
+        return 0;
+    len = eol - buf->data + 1;
+    copy = len < max ? len : max - 1;
+    memcpy(dest, buf->data, copy);
+    dest[copy] = '\0';
+    memmove(buf->data, buf->data + len, buf->used - len);
+    buf->used -= len;
+    return len;
+}
+
+static void
+sink_readable(struct sink_conn *conn)
+{
+    char line[1024];
+    unsigned int len;
+    int res;
+
+    res = recv(conn->fd, conn->in.data + conn->in.used, sizeof(conn->in.data) - conn->in.used, 0);
+    if (res <= 0) {
+        sink_close(conn);
+        return;
+    }
+    conn->in.used += res;
+    while ((len = buffer_line(&conn->in, line, sizeof(line))) > 0) {
+        len = strlen(line);
+        while (len > 0 && (line[len-1] == '\r' || line[len-1] == '\n'))
+            line[--len] = '\0';
+        sink_line(conn, line);
+    }
+}
+
+static void
+sink_accept(void)
+{
+    unsigned int ii;
+    int fd;
+
+    fd = accept(sink_listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    for (ii = 0; ii < MAX_CONNS; ii++)
+        if (sink_conns[ii].fd < 0)
+            break;
+    if (ii == MAX_CONNS) {
+        close(fd);
+        return;
+    }
+    memset(&sink_conns[ii], 0, sizeof(sink_conns[ii]));
+    sink_conns[ii].fd = fd;
+    sink_stats.connections++;
+    sink_reply(&sink_conns[ii], "220 sink.test ESMTP", 0);
+}
+
+static void
+sink_flush(struct sink_conn *conn)
+{
+    unsigned long msec = msec_now();
+    unsigned int ii;
+
+    for (ii = 0; ii < conn->reply_count && conn->replies[ii].due <= msec; ii++) {
+        send(conn->fd, conn->replies[ii].text, strlen(conn->replies[ii].text), 0);
+        if (conn->replies[ii].close) {
+            sink_close(conn);
+            conn->reply_count = 0;
+            return;
+        }
+    }
+    memmove(conn->replies, conn->replies + ii, (conn->reply_count - ii) * sizeof(conn->replies[0]));
+    conn->reply_count -= ii;
+}
+
+static void
+client_readable(int fd)
+{
+    struct io_fd *io_fd = client_fds[fd];
+    int res;
+
+    res = recv(fd, client_in[fd].data + client_in[fd].used, sizeof(client_in[fd].data) - client_in[fd].used, 0);
+    if (res <= 0)
+        client_eof[fd] = 1;
+    else
+        client_in[fd].used += res;
+    /* Hand over each complete line, or the end of the stream. */
+    while (client_fds[fd] == io_fd
+           && (memchr(client_in[fd].data, '\n', client_in[fd].used) || client_eof[fd]))
+        io_fd->readable_cb(io_fd);
+}
+
+/* A saxdb context that writes straight into a recdb object. */
+struct saxdb_context {
+    dict_t stack[8];
+    unsigned int depth;
+};
+
+static dict_t
+spool_object(void)
+{
+    dict_t obj = alloc_database();
+    dict_set_free_keys(obj, free);
+    return obj;
+}
+
+static dict_t
+write_spool(void)
+{
+    struct saxdb_context ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.stack[0] = spool_object();
+    spool_writer(&ctx);
+    return ctx.stack[0];
+}
+
+static unsigned int
+spool_depth(void)
+{
+    dict_t db, queue;
+    unsigned int count;
+
+    db = write_spool();
+    queue = database_get_data(db, "queue", RECDB_OBJECT);
+    count = queue ? dict_size(queue) : 0;
+    free_database(db);
+    return count;
+}
+
+/* Run the sink and the mail client until the sink has seen the
+ * expected deliveries, deferrals and rejections and the queue is down
+ * to the expected depth, or the clock runs out. */
+static unsigned long
+run_loop(unsigned int delivered, unsigned int deferred, unsigned int rejected, unsigned int depth)
+{
+    struct timeval timeout;
+    unsigned long started;
+    unsigned int ii;
+    fd_set readfds;
+    int max_fd;
+
+    started = msec_now();
+    while (msec_now() - started < 20000) {
+        FD_ZERO(&readfds);
+        FD_SET(sink_listen_fd, &readfds);
+        max_fd = sink_listen_fd;
+        for (ii = 0; ii < MAX_CONNS; ii++) {
+            if (sink_conns[ii].fd >= 0) {
+                FD_SET(sink_conns[ii].fd, &readfds);
+                if (sink_conns[ii].fd > max_fd)
+                    max_fd = sink_conns[ii].fd;
+            }
+            if (client_fds[ii]) {
+                FD_SET(ii, &readfds);
+                if ((int)ii > max_fd)
+                    max_fd = ii;
+            }
+        }
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 500;
+        if (select(max_fd + 1, &readfds, NULL, NULL, &timeout) > 0) {
+            if (FD_ISSET(sink_listen_fd, &readfds))
+                sink_accept();
+            for (ii = 0; ii < MAX_CONNS; ii++)
+                if (sink_conns[ii].fd >= 0 && FD_ISSET(sink_conns[ii].fd, &readfds))
+                    sink_readable(&sink_conns[ii]);
+            for (ii = 0; ii < MAX_CONNS; ii++)
+                if (client_fds[ii] && FD_ISSET(ii, &readfds))
+                    client_readable(ii);
+        }
+        for (ii = 0; ii < MAX_CONNS; ii++)
+            if (sink_conns[ii].fd >= 0)
+                sink_flush(&sink_conns[ii]);
+        now = time(NULL) + time_offset;
+        if (timeq_next() <= (unsigned long)now)
+            timeq_run();
+        if (sink_stats.delivered >= delivered
+            && sink_stats.deferred >= deferred
+            && sink_stats.rejected >= rejected
+            && spool_depth() == depth)
+            break;
+    }
+    return msec_now() - started;
+}
+
+static void
+set_config(const char *port, const char *sessions, const char *pipelining)
+{
+    dict_t mail;
+
+    mail = alloc_database();
+    dict_insert(mail, "enable", alloc_record_data_qstring("1"));
+    dict_insert(mail, "smtp_server", alloc_record_data_qstring("127.0.0.1"));
+    dict_insert(mail, "smtp_service", alloc_record_data_qstring(port));
+    dict_insert(mail, "smtp_myname", alloc_record_data_qstring("mailtest.test"));
+    dict_insert(mail, "from_address", alloc_record_data_qstring("services@mailtest.test"));
+    dict_insert(mail, "smtp_sessions", alloc_record_data_qstring(sessions));
+    dict_insert(mail, "smtp_pipelining", alloc_record_data_qstring(pipelining));
+    dict_insert(mail, "smtp_idle_timeout", alloc_record_data_qstring("5"));
+    dict_insert(mail, "smtp_retry_delay", alloc_record_data_qstring("30"));
+    if (test_conf)
+        free_database(test_conf);
+    test_conf = alloc_database();
+    dict_insert(test_conf, "mail", alloc_record_data_object(mail));
+    test_run_reloads();
+}
+
+static void
+send_one(const char *name)
+{
+    struct handle_info hi;
+    struct userNode from;
+    char email[64];
+
+    memset(&from, 0, sizeof(from));
+    from.nick = "AuthServ";
+    memset(&hi, 0, sizeof(hi));
+    snprintf(email, sizeof(email), "%s@mailtest.test", name);
+    hi.handle = (char*)name;
+    hi.email_addr = email;
+    mail_send(&from, &hi, "Your account", "Hello!\n.hidden\nThis line is long enough that it has to be wrapped to fit into the flowed text format, so it is.", 0);
+}
+
+static void
+send_mails(const char *prefix, unsigned int count)
+{
+    unsigned int ii;
+    char name[32];
+
+    for (ii = 0; ii < count; ii++) {
+        snprintf(name, sizeof(name), "%s%u", prefix, ii);
+        send_one(name);
+    }
+}
+
+static void
+show_stats(void)
+{
+    struct service service;
+    struct svccmd cmd;
+
+    memset(&service, 0, sizeof(service));
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.parent = &service;
+    stats_func(NULL, NULL, 0, NULL, &cmd);
+}
+
+static int
+run_round(const char *name, unsigned int count, unsigned long *msec)
+{
+    unsigned int before;
+
+    before = sink_stats.delivered;
+    sink_max_inflight = 0;
+    send_mails(name, count);
+    *msec = run_loop(before + count, 0, 0, 0);
+    printf("%s: %u of %u delivered in %lums; %u connections so far, up to %u replies in flight\n",
+           name, sink_stats.delivered - before, count, *msec, sink_stats.connections, sink_max_inflight);
+    show_stats();
+    return sink_stats.delivered - before == count;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    unsigned int count, before, written, ii;
+    unsigned long serial_msec, pooled_msec, msec;
+    dict_t spool;
+    char port[16];
+    int ok, one;
+
+    count = argc > 1 ? strtoul(argv[1], NULL, 0) : 40;
+    sink_delay = argc > 2 ? strtoul(argv[2], NULL, 0) : 5;
+    if (!count || count > 1000) {
+        fprintf(stderr, "usage: %s [messages] [delay-ms]\n", argv[0]);
+        return 2;
+    }
+
+    tools_init();
+    for (ii = 0; ii < MAX_CONNS; ii++)
+        sink_conns[ii].fd = -1;
+    sink_retried = dict_new();
+    dict_set_free_keys(sink_retried, free);
+    sink_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin_len = sizeof(sin);
+    one = 1;
+    setsockopt(sink_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (sink_listen_fd < 0
+        || bind(sink_listen_fd, (struct sockaddr*)&sin, sizeof(sin)) < 0
+        || listen(sink_listen_fd, 16) < 0
+        || getsockname(sink_listen_fd, (struct sockaddr*)&sin, &sin_len) < 0) {
+        perror("SMTP sink");
+        return 2;
+    }
+    snprintf(port, sizeof(port), "%u", ntohs(sin.sin_port));
+
+    now = time(NULL);
+    mail_init();
+    if (!spool_reader || !spool_writer || !stats_func) {
+        fprintf(stderr, "mail back-end did not register its hooks\n");
+        return 2;
+    }
+
+    set_config(port, "1", "0");
+    ok = run_round("serial", count, &serial_msec);
+    set_config(port, "4", "1");
+    ok &= run_round("pooled", count, &pooled_msec);
+    printf("pooled sessions with pipelining were %.1f times as fast\n", pooled_msec ? (double)serial_msec / pooled_msec : 0.0);
+    ok &= pooled_msec < serial_msec;
+
+    /* One mail to be deferred, one to bounce and one to go through.
+     * The deferred one is delivered once the clock passes its retry
+     * time. */
+    before = sink_stats.delivered;
+    send_one("retry");
+    send_one("bounce");
+    send_one("plain");
+    run_loop(before + 1, 1, 1, 1);
+    printf("retry: %u delivered (expected 1), %u deferred, %u rejected, %u left queued (expected 1)\n",
+           sink_stats.delivered - before, sink_stats.deferred, sink_stats.rejected, spool_depth());
+    ok &= (sink_stats.delivered - before == 1) && (sink_stats.deferred == 1) && (sink_stats.rejected == 1) && (spool_depth() == 1);
+    time_offset += 31;
+    now = time(NULL) + time_offset;
+    msec = run_loop(before + 2, 1, 1, 0);
+    printf("after retry delay: %u delivered (expected 2), %u left queued\n", sink_stats.delivered - before, spool_depth());
+    ok &= (sink_stats.delivered - before == 2) && !spool_depth();
+    show_stats();
+
+    /* Spool round-trip: queue mail, save it, throw the queue away,
+     * then load it back and let it drain. */
+    send_mails("spool", count);
+    spool = write_spool();
+    written = dict_size(database_get_data(spool, "queue", RECDB_OBJECT));
+    test_run_exit_funcs();
+    printf("spool: wrote %u of %u mails; %u left after cleanup\n", written, count, spool_depth());
+    ok &= (written == count) && !spool_depth();
+    msgtab_count = 0;
+    mail_init();
+    set_config(port, "4", "1");
+    before = sink_stats.delivered;
+    spool_reader(spool);
+    free_database(spool);
+    printf("spool: read back %u mails\n", spool_depth());
+    ok &= spool_depth() == count;
+    msec = run_loop(before + count, 0, 0, 0);
+    printf("spool: %u of %u delivered in %lums\n", sink_stats.delivered - before, count, msec);
+    /* Mail that was in flight at cleanup may go out twice. */
+    ok &= sink_stats.delivered - before >= count;
+
+    printf("%u of %u message bodies were dot-stuffed correctly\n", sink_stats.unstuffed, sink_stats.delivered);
+    ok &= sink_stats.unstuffed == sink_stats.delivered;
+    test_run_exit_funcs();
+    return ok ? 0 : 1;
+}
+
+/* Stand-ins for the parts of the services that the mail back-end
+ * uses; the rest come from teststubs.c. */
+
+struct saxdb *
+saxdb_register(const char *name, saxdb_reader_func_t *reader, saxdb_writer_func_t *writer)
+{
+    if (!strcmp(name, "MailQueue")) {
+        spool_reader = reader;
+        spool_writer = writer;
+    }
+    return NULL;
+}
+
+void
+saxdb_start_record(struct saxdb_context *dest, const char *name, int UNUSED_ARG(complex))
+{
+    dict_t obj = spool_object();
+    dict_insert(dest->stack[dest->depth], strdup(name), alloc_record_data_object(obj));
+    dest->stack[++dest->depth] = obj;
+}
+
+void
+saxdb_end_record(struct saxdb_context *dest)
+{
+    dest->depth--;
+}
+
+void
+saxdb_write_string(struct saxdb_context *dest, const char *name, const char *value)
+{
+    dict_insert(dest->stack[dest->depth], strdup(name), alloc_record_data_qstring(value));
+}
+
+void
+saxdb_write_int(struct saxdb_context *dest, const char *name, unsigned long value)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%lu", value);
+    saxdb_write_string(dest, name, buf);
+}
+
+void
+saxdb_write_string_list(struct saxdb_context *dest, const char *name, struct string_list *list)
+{
+    dict_insert(dest->stack[dest->depth], strdup(name), alloc_record_data_string_list(string_list_copy(list)));
+}
+
+struct module *
+module_register(UNUSED_ARG(const char *name), UNUSED_ARG(struct log_type *clog), UNUSED_ARG(const char *helpfile_name), UNUSED_ARG(expand_func_t expand_help))
+{
+    static struct module module;
+    return &module;
+}
+
+struct modcmd *
+modcmd_register(UNUSED_ARG(struct module *module), const char *name, modcmd_func_t func, UNUSED_ARG(unsigned int min_argc), UNUSED_ARG(unsigned int flags), ...)
+{
+    if (!strcmp(name, "stats mailqueue"))
+        stats_func = func;
+    return NULL;
+}
+
+void
+message_register_table(const struct message_entry *table)
+{
+    msgtabs[msgtab_count++] = table;
+}
+
+int
+send_message(UNUSED_ARG(struct userNode *dest), UNUSED_ARG(struct userNode *src), const char *message, ...)
+{
+    unsigned int ii, jj;
+    char line[512], *pos;
+    va_list va;
+
+    for (ii = 0; ii < msgtab_count; ii++)
+        for (jj = 0; msgtabs[ii][jj].msgid; jj++)
+            if (!strcmp(msgtabs[ii][jj].msgid, message)) {
+                va_start(va, message);
+                vsnprintf(line, sizeof(line), msgtabs[ii][jj].format, va);
+                va_end(va);
+                for (pos = line; (pos = strstr(pos, "$b")); )
+                    memmove(pos, pos + 2, strlen(pos + 2) + 1);
+                printf("  %s\n", line);
+                return 1;
+            }
+    return 0;
+}
+
+struct io_fd *
+ioset_connect(UNUSED_ARG(struct sockaddr *local), UNUSED_ARG(unsigned int sa_size), const char *hostname, unsigned int port, UNUSED_ARG(int blocking), void *data, void (*connect_cb)(struct io_fd *fd, int error))
+{
+    struct sockaddr_in sin;
+    struct io_fd *io_fd;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    inet_aton(hostname, &sin.sin_addr);
+    if (fd < 0 || fd >= MAX_CONNS || connect(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    io_fd = calloc(1, sizeof(*io_fd));
+    io_fd->fd = fd;
+    io_fd->data = data;
+    client_fds[fd] = io_fd;
+    client_in[fd].used = 0;
+    client_eof[fd] = 0;
+    connect_cb(io_fd, 0);
+    return io_fd;
+}
+
+void
+ioset_write(struct io_fd *fd, const char *buf, unsigned int nbw)
+{
+    send(fd->fd, buf, nbw, 0);
+}
+
+int
+ioset_line_read(struct io_fd *fd, char *buf, int maxlen)
+{
+    unsigned int len;
+
+    len = buffer_line(&client_in[fd->fd], buf, maxlen);
+    if (len)
+        return len;
+    return client_eof[fd->fd] ? 0 : -1;
+}
+
+void
+ioset_close(struct io_fd *fd, int os_close)
+{
+    client_fds[fd->fd] = NULL;
+    if (fd->destroy_cb)
+        fd->destroy_cb(fd);
+    if (os_close)
+        close(fd->fd);
+    free(fd);
+}
@@ -22,13 +22,17 @@
 
 #include "conf.h"
 #include "gline.h"
+#include "hosthiding.h"
 #include "ioset.h"
+#include "metrics.h"
 #include "modcmd.h"
+#include "profile.h"
 #include "saxdb.h"
 #include "mail.h"
 #include "timeq.h"
 #include "sar.h"
 #include "shun.h"
+#include "sweep.h"
 
 #include "chanserv.h"
 #include "global.h"
@@ -244,6 +248,8 @@ int main(int argc, char *argv[])
     if (debug)
         log_debug();
     ioset_init();
+    sweep_init();
+    metrics_init();
     init_structs();
     init_parse();
     modcmd_init();
@@ -251,6 +257,8 @@ int main(int argc, char *argv[])
     sar_init();
     gline_init();
     shun_init();
+    hosthiding_init();
+    profile_init();
     mail_init();
     helpfile_init();
     conf_globals(); /* initializes the core services */
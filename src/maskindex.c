@@ -0,0 +1,234 @@
+/* maskindex.c - Index of user@host glob masks
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "dict.h"
+#include "globset.h"
+#include "maskindex.h"
+
+struct mask_entry {
+    const char *mask;
+    void *data;
+};
+
+/* All masks that share one host part (compared with irccasecmp). */
+struct mask_bucket {
+    char *host;
+    struct mask_entry *list;
+    unsigned int used, size;
+};
+
+struct mask_index {
+    dict_t masks;          /* key: mask, data: caller's data */
+    dict_t hosts;          /* key: literal host, data: struct mask_bucket* */
+    dict_t host_globs;     /* key: wildcard host, data: struct mask_bucket* */
+    struct globset *globs; /* wildcard host -> struct mask_bucket* */
+    struct mask_bucket other;
+};
+
+struct mask_search {
+    const char *text;
+    const char *mask;
+    void *data;
+};
+
+static void
+mask_bucket_free(void *data)
+{
+    struct mask_bucket *bucket = data;
+    free(bucket->host);
+    free(bucket->list);
+    free(bucket);
+}
+
+static void
+mask_bucket_add(struct mask_bucket *bucket, const char *mask, void *data)
+{
+    if (bucket->used == bucket->size) {
+        bucket->size = bucket->size ? bucket->size << 1 : 4;
+        bucket->list = realloc(bucket->list, bucket->size * sizeof(bucket->list[0]));
+    }
+    bucket->list[bucket->used].mask = mask;
+    bucket->list[bucket->used].data = data;
+    bucket->used++;
+}
+
+static int
+mask_bucket_remove(struct mask_bucket *bucket, const char *mask)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < bucket->used; ii++) {
+        if (irccasecmp(bucket->list[ii].mask, mask))
+            continue;
+        bucket->list[ii] = bucket->list[--bucket->used];
+        return 1;
+    }
+    return 0;
+}
+
+/* Keeps the lowest-sorting matching mask, which is the one a walk of
+ * a dict would have found first. */
+static void
+mask_bucket_search(struct mask_bucket *bucket, struct mask_search *search)
+{
+    struct mask_entry *entry;
+    unsigned int ii;
+
+    for (ii = 0; ii < bucket->used; ii++) {
+        entry = &bucket->list[ii];
+        if ((!search->mask || irccasecmp(entry->mask, search->mask) < 0)
+            && match_ircglob(search->text, entry->mask)) {
+            search->mask = entry->mask;
+            search->data = entry->data;
+        }
+    }
+}
+
+static int
+mask_index_glob_func(UNUSED_ARG(const char *glob), void *data, void *extra)
+{
+    mask_bucket_search(data, extra);
+    return 0;
+}
+
+/* Returns the host part of mask if the mask can be filed under it.
+ * That needs exactly one '@' and no escapes, so that the '@' in the
+ * mask can only line up with the '@' in a matching text. */
+static const char *
+mask_index_host(const char *mask)
+{
+    const char *at;
+
+    if (strchr(mask, '\\') || !(at = strchr(mask, '@')) || strchr(at + 1, '@') || !at[1])
+        return NULL;
+    return at + 1;
+}
+
+struct mask_index *
+mask_index_new(void)
+{
+    struct mask_index *idx;
+
+    idx = calloc(1, sizeof(*idx));
+    idx->masks = dict_new();
+    idx->hosts = dict_new();
+    dict_set_free_data(idx->hosts, mask_bucket_free);
+    idx->host_globs = dict_new();
+    dict_set_free_data(idx->host_globs, mask_bucket_free);
+    idx->globs = globset_new();
+    return idx;
+}
+
+void
+mask_index_delete(struct mask_index *idx)
+{
+    globset_delete(idx->globs);
+    dict_delete(idx->host_globs);
+    dict_delete(idx->hosts);
+    dict_delete(idx->masks);
+    free(idx->other.list);
+    free(idx);
+}
+
+unsigned int
+mask_index_size(struct mask_index *idx)
+{
+    return dict_size(idx->masks);
+}
+
+void
+mask_index_add(struct mask_index *idx, const char *mask, void *data)
+{
+    struct mask_bucket *bucket;
+    const char *host;
+    int wild;
+
+    mask_index_remove(idx, mask);
+    dict_insert(idx->masks, mask, data);
+    if (!(host = mask_index_host(mask))) {
+        mask_bucket_add(&idx->other, mask, data);
+        return;
+    }
+    wild = host[strcspn(host, "*?")] != '\0';
+    if (!(bucket = dict_find(wild ? idx->host_globs : idx->hosts, host, NULL))) {
+        bucket = calloc(1, sizeof(*bucket));
+        bucket->host = strdup(host);
+        dict_insert(wild ? idx->host_globs : idx->hosts, bucket->host, bucket);
+        if (wild)
+            globset_add(idx->globs, bucket->host, bucket);
+    }
+    mask_bucket_add(bucket, mask, data);
+}
+
+int
+mask_index_remove(struct mask_index *idx, const char *mask)
+{
+    struct mask_bucket *bucket;
+    const char *host;
+    int wild;
+
+    if (!dict_find(idx->masks, mask, NULL))
+        return 0;
+    if (!(host = mask_index_host(mask))) {
+        mask_bucket_remove(&idx->other, mask);
+    } else {
+        wild = host[strcspn(host, "*?")] != '\0';
+        bucket = dict_find(wild ? idx->host_globs : idx->hosts, host, NULL);
+        if (bucket && mask_bucket_remove(bucket, mask) && !bucket->used) {
+            if (wild)
+                globset_remove(idx->globs, bucket->host);
+            dict_remove(wild ? idx->host_globs : idx->hosts, bucket->host);
+        }
+    }
+    /* Last, since the dict key may be the caller's copy of mask. */
+    dict_remove(idx->masks, mask);
+    return 1;
+}
+
+void *
+mask_index_find(struct mask_index *idx, const char *text)
+{
+    struct mask_search search;
+    struct mask_bucket *bucket;
+    dict_iterator_t it;
+    const char *at;
+
+    /* With more than one '@' in the text, a wildcard in a mask's user
+     * part could swallow one of them, so fall back to trying them all. */
+    at = strchr(text, '@');
+    if (at && strchr(at + 1, '@')) {
+        for (it = dict_first(idx->masks); it; it = iter_next(it))
+            if (match_ircglob(text, iter_key(it)))
+                return iter_data(it);
+        return NULL;
+    }
+
+    search.text = text;
+    search.mask = NULL;
+    search.data = NULL;
+    if (at) {
+        if ((bucket = dict_find(idx->hosts, at + 1, NULL)))
+            mask_bucket_search(bucket, &search);
+        globset_match(idx->globs, at + 1, mask_index_glob_func, &search);
+    }
+    mask_bucket_search(&idx->other, &search);
+    return search.data;
+}
@@ -0,0 +1,47 @@
+/* maskindex.h - Index of user@host glob masks
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef MASKINDEX_H
+#define MASKINDEX_H
+
+/* A mask index finds which of a set of user@host globs (G-lines,
+ * shuns) match a piece of text without trying all of them.  Masks are
+ * filed by their host part: literal hosts in a dict, wildcard hosts
+ * in a globset, so a lookup only runs match_ircglob() on the masks
+ * whose host part could match.
+ *
+ * Like dict keys, the mask strings are not copied and must stay valid
+ * until they are removed from the index.
+ */
+
+struct mask_index;
+
+struct mask_index *mask_index_new(void);
+void mask_index_delete(struct mask_index *idx);
+void mask_index_add(struct mask_index *idx, const char *mask, void *data);
+int mask_index_remove(struct mask_index *idx, const char *mask);
+unsigned int mask_index_size(struct mask_index *idx);
+
+/* Returns the data for the first mask, in dict (irccasecmp) order,
+ * for which match_ircglob(text, mask) is true -- the same answer as
+ * walking a dict of the masks -- or NULL if none match. */
+void *mask_index_find(struct mask_index *idx, const char *text);
+
+#endif /* ndef MASKINDEX_H */
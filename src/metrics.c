@@ -0,0 +1,395 @@
+/* metrics.c - Prometheus metrics registry and HTTP exporter
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "conf.h"
+#include "ioset.h"
+#include "log.h"
+#include "metrics.h"
+#include "sweep.h"
+#include "timeq.h"
+
+#define METRICS_REQUEST_MAX 2048
+#define METRICS_TIMEOUT     30
+#define METRICS_SLICE       16
+
+struct metric {
+    char *name;
+    char *help;
+    enum metric_type type;
+    metric_value_func value;
+    metric_collect_func collect;
+    void *extra;
+};
+
+struct metrics_out {
+    struct string_buffer *buf;
+    const struct metric *metric;
+};
+
+/* One HTTP connection.  Requests are answered once, then the
+ * connection is closed when the response has been sent. */
+struct metrics_client {
+    struct io_fd *fd;
+    struct sweep *sweep;
+    struct metrics_client *prev;
+    struct metrics_client *next;
+    unsigned int used;
+    unsigned int answered : 1;
+    char request[METRICS_REQUEST_MAX];
+};
+
+static dict_t metrics;
+static struct io_fd *metrics_listener;
+static struct metrics_client *metrics_clients;
+static struct string_buffer metrics_buf;
+static unsigned long metrics_scrapes;
+
+static struct {
+    unsigned long max_sendq;
+} metrics_conf;
+
+static void
+metric_free(void *data)
+{
+    struct metric *metric = data;
+
+    free(metric->name);
+    free(metric->help);
+    free(metric);
+}
+
+static int
+metrics_valid_name(const char *name)
+{
+    if (!isalpha(*name) && *name != '_' && *name != ':')
+        return 0;
+    for (++name; *name; ++name)
+        if (!isalnum(*name) && *name != '_' && *name != ':')
+            return 0;
+    return 1;
+}
+
+static struct metric *
+metric_add(const char *name, const char *help, enum metric_type type)
+{
+    struct metric *metric;
+
+    if (!metrics_valid_name(name)) {
+        log_module(MAIN_LOG, LOG_ERROR, "Not registering metric with invalid name %s.", name);
+        return NULL;
+    }
+    if (!metrics) {
+        metrics = dict_new();
+        dict_set_free_data(metrics, metric_free);
+    }
+    dict_remove(metrics, name);
+    metric = calloc(1, sizeof(*metric));
+    metric->name = strdup(name);
+    metric->help = strdup(help);
+    metric->type = type;
+    dict_insert(metrics, metric->name, metric);
+    return metric;
+}
+
+void
+metrics_register(const char *name, const char *help, enum metric_type type, metric_value_func value, void *extra)
+{
+    struct metric *metric;
+
+    if ((metric = metric_add(name, help, type))) {
+        metric->value = value;
+        metric->extra = extra;
+    }
+}
+
+static double
+metrics_read_ulong(void *extra)
+{
+    return *(const unsigned long*)extra;
+}
+
+void
+metrics_register_ulong(const char *name, const char *help, enum metric_type type, const unsigned long *value)
+{
+    metrics_register(name, help, type, metrics_read_ulong, (void*)value);
+}
+
+void
+metrics_register_collector(const char *name, const char *help, enum metric_type type, metric_collect_func collect, void *extra)
+{
+    struct metric *metric;
+
+    if ((metric = metric_add(name, help, type))) {
+        metric->collect = collect;
+        metric->extra = extra;
+    }
+}
+
+void
+metrics_unregister(const char *name)
+{
+    if (metrics)
+        dict_remove(metrics, name);
+}
+
+static void
+metrics_escape(struct string_buffer *buf, const char *str, int quote)
+{
+    for (; *str; ++str) {
+        if (*str == '\\')
+            string_buffer_append_string(buf, "\\\\");
+        else if (*str == '\n')
+            string_buffer_append_string(buf, "\\n");
+        else if (*str == '"' && quote)
+            string_buffer_append_string(buf, "\\\"");
+        else
+            string_buffer_append(buf, *str);
+    }
+}
+
+static void
+metrics_line(struct metrics_out *out, const char *suffix, const char *label, const char *label_value, const char *quantile, double value)
+{
+    struct string_buffer *buf = out->buf;
+
+    string_buffer_append_string(buf, out->metric->name);
+    if (suffix)
+        string_buffer_append_string(buf, suffix);
+    if (label || quantile) {
+        string_buffer_append(buf, '{');
+        if (label) {
+            string_buffer_append_printf(buf, "%s=\"", label);
+            metrics_escape(buf, label_value, 1);
+            string_buffer_append(buf, '"');
+        }
+        if (quantile)
+            string_buffer_append_printf(buf, "%squantile=\"%s\"", label ? "," : "", quantile);
+        string_buffer_append(buf, '}');
+    }
+    string_buffer_append_printf(buf, " %.15g\n", value);
+}
+
+void
+metrics_sample(struct metrics_out *out, const char *label, const char *label_value, double value)
+{
+    metrics_line(out, NULL, label, label_value, NULL, value);
+}
+
+void
+metrics_summary(struct metrics_out *out, const char *label, const char *label_value, const struct histogram *hist, double scale)
+{
+    metrics_line(out, NULL, label, label_value, "0.5", histogram_percentile(hist, 0.5) * scale);
+    metrics_line(out, NULL, label, label_value, "0.9", histogram_percentile(hist, 0.9) * scale);
+    metrics_line(out, NULL, label, label_value, "0.99", histogram_percentile(hist, 0.99) * scale);
+    metrics_line(out, "_sum", label, label_value, NULL, hist->sum * scale);
+    metrics_line(out, "_count", label, label_value, NULL, hist->count);
+}
+
+/* Renders and queues one family; the sweep pauses while the client
+ * has more than max_sendq bytes waiting. */
+static int
+metrics_render_family(UNUSED_ARG(const char *key), void *data, void *extra)
+{
+    static const char *type_names[] = { "counter", "gauge", "summary" };
+    struct metrics_client *client = extra;
+    struct metric *metric = data;
+    struct metrics_out out;
+
+    metrics_buf.used = 0;
+    string_buffer_append_printf(&metrics_buf, "# HELP %s ", metric->name);
+    metrics_escape(&metrics_buf, metric->help, 0);
+    string_buffer_append_printf(&metrics_buf, "\n# TYPE %s %s\n", metric->name, type_names[metric->type]);
+    out.buf = &metrics_buf;
+    out.metric = metric;
+    if (metric->collect)
+        metric->collect(&out, metric->extra);
+    else
+        metrics_line(&out, NULL, NULL, NULL, NULL, metric->value(metric->extra));
+    ioset_write(client->fd, metrics_buf.list, metrics_buf.used);
+    if (ioset_send_queued(client->fd) > metrics_conf.max_sendq)
+        sweep_defer(client->sweep, now + 1);
+    return 0;
+}
+
+static void
+metrics_render_done(void *extra)
+{
+    struct metrics_client *client = extra;
+
+    client->sweep = NULL;
+    metrics_scrapes++;
+    ioset_close_after_send(client->fd);
+}
+
+static void
+metrics_respond(struct metrics_client *client, const char *status, const char *body)
+{
+    ioset_printf(client->fd, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %u\r\nConnection: close\r\n\r\n%s", status, (unsigned int)strlen(body), body);
+    ioset_close_after_send(client->fd);
+}
+
+static void
+metrics_request(struct metrics_client *client)
+{
+    char *method, *path;
+
+    method = client->request;
+    if (!(path = strchr(method, ' '))) {
+        metrics_respond(client, "400 Bad Request", "Bad request.\n");
+        return;
+    }
+    *path++ = '\0';
+    path[strcspn(path, " ?\r\n")] = '\0';
+    if (strcmp(method, "GET")) {
+        metrics_respond(client, "405 Method Not Allowed", "Only GET is supported.\n");
+    } else if (strcmp(path, "/metrics")) {
+        metrics_respond(client, "404 Not Found", "Metrics are at /metrics.\n");
+    } else {
+        ioset_printf(client->fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        client->sweep = sweep_dict("metrics", metrics, metrics_render_family, metrics_render_done, client);
+        sweep_set_slice(client->sweep, METRICS_SLICE, 0);
+    }
+}
+
+static void
+metrics_readable(struct io_fd *fd)
+{
+    struct metrics_client *client = fd->data;
+    int res;
+
+    res = recv(fd->fd, client->request + client->used, sizeof(client->request) - client->used - 1, 0);
+    if (res <= 0) {
+        if (res == 0 || errno != EAGAIN)
+            ioset_close(fd, 1);
+        return;
+    }
+    if (client->answered)
+        return;
+    client->used += res;
+    client->request[client->used] = '\0';
+    if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n")) {
+        client->answered = 1;
+        client->used = 0;
+        metrics_request(client);
+    } else if (client->used == sizeof(client->request) - 1) {
+        client->answered = 1;
+        client->used = 0;
+        metrics_respond(client, "400 Bad Request", "Request too long.\n");
+    }
+}
+
+static void
+metrics_timeout(void *data)
+{
+    struct metrics_client *client = data;
+
+    log_module(MAIN_LOG, LOG_DEBUG, "Closing metrics connection that took longer than %u seconds.", METRICS_TIMEOUT);
+    ioset_close(client->fd, 1);
+}
+
+static void
+metrics_destroy_fd(struct io_fd *fd)
+{
+    struct metrics_client *client = fd->data;
+
+    if (client->sweep)
+        sweep_cancel(client->sweep);
+    timeq_del(0, metrics_timeout, client, TIMEQ_IGNORE_WHEN);
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        metrics_clients = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    free(client);
+}
+
+static void
+metrics_accept(UNUSED_ARG(struct io_fd *listener), struct io_fd *fd)
+{
+    struct metrics_client *client;
+
+    client = calloc(1, sizeof(*client));
+    client->fd = fd;
+    fd->data = client;
+    fd->readable_cb = metrics_readable;
+    fd->destroy_cb = metrics_destroy_fd;
+    client->next = metrics_clients;
+    if (metrics_clients)
+        metrics_clients->prev = client;
+    metrics_clients = client;
+    timeq_add(now + METRICS_TIMEOUT, metrics_timeout, client);
+}
+
+static void
+metrics_conf_read(void)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    const char *address;
+    const char *port;
+    const char *str;
+    dict_t node;
+    int res;
+
+    ioset_close(metrics_listener, 1);
+    metrics_listener = NULL;
+    node = conf_get_data("metrics", RECDB_OBJECT);
+    str = node ? database_get_data(node, "max_sendq", RECDB_QSTRING) : NULL;
+    metrics_conf.max_sendq = str ? strtoul(str, NULL, 0) : 65536;
+    port = node ? database_get_data(node, "port", RECDB_QSTRING) : NULL;
+    if (!port)
+        return;
+    address = database_get_data(node, "bind_address", RECDB_QSTRING);
+    if (!address)
+        address = "127.0.0.1";
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((res = getaddrinfo(address, port, &hints, &ai))) {
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to find metrics address [%s]:%s: %s", address, port, gai_strerror(res));
+        return;
+    }
+    if (!(metrics_listener = ioset_listen(ai->ai_addr, ai->ai_addrlen, NULL, metrics_accept)))
+        log_module(MAIN_LOG, LOG_ERROR, "Unable to listen for metrics scrapes on [%s]:%s", address, port);
+    freeaddrinfo(ai);
+}
+
+static void
+metrics_cleanup(UNUSED_ARG(void *extra))
+{
+    ioset_close(metrics_listener, 1);
+    metrics_listener = NULL;
+    while (metrics_clients)
+        ioset_close(metrics_clients->fd, 1);
+    dict_delete(metrics);
+    metrics = NULL;
+    free(metrics_buf.list);
+    metrics_buf.list = NULL;
+    metrics_buf.size = metrics_buf.used = 0;
+}
+
+void
+metrics_init(void)
+{
+    reg_exit_func(metrics_cleanup, NULL);
+    conf_register_reload(metrics_conf_read);
+    metrics_register_ulong("x3_metrics_scrapes_total", "Completed scrapes of the metrics endpoint.", METRIC_COUNTER, &metrics_scrapes);
+}
@@ -0,0 +1,65 @@
+/* metrics.h - Prometheus metrics registry and HTTP exporter
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "histogram.h"
+
+/* Subsystems and modules register metric families by name; nothing is
+ * read until a scrape asks for it.  A family is either a single value,
+ * read through a callback (or straight from an unsigned long), or a
+ * collector that emits any number of labelled samples.
+ *
+ * When the "metrics" section of the configuration names a port, an
+ * HTTP listener serves every family in the Prometheus text format at
+ * /metrics.  Families are rendered and written a few at a time as
+ * background sweeps, so a large scrape or a slow client never stalls
+ * the event loop.
+ */
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_SUMMARY
+};
+
+struct metrics_out;
+
+typedef double (*metric_value_func)(void *extra);
+typedef void (*metric_collect_func)(struct metrics_out *out, void *extra);
+
+/* Names must match [a-zA-Z_:][a-zA-Z0-9_:]* and help must be one
+ * line.  Registering a name again replaces the old family. */
+void metrics_register(const char *name, const char *help, enum metric_type type, metric_value_func value, void *extra);
+void metrics_register_ulong(const char *name, const char *help, enum metric_type type, const unsigned long *value);
+void metrics_register_collector(const char *name, const char *help, enum metric_type type, metric_collect_func collect, void *extra);
+void metrics_unregister(const char *name);
+
+/* For collectors: emit one sample of the family being rendered, with
+ * an optional label (label may be NULL). */
+void metrics_sample(struct metrics_out *out, const char *label, const char *label_value, double value);
+/* Emits a summary from a histogram; scale converts its units (for
+ * example 1e-6 for microseconds to seconds). */
+void metrics_summary(struct metrics_out *out, const char *label, const char *label_value, const struct histogram *hist, double scale);
+
+void metrics_init(void);
+
+#endif /* !defined(METRICS_H) */
@@ -0,0 +1,506 @@
+#include "common.h"
+#include "conf.h"
+#include "helpfile.h"
+#include "ioset.h"
+#include "log.h"
+#include "metrics.h"
+#include "profile.h"
+#include "sweep.h"
+#include "teststubs.h"
+#include "timeq.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#include <signal.h>
+
+/* Scrapes the metrics endpoint over a loopback connection:
+ *
+ *   metricstest [families] [samples]
+ *
+ * Registers families gauges, a counter, a summary and a collector with
+ * samples labelled samples, then checks that a scrape returns each of
+ * them once, in the text format, and that rendering was spread over
+ * several passes through the loop.  The second round lets the client
+ * take only a little output per pass and checks that the endpoint
+ * waits for it rather than queueing the whole response.  Later rounds
+ * check the error responses, a client that goes away mid-scrape and
+ * the idle timeout.  Exits non-zero on any failure. */
+
+#define MAX_FDS      256
+#define MAX_PASSES   200000
+#define TEST_TIMEOUT 30
+
+/* The server side of the stand-in ioset. */
+static struct io_fd *io_fds[MAX_FDS];
+static struct string_buffer io_out[MAX_FDS];
+static unsigned int io_sent[MAX_FDS];
+static struct io_fd *listen_fd;
+static unsigned int write_limit;
+static unsigned int max_queued;
+
+static unsigned int passes;
+static unsigned int clock_ticks;
+static unsigned int first_render_pass;
+static unsigned int last_render_pass;
+static unsigned long test_counter = 12345;
+static struct histogram test_hist;
+static unsigned int test_samples;
+
+struct scrape {
+    int fd;
+    int eof;
+    unsigned int stop_at;
+    struct string_buffer in;
+};
+
+static double
+test_gauge(void *extra)
+{
+    if (!first_render_pass)
+        first_render_pass = passes;
+    last_render_pass = passes;
+    return (double)(unsigned long)extra;
+}
+
+static void
+test_collect(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    char value[32];
+    unsigned int ii;
+
+    metrics_sample(out, "name", "a\"b\\c\nd", 1);
+    for (ii = 0; ii < test_samples; ii++) {
+        snprintf(value, sizeof(value), "sample%05u", ii);
+        metrics_sample(out, "name", value, ii);
+    }
+}
+
+static void
+test_summary(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    metrics_summary(out, NULL, NULL, &test_hist, 1e-6);
+}
+
+static void
+set_config(const char *max_sendq)
+{
+    dict_t metrics;
+
+    metrics = alloc_database();
+    dict_insert(metrics, "port", alloc_record_data_qstring("0"));
+    dict_insert(metrics, "bind_address", alloc_record_data_qstring("127.0.0.1"));
+    dict_insert(metrics, "max_sendq", alloc_record_data_qstring(max_sendq));
+    if (test_conf)
+        free_database(test_conf);
+    test_conf = alloc_database();
+    dict_insert(test_conf, "metrics", alloc_record_data_object(metrics));
+    test_run_reloads();
+}
+
+static unsigned int
+open_fds(void)
+{
+    unsigned int ii, count;
+
+    for (ii = count = 0; ii < MAX_FDS; ii++)
+        if (io_fds[ii] && io_fds[ii] != listen_fd)
+            count++;
+    return count;
+}
+
+static void
+flush_fd(struct io_fd *fd)
+{
+    unsigned int len;
+    int res;
+
+    len = io_out[fd->fd].used - io_sent[fd->fd];
+    if (write_limit && len > write_limit)
+        len = write_limit;
+    if (len) {
+        res = send(fd->fd, io_out[fd->fd].list + io_sent[fd->fd], len, 0);
+        /* Drop what cannot be sent; the read side notices the close. */
+        io_sent[fd->fd] += (res > 0) ? (unsigned int)res : len;
+    }
+    if (io_sent[fd->fd] == io_out[fd->fd].used) {
+        io_out[fd->fd].used = io_sent[fd->fd] = 0;
+        if (fd->close_after_send)
+            ioset_close(fd, 1);
+    }
+}
+
+static int
+scrape_start(const char *request)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    int fd;
+
+    sin_len = sizeof(sin);
+    if (!listen_fd || getsockname(listen_fd->fd, (struct sockaddr*)&sin, &sin_len) < 0)
+        return -1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("connect");
+        exit(2);
+    }
+    if (request)
+        send(fd, request, strlen(request), 0);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* Runs the loop until the scrape sees EOF or stop_at bytes (or, with
+ * no scrape, until every server connection is gone).  The clock only
+ * moves when there is nothing else to do, so deferred sweeps and the
+ * idle timeout fire without any real waiting. */
+static void
+run_loop(struct scrape *scrape)
+{
+    struct timeval timeout;
+    struct io_fd *fd;
+    fd_set readfds;
+    unsigned int ii, busy;
+    char buf[4096];
+    int maxfd, res, newfd;
+
+    for (; passes < MAX_PASSES; passes++) {
+        if (scrape ? (scrape->eof || (scrape->stop_at && scrape->in.used >= scrape->stop_at)) : !open_fds())
+            return;
+        if (timeq_size())
+            timeq_run();
+        sweep_run();
+        busy = sweep_pending();
+        for (ii = 0; ii < MAX_FDS; ii++) {
+            if ((fd = io_fds[ii]) && io_out[ii].used > io_sent[ii]) {
+                flush_fd(fd);
+                busy = 1;
+            }
+        }
+
+        FD_ZERO(&readfds);
+        maxfd = -1;
+        for (ii = 0; ii < MAX_FDS; ii++) {
+            if (io_fds[ii]) {
+                FD_SET(ii, &readfds);
+                maxfd = ii;
+            }
+        }
+        if (scrape && scrape->fd >= 0) {
+            FD_SET(scrape->fd, &readfds);
+            if (scrape->fd > maxfd)
+                maxfd = scrape->fd;
+        }
+        timeout.tv_sec = 0;
+        timeout.tv_usec = busy ? 0 : 10000;
+        res = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+        if (res < 0) {
+            perror("select");
+            exit(2);
+        }
+        if (!res && !busy) {
+            now++;
+            clock_ticks++;
+            continue;
+        }
+
+        if (scrape && scrape->fd >= 0 && FD_ISSET(scrape->fd, &readfds)) {
+            res = recv(scrape->fd, buf, sizeof(buf), 0);
+            if (res > 0)
+                string_buffer_append_substring(&scrape->in, buf, res);
+            else if (res == 0 || errno != EAGAIN)
+                scrape->eof = 1;
+        }
+        for (ii = 0; ii < MAX_FDS; ii++) {
+            if (!(fd = io_fds[ii]) || !FD_ISSET(ii, &readfds))
+                continue;
+            if (fd == listen_fd) {
+                if ((newfd = accept(fd->fd, NULL, NULL)) < 0)
+                    continue;
+                fd->accept_cb(fd, ioset_add(newfd));
+            } else {
+                fd->readable_cb(fd);
+            }
+        }
+    }
+    fprintf(stderr, "loop did not finish in %u passes\n", MAX_PASSES);
+    exit(1);
+}
+
+static void
+scrape(struct scrape *scrape, const char *request)
+{
+    memset(scrape, 0, sizeof(*scrape));
+    scrape->fd = scrape_start(request);
+    run_loop(scrape);
+    close(scrape->fd);
+    string_buffer_append(&scrape->in, '\0');
+    scrape->in.used--;
+}
+
+static unsigned int
+count_lines(const char *text, const char *prefix)
+{
+    unsigned int count, len;
+
+    len = strlen(prefix);
+    for (count = 0; text; text = strchr(text, '\n')) {
+        if (*text == '\n')
+            text++;
+        if (!strncmp(text, prefix, len))
+            count++;
+    }
+    return count;
+}
+
+static int
+check_body(const char *name, const char *text, unsigned int families, unsigned long scrapes)
+{
+    const char *body;
+    char line[128];
+    unsigned int ii;
+    int ok = 1;
+
+    if (strncmp(text, "HTTP/1.0 200 ", 13) || !(body = strstr(text, "\r\n\r\n"))) {
+        printf("%s: bad response: %.40s\n", name, text);
+        return 0;
+    }
+    body += 4;
+    for (ii = 0; ii < families; ii++) {
+        snprintf(line, sizeof(line), "test_gauge_%05u %u\n", ii, ii);
+        if (!strstr(body, line)) {
+            printf("%s: missing sample %s", name, line);
+            ok = 0;
+            break;
+        }
+    }
+    ok &= count_lines(body, "# HELP test_gauge_") == families;
+    ok &= count_lines(body, "# TYPE test_gauge_") == families;
+    ok &= count_lines(body, "test_labels{name=\"sample") == test_samples;
+    ok &= strstr(body, "# HELP test_labels Help with \\\\ and\\nnewline.\n") != NULL;
+    ok &= strstr(body, "# TYPE test_labels gauge\n") != NULL;
+    ok &= strstr(body, "test_labels{name=\"a\\\"b\\\\c\\nd\"} 1\n") != NULL;
+    ok &= strstr(body, "# TYPE test_counter_total counter\ntest_counter_total 12345\n") != NULL;
+    ok &= strstr(body, "# TYPE test_summary summary\ntest_summary{quantile=\"0.5\"} ") != NULL;
+    ok &= strstr(body, "\ntest_summary_sum 0.5005\ntest_summary_count 1000\n") != NULL;
+    ok &= strstr(body, "# TYPE x3_event_loop_lag_seconds summary\n") != NULL;
+    snprintf(line, sizeof(line), "\nx3_metrics_scrapes_total %lu\n", scrapes);
+    ok &= strstr(body, line) != NULL;
+    printf("%s: %u bytes, %u HELP lines, rendered over %u passes, %s\n", name, (unsigned int)strlen(body),
+           count_lines(body, "# HELP "), last_render_pass - first_render_pass + 1, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int
+check_status(const char *request, const char *status)
+{
+    struct scrape sc;
+    int ok;
+
+    scrape(&sc, request);
+    ok = !strncmp(sc.in.list, status, strlen(status));
+    printf("%.20s...: %.*s %s\n", request, (int)strcspn(sc.in.list, "\r\n"), sc.in.list, ok ? "ok" : "FAILED");
+    free(sc.in.list);
+    return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct scrape sc;
+    char name[32], *big;
+    unsigned int families, ii;
+    unsigned long rendered;
+    int ok;
+
+    families = argc > 1 ? strtoul(argv[1], NULL, 0) : 500;
+    test_samples = argc > 2 ? strtoul(argv[2], NULL, 0) : 200;
+    if (!families) {
+        fprintf(stderr, "usage: %s [families] [samples]\n", argv[0]);
+        return 2;
+    }
+
+    tools_init();
+    signal(SIGPIPE, SIG_IGN);
+    now = time(NULL);
+    for (ii = 0; ii < families; ii++) {
+        snprintf(name, sizeof(name), "test_gauge_%05u", ii);
+        metrics_register(name, "A test gauge.", METRIC_GAUGE, test_gauge, (void*)(unsigned long)ii);
+    }
+    metrics_register("bad-name", "Never registered.", METRIC_GAUGE, test_gauge, NULL);
+    metrics_register_ulong("test_counter_total", "A test counter.", METRIC_COUNTER, &test_counter);
+    metrics_register_collector("test_labels", "Help with \\ and\nnewline.", METRIC_GAUGE, test_collect, NULL);
+    metrics_register_collector("test_summary", "A test summary.", METRIC_SUMMARY, test_summary, NULL);
+    for (ii = 1; ii <= 1000; ii++)
+        histogram_add(&test_hist, ii);
+    metrics_init();
+    profile_init();
+    set_config("1000000");
+    if (!listen_fd) {
+        fprintf(stderr, "metrics endpoint did not listen\n");
+        return 2;
+    }
+
+    /* An unthrottled scrape. */
+    scrape(&sc, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    ok = check_body("fast client", sc.in.list, families, 0);
+    ok &= strstr(sc.in.list, "bad-name") == NULL;
+    ok &= last_render_pass > first_render_pass;
+    rendered = strlen(sc.in.list);
+    free(sc.in.list);
+
+    /* A client that takes 512 bytes a pass: the queue should stay
+     * near max_sendq, and the response should not change. */
+    set_config("4096");
+    write_limit = 512;
+    max_queued = 0;
+    clock_ticks = 0;
+    first_render_pass = last_render_pass = 0;
+    scrape(&sc, "GET /metrics\n\n");
+    ok &= check_body("slow client", sc.in.list, families, 1);
+    printf("slow client: at most %u bytes queued, waited %u times\n", max_queued, clock_ticks);
+    ok &= max_queued < 4096 + 64 * (test_samples + 8);
+    ok &= clock_ticks > 0;
+    ok &= strlen(sc.in.list) == rendered;
+    free(sc.in.list);
+
+    ok &= check_status("GET /other HTTP/1.0\r\n\r\n", "HTTP/1.0 404 ");
+    ok &= check_status("POST /metrics HTTP/1.0\r\n\r\n", "HTTP/1.0 405 ");
+    /* Exactly fills the request buffer, so nothing is left unread. */
+    big = malloc(2048);
+    memset(big, 'x', 2047);
+    big[2047] = '\0';
+    memcpy(big, "GET /", 5);
+    ok &= check_status(big, "HTTP/1.0 400 ");
+    free(big);
+
+    /* Go away after the first bytes of a scrape; the server should
+     * drop the connection and its sweep. */
+    memset(&sc, 0, sizeof(sc));
+    sc.stop_at = 1;
+    sc.fd = scrape_start("GET /metrics HTTP/1.0\r\n\r\n");
+    run_loop(&sc);
+    close(sc.fd);
+    free(sc.in.list);
+    run_loop(NULL);
+    printf("abandoned scrape: %u connections, %u sweeps left\n", open_fds(), sweep_pending());
+    ok &= !open_fds() && !sweep_pending();
+
+    /* An idle connection is closed after the timeout. */
+    clock_ticks = 0;
+    scrape(&sc, NULL);
+    printf("idle connection: closed after %u seconds (expected %u)\n", clock_ticks, TEST_TIMEOUT);
+    ok &= clock_ticks >= TEST_TIMEOUT && !open_fds();
+    free(sc.in.list);
+
+    test_run_exit_funcs();
+    ok &= listen_fd == NULL;
+    return ok ? 0 : 1;
+}
+
+/* Stand-ins for the parts of the services that the endpoint uses;
+ * the rest come from teststubs.c. */
+
+struct io_fd *
+ioset_add(int fd)
+{
+    struct io_fd *io_fd;
+
+    if (fd < 0 || fd >= MAX_FDS) {
+        fprintf(stderr, "descriptor %d out of range\n", fd);
+        exit(2);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    io_fd = calloc(1, sizeof(*io_fd));
+    io_fd->fd = fd;
+    io_fd->state = IO_CONNECTED;
+    io_fds[fd] = io_fd;
+    io_out[fd].used = io_sent[fd] = 0;
+    return io_fd;
+}
+
+struct io_fd *
+ioset_listen(struct sockaddr *local, unsigned int sa_size, void *data, void (*accept_cb)(struct io_fd *listener, struct io_fd *new_connect))
+{
+    int fd, opt = 1;
+
+    fd = socket(local->sa_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(fd, local, sa_size) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return NULL;
+    }
+    listen_fd = ioset_add(fd);
+    listen_fd->state = IO_LISTENING;
+    listen_fd->data = data;
+    listen_fd->accept_cb = accept_cb;
+    return listen_fd;
+}
+
+void
+ioset_write(struct io_fd *fd, const char *buf, unsigned int nbw)
+{
+    string_buffer_append_substring(&io_out[fd->fd], buf, nbw);
+    if (ioset_send_queued(fd) > max_queued)
+        max_queued = ioset_send_queued(fd);
+}
+
+int
+ioset_printf(struct io_fd *fd, const char *fmt, ...)
+{
+    struct string_buffer *buf = &io_out[fd->fd];
+    unsigned int before = buf->used;
+    va_list ap;
+
+    va_start(ap, fmt);
+    string_buffer_append_vprintf(buf, fmt, ap);
+    va_end(ap);
+    return buf->used - before;
+}
+
+unsigned int
+ioset_send_queued(const struct io_fd *fd)
+{
+    return io_out[fd->fd].used - io_sent[fd->fd];
+}
+
+void
+ioset_close_after_send(struct io_fd *fd)
+{
+    if (!ioset_send_queued(fd))
+        ioset_close(fd, 1);
+    else
+        fd->close_after_send = 1;
+}
+
+void
+ioset_close(struct io_fd *fd, int os_close)
+{
+    if (!fd)
+        return;
+    io_fds[fd->fd] = NULL;
+    io_out[fd->fd].used = io_sent[fd->fd] = 0;
+    if (fd == listen_fd)
+        listen_fd = NULL;
+    if (fd->destroy_cb)
+        fd->destroy_cb(fd);
+    if (os_close)
+        close(fd->fd);
+    free(fd);
+}
@@ -23,9 +23,24 @@
 #include "modcmd.h"
 #include "proto.h"
 #include "sar.h"
+#include "sweep.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 const char *blacklist_module_deps[] = { NULL };
 
+extern struct modcmd *opserv_define_func(const char *name, modcmd_func_t *func, int min_level, int reqchan, int min_argc);
+
+static const struct message_entry msgtab[] = {
+    { "BLMSG_STATS_EMPTY", "No local blacklist is loaded." },
+    { "BLMSG_STATS_TABLE", "Local blacklist from %s: %u address ranges, %u hosts and %u wildcard hosts with %u distinct reasons, in %lu bytes; loaded in %lums." },
+    { "BLMSG_STATS_LOADING", "Reloading the local blacklist from %s: %lu lines read so far." },
+    { "BLMSG_STATS_LOOKUPS", "Checked %lu new users against the local blacklist (%lu matched): %lu.%02lu usec per user on average, %lu usec at most." },
+    { NULL, NULL }
+};
+
 struct dnsbl_zone {
     struct string_list reasons;
     const char *description;
@@ -41,10 +56,68 @@ struct dnsbl_data {
     char zone_name[1];
 };
 
+/* The local blacklist is kept in flat sorted arrays instead of a dict
+ * so that large feeds cost a few dozen bytes per entry.  Address
+ * entries are CIDR ranges sorted by base address, each pointing at
+ * the smallest range that encloses it; host names and "*.suffix"
+ * wildcards are sorted separately.  All strings (names and reasons)
+ * live in one pool and are referred to by offset.
+ */
+struct blacklist_range {
+    irc_in_addr_t base;
+    unsigned char bits;
+    int parent; /* line number until the ranges are sorted */
+    unsigned int reason;
+};
+
+struct blacklist_name {
+    unsigned int name;
+    unsigned int reason;
+};
+
+struct blacklist_names {
+    struct blacklist_name *list;
+    unsigned int used;
+    unsigned int size;
+};
+
+struct blacklist_table {
+    char *filename;
+    struct blacklist_range *ranges;
+    unsigned int ranges_used;
+    unsigned int ranges_size;
+    struct blacklist_names hosts;
+    struct blacklist_names suffixes;
+    char *pool;
+    unsigned int pool_used;
+    unsigned int pool_size;
+    unsigned int reasons;
+    unsigned long lines;
+    unsigned long load_msec;
+};
+
+/* A table being loaded, a slice at a time, by a sweep job. */
+struct blacklist_load {
+    struct blacklist_table *table;
+    struct sweep *sweep;
+    FILE *file;
+    char *default_reason;
+    dict_t reasons; /* maps reason strings to their pool offset plus one */
+    struct timeval started;
+    unsigned int phase;
+};
+
 static struct log_type *bl_log;
 static dict_t blacklist_zones; /* contains struct dnsbl_zone */
-static dict_t blacklist_hosts; /* maps IPs or hostnames to reasons from blacklist_reasons */
-static dict_t blacklist_reasons; /* maps strings to themselves (poor man's data sharing) */
+static struct blacklist_table *blacklist_table;
+static struct blacklist_load *blacklist_loading;
+
+static struct {
+    unsigned long lookups;
+    unsigned long matches;
+    unsigned long total_usec;
+    unsigned long max_usec;
+} blacklist_stats;
 
 static struct {
     struct userNode *debug_bot;
@@ -158,8 +231,378 @@ dnsbl_hit(struct sar_request *req, struct dns_header *hdr, struct dns_rr *rr, un
     free(txt);
 }
 
+static unsigned int
+blacklist_pool_add(struct blacklist_table *table, const char *str)
+{
+    unsigned int len, ofs;
+
+    len = strlen(str) + 1;
+    if (table->pool_used + len > table->pool_size) {
+        table->pool_size = (table->pool_size + len) * 2;
+        table->pool = realloc(table->pool, table->pool_size);
+    }
+    ofs = table->pool_used;
+    memcpy(table->pool + ofs, str, len);
+    table->pool_used += len;
+    return ofs;
+}
+
+static void
+blacklist_names_add(struct blacklist_table *table, struct blacklist_names *names, const char *name, unsigned int reason)
+{
+    if (names->used == names->size) {
+        names->size = names->size ? names->size * 2 : 64;
+        names->list = realloc(names->list, names->size * sizeof(names->list[0]));
+    }
+    names->list[names->used].name = blacklist_pool_add(table, name);
+    names->list[names->used].reason = reason;
+    names->used++;
+}
+
+static void
+blacklist_table_free(struct blacklist_table *table)
+{
+    if (!table)
+        return;
+    free(table->filename);
+    free(table->ranges);
+    free(table->hosts.list);
+    free(table->suffixes.list);
+    free(table->pool);
+    free(table);
+}
+
+static unsigned long
+blacklist_table_bytes(const struct blacklist_table *table)
+{
+    return sizeof(*table)
+        + table->ranges_size * sizeof(table->ranges[0])
+        + table->hosts.size * sizeof(table->hosts.list[0])
+        + table->suffixes.size * sizeof(table->suffixes.list[0])
+        + table->pool_size;
+}
+
+static void
+blacklist_add_entry(struct blacklist_load *load, const char *entry, const char *reason)
+{
+    struct blacklist_table *table;
+    struct blacklist_range *range;
+    irc_in_addr_t addr;
+    unsigned long ofs;
+    unsigned int ii;
+    unsigned char bits;
+
+    /* See if the reason string is already known. */
+    table = load->table;
+    ofs = (unsigned long)dict_find(load->reasons, reason, NULL);
+    if (!ofs) {
+        ofs = blacklist_pool_add(table, reason) + 1;
+        dict_insert(load->reasons, strdup(reason), (void*)ofs);
+        table->reasons++;
+    }
+    ofs--;
+
+    if (entry[0] != '*' && irc_pton(&addr, &bits, entry) == strlen(entry)) {
+        /* An address or CIDR range; clear the bits below the prefix. */
+        for (ii = bits; ii < 128; ++ii)
+            addr.in6_8[ii / 8] &= ~(0x80 >> (ii % 8));
+        if (table->ranges_used == table->ranges_size) {
+            table->ranges_size = table->ranges_size ? table->ranges_size * 2 : 64;
+            table->ranges = realloc(table->ranges, table->ranges_size * sizeof(table->ranges[0]));
+        }
+        range = &table->ranges[table->ranges_used++];
+        range->base = addr;
+        range->bits = bits;
+        range->parent = table->lines;
+        range->reason = ofs;
+    } else if (entry[0] == '*' && entry[1] == '.' && entry[2] != '\0')
+        blacklist_names_add(table, &table->suffixes, entry + 2, ofs);
+    else
+        blacklist_names_add(table, &table->hosts, entry, ofs);
+}
+
+static int
+blacklist_range_compare(const void *a_, const void *b_)
+{
+    const struct blacklist_range *a = a_, *b = b_;
+    int res;
+
+    if ((res = memcmp(&a->base, &b->base, sizeof(a->base))))
+        return res;
+    if (a->bits != b->bits)
+        return a->bits - b->bits;
+    return a->parent - b->parent;
+}
+
+/* Sort the ranges (so enclosing ranges come before those inside
+ * them), keep only the last line for any duplicate, and link each
+ * range to the one that most closely encloses it. */
+static void
+blacklist_index_ranges(struct blacklist_table *table)
+{
+    struct blacklist_range *ranges;
+    int stack[129];
+    unsigned int ii, jj, depth;
+
+    ranges = table->ranges;
+    qsort(ranges, table->ranges_used, sizeof(ranges[0]), blacklist_range_compare);
+    for (ii = jj = 0; ii < table->ranges_used; ++ii) {
+        if (jj && ranges[jj-1].bits == ranges[ii].bits
+            && !memcmp(&ranges[jj-1].base, &ranges[ii].base, sizeof(ranges[ii].base)))
+            ranges[jj-1] = ranges[ii];
+        else
+            ranges[jj++] = ranges[ii];
+    }
+    table->ranges_used = jj;
+    for (ii = depth = 0; ii < table->ranges_used; ++ii) {
+        while (depth && !irc_check_mask(&ranges[ii].base, &ranges[stack[depth-1]].base, ranges[stack[depth-1]].bits))
+            depth--;
+        ranges[ii].parent = depth ? stack[depth-1] : -1;
+        stack[depth++] = ii;
+    }
+}
+
+static const char *blacklist_sort_pool;
+
+static int
+blacklist_name_compare(const void *a_, const void *b_)
+{
+    const struct blacklist_name *a = a_, *b = b_;
+    int res;
+
+    if ((res = irccasecmp(blacklist_sort_pool + a->name, blacklist_sort_pool + b->name)))
+        return res;
+    return a->name < b->name ? -1 : a->name > b->name;
+}
+
+static void
+blacklist_index_names(struct blacklist_table *table, struct blacklist_names *names)
+{
+    unsigned int ii, jj;
+
+    /* Names are added in file order, so their pool offsets break
+     * ties and the last duplicate wins. */
+    blacklist_sort_pool = table->pool;
+    qsort(names->list, names->used, sizeof(names->list[0]), blacklist_name_compare);
+    for (ii = jj = 0; ii < names->used; ++ii) {
+        if (jj && !irccasecmp(table->pool + names->list[jj-1].name, table->pool + names->list[ii].name))
+            names->list[jj-1] = names->list[ii];
+        else
+            names->list[jj++] = names->list[ii];
+    }
+    names->used = jj;
+}
+
+static const char *
+blacklist_find_addr(const struct blacklist_table *table, const irc_in_addr_t *addr)
+{
+    const struct blacklist_range *ranges;
+    int lo, hi, mid, found;
+
+    /* Find the last range starting at or before addr; any range that
+     * contains addr is that one or encloses it. */
+    ranges = table->ranges;
+    for (lo = 0, hi = table->ranges_used - 1, found = -1; lo <= hi; ) {
+        mid = (lo + hi) / 2;
+        if (memcmp(&ranges[mid].base, addr, sizeof(*addr)) <= 0) {
+            found = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    for (; found >= 0; found = ranges[found].parent)
+        if (irc_check_mask(addr, &ranges[found].base, ranges[found].bits))
+            return table->pool + ranges[found].reason;
+    return NULL;
+}
+
+static const char *
+blacklist_find_name(const struct blacklist_table *table, const struct blacklist_names *names, const char *name)
+{
+    int lo, hi, mid, res;
+
+    for (lo = 0, hi = names->used - 1; lo <= hi; ) {
+        mid = (lo + hi) / 2;
+        res = irccasecmp(name, table->pool + names->list[mid].name);
+        if (!res)
+            return table->pool + names->list[mid].reason;
+        else if (res < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+static const char *
+blacklist_find_host(const struct blacklist_table *table, const char *host)
+{
+    const char *reason;
+
+    if ((reason = blacklist_find_name(table, &table->hosts, host)))
+        return reason;
+    if (!table->suffixes.used)
+        return NULL;
+    while ((host = strchr(host, '.')))
+        if ((reason = blacklist_find_name(table, &table->suffixes, ++host)))
+            return reason;
+    return NULL;
+}
+
+static void
+blacklist_load_free(struct blacklist_load *load)
+{
+    if (load->file)
+        fclose(load->file);
+    blacklist_table_free(load->table);
+    dict_delete(load->reasons);
+    free(load->default_reason);
+    free(load);
+}
+
+/* Read one line of the file, then index the table a piece at a time. */
+static int
+blacklist_load_step(void *extra)
+{
+    struct blacklist_load *load;
+    const char *reason;
+    char *sep;
+    size_t len;
+    char linebuf[MAXLEN];
+
+    load = extra;
+    switch (load->phase) {
+    case 0:
+        if (!fgets(linebuf, sizeof(linebuf), load->file)) {
+            fclose(load->file);
+            load->file = NULL;
+            load->phase++;
+            return 1;
+        }
+        load->table->lines++;
+
+        /* Trim whitespace from end of line. */
+        len = strlen(linebuf);
+        while (len > 0 && isspace(linebuf[len-1]))
+            linebuf[--len] = '\0';
+        if (len == 0)
+            return 1;
+
+        /* Figure out which reason string we should use. */
+        reason = load->default_reason;
+        sep = strchr(linebuf, ' ');
+        if (sep) {
+            *sep++ = '\0';
+            while (isspace(*sep))
+                sep++;
+            if (*sep != '\0')
+                reason = sep;
+        }
+        blacklist_add_entry(load, linebuf, reason);
+        return 1;
+    case 1:
+        blacklist_index_ranges(load->table);
+        break;
+    case 2:
+        blacklist_index_names(load->table, &load->table->hosts);
+        break;
+    case 3:
+        blacklist_index_names(load->table, &load->table->suffixes);
+        break;
+    default:
+        return 0;
+    }
+    load->phase++;
+    return 1;
+}
+
+static void
+blacklist_load_done(void *extra)
+{
+    struct blacklist_load *load;
+    struct blacklist_table *table;
+    struct timeval stop;
+
+    load = extra;
+    table = load->table;
+    load->table = NULL;
+
+    /* Trim the arrays down to what they hold. */
+    if (table->ranges_used < table->ranges_size) {
+        table->ranges_size = table->ranges_used;
+        table->ranges = realloc(table->ranges, table->ranges_size * sizeof(table->ranges[0]));
+    }
+    if (table->hosts.used < table->hosts.size) {
+        table->hosts.size = table->hosts.used;
+        table->hosts.list = realloc(table->hosts.list, table->hosts.size * sizeof(table->hosts.list[0]));
+    }
+    if (table->suffixes.used < table->suffixes.size) {
+        table->suffixes.size = table->suffixes.used;
+        table->suffixes.list = realloc(table->suffixes.list, table->suffixes.size * sizeof(table->suffixes.list[0]));
+    }
+    if (table->pool_used < table->pool_size) {
+        table->pool_size = table->pool_used;
+        table->pool = realloc(table->pool, table->pool_size);
+    }
+
+    gettimeofday(&stop, NULL);
+    table->load_msec = (stop.tv_sec - load->started.tv_sec) * 1000 + (stop.tv_usec - load->started.tv_usec) / 1000;
+    log_module(bl_log, LOG_INFO, "Loaded %u address ranges, %u hosts and %u wildcard hosts (%lu bytes) from %s in %lums.", table->ranges_used, table->hosts.used, table->suffixes.used, blacklist_table_bytes(table), table->filename, table->load_msec);
+
+    /* Only now does the new table replace the old one. */
+    blacklist_table_free(blacklist_table);
+    blacklist_table = table;
+    blacklist_loading = NULL;
+    blacklist_load_free(load);
+}
+
+static void
+blacklist_load_cancel(void)
+{
+    if (!blacklist_loading)
+        return;
+    sweep_cancel(blacklist_loading->sweep);
+    blacklist_load_free(blacklist_loading);
+    blacklist_loading = NULL;
+}
+
+/* Start loading filename in the background; the current table stays
+ * in use until the new one is complete. */
+static void
+blacklist_load_file(const char *filename, const char *default_reason)
+{
+    struct blacklist_load *load;
+    FILE *file;
+
+    blacklist_load_cancel();
+    if (!filename) {
+        blacklist_table_free(blacklist_table);
+        blacklist_table = NULL;
+        return;
+    }
+    if (!default_reason)
+        default_reason = "client is blacklisted";
+    file = fopen(filename, "r");
+    if (!file) {
+        log_module(bl_log, LOG_ERROR, "Unable to open %s for reading: %s", filename, strerror(errno));
+        return;
+    }
+    log_module(bl_log, LOG_DEBUG, "Loading blacklist from %s.", filename);
+    load = calloc(1, sizeof(*load));
+    load->file = file;
+    load->default_reason = strdup(default_reason);
+    load->reasons = dict_new();
+    dict_set_free_keys(load->reasons, free);
+    load->table = calloc(1, sizeof(*load->table));
+    load->table->filename = strdup(filename);
+    gettimeofday(&load->started, NULL);
+    load->sweep = sweep_job("blacklist", blacklist_load_step, blacklist_load_done, load);
+    sweep_set_slice(load->sweep, 4096, 0);
+    blacklist_loading = load;
+}
+
 static int
-blacklist_check_user(struct userNode *user)
+blacklist_check_user(struct userNode *user, UNUSED_ARG(void *extra))
 {
     static const char *hexdigits = "0123456789abcdef";
     dict_iterator_t it;
@@ -180,12 +623,28 @@ blacklist_check_user(struct userNode *user)
 
     /* Check local file-based blacklist. */
     irc_ntop(ip, sizeof(ip), &user->ip);
-    reason = dict_find(blacklist_hosts, host = ip, NULL);
-    if (reason == NULL) {
-        reason = dict_find(blacklist_hosts, host = user->hostname, NULL);
+    reason = NULL;
+    if (blacklist_table) {
+        struct timeval start, stop;
+        unsigned long usec;
+
+        gettimeofday(&start, NULL);
+        reason = blacklist_find_addr(blacklist_table, &user->ip);
+        host = ip;
+        if (reason == NULL) {
+            reason = blacklist_find_host(blacklist_table, user->hostname);
+            host = user->hostname;
+        }
+        gettimeofday(&stop, NULL);
+        usec = (stop.tv_sec - start.tv_sec) * 1000000 + (stop.tv_usec - start.tv_usec);
+        blacklist_stats.lookups++;
+        blacklist_stats.total_usec += usec;
+        if (usec > blacklist_stats.max_usec)
+            blacklist_stats.max_usec = usec;
     }
     if (reason != NULL) {
         char *target;
+        blacklist_stats.matches++;
         target = alloca(strlen(host) + 3);
         target[0] = '*';
         target[1] = '@';
@@ -227,54 +686,21 @@ blacklist_check_user(struct userNode *user)
     return 0;
 }
 
-static void
-blacklist_load_file(const char *filename, const char *default_reason)
+static MODCMD_FUNC(cmd_stats_blacklist)
 {
-    FILE *file;
-    const char *reason;
-    char *mapped_reason;
-    char *sep;
-    size_t len;
-    char linebuf[MAXLEN];
-
-    if (!filename)
-        return;
-    if (!default_reason)
-        default_reason = "client is blacklisted";
-    file = fopen(filename, "r");
-    if (!file) {
-        log_module(bl_log, LOG_ERROR, "Unable to open %s for reading: %s", filename, strerror(errno));
-        return;
-    }
-    log_module(bl_log, LOG_DEBUG, "Loading blacklist from %s.", filename);
-    while (fgets(linebuf, sizeof(linebuf), file)) {
-        /* Trim whitespace from end of line. */
-        len = strlen(linebuf);
-        while (isspace(linebuf[len-1]))
-            linebuf[--len] = '\0';
-
-        /* Figure out which reason string we should use. */
-        reason = default_reason;
-        sep = strchr(linebuf, ' ');
-        if (sep) {
-            *sep++ = '\0';
-            while (isspace(*sep))
-                sep++;
-            if (*sep != '\0')
-                reason = sep;
-        }
-
-        /* See if the reason string is already known. */
-        mapped_reason = dict_find(blacklist_reasons, reason, NULL);
-        if (!mapped_reason) {
-            mapped_reason = strdup(reason);
-            dict_insert(blacklist_reasons, mapped_reason, (char*)mapped_reason);
-        }
-
-        /* Store the blacklist entry. */
-        dict_insert(blacklist_hosts, strdup(linebuf), mapped_reason);
-    }
-    fclose(file);
+    struct blacklist_table *table;
+    unsigned long avg;
+
+    table = blacklist_table;
+    if (table)
+        reply("BLMSG_STATS_TABLE", table->filename, table->ranges_used, table->hosts.used, table->suffixes.used, table->reasons, blacklist_table_bytes(table), table->load_msec);
+    else
+        reply("BLMSG_STATS_EMPTY");
+    if (blacklist_loading)
+        reply("BLMSG_STATS_LOADING", blacklist_loading->table->filename, blacklist_loading->table->lines);
+    avg = blacklist_stats.lookups ? blacklist_stats.total_usec * 100 / blacklist_stats.lookups : 0;
+    reply("BLMSG_STATS_LOOKUPS", blacklist_stats.lookups, blacklist_stats.matches, avg / 100, avg % 100, blacklist_stats.max_usec);
+    return 1;
 }
 
 static void
@@ -298,17 +724,11 @@ blacklist_conf_read(void)
     blacklist_zones = dict_new();
     dict_set_free_data(blacklist_zones, dnsbl_zone_free);
 
-    dict_delete(blacklist_hosts);
-    blacklist_hosts = dict_new();
-    dict_set_free_keys(blacklist_hosts, free);
-
-    dict_delete(blacklist_reasons);
-    blacklist_reasons = dict_new();
-    dict_set_free_keys(blacklist_reasons, free);
-
     node = conf_get_data("modules/blacklist", RECDB_OBJECT);
-    if (node == NULL)
+    if (node == NULL) {
+        blacklist_load_file(NULL, NULL);
         return;
+    }
 
     str1 = database_get_data(node, "debug_bot", RECDB_QSTRING);
     if (str1)
@@ -386,11 +806,12 @@ blacklist_conf_read(void)
 }
 
 static void
-blacklist_cleanup(void)
+blacklist_cleanup(UNUSED_ARG(void *extra))
 {
     dict_delete(blacklist_zones);
-    dict_delete(blacklist_hosts);
-    dict_delete(blacklist_reasons);
+    blacklist_load_cancel();
+    blacklist_table_free(blacklist_table);
+    blacklist_table = NULL;
 }
 
 int
@@ -398,8 +819,10 @@ blacklist_init(void)
 {
     bl_log = log_register_type("blacklist", "file:blacklist.log");
     conf_register_reload(blacklist_conf_read);
-    reg_new_user_func(blacklist_check_user);
-    reg_exit_func(blacklist_cleanup);
+    reg_new_user_func(blacklist_check_user, NULL);
+    reg_exit_func(blacklist_cleanup, NULL);
+    message_register_table(msgtab);
+    opserv_define_func("STATS BLACKLIST", cmd_stats_blacklist, 0, 0, 0);
     return 1;
 }
 
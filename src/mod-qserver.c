@@ -18,50 +18,461 @@
  * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
  */
 
+#include "chanserv.h"
 #include "conf.h"
 #include "hash.h"
 #include "ioset.h"
 #include "log.h"
 #include "modcmd.h"
+#include "nickserv.h"
 #include "proto.h"
+#include "sar.h"
 
 const char *qserver_module_deps[] = { NULL };
 
-struct qserverClient {
+/* Requests are lines of the form "<tag> <target> [args...]" and may be
+ * pipelined freely; responses come back in request order, one per
+ * request.  By default the target is a service nick, and the service's
+ * replies are relayed between "<tag> S" and "<tag> E" lines.  After
+ * "<tag> MODE JSON", each response is instead a single JSON object on
+ * one line:
+ *
+ *   {"tag":"7","ok":true,"lines":["...","..."]}
+ *   {"tag":"8","ok":false,"error":"unknown target"}
+ *
+ * In JSON mode the targets ACCOUNT, ACCESS, CHANNEL and USER answer
+ * directly from the in-memory indexes with structured fields, without
+ * going through a service or the help text formatter.  COMMANDS
+ * <service|*> reports command timings in microseconds.  Target names
+ * are case sensitive, so they do not clash with service nicks.  These
+ * answers include real hosts, IPs and oper levels, so they are only
+ * given once the connection has sent the configured password. */
+
+/* Connections do not get a user of their own.  A fixed pool of users
+ * is introduced once, and each connection is attached to the least
+ * busy one; since commands run synchronously, replies are routed to
+ * whichever connection the pool user is currently running a command
+ * for.  A pool user that becomes authenticated is kept for the
+ * connection that authenticated it, and replaced once that connection
+ * goes away, so that accounts never leak between connections. */
+struct qserverUser {
     struct userNode *user;
-    struct io_fd *fd;
+    struct qserverClient *current;
     unsigned int id;
+    unsigned int clients;
+    unsigned int tainted : 1;
+};
+
+struct qserverClient {
+    struct qserverUser *pool;
+    struct io_fd *fd;
+    struct sar_request *rdns;
+    struct qserverClient *next;
+    struct qserverClient *prev;
     unsigned int password_ok : 1;
+    unsigned int json : 1;
+    unsigned int lines;
+    char ip[SAR_NTOP_MAX];
 };
 
 static struct log_type *qserver_log;
 static struct io_fd *qserver_listener;
-static struct qserverClient **qserver_clients;
+static struct qserverUser **qserver_users;
+static struct qserverClient *qserver_client_list;
 static dict_t qserver_dict;
-static unsigned int qserver_nbots;
+static unsigned int qserver_nusers;
+static struct string_buffer qserver_out;
 
 static struct {
     const char *password;
+    unsigned int users;
+    unsigned int resolve_hosts : 1;
 } conf;
 
+/* Returns the length of the well-formed UTF-8 sequence starting at
+ * str, or zero if the byte there does not start one. */
+static unsigned int
+qserver_utf8_length(const unsigned char *str)
+{
+    unsigned long cp;
+    unsigned int len, ii;
+
+    if (str[0] < 0xc2)
+        return 0;
+    else if (str[0] < 0xe0)
+        len = 2, cp = str[0] & 0x1f;
+    else if (str[0] < 0xf0)
+        len = 3, cp = str[0] & 0x0f;
+    else if (str[0] < 0xf5)
+        len = 4, cp = str[0] & 0x07;
+    else
+        return 0;
+    for (ii = 1; ii < len; ++ii) {
+        if ((str[ii] & 0xc0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (str[ii] & 0x3f);
+    }
+    if ((len == 3 && (cp < 0x800 || (cp >= 0xd800 && cp < 0xe000)))
+        || (len == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+        return 0;
+    return len;
+}
+
+/* IRC text is not always UTF-8; bytes that are not part of a valid
+ * sequence are taken to be Latin-1 and escaped as such. */
 static void
-qserver_privmsg(struct userNode *user, struct userNode *target, const char *text, UNUSED_ARG(int server_qualified))
+qserver_json_string(struct string_buffer *buf, const char *str_)
+{
+    const unsigned char *str, *run;
+    unsigned int len;
+
+    string_buffer_append(buf, '"');
+    for (run = str = (const unsigned char*)str_; *str; ) {
+        if (*str >= 0x80 && (len = qserver_utf8_length(str))) {
+            str += len;
+            continue;
+        }
+        if (*str >= 0x20 && *str < 0x80 && *str != '"' && *str != '\\') {
+            str++;
+            continue;
+        }
+        string_buffer_append_substring(buf, (const char*)run, str - run);
+        if (*str == '"' || *str == '\\')
+            string_buffer_append_printf(buf, "\\%c", *str);
+        else
+            string_buffer_append_printf(buf, "\\u%04x", *str);
+        run = ++str;
+    }
+    string_buffer_append_substring(buf, (const char*)run, str - run);
+    string_buffer_append(buf, '"');
+}
+
+static void
+qserver_json_field(struct string_buffer *buf, const char *name, const char *value)
+{
+    string_buffer_append_printf(buf, ",\"%s\":", name);
+    if (value)
+        qserver_json_string(buf, value);
+    else
+        string_buffer_append_string(buf, "null");
+}
+
+static void
+qserver_json_number(struct string_buffer *buf, const char *name, unsigned long value)
+{
+    string_buffer_append_printf(buf, ",\"%s\":%lu", name, value);
+}
+
+static void
+qserver_json_start(const char *tag)
+{
+    qserver_out.used = 0;
+    string_buffer_append_string(&qserver_out, "{\"tag\":");
+    qserver_json_string(&qserver_out, tag);
+}
+
+static void
+qserver_json_send(struct qserverClient *client)
+{
+    string_buffer_append_string(&qserver_out, "}\n");
+    ioset_write(client->fd, qserver_out.list, qserver_out.used);
+}
+
+static void
+qserver_error(struct qserverClient *client, const char *tag, const char *error, const char *arg)
+{
+    if (!client->json) {
+        ioset_printf(client->fd, "%s X %s\n", tag, arg);
+        return;
+    }
+    qserver_json_start(tag);
+    string_buffer_append_string(&qserver_out, ",\"ok\":false");
+    qserver_json_field(&qserver_out, "error", error);
+    qserver_json_send(client);
+}
+
+static void
+qserver_relay(struct qserverUser *pool, struct userNode *user, char type, const char *text)
 {
     struct qserverClient *client;
 
-    client = dict_find(qserver_dict, target->nick, NULL);
-    assert(client->user == target);
-    ioset_printf(client->fd, "%s P :%s\n", user->nick, text);
+    if (!(client = pool->current))
+        return;
+    if (!client->json) {
+        ioset_printf(client->fd, "%s %c :%s\n", user->nick, type, text);
+        return;
+    }
+    string_buffer_append_string(&qserver_out, client->lines++ ? "," : ",\"lines\":[");
+    qserver_json_string(&qserver_out, text);
+}
+
+static void
+qserver_privmsg(struct userNode *user, struct userNode *target, const char *text, UNUSED_ARG(int server_qualified))
+{
+    struct qserverUser *pool;
+
+    pool = dict_find(qserver_dict, target->nick, NULL);
+    assert(pool->user == target);
+    qserver_relay(pool, user, 'P', text);
 }
 
 static void
 qserver_notice(struct userNode *user, struct userNode *target, const char *text, UNUSED_ARG(int server_qualified))
+{
+    struct qserverUser *pool;
+
+    pool = dict_find(qserver_dict, target->nick, NULL);
+    assert(pool->user == target);
+    qserver_relay(pool, user, 'N', text);
+}
+
+static void
+qserver_pool_introduce(struct qserverUser *pool)
+{
+    char nick[NICKLEN+1];
+
+    snprintf(nick, sizeof(nick), " QServ%04d", pool->id);
+    pool->user = AddLocalUser(nick, nick+1, "srvx.dummy.user", "qserver dummy user", "*+oi");
+    irc_pton(&pool->user->ip, NULL, "0.0.0.0");
+    dict_insert(qserver_dict, pool->user->nick, pool);
+    reg_privmsg_func(pool->user, qserver_privmsg);
+    reg_notice_func(pool->user, qserver_notice);
+}
+
+static void
+qserver_pool_retire(struct qserverUser *pool, const char *why)
+{
+    dict_remove(qserver_dict, pool->user->nick);
+    DelUser(pool->user, NULL, 0, why);
+    pool->user = NULL;
+}
+
+/* Grows the pool to the configured size, and drops idle users beyond it. */
+static void
+qserver_pool_resize(unsigned int count)
+{
+    unsigned int ii;
+
+    if (count > qserver_nusers) {
+        qserver_users = realloc(qserver_users, count * sizeof(qserver_users[0]));
+        for (ii = qserver_nusers; ii < count; ++ii) {
+            qserver_users[ii] = calloc(1, sizeof(*qserver_users[ii]));
+            qserver_users[ii]->id = ii;
+            qserver_pool_introduce(qserver_users[ii]);
+        }
+        qserver_nusers = count;
+    }
+    while (qserver_nusers > count && !qserver_users[qserver_nusers - 1]->clients) {
+        qserver_pool_retire(qserver_users[--qserver_nusers], "pool shrunk");
+        free(qserver_users[qserver_nusers]);
+    }
+}
+
+static struct qserverUser *
+qserver_pool_pick(void)
+{
+    struct qserverUser *best;
+    unsigned int ii;
+
+    for (ii = 0, best = NULL; ii < qserver_nusers; ++ii) {
+        if (qserver_users[ii]->tainted)
+            continue;
+        if (!best || qserver_users[ii]->clients < best->clients)
+            best = qserver_users[ii];
+    }
+    if (!best) {
+        /* Every pool user belongs to an authenticated connection. */
+        qserver_pool_resize(qserver_nusers + 1);
+        best = qserver_users[qserver_nusers - 1];
+    }
+    return best;
+}
+
+static void
+qserver_attach(struct qserverClient *client, struct qserverUser *pool)
+{
+    if (client->pool)
+        client->pool->clients--;
+    client->pool = pool;
+    pool->clients++;
+}
+
+static void
+qserver_auth(struct userNode *user, UNUSED_ARG(struct handle_info *old_handle), UNUSED_ARG(void *extra))
 {
     struct qserverClient *client;
+    struct qserverUser *pool;
+
+    if (!user->handle_info
+        || !(pool = dict_find(qserver_dict, user->nick, NULL))
+        || (pool->user != user)
+        || !pool->current
+        || pool->tainted)
+        return;
+    pool->tainted = 1;
+    for (client = qserver_client_list; client; client = client->next)
+        if (client->pool == pool && client != pool->current)
+            qserver_attach(client, qserver_pool_pick());
+    log_module(qserver_log, LOG_INFO, "Pool user %s authenticated as %s for connection from %s; reserved until it closes.", user->nick, user->handle_info->handle, pool->current->ip);
+}
+
+/* Native queries.  Each appends its fields to qserver_out and returns
+ * NULL, or returns an error message without touching qserver_out. */
+typedef const char *(*qserver_query_func)(unsigned int argc, char *argv[]);
 
-    client = dict_find(qserver_dict, target->nick, NULL);
-    assert(client->user == target);
-    ioset_printf(client->fd, "%s N :%s\n", user->nick, text);
+static const char *
+qserver_query_account(UNUSED_ARG(unsigned int argc), char *argv[])
+{
+    struct handle_info *hi;
+    struct userNode *user;
+    struct userData *ud;
+    unsigned int ii, count;
+    char flags[sizeof(HANDLE_FLAGS)];
+
+    if (!(hi = get_handle_info(argv[0])))
+        return "no such account";
+    for (ii = count = 0; handle_flags[ii]; ++ii)
+        if (hi->flags & (1 << ii))
+            flags[count++] = handle_flags[ii];
+    flags[count] = '\0';
+    for (ud = hi->channels, count = 0; ud; ud = ud->u_next)
+        count++;
+    qserver_json_field(&qserver_out, "account", hi->handle);
+    qserver_json_number(&qserver_out, "registered", hi->registered);
+    qserver_json_number(&qserver_out, "lastseen", hi->lastseen);
+    qserver_json_number(&qserver_out, "opserv_level", hi->opserv_level);
+    qserver_json_field(&qserver_out, "flags", flags);
+    qserver_json_field(&qserver_out, "epithet", hi->epithet);
+    qserver_json_field(&qserver_out, "fakehost", hi->fakehost);
+    qserver_json_number(&qserver_out, "channels", count);
+    string_buffer_append_string(&qserver_out, ",\"online\":[");
+    for (user = hi->users; user; user = user->next_authed) {
+        qserver_json_string(&qserver_out, user->nick);
+        if (user->next_authed)
+            string_buffer_append(&qserver_out, ',');
+    }
+    string_buffer_append(&qserver_out, ']');
+    return NULL;
+}
+
+static const char *
+qserver_query_access(UNUSED_ARG(unsigned int argc), char *argv[])
+{
+    struct chanNode *channel;
+    struct chanData *cData;
+    struct userData *ud;
+
+    if (!(channel = GetChannel(argv[0])) || !(cData = channel->channel_info))
+        return "channel not registered";
+    qserver_json_field(&qserver_out, "channel", channel->name);
+    qserver_json_number(&qserver_out, "registered", cData->registered);
+    qserver_json_number(&qserver_out, "count", cData->userCount);
+    string_buffer_append_string(&qserver_out, ",\"users\":[");
+    for (ud = cData->users; ud; ud = ud->next) {
+        string_buffer_append_string(&qserver_out, "{\"account\":");
+        qserver_json_string(&qserver_out, ud->handle->handle);
+        qserver_json_number(&qserver_out, "access", ud->access);
+        qserver_json_number(&qserver_out, "seen", ud->present ? (unsigned long)now : (unsigned long)ud->seen);
+        qserver_json_number(&qserver_out, "present", ud->present);
+        string_buffer_append_string(&qserver_out, ud->next ? "}," : "}");
+    }
+    string_buffer_append(&qserver_out, ']');
+    return NULL;
+}
+
+/* Command timings in microseconds, busiest first; "*" for every service. */
+static const char *
+qserver_query_commands(UNUSED_ARG(unsigned int argc), char *argv[])
+{
+    struct svccmd_list commands;
+    struct service *service = NULL;
+    struct svccmd_timing *timing;
+    unsigned int ii;
+
+    if (strcmp(argv[0], "*") && !(service = service_find(argv[0])))
+        return "no such service";
+    svccmd_list_init(&commands);
+    svccmd_list_timed(&commands, service);
+    string_buffer_append_string(&qserver_out, ",\"commands\":[");
+    for (ii = 0; ii < commands.used; ++ii) {
+        timing = commands.list[ii]->timing;
+        string_buffer_append_string(&qserver_out, "{\"service\":");
+        qserver_json_string(&qserver_out, commands.list[ii]->parent->bot->nick);
+        qserver_json_field(&qserver_out, "command", commands.list[ii]->name);
+        qserver_json_number(&qserver_out, "runs", timing->wall.count);
+        qserver_json_number(&qserver_out, "total", (unsigned long)timing->wall.sum);
+        qserver_json_number(&qserver_out, "p50", histogram_percentile(&timing->wall, 0.5));
+        qserver_json_number(&qserver_out, "p90", histogram_percentile(&timing->wall, 0.9));
+        qserver_json_number(&qserver_out, "p99", histogram_percentile(&timing->wall, 0.99));
+        qserver_json_number(&qserver_out, "max", timing->wall.max);
+        qserver_json_number(&qserver_out, "cpu_total", (unsigned long)timing->cpu.sum);
+        qserver_json_number(&qserver_out, "cpu_p99", histogram_percentile(&timing->cpu, 0.99));
+        qserver_json_number(&qserver_out, "slow", timing->slow);
+        string_buffer_append_string(&qserver_out, (ii + 1 < commands.used) ? "}," : "}");
+    }
+    string_buffer_append(&qserver_out, ']');
+    svccmd_list_clean(&commands);
+    return NULL;
+}
+
+static const char *
+qserver_query_channel(UNUSED_ARG(unsigned int argc), char *argv[])
+{
+    struct chanNode *channel;
+
+    if (!(channel = GetChannel(argv[0])))
+        return "no such channel";
+    qserver_json_field(&qserver_out, "channel", channel->name);
+    qserver_json_number(&qserver_out, "created", channel->timestamp);
+    qserver_json_number(&qserver_out, "members", channel->members.used);
+    qserver_json_number(&qserver_out, "bans", channel->banlist.used);
+    qserver_json_field(&qserver_out, "topic", channel->topic);
+    qserver_json_field(&qserver_out, "topic_nick", channel->topic_nick);
+    qserver_json_number(&qserver_out, "topic_time", channel->topic_time);
+    qserver_json_number(&qserver_out, "registered", channel->channel_info ? 1 : 0);
+    return NULL;
+}
+
+static const char *
+qserver_query_user(UNUSED_ARG(unsigned int argc), char *argv[])
+{
+    struct userNode *user;
+
+    if (!(user = GetUserH(argv[0])))
+        return "no such user";
+    qserver_json_field(&qserver_out, "nick", user->nick);
+    qserver_json_field(&qserver_out, "ident", user->ident);
+    qserver_json_field(&qserver_out, "host", user->hostname);
+    qserver_json_field(&qserver_out, "ip", irc_ntoa(&user->ip));
+    qserver_json_field(&qserver_out, "info", user->info);
+    qserver_json_field(&qserver_out, "server", user->uplink->name);
+    qserver_json_field(&qserver_out, "account", user->handle_info ? user->handle_info->handle : NULL);
+    qserver_json_number(&qserver_out, "timestamp", user->timestamp);
+    qserver_json_number(&qserver_out, "oper", IsOper(user) ? 1 : 0);
+    qserver_json_number(&qserver_out, "channels", user->channels.used);
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    qserver_query_func func;
+} qserver_queries[] = {
+    { "ACCESS", qserver_query_access },
+    { "ACCOUNT", qserver_query_account },
+    { "CHANNEL", qserver_query_channel },
+    { "COMMANDS", qserver_query_commands },
+    { "USER", qserver_query_user },
+};
+
+static qserver_query_func
+qserver_find_query(const char *name)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < ArrayLength(qserver_queries); ++ii)
+        if (!strcmp(qserver_queries[ii].name, name))
+            return qserver_queries[ii].func;
+    return NULL;
 }
 
 static void
@@ -69,6 +480,8 @@ qserver_readable(struct io_fd *fd)
 {
     struct qserverClient *client;
     struct service *service;
+    qserver_query_func query;
+    const char *error;
     char *argv[MAXNUMPARAMS];
     unsigned int argc;
     size_t len;
@@ -85,24 +498,70 @@ qserver_readable(struct io_fd *fd)
         return;
     }
     len = strlen(tmpline);
-    while (tmpline[len - 1] == '\r' || tmpline[len - 1] == '\n')
+    while (len > 0 && (tmpline[len - 1] == '\r' || tmpline[len - 1] == '\n'))
         tmpline[--len] = '\0';
     argc = split_line(tmpline, false, ArrayLength(argv), argv);
     if (argc < 3) {
-        ioset_printf(fd, "MISSING_ARGS\n");
+        if (client->json && argc > 0)
+            qserver_error(client, argv[0], "missing arguments", NULL);
+        else
+            ioset_printf(fd, "MISSING_ARGS\n");
         return;
     }
     if (!strcmp(argv[1], "PASS")
         && conf.password
         && !strcmp(argv[2], conf.password)) {
         client->password_ok = 1;
-    } else if ((client->password_ok || !conf.password)
-               && (service = service_find(argv[1])) != NULL) {
-        ioset_printf(fd, "%s S\n", argv[0]);
-        svccmd_invoke_argv(client->user, service, NULL, argc - 2, argv + 2, 1);
-        ioset_printf(fd, "%s E\n", argv[0]);
+        if (client->json) {
+            qserver_json_start(argv[0]);
+            string_buffer_append_string(&qserver_out, ",\"ok\":true");
+            qserver_json_send(client);
+        }
+    } else if (!client->password_ok && conf.password) {
+        qserver_error(client, argv[0], "password required", argv[1]);
+    } else if (!strcmp(argv[1], "MODE")) {
+        if (!irccasecmp(argv[2], "JSON")) {
+            client->json = 1;
+            qserver_json_start(argv[0]);
+            string_buffer_append_string(&qserver_out, ",\"ok\":true");
+            qserver_json_field(&qserver_out, "mode", "json");
+            qserver_json_send(client);
+        } else if (!irccasecmp(argv[2], "LINES")) {
+            client->json = 0;
+            ioset_printf(fd, "%s S\n%s E\n", argv[0], argv[0]);
+        } else {
+            qserver_error(client, argv[0], "unknown mode", argv[2]);
+        }
+    } else if (client->json && (query = qserver_find_query(argv[1]))) {
+        if (!client->password_ok) {
+            qserver_error(client, argv[0], "password required", argv[1]);
+            return;
+        }
+        qserver_json_start(argv[0]);
+        string_buffer_append_string(&qserver_out, ",\"ok\":true");
+        if ((error = query(argc - 2, argv + 2))) {
+            qserver_error(client, argv[0], error, argv[1]);
+            return;
+        }
+        qserver_json_send(client);
+    } else if ((service = service_find(argv[1])) != NULL) {
+        if (client->json) {
+            qserver_json_start(argv[0]);
+            string_buffer_append_string(&qserver_out, ",\"ok\":true");
+            client->lines = 0;
+        } else
+            ioset_printf(fd, "%s S\n", argv[0]);
+        client->pool->current = client;
+        svccmd_invoke_argv(client->pool->user, service, NULL, argc - 2, argv + 2, 1);
+        client->pool->current = NULL;
+        if (!client->json)
+            ioset_printf(fd, "%s E\n", argv[0]);
+        else {
+            string_buffer_append_string(&qserver_out, client->lines ? "]" : ",\"lines\":[]");
+            qserver_json_send(client);
+        }
     } else {
-        ioset_printf(fd, "%s X %s\n", argv[0], argv[1]);
+        qserver_error(client, argv[0], "unknown target", argv[1]);
     }
 }
 
@@ -110,62 +569,68 @@ static void
 qserver_destroy_fd(struct io_fd *fd)
 {
     struct qserverClient *client;
+    struct qserverUser *pool;
 
     client = fd->data;
     assert(client->fd == fd);
-    dict_remove(qserver_dict, client->user->nick);
-    DelUser(client->user, NULL, 0, "client disconnected");
-    qserver_clients[client->id] = NULL;
+    sar_request_abort(client->rdns);
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        qserver_client_list = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    pool = client->pool;
+    pool->clients--;
+    if (pool->tainted && !pool->clients) {
+        qserver_pool_retire(pool, "client disconnected");
+        pool->tainted = 0;
+        qserver_pool_introduce(pool);
+    }
     free(client);
 }
 
+static void
+qserver_resolved(void *ctx, const char *host, UNUSED_ARG(const char *serv), enum sar_errcode errcode)
+{
+    struct qserverClient *client = ctx;
+
+    client->rdns = NULL;
+    if (errcode == SAI_SUCCESS)
+        log_module(qserver_log, LOG_INFO, "Connection from %s (%s) on %s.", host, client->ip, client->pool->user->nick);
+    else
+        log_module(qserver_log, LOG_INFO, "Connection from %s (%s) on %s.", client->ip, sar_strerror(errcode), client->pool->user->nick);
+}
+
 static void
 qserver_accept(UNUSED_ARG(struct io_fd *listener), struct io_fd *fd)
 {
     struct qserverClient *client;
     struct sockaddr_storage ss;
     socklen_t sa_len;
-    unsigned int ii;
-    unsigned int jj;
-    int res;
-    char nick[NICKLEN+1];
-    char host[HOSTLEN+1];
-    char ip[HOSTLEN+1];
 
     client = calloc(1, sizeof(*client));
     fd->data = client;
     fd->line_reads = 1;
     fd->readable_cb = qserver_readable;
     fd->destroy_cb = qserver_destroy_fd;
-
-    for (ii = 0; ii < qserver_nbots; ++ii)
-        if (qserver_clients[ii] == NULL)
-            break;
-    if (ii == qserver_nbots) {
-        qserver_nbots += 8;
-        qserver_clients = realloc(qserver_clients, qserver_nbots * sizeof(qserver_clients[0]));
-        for (jj = ii; jj < qserver_nbots; ++jj)
-            qserver_clients[jj] = NULL;
-    }
-    client->id = ii;
     client->fd = fd;
-    qserver_clients[client->id] = client;
-    snprintf(nick, sizeof(nick), " QServ%04d", client->id);
-    safestrncpy(host, "srvx.dummy.user", sizeof(host));
-    safestrncpy(ip, "0.0.0.0", sizeof(ip));
+    client->next = qserver_client_list;
+    if (qserver_client_list)
+        qserver_client_list->prev = client;
+    qserver_client_list = client;
+    qserver_attach(client, qserver_pool_pick());
+
+    safestrncpy(client->ip, "0.0.0.0", sizeof(client->ip));
     sa_len = sizeof(ss);
-    res = getpeername(fd->fd, (struct sockaddr*)&ss, &sa_len);
-    if (res == 0) {
-        getnameinfo((struct sockaddr*)&ss, sa_len, ip, sizeof(host), NULL, 0, NI_NUMERICHOST);
-        if (getnameinfo((struct sockaddr*)&ss, sa_len, host, sizeof(host), NULL, 0, 0) != 0)
-            safestrncpy(host, ip, sizeof(host));
+    if (getpeername(fd->fd, (struct sockaddr*)&ss, &sa_len) == 0) {
+        sar_ntop(client->ip, sizeof(client->ip), (struct sockaddr*)&ss, sa_len);
+        if (conf.resolve_hosts) {
+            client->rdns = sar_getname((struct sockaddr*)&ss, sa_len, SNI_NAMEREQD, qserver_resolved, client);
+            return;
+        }
     }
-    client->user = AddLocalUser(nick, nick+1, host, "qserver dummy user", "*+oi");
-    irc_pton(&client->user->ip, NULL, ip);
-    dict_insert(qserver_dict, client->user->nick, client);
-
-    reg_privmsg_func(client->user, qserver_privmsg);
-    reg_notice_func(client->user, qserver_notice);
+    log_module(qserver_log, LOG_DEBUG, "Connection from %s on %s.", client->ip, client->pool->user->nick);
 }
 
 static void
@@ -199,6 +664,13 @@ qserver_conf_read(void)
         log_module(qserver_log, LOG_ERROR, "Unable to listen on [%s]:%s", str1 ? str1 : "", str2);
     }
     conf.password = database_get_data(node, "password", RECDB_QSTRING);
+    str1 = database_get_data(node, "users", RECDB_QSTRING);
+    conf.users = str1 ? strtoul(str1, NULL, 0) : 4;
+    if (!conf.users)
+        conf.users = 1;
+    str1 = database_get_data(node, "resolve_hosts", RECDB_QSTRING);
+    conf.resolve_hosts = str1 ? enabled_string(str1) : 0;
+    qserver_pool_resize(conf.users);
     freeaddrinfo(ai);
 }
 
@@ -208,9 +680,17 @@ qserver_cleanup(UNUSED_ARG(void *extra))
     unsigned int ii;
 
     ioset_close(qserver_listener, 1);
-    for (ii = 0; ii < qserver_nbots; ++ii)
-        if (qserver_clients[ii])
-            DelUser(qserver_clients[ii]->user, NULL, 0, "module finalizing");
+    for (ii = 0; ii < qserver_nusers; ++ii)
+        qserver_users[ii]->tainted = 0;
+    while (qserver_client_list)
+        ioset_close(qserver_client_list->fd, 1);
+    for (ii = 0; ii < qserver_nusers; ++ii) {
+        if (qserver_users[ii]->user)
+            DelUser(qserver_users[ii]->user, NULL, 0, "module finalizing");
+        free(qserver_users[ii]);
+    }
+    free(qserver_users);
+    free(qserver_out.list);
     dict_delete(qserver_dict);
 }
 
@@ -220,6 +700,7 @@ qserver_init(void)
     qserver_log = log_register_type("QServer", "file:qserver.log");
     conf_register_reload(qserver_conf_read);
     qserver_dict = dict_new();
+    reg_auth_func(qserver_auth, NULL);
     reg_exit_func(qserver_cleanup, NULL);
     return 1;
 }
@@ -20,10 +20,16 @@
 
 #include "conf.h"
 #include "gline.h"
+#include "heap.h"
 #include "ioset.h"
+#include "metrics.h"
 #include "modcmd.h"
+#include "saxdb.h"
 #include "timeq.h"
 
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
@@ -43,6 +49,10 @@
 #define SOCKCHECK_DEBUG 0
 #endif
 #define SOCKCHECK_TEST_DB "sockcheck.conf"
+#define SOCKCHECK_MAX_PARALLEL 16
+#define SOCKCHECK_WAIT_SAMPLES 1024
+
+#define KEY_CACHED_HOSTS "hosts"
 
 enum sockcheck_decision {
     CHECKING,
@@ -52,24 +62,58 @@ enum sockcheck_decision {
 
 typedef struct {
     irc_in_addr_t addr;
-    const char *reason;
+    char *reason;
     time_t last_touched;
+    time_t expires;
     enum sockcheck_decision decision;
     char hostname[IRC_NTOP_MAX_SIZE]; /* acts as key for checked_ip_dict */
 } *sockcheck_cache_info;
 
-DECLARE_LIST(sci_list, sockcheck_cache_info);
-DEFINE_LIST(sci_list, sockcheck_cache_info)
-
-/* Here's the list of hosts that need to be started on.
+/* Here are the hosts that need to be started on.  Users who just
+ * connected go in the live lane, which is always served first; users
+ * seen in a burst (if scanned at all) wait in the burst lane.  Each
+ * lane is a ring buffer holding at most max_queue hosts; anything
+ * past that is dropped and counted.
  */
-static struct sci_list pending_sci_list;
+enum sockcheck_lane {
+    LANE_LIVE,
+    LANE_BURST,
+    LANE_COUNT
+};
+
+struct sockcheck_pending {
+    sockcheck_cache_info sci;
+    unsigned long queued; /* msec */
+};
+
+struct sockcheck_queue {
+    struct sockcheck_pending *list;
+    unsigned int size, head, used;
+    unsigned long dropped;
+};
+
+static struct sockcheck_queue pending_queue[LANE_COUNT];
 
 /* Map of previously checked IPs state (if we've accepted the address yet).
  * The data for each entry is a pointer to a sockcheck_cache_info.
  */
 static dict_t checked_ip_dict;
 
+/* Decided hosts are queued by hostname in cache_expiry_heap, keyed by
+ * the time their decision lapses, and one timeq entry is kept for the
+ * earliest.  Entries that were uncached or rescanned in the meantime
+ * are left in the heap; sockcheck_expire_cache() checks the dict
+ * before removing anything. */
+static heap_t cache_expiry_heap;
+static time_t cache_expiry_next;
+
+static struct {
+    unsigned long accepted;
+    unsigned long rejected;
+    unsigned long checking;
+    unsigned long misses;
+} cache_stats;
+
 /* Each sockcheck template is formed as a Mealy state machine (that is,
  * the output on a state transition is a function of both the current
  * state and the input).  Mealy state machines require fewer states to
@@ -110,12 +154,29 @@ struct sockcheck_list {
  */
 static struct sockcheck_list *tests;
 
-/* Stuff to track client state, one instance per open connection. */
+/* One host being checked.  Its tests are dealt out round-robin to up
+ * to max_parallel_tests probes, which run at the same time.  The host
+ * is decided as soon as one probe rejects it, or when every probe has
+ * accepted; probes still running after that finish their current test
+ * and stop.
+ */
+struct sockcheck_host {
+    sockcheck_cache_info addr; /* NULL once decided */
+    irc_in_addr_t ip;
+    char hostname[IRC_NTOP_MAX_SIZE];
+    struct sockcheck_list *tests;
+    unsigned int client_index;
+    unsigned int stride;
+    unsigned int running;
+    struct sockcheck_client *probes[SOCKCHECK_MAX_PARALLEL];
+};
+
+/* Stuff to track probe state, one instance per open connection. */
 struct sockcheck_client {
     struct io_fd *fd;
+    struct sockcheck_host *host;
     struct sockcheck_list *tests;
-    sockcheck_cache_info addr;
-    unsigned int client_index;
+    unsigned int probe_index;
     unsigned int test_index;
     unsigned short test_rep;
     struct sockcheck_state *state;
@@ -126,6 +187,9 @@ struct sockcheck_client {
 
 static struct {
     unsigned int max_clients;
+    unsigned int max_parallel_tests;
+    unsigned int max_queue;
+    unsigned int scan_bursts;
     unsigned int max_read;
     unsigned int gline_duration;
     unsigned int max_cache_age;
@@ -133,9 +197,16 @@ static struct {
     int local_addr_len;
 } sockcheck_conf;
 
-static unsigned int sockcheck_num_clients;
-static struct sockcheck_client **client_list;
+static unsigned int sockcheck_num_clients, client_slots;
+static struct sockcheck_host **client_list;
 static unsigned int proxies_detected, checked_ip_count;
+
+/* How long recent hosts waited in the queue, and how many hosts were
+ * finished in each of the last 60 seconds. */
+static unsigned long wait_samples[SOCKCHECK_WAIT_SAMPLES];
+static unsigned int wait_next, wait_count;
+static unsigned int scan_counts[60];
+static time_t scan_stamps[60];
 static struct module *sockcheck_module;
 static struct log_type *PC_LOG;
 const char *sockcheck_module_deps[] = { NULL };
@@ -156,6 +227,10 @@ static const struct message_entry msgtab[] = {
     { "PCMSG_STATUS_REJECTED", "IP %s proxycheck state: last touched %s ago, rejected: %s" },
     { "PCMSG_STATUS_UNKNOWN", "IP %s proxycheck state: last touched %s ago, invalid status" },
     { "PCMSG_STATISTICS", "Since booting, I have checked %d clients for illicit proxies, and detected %d proxy hosts.\nI am currently checking %d clients (out of %d max) and have a backlog of %d more to start on.\nI currently have %d hosts cached.\nI know how to detect %d kinds of proxies." },
+    { "PCMSG_STATISTICS_QUEUE", "Queued: %u live and %u burst hosts (at most %u each); dropped %lu live and %lu burst hosts." },
+    { "PCMSG_STATISTICS_WAIT", "Queue wait over the last %u hosts: median %lums, 90th percentile %lums, 99th percentile %lums, max %lums." },
+    { "PCMSG_STATISTICS_CACHE", "Cache lookups: %lu accepted and %lu rejected hits, %lu already checking, %lu misses (%u%% hit rate); accepts are cached for %s." },
+    { "PCMSG_STATISTICS_RATE", "Finished %u hosts in the last minute (%u.%02u per second), %u tests at a time per host." },
     { NULL, NULL }
 };
 
@@ -210,14 +285,75 @@ sockcheck_issue_gline(sockcheck_cache_info sci)
 
 }
 
+static void
+sockcheck_free_sci(void *data)
+{
+    sockcheck_cache_info sci = data;
+    free(sci->reason);
+    free(sci);
+}
+
+static void sockcheck_expire_cache(void *data);
+
+static void
+sockcheck_cache_schedule(void)
+{
+    void *key;
+
+    if (!heap_size(cache_expiry_heap))
+        return;
+    heap_peek(cache_expiry_heap, &key, NULL);
+    if (cache_expiry_next && cache_expiry_next <= (time_t)key)
+        return;
+    if (cache_expiry_next)
+        timeq_del(cache_expiry_next, sockcheck_expire_cache, NULL, 0);
+    cache_expiry_next = (time_t)key;
+    timeq_add(cache_expiry_next, sockcheck_expire_cache, NULL);
+}
+
+static void
+sockcheck_cache_add(sockcheck_cache_info sci)
+{
+    heap_insert(cache_expiry_heap, (void*)sci->expires, strdup(sci->hostname));
+    sockcheck_cache_schedule();
+}
+
+static void
+sockcheck_expire_cache(UNUSED_ARG(void *data))
+{
+    sockcheck_cache_info sci;
+    char *hostname;
+    void *key;
+
+    cache_expiry_next = 0;
+    while (heap_size(cache_expiry_heap)) {
+        heap_peek(cache_expiry_heap, &key, (void**)&hostname);
+        if ((time_t)key > now)
+            break;
+        heap_pop(cache_expiry_heap);
+        /* Hosts still being checked or queued belong to their probes. */
+        sci = dict_find(checked_ip_dict, hostname, NULL);
+        if (sci && (sci->decision != CHECKING) && (sci->expires <= now)) {
+            if (SOCKCHECK_DEBUG) {
+                log_module(PC_LOG, LOG_INFO, " .. nuking %s (last touched "FMT_TIME_T").", sci->hostname, sci->last_touched);
+            }
+            dict_remove(checked_ip_dict, hostname);
+        }
+        free(hostname);
+    }
+    sockcheck_cache_schedule();
+}
+
 static struct sockcheck_client *
-sockcheck_alloc_client(sockcheck_cache_info sci)
+sockcheck_alloc_client(struct sockcheck_host *host, unsigned int probe_index)
 {
     struct sockcheck_client *client;
     client = calloc(1, sizeof(*client));
-    client->tests = tests;
+    client->tests = host->tests;
     client->tests->refs++;
-    client->addr = sci;
+    client->host = host;
+    client->probe_index = probe_index;
+    client->test_index = probe_index;
     client->read_size = sockcheck_conf.max_read;
     client->read = malloc(client->read_size);
     client->resp_state = malloc(max_responses * sizeof(client->resp_state[0]));
@@ -228,11 +364,12 @@ static void
 sockcheck_free_client(struct sockcheck_client *client)
 {
     if (SOCKCHECK_DEBUG) {
-        log_module(PC_LOG, LOG_INFO, "Goodbye %s (%p)!  I set you free!", client->addr->hostname, (void*)client);
+        log_module(PC_LOG, LOG_INFO, "Goodbye %s (%p)!  I set you free!", client->host->hostname, (void*)client);
     }
     verify(client);
     ioset_close(client->fd, 1);
     client->fd = NULL;
+    client->host->probes[client->probe_index] = NULL;
     sockcheck_list_unref(client->tests);
     free(client->read);
     free(client->resp_state);
@@ -248,7 +385,7 @@ sockcheck_timeout_client(void *data)
 {
     struct sockcheck_client *client = data;
     if (SOCKCHECK_DEBUG) {
-        log_module(PC_LOG, LOG_INFO, "Client %s timed out.", client->addr->hostname);
+        log_module(PC_LOG, LOG_INFO, "Client %s timed out.", client->host->hostname);
     }
     verify(client);
     sockcheck_advance(client, client->state->responses.used-1);
@@ -258,12 +395,11 @@ static void
 sockcheck_print_client(const struct sockcheck_client *client)
 {
     static const char *decs[] = {"CHECKING", "ACCEPT", "REJECT"};
-    log_module(PC_LOG, LOG_INFO, "client %p: { addr = %p { decision = %s; last_touched = "FMT_TIME_T"; reason = %s; hostname = \"%s\" }; "
-        "test_index = %d; state = %p { port = %d; type = %s; template = \"%s\"; ... }; "
+    log_module(PC_LOG, LOG_INFO, "client %p: { host = %p { addr = %p; hostname = \"%s\"; running = %d }; "
+        "probe_index = %d; test_index = %d; state = %p { port = %d; type = %s; template = \"%s\"; ... }; "
         "fd = %p(%d); read = %p; read_size = %d; read_used = %d; read_pos = %d; }",
-        (void*)client, (void*)client->addr, decs[client->addr->decision], client->addr->last_touched,
-        client->addr->reason, client->addr->hostname,
-        client->test_index, (void*)client->state,
+        (void*)client, (void*)client->host, (void*)client->host->addr, client->host->hostname,
+        client->host->running, client->probe_index, client->test_index, (void*)client->state,
         (client->state ? client->state->port : 0),
         (client->state ? decs[client->state->type] : "N/A"),
         (client->state ? client->state->template : "N/A"),
@@ -294,11 +430,11 @@ expand_var(const struct sockcheck_client *client, char var, char **p_expansion,
     /* expand variable */
     switch (var) {
     case 'c':
-        expansion = client->addr->hostname;
+        expansion = client->host->hostname;
         exp_length = strlen(expansion);
         break;
     case 'i':
-        exp4 = client->addr->addr.in6_32[3];
+        exp4 = client->host->ip.in6_32[3];
 	exp_length = sizeof(exp4);
 	expansion = (char*)&exp4;
 	break;
@@ -415,32 +551,49 @@ sockcheck_elaborate_state(struct sockcheck_client *client)
     }
     timeq_add(now + client->state->timeout, sockcheck_timeout_client, client);
     if (SOCKCHECK_DEBUG) {
-        log_module(PC_LOG, LOG_INFO, "Elaborated state for %s:", client->addr->hostname);
+        log_module(PC_LOG, LOG_INFO, "Elaborated state for %s:", client->host->hostname);
         sockcheck_print_client(client);
     }
 }
 
+static void
+sockcheck_count_scan(void)
+{
+    unsigned int slot = now % ArrayLength(scan_counts);
+
+    if (scan_stamps[slot] != now) {
+        scan_stamps[slot] = now;
+        scan_counts[slot] = 0;
+    }
+    scan_counts[slot]++;
+}
+
 static void
 sockcheck_decide(struct sockcheck_client *client, enum sockcheck_decision decision)
 {
+    struct sockcheck_host *host = client->host;
+    sockcheck_cache_info sci = host->addr;
     unsigned int n;
 
-    checked_ip_count++;
-    client->addr->decision = decision;
-    client->addr->last_touched = now;
     switch (decision) {
     case ACCEPT:
-	/* do nothing */
-        if (SOCKCHECK_DEBUG) {
-            log_module(PC_LOG, LOG_INFO, "Proxy check passed for client at %s.", client->addr->hostname);
-        }
+        /* This probe ran out of tests; the host passes once all have. */
         break;
     case REJECT:
-	client->addr->reason = client->state->template;
+        if (!sci)
+            break;
+        checked_ip_count++;
+        sockcheck_count_scan();
+        sci->decision = REJECT;
+        sci->last_touched = now;
+        sci->expires = now + sockcheck_conf.gline_duration;
+        sci->reason = strdup(client->state->template);
+        sockcheck_cache_add(sci);
 	proxies_detected++;
-	sockcheck_issue_gline(client->addr);
+	sockcheck_issue_gline(sci);
+        host->addr = NULL;
         if (SOCKCHECK_DEBUG) {
-            log_module(PC_LOG, LOG_INFO, "Proxy check rejects client at %s (%s)", client->addr->hostname, client->addr->reason);
+            log_module(PC_LOG, LOG_INFO, "Proxy check rejects client at %s (%s)", host->hostname, sci->reason);
         }
 	/* Don't compare test_index != 0 directly, because somebody
 	 * else may have reordered the tests already. */
@@ -455,16 +608,28 @@ sockcheck_decide(struct sockcheck_client *client, enum sockcheck_decision decisi
 	}
         break;
     default:
-	log_module(PC_LOG, LOG_ERROR, "BUG: sockcheck_decide(\"%s\", %d): unrecognized decision.", client->addr->hostname, decision);
+	log_module(PC_LOG, LOG_ERROR, "BUG: sockcheck_decide(\"%s\", %d): unrecognized decision.", host->hostname, decision);
     }
-    n = client->client_index;
     sockcheck_free_client(client);
-    if ((--sockcheck_num_clients < sockcheck_conf.max_clients)
-        && (pending_sci_list.used > 0)) {
-        sockcheck_start_client(n);
-    } else {
-        client_list[n] = 0;
+    if (--host->running > 0)
+        return;
+    if ((sci = host->addr)) {
+        checked_ip_count++;
+        sockcheck_count_scan();
+        sci->decision = ACCEPT;
+        sci->last_touched = now;
+        sci->expires = now + sockcheck_conf.max_cache_age;
+        sockcheck_cache_add(sci);
+        if (SOCKCHECK_DEBUG) {
+            log_module(PC_LOG, LOG_INFO, "Proxy check passed for client at %s.", host->hostname);
+        }
     }
+    n = host->client_index;
+    sockcheck_list_unref(host->tests);
+    free(host);
+    client_list[n] = 0;
+    if (--sockcheck_num_clients < sockcheck_conf.max_clients)
+        sockcheck_start_client(n);
 }
 
 static void
@@ -478,7 +643,7 @@ sockcheck_advance(struct sockcheck_client *client, unsigned int next_state)
         unsigned int n, m;
         char buffer[201];
         static const char *hexmap = "0123456789ABCDEF";
-	log_module(PC_LOG, LOG_INFO, "sockcheck_advance(%s) following response %d (type %d) of %d.", client->addr->hostname, next_state, client->state->responses.list[next_state]->next->type, client->state->responses.used);
+	log_module(PC_LOG, LOG_INFO, "sockcheck_advance(%s) following response %d (type %d) of %d.", client->host->hostname, next_state, client->state->responses.list[next_state]->next->type, client->state->responses.used);
 	for (n=0; n<client->read_used; n++) {
 	    for (m=0; (m<(sizeof(buffer)-1)>>1) && ((n+m) < client->read_used); m++) {
 		buffer[m << 1] = hexmap[client->read[n+m] >> 4];
@@ -502,7 +667,7 @@ sockcheck_advance(struct sockcheck_client *client, unsigned int next_state)
     case ACCEPT:
         if (++client->test_rep < client->tests->list[client->test_index]->reps) {
             sockcheck_begin_test(client);
-        } else if (++client->test_index < client->tests->used) {
+        } else if ((client->test_index += client->host->stride) < client->tests->used) {
             client->test_rep = 0;
             sockcheck_begin_test(client);
         } else {
@@ -528,7 +693,7 @@ sockcheck_readable(struct io_fd *fd)
     if (res < 0) {
         switch (res = errno) {
         default:
-	    log_module(PC_LOG, LOG_ERROR, "BUG: sockcheck_readable(%d/%s): read() returned errno %d (%s)", fd->fd, client->addr->hostname, errno, strerror(errno));
+	    log_module(PC_LOG, LOG_ERROR, "BUG: sockcheck_readable(%d/%s): read() returned errno %d (%s)", fd->fd, client->host->hostname, errno, strerror(errno));
         case EAGAIN:
             return;
         case ECONNRESET:
@@ -619,7 +784,7 @@ sockcheck_readable(struct io_fd *fd)
     if (client->read_used >= client->read_size) {
 	/* we got more data than we expected to get .. don't read any more */
         if (SOCKCHECK_DEBUG) {
-            log_module(PC_LOG, LOG_INFO, "Buffer filled (unmatched) for client %s", client->addr->hostname);
+            log_module(PC_LOG, LOG_INFO, "Buffer filled (unmatched) for client %s", client->host->hostname);
         }
         sockcheck_advance(client, client->state->responses.used-1);
 	return;
@@ -634,19 +799,19 @@ sockcheck_connected(struct io_fd *fd, int rc)
     client->fd = fd;
     switch (rc) {
     default:
-        log_module(PC_LOG, LOG_ERROR, "BUG: connect() got error %d (%s) for client at %s.", rc, strerror(rc), client->addr->hostname);
+        log_module(PC_LOG, LOG_ERROR, "BUG: connect() got error %d (%s) for client at %s.", rc, strerror(rc), client->host->hostname);
     case EHOSTUNREACH:
     case ECONNREFUSED:
     case ETIMEDOUT:
         if (SOCKCHECK_DEBUG) {
-            log_module(PC_LOG, LOG_INFO, "Client %s gave us errno %d (%s)", client->addr->hostname, rc, strerror(rc));
+            log_module(PC_LOG, LOG_INFO, "Client %s gave us errno %d (%s)", client->host->hostname, rc, strerror(rc));
         }
         sockcheck_advance(client, client->state->responses.used-1);
         return;
     case 0: break;
     }
     if (SOCKCHECK_DEBUG) {
-        log_module(PC_LOG, LOG_INFO, "Connected: to %s port %d.", client->addr->hostname, client->state->port);
+        log_module(PC_LOG, LOG_INFO, "Connected: to %s port %d.", client->host->hostname, client->state->port);
     }
     sockcheck_elaborate_state(client);
 }
@@ -659,67 +824,152 @@ sockcheck_begin_test(struct sockcheck_client *client)
     verify(client);
     ioset_close(client->fd, 1);
     client->fd = NULL;
-    do {
+    /* Another probe already decided this host. */
+    if (!client->host->addr) {
+        sockcheck_decide(client, ACCEPT);
+        return;
+    }
+    while (client->test_index < client->tests->used) {
         client->state = client->tests->list[client->test_index];
         client->read_pos = 0;
         client->read_used = 0;
-        io_fd = ioset_connect(sockcheck_conf.local_addr, sockcheck_conf.local_addr_len, client->addr->hostname, client->state->port, 0, client, sockcheck_connected);
+        io_fd = ioset_connect(sockcheck_conf.local_addr, sockcheck_conf.local_addr_len, client->host->hostname, client->state->port, 0, client, sockcheck_connected);
         client->fd = io_fd;
         if (!io_fd) {
-            client->test_index++;
+            client->test_index += client->host->stride;
             continue;
         }
         io_fd->readable_cb = sockcheck_readable;
         timeq_add(now + client->state->timeout, sockcheck_timeout_client, client);
         if (SOCKCHECK_DEBUG) {
-            log_module(PC_LOG, LOG_INFO, "Starting proxy check on %s:%d (test %d) with fd %d (%p).", client->addr->hostname, client->state->port, client->test_index, io_fd->fd, (void*)io_fd);
+            log_module(PC_LOG, LOG_INFO, "Starting proxy check on %s:%d (test %d) with fd %d (%p).", client->host->hostname, client->state->port, client->test_index, io_fd->fd, (void*)io_fd);
         }
         return;
-    } while (client->test_index < client->tests->used);
+    }
     /* Ran out of tests to run; accept this client. */
     sockcheck_decide(client, ACCEPT);
 }
 
+static unsigned long
+sockcheck_msec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int
+sockcheck_queue_push(struct sockcheck_queue *queue, sockcheck_cache_info sci)
+{
+    struct sockcheck_pending *list;
+    unsigned int size, nn;
+
+    if (queue->used >= sockcheck_conf.max_queue) {
+        queue->dropped++;
+        return 0;
+    }
+    if (queue->used == queue->size) {
+        size = queue->size ? queue->size << 1 : 64;
+        list = malloc(size * sizeof(list[0]));
+        for (nn = 0; nn < queue->used; nn++)
+            list[nn] = queue->list[(queue->head + nn) % queue->size];
+        free(queue->list);
+        queue->list = list;
+        queue->size = size;
+        queue->head = 0;
+    }
+    nn = (queue->head + queue->used++) % queue->size;
+    queue->list[nn].sci = sci;
+    queue->list[nn].queued = sockcheck_msec();
+    return 1;
+}
+
+static int
+sockcheck_queue_pop(struct sockcheck_pending *item)
+{
+    struct sockcheck_queue *queue;
+    unsigned int lane;
+
+    for (lane = 0; lane < LANE_COUNT; lane++) {
+        queue = &pending_queue[lane];
+        if (!queue->used)
+            continue;
+        *item = queue->list[queue->head];
+        queue->head = (queue->head + 1) % queue->size;
+        queue->used--;
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned int
+sockcheck_queue_length(void)
+{
+    unsigned int lane, count;
+    for (lane = count = 0; lane < LANE_COUNT; lane++)
+        count += pending_queue[lane].used;
+    return count;
+}
+
 static void
 sockcheck_start_client(unsigned int idx)
 {
+    struct sockcheck_client *probes[SOCKCHECK_MAX_PARALLEL];
+    struct sockcheck_pending item;
+    struct sockcheck_host *host;
     sockcheck_cache_info sci;
-    struct sockcheck_client *client;
-
-    if (pending_sci_list.used == 0) return;
-    if (!(sci = pending_sci_list.list[0])) {
-        log_module(PC_LOG, LOG_ERROR, "BUG: sockcheck_start_client(%d) found null pointer in pending_sci_list.", idx);
-        return;
-    }
-    memmove(pending_sci_list.list, pending_sci_list.list+1,
-	    (--pending_sci_list.used)*sizeof(pending_sci_list.list[0]));
+    unsigned int nn, stride;
+
+    if (!tests || !sockcheck_queue_pop(&item)) return;
+    sci = item.sci;
+    wait_samples[wait_next] = sockcheck_msec() - item.queued;
+    wait_next = (wait_next + 1) % SOCKCHECK_WAIT_SAMPLES;
+    if (wait_count < SOCKCHECK_WAIT_SAMPLES)
+        wait_count++;
     sockcheck_num_clients++;
-    if (!tests) return;
-    client = client_list[idx] = sockcheck_alloc_client(sci);
-    log_module(PC_LOG, LOG_INFO, "Proxy-checking client at %s as client %d (%p) of %d.", sci->hostname, idx, (void*)client, sockcheck_num_clients);
-    client->test_rep = 0;
-    client->client_index = idx;
-    sockcheck_begin_test(client);
+    stride = sockcheck_conf.max_parallel_tests;
+    if (stride > tests->used)
+        stride = tests->used;
+    host = client_list[idx] = calloc(1, sizeof(*host));
+    host->addr = sci;
+    host->ip = sci->addr;
+    safestrncpy(host->hostname, sci->hostname, sizeof(host->hostname));
+    host->tests = tests;
+    host->tests->refs++;
+    host->client_index = idx;
+    host->stride = stride;
+    host->running = stride;
+    log_module(PC_LOG, LOG_INFO, "Proxy-checking client at %s as client %d (%p) of %d.", sci->hostname, idx, (void*)host, sockcheck_num_clients);
+    for (nn = 0; nn < stride; nn++)
+        probes[nn] = host->probes[nn] = sockcheck_alloc_client(host, nn);
+    /* The last probe to finish frees the host, perhaps right away. */
+    for (nn = 0; nn < stride; nn++)
+        sockcheck_begin_test(probes[nn]);
 }
 
 void
-sockcheck_queue_address(irc_in_addr_t addr)
+sockcheck_queue_address(irc_in_addr_t addr, enum sockcheck_lane lane)
 {
     sockcheck_cache_info sci;
     const char *ipstr = irc_ntoa(&addr);
-
+    unsigned int idx;
     sci = dict_find(checked_ip_dict, ipstr, NULL);
     if (sci) {
         verify(sci);
         switch (sci->decision) {
         case CHECKING:
             /* We are already checking this host. */
+            cache_stats.checking++;
             return;
         case ACCEPT:
-            if ((sci->last_touched + sockcheck_conf.max_cache_age) >= (unsigned)now) return;
+            if (sci->expires > now) {
+                cache_stats.accepted++;
+                return;
+            }
             break;
         case REJECT:
-            if ((sci->last_touched + sockcheck_conf.gline_duration) >= (unsigned)now) {
+            if (sci->expires > now) {
+                cache_stats.rejected++;
                 sockcheck_issue_gline(sci);
                 return;
             }
@@ -727,16 +977,23 @@ sockcheck_queue_address(irc_in_addr_t addr)
         }
         dict_remove(checked_ip_dict, sci->hostname);
     }
+    cache_stats.misses++;
     sci = calloc(1, sizeof(*sci));
     sci->decision = CHECKING;
     sci->last_touched = now;
     sci->reason = NULL;
     sci->addr = addr;
     strncpy(sci->hostname, ipstr, sizeof(sci->hostname));
+    if (!sockcheck_queue_push(&pending_queue[lane], sci)) {
+        free(sci);
+        return;
+    }
     dict_insert(checked_ip_dict, sci->hostname, sci);
-    sci_list_append(&pending_sci_list, sci);
-    if (sockcheck_num_clients < sockcheck_conf.max_clients)
-        sockcheck_start_client(sockcheck_num_clients);
+    if (sockcheck_num_clients < sockcheck_conf.max_clients) {
+        for (idx = 0; idx < client_slots && client_list[idx]; idx++) ;
+        if (idx < client_slots)
+            sockcheck_start_client(idx);
+    }
 }
 
 int
@@ -928,18 +1185,40 @@ sockcheck_add_test(const char *desc)
 static void
 sockcheck_shutdown(UNUSED_ARG(void *extra))
 {
-    unsigned int n;
+    struct sockcheck_host *host;
+    unsigned int n, m;
 
     if (client_list) {
-        for (n=0; n<sockcheck_conf.max_clients; n++) {
-            if (client_list[n])
-                sockcheck_free_client(client_list[n]);
+        for (n=0; n<client_slots; n++) {
+            if (!(host = client_list[n]))
+                continue;
+            for (m=0; m<host->stride; m++) {
+                if (host->probes[m]) {
+                    timeq_del(0, sockcheck_timeout_client, host->probes[m], TIMEQ_IGNORE_WHEN);
+                    sockcheck_free_client(host->probes[m]);
+                }
+            }
+            sockcheck_list_unref(host->tests);
+            free(host);
         }
         free(client_list);
     }
     sockcheck_num_clients = 0;
     dict_delete(checked_ip_dict);
-    sci_list_clean(&pending_sci_list);
+    if (cache_expiry_next)
+        timeq_del(cache_expiry_next, sockcheck_expire_cache, NULL, 0);
+    cache_expiry_next = 0;
+    while (heap_size(cache_expiry_heap)) {
+        char *hostname;
+        heap_peek(cache_expiry_heap, NULL, (void**)&hostname);
+        heap_pop(cache_expiry_heap);
+        free(hostname);
+    }
+    heap_delete(cache_expiry_heap);
+    for (n=0; n<LANE_COUNT; n++) {
+        free(pending_queue[n].list);
+        memset(&pending_queue[n], 0, sizeof(pending_queue[n]));
+    }
     if (tests)
 	for (n=0; n<tests->used; n++)
 	    sockcheck_free_state(tests->list[n]);
@@ -950,53 +1229,6 @@ sockcheck_shutdown(UNUSED_ARG(void *extra))
     }
 }
 
-static void
-sockcheck_clean_cache(UNUSED_ARG(void *data))
-{
-    dict_t curr_clients;
-    dict_iterator_t it, next;
-    sockcheck_cache_info sci;
-    unsigned int nn;
-    int max_age;
-
-    if (SOCKCHECK_DEBUG) {
-        struct string_buffer sb;
-        string_buffer_init(&sb);
-        /* Remember which clients we're still checking; we're not allowed to remove them. */
-        for (curr_clients = dict_new(), nn=0; nn < sockcheck_conf.max_clients; nn++) {
-            if (!client_list[nn])
-                continue;
-            dict_insert(curr_clients, client_list[nn]->addr->hostname, client_list[nn]);
-            string_buffer_append(&sb, ' ');
-            string_buffer_append_string(&sb, client_list[nn]->addr->hostname);
-        }
-        string_buffer_append(&sb, '\0');
-        log_module(PC_LOG, LOG_INFO, "Cleaning sockcheck cache at "FMT_TIME_T"; current clients: %s.", now, sb.list);
-        string_buffer_clean(&sb);
-    } else {
-        for (curr_clients = dict_new(), nn=0; nn < sockcheck_conf.max_clients; nn++) {
-            if (!client_list[nn])
-                continue;
-            dict_insert(curr_clients, client_list[nn]->addr->hostname, client_list[nn]);
-        }
-    }
-
-    for (it=dict_first(checked_ip_dict); it; it=next) {
-        next = iter_next(it);
-        sci = iter_data(it);
-        max_age = (sci->decision == REJECT) ? sockcheck_conf.gline_duration : sockcheck_conf.max_cache_age;
-        if (((sci->last_touched + max_age) < now)
-            && !dict_find(curr_clients, sci->hostname, NULL)) {
-            if (SOCKCHECK_DEBUG) {
-                log_module(PC_LOG, LOG_INFO, " .. nuking %s (last touched "FMT_TIME_T").", sci->hostname, sci->last_touched);
-            }
-            dict_remove(checked_ip_dict, sci->hostname);
-        }
-    }
-    dict_delete(curr_clients);
-    timeq_add(now+sockcheck_conf.max_cache_age, sockcheck_clean_cache, 0);
-}
-
 static MODCMD_FUNC(cmd_defproxy)
 {
     const char *reason;
@@ -1024,13 +1256,13 @@ static MODCMD_FUNC(cmd_hostscan)
                 reply("PCMSG_UNSCANNABLE_IP", un->nick);
             } else {
                 irc_ntop(hnamebuf, sizeof(hnamebuf), &un->ip);
-                sockcheck_queue_address(un->ip);
+                sockcheck_queue_address(un->ip, LANE_LIVE);
                 reply("PCMSG_ADDRESS_QUEUED", hnamebuf);
             }
         } else {
             char *scanhost = argv[n];
             if (irc_pton(&ipaddr, NULL, scanhost)) {
-                sockcheck_queue_address(ipaddr);
+                sockcheck_queue_address(ipaddr, LANE_LIVE);
                 reply("PCMSG_ADDRESS_QUEUED", scanhost);
             } else {
                 reply("PCMSG_ADDRESS_UNRESOLVED", scanhost);
@@ -1070,6 +1302,13 @@ static MODCMD_FUNC(cmd_clearhost)
     return 1;
 }
 
+static int
+sockcheck_compare_waits(const void *a_, const void *b_)
+{
+    unsigned long a = *(const unsigned long*)a_, b = *(const unsigned long*)b_;
+    return (a > b) - (a < b);
+}
+
 static MODCMD_FUNC(cmd_stats_proxycheck)
 {
     if (argc > 1) {
@@ -1092,18 +1331,38 @@ static MODCMD_FUNC(cmd_stats_proxycheck)
         reply(msg, sci->hostname, elapse_buf, sci->reason);
         return 1;
     } else {
-        reply("PCMSG_STATISTICS", checked_ip_count, proxies_detected, sockcheck_num_clients, sockcheck_conf.max_clients, pending_sci_list.used, dict_size(checked_ip_dict), (tests ? tests->used : 0));
+        unsigned long waits[SOCKCHECK_WAIT_SAMPLES];
+        unsigned long lookups;
+        char cache_age[INTERVALLEN];
+        unsigned int nn, scans;
+
+        reply("PCMSG_STATISTICS", checked_ip_count, proxies_detected, sockcheck_num_clients, sockcheck_conf.max_clients, sockcheck_queue_length(), dict_size(checked_ip_dict), (tests ? tests->used : 0));
+        lookups = cache_stats.accepted + cache_stats.rejected + cache_stats.checking + cache_stats.misses;
+        intervalString(cache_age, sockcheck_conf.max_cache_age, user->handle_info);
+        reply("PCMSG_STATISTICS_CACHE", cache_stats.accepted, cache_stats.rejected, cache_stats.checking, cache_stats.misses, (unsigned int)(lookups ? (lookups - cache_stats.misses) * 100 / lookups : 0), cache_age);
+        reply("PCMSG_STATISTICS_QUEUE", pending_queue[LANE_LIVE].used, pending_queue[LANE_BURST].used, sockcheck_conf.max_queue, pending_queue[LANE_LIVE].dropped, pending_queue[LANE_BURST].dropped);
+        if (wait_count) {
+            memcpy(waits, wait_samples, wait_count * sizeof(waits[0]));
+            qsort(waits, wait_count, sizeof(waits[0]), sockcheck_compare_waits);
+            reply("PCMSG_STATISTICS_WAIT", wait_count, waits[wait_count / 2], waits[wait_count * 9 / 10], waits[wait_count * 99 / 100], waits[wait_count - 1]);
+        }
+        for (nn = scans = 0; nn < ArrayLength(scan_counts); nn++)
+            if (scan_stamps[nn] + (time_t)ArrayLength(scan_counts) > now)
+                scans += scan_counts[nn];
+        reply("PCMSG_STATISTICS_RATE", scans, scans / 60, scans * 100 / 60 % 100, sockcheck_conf.max_parallel_tests);
         return 1;
     }
 }
 
 static int
 sockcheck_new_user(struct userNode *user, UNUSED_ARG(void *extra)) {
-    /* If they have a bum IP, or are bursting in, don't proxy-check or G-line them. */
+    /* If they have a bum IP, or are bursting in (unless we were asked
+     * to scan bursts), don't proxy-check or G-line them. */
     if (irc_in_addr_is_valid(user->ip)
         && !irc_in_addr_is_loopback(user->ip)
-        && !user->uplink->burst)
-        sockcheck_queue_address(user->ip);
+        && sockcheck_conf.max_clients
+        && (!user->uplink->burst || sockcheck_conf.scan_bursts))
+        sockcheck_queue_address(user->ip, user->uplink->burst ? LANE_BURST : LANE_LIVE);
     return 0;
 }
 
@@ -1111,13 +1370,85 @@ static void
 _sockcheck_init(void)
 {
     checked_ip_dict = dict_new();
-    dict_set_free_data(checked_ip_dict, free);
-    sci_list_init(&pending_sci_list);
+    dict_set_free_data(checked_ip_dict, sockcheck_free_sci);
+    cache_expiry_heap = heap_new(ulong_comparator);
     sockcheck_num_clients = 0;
     sockcheck_read_tests();
-    timeq_del(0, sockcheck_clean_cache, 0, TIMEQ_IGNORE_WHEN|TIMEQ_IGNORE_DATA);
-    client_list = calloc(sockcheck_conf.max_clients, sizeof(client_list[0]));
-    timeq_add(now+sockcheck_conf.max_cache_age, sockcheck_clean_cache, 0);
+    client_slots = sockcheck_conf.max_clients;
+    client_list = calloc(client_slots, sizeof(client_list[0]));
+}
+
+/* Each cached decision is stored as one string, "<ip> A <expires>" or
+ * "<ip> R <expires> <reason>", so a large cache stays a flat list. */
+static int
+sockcheck_saxdb_read(struct dict *db)
+{
+    struct string_list *hosts;
+    sockcheck_cache_info sci;
+    irc_in_addr_t addr;
+    char *str, *sep, *end;
+    char ipstr[IRC_NTOP_MAX_SIZE];
+    time_t expires;
+    unsigned int ii, loaded;
+
+    if (!(hosts = database_get_data(db, KEY_CACHED_HOSTS, RECDB_STRING_LIST)))
+        return 0;
+    for (ii = loaded = 0; ii < hosts->used; ii++) {
+        str = hosts->list[ii];
+        if (!(sep = strchr(str, ' '))
+            || ((unsigned int)(sep - str) >= sizeof(ipstr)))
+            continue;
+        memcpy(ipstr, str, sep - str);
+        ipstr[sep - str] = '\0';
+        if (!irc_pton(&addr, NULL, ipstr)
+            || (sep[1] != 'A' && sep[1] != 'R')
+            || sep[2] != ' ')
+            continue;
+        expires = strtoul(sep + 3, &end, 10);
+        if (expires <= now)
+            continue;
+        if (dict_find(checked_ip_dict, irc_ntoa(&addr), NULL))
+            continue;
+        sci = calloc(1, sizeof(*sci));
+        sci->addr = addr;
+        safestrncpy(sci->hostname, irc_ntoa(&addr), sizeof(sci->hostname));
+        sci->last_touched = now;
+        sci->expires = expires;
+        if (sep[1] == 'R') {
+            sci->decision = REJECT;
+            sci->reason = strdup(*end ? end + 1 : "proxy");
+        } else
+            sci->decision = ACCEPT;
+        dict_insert(checked_ip_dict, sci->hostname, sci);
+        sockcheck_cache_add(sci);
+        loaded++;
+    }
+    log_module(PC_LOG, LOG_INFO, "Loaded %u of %u cached proxy-check results.", loaded, hosts->used);
+    return 0;
+}
+
+static int
+sockcheck_saxdb_write(struct saxdb_context *ctx)
+{
+    struct string_list *hosts;
+    sockcheck_cache_info sci;
+    dict_iterator_t it;
+    char buf[MAXLEN];
+
+    hosts = alloc_string_list(dict_size(checked_ip_dict) + 1);
+    for (it = dict_first(checked_ip_dict); it; it = iter_next(it)) {
+        sci = iter_data(it);
+        if ((sci->decision == CHECKING) || (sci->expires <= now))
+            continue;
+        if (sci->decision == REJECT)
+            snprintf(buf, sizeof(buf), "%s R "FMT_TIME_T" %s", sci->hostname, sci->expires, sci->reason);
+        else
+            snprintf(buf, sizeof(buf), "%s A "FMT_TIME_T, sci->hostname, sci->expires);
+        string_list_append(hosts, strdup(buf));
+    }
+    saxdb_write_string_list(ctx, KEY_CACHED_HOSTS, hosts);
+    free_string_list(hosts);
+    return 0;
 }
 
 static void
@@ -1129,6 +1460,9 @@ sockcheck_read_conf(void)
 
     /* set the defaults here in case the entire record is missing */
     sockcheck_conf.max_clients = 32;
+    sockcheck_conf.max_parallel_tests = 4;
+    sockcheck_conf.max_queue = 4096;
+    sockcheck_conf.scan_bursts = 0;
     sockcheck_conf.max_read = 1024;
     sockcheck_conf.gline_duration = 3600;
     sockcheck_conf.max_cache_age = 60;
@@ -1142,6 +1476,12 @@ sockcheck_read_conf(void)
 	if (str) sockcheck_conf.max_clients = strtoul(str, NULL, 0);
 	str = database_get_data(my_node, "max_clients", RECDB_QSTRING);
 	if (str) sockcheck_conf.max_clients = strtoul(str, NULL, 0);
+	str = database_get_data(my_node, "max_parallel_tests", RECDB_QSTRING);
+	if (str) sockcheck_conf.max_parallel_tests = strtoul(str, NULL, 0);
+	str = database_get_data(my_node, "max_queue", RECDB_QSTRING);
+	if (str) sockcheck_conf.max_queue = strtoul(str, NULL, 0);
+	str = database_get_data(my_node, "scan_bursts", RECDB_QSTRING);
+	if (str) sockcheck_conf.scan_bursts = enabled_string(str);
 	str = database_get_data(my_node, "max_read", RECDB_QSTRING);
 	if (str) sockcheck_conf.max_read = strtoul(str, NULL, 0);
 	str = database_get_data(my_node, "max_cache_age", RECDB_QSTRING);
@@ -1163,6 +1503,45 @@ sockcheck_read_conf(void)
                 log_module(PC_LOG, LOG_ERROR, "Error: Unable to get host named `%s', not checking from a specific address.", str);
 	}
     }
+    if (sockcheck_conf.max_parallel_tests < 1)
+        sockcheck_conf.max_parallel_tests = 1;
+    else if (sockcheck_conf.max_parallel_tests > SOCKCHECK_MAX_PARALLEL)
+        sockcheck_conf.max_parallel_tests = SOCKCHECK_MAX_PARALLEL;
+    /* client_list is only sized once, at startup. */
+    if (client_list && sockcheck_conf.max_clients > client_slots)
+        sockcheck_conf.max_clients = client_slots;
+}
+
+static const char *sockcheck_lane_names[LANE_COUNT] = { "live", "burst" };
+
+static void
+sockcheck_metric_queued(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    unsigned int lane;
+
+    for (lane = 0; lane < LANE_COUNT; lane++)
+        metrics_sample(out, "lane", sockcheck_lane_names[lane], pending_queue[lane].used);
+}
+
+static void
+sockcheck_metric_dropped(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    unsigned int lane;
+
+    for (lane = 0; lane < LANE_COUNT; lane++)
+        metrics_sample(out, "lane", sockcheck_lane_names[lane], pending_queue[lane].dropped);
+}
+
+static double
+sockcheck_metric_clients(UNUSED_ARG(void *extra))
+{
+    return sockcheck_num_clients;
+}
+
+static double
+sockcheck_metric_cache(UNUSED_ARG(void *extra))
+{
+    return dict_size(checked_ip_dict);
 }
 
 int
@@ -1172,6 +1551,7 @@ sockcheck_init(void)
     conf_register_reload(sockcheck_read_conf);
     reg_exit_func(sockcheck_shutdown, NULL);
     _sockcheck_init();
+    saxdb_register("ProxyCheck", sockcheck_saxdb_read, sockcheck_saxdb_write);
     message_register_table(msgtab);
 
     sockcheck_module = module_register("ProxyCheck", PC_LOG, "mod-sockcheck.help", NULL);
@@ -1180,6 +1560,10 @@ sockcheck_init(void)
     modcmd_register(sockcheck_module, "clearhost", cmd_clearhost, 2, 0, "level", "650", NULL);
     modcmd_register(sockcheck_module, "stats proxycheck", cmd_stats_proxycheck, 0, 0, NULL);
     reg_new_user_func(sockcheck_new_user, NULL);
+    metrics_register_collector("x3_proxycheck_queued", "Addresses waiting for a proxy check.", METRIC_GAUGE, sockcheck_metric_queued, NULL);
+    metrics_register_collector("x3_proxycheck_dropped_total", "Addresses not checked because their queue was full.", METRIC_COUNTER, sockcheck_metric_dropped, NULL);
+    metrics_register("x3_proxycheck_clients", "Proxy checks in progress.", METRIC_GAUGE, sockcheck_metric_clients, NULL);
+    metrics_register("x3_proxycheck_cache_entries", "Addresses with a cached proxy check result.", METRIC_GAUGE, sockcheck_metric_cache, NULL);
     return 1;
 }
 
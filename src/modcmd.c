@@ -21,12 +21,16 @@
 #include "chanserv.h"
 #include "conf.h"
 #include "compat.h"
+#include "metrics.h"
 #include "modcmd.h"
 #include "opserv.h"
 #include "saxdb.h"
 #include "timeq.h"
 #include "version.h"
 
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 
 struct pending_template {
     struct svccmd *cmd;
@@ -40,6 +44,11 @@ static struct dict *services;
 static struct pending_template *pending_templates;
 static struct module *modcmd_module;
 static struct modcmd *bind_command, *help_command, *version_command, *credits_command;
+
+static struct {
+    unsigned long slow_command; /* microseconds; 0 to not log */
+    unsigned int command_timing : 1;
+} modcmd_conf;
 static const struct message_entry msgtab[] = {
     { "MCMSG_BARE_FLAG", "Flag %.*s must be preceded by a + or -." },
     { "MCMSG_UNKNOWN_FLAG", "Unknown module flag %.*s." },
@@ -87,6 +96,9 @@ static const struct message_entry msgtab[] = {
     { "MCMSG_HELPFILE_ERROR", "Syntax error reading %s; help contents not changed." },
     { "MCMSG_HELPFILE_READ", "Read %s help database in "FMT_TIME_T".%03lu seconds." },
     { "MCMSG_COMMAND_TIME", "Command $b%s$b finished in "FMT_TIME_T".%06lu seconds." },
+    { "MCMSG_TIMING_DISABLED", "Command timing is disabled (server/command_timing)." },
+    { "MCMSG_NO_TIMED_COMMANDS", "No commands have been timed yet." },
+    { "MCMSG_COMMAND_TIMING", "Command times in milliseconds, busiest first (%u of %u commands):" },
     { "MCMSG_NEED_OPSERV_LEVEL", "You must have $O access of at least $b%u$b." },
     { "MCMSG_NEED_CHANSERV_LEVEL", "You must have $C access of at least $b%u$b in the channel." },
     { "MCMSG_NEED_ACCOUNT_FLAGS", "You must have account flags $b%s$b." },
@@ -200,6 +212,7 @@ free_service_command(void *data) {
             free(svccmd->alias.list[nn]);
         free(svccmd->alias.list);
     }
+    free(svccmd->timing);
     free(svccmd->name);
     free(svccmd);
 }
@@ -687,12 +700,54 @@ svccmd_expand_alias(struct svccmd *cmd, struct userNode *user, unsigned int old_
     return new_argc;
 }
 
+static unsigned long
+modcmd_cpu_usec(void) {
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage ru;
+
+    if (!getrusage(RUSAGE_SELF, &ru))
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000UL
+            + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+    return 0;
+}
+
+/* Records one run of a command.  Slow runs are logged without their
+ * arguments, which may hold passwords or other private data. */
+static void
+svccmd_record_time(struct svccmd *cmd, struct userNode *user, const char *channel_name, unsigned int argc, const struct timeval *start, unsigned long cpu_start) {
+    struct timeval stop;
+    unsigned long cpu;
+    long wall;
+
+    gettimeofday(&stop, NULL);
+    cpu = modcmd_cpu_usec() - cpu_start;
+    wall = (stop.tv_sec - start->tv_sec) * 1000000L + (stop.tv_usec - start->tv_usec);
+    if (wall < 0)
+        wall = 0;
+    if (!cmd->timing && !(cmd->timing = calloc(1, sizeof(*cmd->timing))))
+        return;
+    histogram_add(&cmd->timing->wall, wall);
+    histogram_add(&cmd->timing->cpu, cpu);
+    if (modcmd_conf.slow_command && (unsigned long)wall >= modcmd_conf.slow_command) {
+        cmd->timing->slow++;
+        log_module(MAIN_LOG, LOG_WARNING, "Slow command: %s.%s (%u argument%s%s%s) from %s took %lu.%03lu ms (%lu.%03lu ms CPU).",
+                   cmd->parent->bot->nick, cmd->name, argc - 1, (argc == 2) ? "" : "s",
+                   channel_name[0] ? " in " : "", channel_name, user->nick,
+                   (unsigned long)wall / 1000, (unsigned long)wall % 1000, cpu / 1000, cpu % 1000);
+    }
+}
+
 int
 svccmd_invoke_argv(struct userNode *user, struct service *service, struct chanNode *channel, unsigned int argc, char *argv[], unsigned int server_qualified) {
     extern struct userNode *chanserv;
-    struct svccmd *cmd;
+    struct service *timed_service;
+    struct svccmd *cmd, *timed;
+    struct timeval start;
+    unsigned long cpu_start = 0;
     unsigned int cmd_arg, perms, flags, options, result;
     char channel_name[CHANNELLEN+1];
+    char timed_bot[NICKLEN+1], timed_name[MAXLEN];
     char *new_argv[MAXNUMPARAMS]; /* for aliases */
 
     options = (server_qualified ? SVCCMD_QUALIFIED : 0) | SVCCMD_DEBIT | SVCCMD_NOISY;
@@ -812,7 +867,20 @@ svccmd_invoke_argv(struct userNode *user, struct service *service, struct chanNo
         channel_name[0] = 0;
 
     /* Call the function here */
-    if (!(result = cmd->command->func(user, channel, argc, argv, cmd))) 
+    if (modcmd_conf.command_timing) {
+        /* The command may unbind itself or remove its service, so
+         * look the binding up again afterwards instead of using cmd. */
+        safestrncpy(timed_bot, service->bot->nick, sizeof(timed_bot));
+        safestrncpy(timed_name, cmd->name, sizeof(timed_name));
+        gettimeofday(&start, NULL);
+        cpu_start = modcmd_cpu_usec();
+    }
+    result = cmd->command->func(user, channel, argc, argv, cmd);
+    if (modcmd_conf.command_timing
+        && (timed_service = service_find(timed_bot))
+        && (timed = dict_find(timed_service->commands, timed_name, NULL)))
+        svccmd_record_time(timed, user, channel_name, argc, &start, cpu_start);
+    if (!result)
         return 0;
 
     if (!(flags & MODCMD_NO_LOG)) {
@@ -1802,6 +1870,112 @@ static MODCMD_FUNC(cmd_stats_services) {
     }
 }
 
+static int
+svccmd_timing_compare(const void *a_, const void *b_) {
+    const struct svccmd *a = *(const struct svccmd**)a_;
+    const struct svccmd *b = *(const struct svccmd**)b_;
+    return (a->timing->wall.sum < b->timing->wall.sum) - (a->timing->wall.sum > b->timing->wall.sum);
+}
+
+void
+svccmd_list_timed(struct svccmd_list *list, struct service *service) {
+    dict_iterator_t it, it2;
+    struct svccmd *svccmd;
+
+    for (it = dict_first(services); it; it = iter_next(it)) {
+        if (service && iter_data(it) != service)
+            continue;
+        for (it2 = dict_first(((struct service*)iter_data(it))->commands); it2; it2 = iter_next(it2)) {
+            svccmd = iter_data(it2);
+            if (svccmd->timing && svccmd->timing->wall.count)
+                svccmd_list_append(list, svccmd);
+        }
+    }
+    qsort(list->list, list->used, sizeof(list->list[0]), svccmd_timing_compare);
+}
+
+static void
+modcmd_metric_commands(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    struct svccmd_list commands;
+    struct svccmd *svccmd;
+    unsigned int ii;
+    char label[128];
+
+    svccmd_list_init(&commands);
+    svccmd_list_timed(&commands, NULL);
+    for (ii = 0; ii < commands.used; ii++) {
+        svccmd = commands.list[ii];
+        snprintf(label, sizeof(label), "%s.%s", svccmd->parent->bot->nick, svccmd->name);
+        metrics_summary(out, "command", label, &svccmd->timing->wall, 1e-6);
+    }
+    svccmd_list_clean(&commands);
+}
+
+static void
+stats_commands_ms(struct helpfile_table *tbl, char *cells, unsigned int row, unsigned int col, unsigned long usec) {
+    table_cell_printf(tbl, cells, row, col, "%lu.%03lu", usec / 1000, usec % 1000);
+}
+
+static MODCMD_FUNC(cmd_stats_commands) {
+    struct helpfile_table tbl;
+    struct svccmd_list commands;
+    struct service *service = NULL;
+    struct svccmd_timing *timing;
+    unsigned int ii, limit = 20;
+    char *cells;
+
+    if (!modcmd_conf.command_timing) {
+        reply("MCMSG_TIMING_DISABLED");
+        return 0;
+    }
+    for (ii = 1; ii < argc; ii++) {
+        if (isdigit(argv[ii][0]))
+            limit = strtoul(argv[ii], NULL, 0);
+        else if (!(service = dict_find(services, argv[ii], NULL))) {
+            reply("MCMSG_UNKNOWN_SERVICE", argv[ii]);
+            return 0;
+        }
+    }
+    svccmd_list_init(&commands);
+    svccmd_list_timed(&commands, service);
+    if (!commands.used) {
+        reply("MCMSG_NO_TIMED_COMMANDS");
+        svccmd_list_clean(&commands);
+        return 0;
+    }
+    if (!limit || limit > commands.used)
+        limit = commands.used;
+
+    tbl.width = 8;
+    tbl.flags = TABLE_PAD_LEFT;
+    cells = table_alloc_cells(&tbl, limit);
+    tbl.contents[0][0] = "Command";
+    tbl.contents[0][1] = "Runs";
+    tbl.contents[0][2] = "Avg";
+    tbl.contents[0][3] = "p50";
+    tbl.contents[0][4] = "p99";
+    tbl.contents[0][5] = "Max";
+    tbl.contents[0][6] = "CPU p99";
+    tbl.contents[0][7] = "Slow";
+    for (ii = 0; ii < limit; ii++) {
+        timing = commands.list[ii]->timing;
+        table_cell_printf(&tbl, cells, ii+1, 0, "%s.%s", commands.list[ii]->parent->bot->nick, commands.list[ii]->name);
+        table_cell_printf(&tbl, cells, ii+1, 1, "%lu", timing->wall.count);
+        stats_commands_ms(&tbl, cells, ii+1, 2, (unsigned long)(timing->wall.sum / timing->wall.count));
+        stats_commands_ms(&tbl, cells, ii+1, 3, histogram_percentile(&timing->wall, 0.5));
+        stats_commands_ms(&tbl, cells, ii+1, 4, histogram_percentile(&timing->wall, 0.99));
+        stats_commands_ms(&tbl, cells, ii+1, 5, timing->wall.max);
+        stats_commands_ms(&tbl, cells, ii+1, 6, histogram_percentile(&timing->cpu, 0.99));
+        table_cell_printf(&tbl, cells, ii+1, 7, "%lu", timing->slow);
+    }
+    reply("MCMSG_COMMAND_TIMING", limit, commands.used);
+    table_send(cmd->parent->bot, user->nick, 0, 0, tbl);
+    free(cells);
+    svccmd_list_clean(&commands);
+    return 0;
+}
+
 static MODCMD_FUNC(cmd_showcommands) {
     struct svccmd_list commands;
     struct helpfile_table tbl;
@@ -2308,7 +2482,13 @@ modcmd_load_bots(struct dict *db, int default_nick) {
 
 static void
 modcmd_conf_read(void) {
+    const char *str;
+
     modcmd_load_bots(conf_get_data("services", RECDB_OBJECT), 0);
+    str = conf_get_data("server/command_timing", RECDB_QSTRING);
+    modcmd_conf.command_timing = str ? enabled_string(str) : 1;
+    str = conf_get_data("server/slow_command", RECDB_QSTRING);
+    modcmd_conf.slow_command = (str ? strtoul(str, NULL, 0) : 250) * 1000;
 }
 
 void
@@ -2321,6 +2501,7 @@ modcmd_init(void) {
     reg_nick_change_func(modcmd_nick_change, NULL);
     reg_exit_func(modcmd_cleanup, NULL);
     conf_register_reload(modcmd_conf_read);
+    metrics_register_collector("x3_command_duration_seconds", "Wall clock time spent running each service command.", METRIC_SUMMARY, modcmd_metric_commands, NULL);
 
     modcmd_module = module_register("modcmd", MAIN_LOG, "modcmd.help", modcmd_expand);
     bind_command = modcmd_register(modcmd_module, "bind", cmd_bind, 4, MODCMD_KEEP_BOUND, "oper_level", "800", NULL);
@@ -2334,6 +2515,7 @@ modcmd_init(void) {
     modcmd_register(modcmd_module, "joiner", cmd_joiner, 1, 0, NULL);
     modcmd_register(modcmd_module, "stats modules", cmd_stats_modules, 1, 0, "flags", "+oper", NULL);
     modcmd_register(modcmd_module, "stats services", cmd_stats_services, 1, 0, "flags", "+oper", NULL);
+    modcmd_register(modcmd_module, "stats commands", cmd_stats_commands, 1, 0, "flags", "+oper", NULL);
     modcmd_register(modcmd_module, "showcommands", cmd_showcommands, 1, 0, "flags", "+acceptchan", NULL);
     modcmd_register(modcmd_module, "helpfiles", cmd_helpfiles, 2, 0, "template", "bind", NULL);
     modcmd_register(modcmd_module, "service add", cmd_service_add, 4, 0, "flags", "+oper", NULL);
@@ -23,6 +23,7 @@
 
 #include "recdb.h"
 #include "helpfile.h"
+#include "histogram.h"
 #include "log.h"
 
 struct service;
@@ -114,12 +115,20 @@ struct service {
     char trigger;
 };
 
+/* How long a command has taken, in microseconds. */
+struct svccmd_timing {
+    struct histogram wall;
+    struct histogram cpu;
+    unsigned long slow; /* how many runs went over the slow_command limit? */
+};
+
 struct svccmd {
     char *name;
     struct service *parent; /* where is this command bound? */
     struct modcmd *command; /* what is the implementation? */
     struct string_list alias; /* if it's a complicated binding, what is the expansion? */
     unsigned int uses; /* how many times was this command used? */
+    struct svccmd_timing *timing; /* allocated on first timed use */
     unsigned int flags;
     unsigned long req_account_flags;
     unsigned long deny_account_flags;
@@ -188,6 +197,10 @@ int svccmd_invoke_argv(struct userNode *user, struct service *service, struct ch
  */
 typedef void (*svccmd_unbind_func_t)(struct svccmd *target, void *extra);
 void reg_svccmd_unbind_func(svccmd_unbind_func_t handler, void *extra);
+/* Collect the commands (of one service, or all if service is NULL)
+ * that have timing data, busiest (by total time) first.
+ */
+void svccmd_list_timed(struct svccmd_list *list, struct service *service);
 
 /* Initialize the module command subsystem. */
 void modcmd_init(void);
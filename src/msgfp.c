@@ -0,0 +1,316 @@
+/* msgfp.c - Network-wide duplicate message fingerprints
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "msgfp.h"
+
+#include <ctype.h>
+
+/* Every table slot starts with its key; zero marks an empty slot. */
+struct msgfp_entry {
+    unsigned long key;
+    struct msgfp_info info;
+};
+
+struct msgfp_pair {
+    unsigned long key;
+    unsigned int refs;
+};
+
+struct msgfp_line {
+    unsigned long hash;
+    unsigned long user;
+    unsigned long chan;
+    time_t when;
+    irc_in_addr_t ip;
+};
+
+struct msgfp {
+    unsigned long window;
+
+    /* Ring of remembered lines, oldest at head. */
+    struct msgfp_line *lines;
+    unsigned int capacity, head, used;
+
+    /* Fingerprint -> counts, and (fingerprint, user or channel) ->
+     * number of remembered lines, for counting distinct senders. */
+    struct msgfp_entry *entries;
+    unsigned int entries_mask, entries_used;
+    struct msgfp_pair *pairs;
+    unsigned int pairs_mask;
+};
+
+static unsigned long
+msgfp_mix(unsigned long key)
+{
+    key ^= key >> 16;
+    key *= 0x45d9f3bUL;
+    key ^= key >> 16;
+    return key;
+}
+
+static unsigned long
+msgfp_pair_key(unsigned long hash, unsigned long id, unsigned int kind)
+{
+    unsigned long key = msgfp_mix(hash ^ msgfp_mix(id * 2 + kind));
+    return key ? key : 1;
+}
+
+/* Returns the slot holding key, or the empty slot where it belongs. */
+static unsigned int
+msgfp_probe(const void *table, size_t size, unsigned int mask, unsigned long key)
+{
+    const char *base = table;
+    unsigned long slot_key;
+    unsigned int pos;
+
+    for (pos = msgfp_mix(key) & mask; ; pos = (pos + 1) & mask) {
+        slot_key = *(const unsigned long *)(base + pos * size);
+        if (!slot_key || slot_key == key)
+            return pos;
+    }
+}
+
+/* Empties a slot, shifting the rest of its probe run back so that
+ * lookups never need tombstones. */
+static void
+msgfp_vacate(void *table, size_t size, unsigned int mask, unsigned int hole)
+{
+    char *base = table;
+    unsigned long key;
+    unsigned int pos, home;
+
+    for (pos = (hole + 1) & mask; (key = *(unsigned long *)(base + pos * size)); pos = (pos + 1) & mask) {
+        home = msgfp_mix(key) & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            memcpy(base + hole * size, base + pos * size, size);
+            hole = pos;
+        }
+    }
+    memset(base + hole * size, 0, size);
+}
+
+static unsigned int
+msgfp_table_size(unsigned int min)
+{
+    unsigned int size;
+    for (size = 16; size < min; size <<= 1) ;
+    return size;
+}
+
+struct msgfp *
+msgfp_new(unsigned int capacity, unsigned long window)
+{
+    struct msgfp *mf;
+
+    if (!capacity)
+        capacity = 1;
+    mf = calloc(1, sizeof(*mf));
+    mf->window = window;
+    mf->capacity = capacity;
+    mf->lines = calloc(capacity, sizeof(mf->lines[0]));
+    /* At most one fingerprint and two pairs per line; keep both
+     * tables no more than half full. */
+    mf->entries_mask = msgfp_table_size(capacity * 2) - 1;
+    mf->entries = calloc(mf->entries_mask + 1, sizeof(mf->entries[0]));
+    mf->pairs_mask = msgfp_table_size(capacity * 4) - 1;
+    mf->pairs = calloc(mf->pairs_mask + 1, sizeof(mf->pairs[0]));
+    return mf;
+}
+
+void
+msgfp_delete(struct msgfp *mf)
+{
+    if (!mf)
+        return;
+    free(mf->lines);
+    free(mf->entries);
+    free(mf->pairs);
+    free(mf);
+}
+
+/* Hashes the letters of text, ignoring case, so that colour codes,
+ * punctuation, spacing and random numbers do not change the result.
+ * Returns 0 if there are fewer than min_len letters. */
+unsigned long
+msgfp_hash(const char *text, unsigned int min_len)
+{
+    unsigned long hash = 2166136261UL;
+    unsigned int len;
+    unsigned char ch;
+
+    for (len = 0; (ch = *text); text++) {
+        if (ch < 0x80) {
+            if (!isalpha(ch))
+                continue;
+            ch = tolower(ch);
+        }
+        hash = (hash ^ ch) * 16777619UL;
+        len++;
+    }
+    if (len < min_len)
+        return 0;
+    return hash ? hash : 1;
+}
+
+/* Drops one reference to a (fingerprint, sender) pair; returns
+ * non-zero if that was the sender's last remembered line. */
+static int
+msgfp_pair_release(struct msgfp *mf, unsigned long key)
+{
+    unsigned int pos = msgfp_probe(mf->pairs, sizeof(mf->pairs[0]), mf->pairs_mask, key);
+
+    if (!mf->pairs[pos].key || --mf->pairs[pos].refs)
+        return 0;
+    msgfp_vacate(mf->pairs, sizeof(mf->pairs[0]), mf->pairs_mask, pos);
+    return 1;
+}
+
+static int
+msgfp_pair_hold(struct msgfp *mf, unsigned long key)
+{
+    unsigned int pos = msgfp_probe(mf->pairs, sizeof(mf->pairs[0]), mf->pairs_mask, key);
+
+    mf->pairs[pos].key = key;
+    return ++mf->pairs[pos].refs == 1;
+}
+
+static void
+msgfp_drop_oldest(struct msgfp *mf)
+{
+    struct msgfp_line *line = &mf->lines[mf->head];
+    struct msgfp_entry *entry;
+    unsigned int pos;
+
+    pos = msgfp_probe(mf->entries, sizeof(mf->entries[0]), mf->entries_mask, line->hash);
+    entry = &mf->entries[pos];
+    if (msgfp_pair_release(mf, msgfp_pair_key(line->hash, line->user, 0)))
+        entry->info.users--;
+    if (msgfp_pair_release(mf, msgfp_pair_key(line->hash, line->chan, 1)))
+        entry->info.channels--;
+    if (!--entry->info.lines) {
+        msgfp_vacate(mf->entries, sizeof(mf->entries[0]), mf->entries_mask, pos);
+        mf->entries_used--;
+    }
+    mf->head = (mf->head + 1) % mf->capacity;
+    mf->used--;
+}
+
+void
+msgfp_expire(struct msgfp *mf, time_t when)
+{
+    while (mf->used && (unsigned long)(when - mf->lines[mf->head].when) > mf->window)
+        msgfp_drop_oldest(mf);
+}
+
+void
+msgfp_add(struct msgfp *mf, unsigned long hash, unsigned long user, unsigned long chan, const irc_in_addr_t *ip, time_t when, struct msgfp_info *info)
+{
+    struct msgfp_entry *entry;
+    struct msgfp_line *line;
+    unsigned int pos;
+
+    msgfp_expire(mf, when);
+    if (mf->used == mf->capacity)
+        msgfp_drop_oldest(mf);
+
+    line = &mf->lines[(mf->head + mf->used++) % mf->capacity];
+    line->hash = hash;
+    line->user = user;
+    line->chan = chan;
+    line->when = when;
+    if (ip)
+        line->ip = *ip;
+    else
+        memset(&line->ip, 0, sizeof(line->ip));
+
+    pos = msgfp_probe(mf->entries, sizeof(mf->entries[0]), mf->entries_mask, hash);
+    entry = &mf->entries[pos];
+    if (!entry->key) {
+        entry->key = hash;
+        entry->info.first = when;
+        mf->entries_used++;
+    }
+    entry->info.lines++;
+    if (msgfp_pair_hold(mf, msgfp_pair_key(hash, user, 0)))
+        entry->info.users++;
+    if (msgfp_pair_hold(mf, msgfp_pair_key(hash, chan, 1)))
+        entry->info.channels++;
+    if (info)
+        *info = entry->info;
+}
+
+void
+msgfp_mark(struct msgfp *mf, unsigned long hash)
+{
+    unsigned int pos = msgfp_probe(mf->entries, sizeof(mf->entries[0]), mf->entries_mask, hash);
+
+    if (mf->entries[pos].key)
+        mf->entries[pos].info.marked = 1;
+}
+
+unsigned int
+msgfp_foreach(struct msgfp *mf, unsigned long hash, msgfp_func func, void *extra)
+{
+    struct msgfp_line *line;
+    unsigned int ii, count;
+
+    for (ii = count = 0; ii < mf->used; ii++) {
+        line = &mf->lines[(mf->head + ii) % mf->capacity];
+        if (line->hash != hash)
+            continue;
+        func(line->user, &line->ip, extra);
+        count++;
+    }
+    return count;
+}
+
+unsigned int
+msgfp_capacity(const struct msgfp *mf)
+{
+    return mf->capacity;
+}
+
+unsigned long
+msgfp_window(const struct msgfp *mf)
+{
+    return mf->window;
+}
+
+unsigned int
+msgfp_lines(const struct msgfp *mf)
+{
+    return mf->used;
+}
+
+unsigned int
+msgfp_count(const struct msgfp *mf)
+{
+    return mf->entries_used;
+}
+
+unsigned long
+msgfp_memory(const struct msgfp *mf)
+{
+    return sizeof(*mf)
+        + mf->capacity * sizeof(mf->lines[0])
+        + (mf->entries_mask + 1) * sizeof(mf->entries[0])
+        + (mf->pairs_mask + 1) * sizeof(mf->pairs[0]);
+}
@@ -0,0 +1,61 @@
+/* msgfp.h - Network-wide duplicate message fingerprints
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef MSGFP_H
+#define MSGFP_H
+
+#include "common.h"
+
+/* A msgfp remembers the last few thousand channel messages seen
+ * anywhere on the network, as fingerprints of their normalized text,
+ * and keeps for each fingerprint the number of lines and of distinct
+ * users and channels that sent it within a sliding time window.
+ * Adding a message and aging one out are both O(1).
+ *
+ * The window is bounded both by age and by the number of messages
+ * kept, so memory use is fixed when the msgfp is created.
+ */
+
+struct msgfp;
+
+struct msgfp_info {
+    unsigned int lines;
+    unsigned int users;
+    unsigned int channels;
+    unsigned int marked;
+    time_t first;
+};
+
+typedef void (*msgfp_func)(unsigned long user, const irc_in_addr_t *ip, void *extra);
+
+struct msgfp *msgfp_new(unsigned int capacity, unsigned long window);
+void msgfp_delete(struct msgfp *mf);
+unsigned long msgfp_hash(const char *text, unsigned int min_len);
+void msgfp_add(struct msgfp *mf, unsigned long hash, unsigned long user, unsigned long chan, const irc_in_addr_t *ip, time_t when, struct msgfp_info *info);
+void msgfp_expire(struct msgfp *mf, time_t when);
+void msgfp_mark(struct msgfp *mf, unsigned long hash);
+unsigned int msgfp_foreach(struct msgfp *mf, unsigned long hash, msgfp_func func, void *extra);
+unsigned int msgfp_capacity(const struct msgfp *mf);
+unsigned long msgfp_window(const struct msgfp *mf);
+unsigned int msgfp_lines(const struct msgfp *mf);
+unsigned int msgfp_count(const struct msgfp *mf);
+unsigned long msgfp_memory(const struct msgfp *mf);
+
+#endif /* ndef MSGFP_H */
@@ -0,0 +1,152 @@
+#include "msgfp.h"
+#include "common.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* Replays a synthetic botnet flood against a msgfp:
+ *
+ *   msgfpbench [messages] [bots] [capacity] [window]
+ *
+ * Ordinary users chat in many channels at a steady rate.  Halfway
+ * through, a botnet starts posting one advert, with random numbers
+ * and colour codes mixed in, to random channels.  Reports the cost
+ * per message, how long detection took, and the worst fingerprint
+ * among ordinary traffic.  The distinct-user counts are checked
+ * against a walk of the remembered lines as it goes. */
+
+#define USERS       2000
+#define CHANNELS    300
+#define VOCABULARY  500
+#define RATE        200     /* messages per simulated second */
+#define BOT_SHARE   10      /* one bot message in every BOT_SHARE */
+#define MIN_LEN     12
+#define ALERT_USERS 10
+#define ALERT_CHANS 3
+
+static char vocabulary[VOCABULARY][8];
+
+static void
+make_chatter(char *buf, size_t size)
+{
+    unsigned int ii, words = 3 + rand() % 6;
+    size_t pos = 0;
+
+    for (ii = 0; ii < words && pos + 10 < size; ii++)
+        pos += sprintf(buf + pos, "%s%s", ii ? " " : "", vocabulary[rand() % VOCABULARY]);
+}
+
+static void
+make_advert(char *buf, size_t size)
+{
+    snprintf(buf, size, "\003%uFREE movies %u at http://spam%u.example/ !!!", rand() % 16, rand() % 100000, rand() % 1000);
+}
+
+struct user_set {
+    unsigned long seen[USERS + 1000];
+    unsigned int count;
+};
+
+static void
+count_user(unsigned long user, UNUSED_ARG(const irc_in_addr_t *ip), void *extra)
+{
+    struct user_set *set = extra;
+    unsigned int ii;
+
+    for (ii = 0; ii < set->count && set->seen[ii] != user; ii++) ;
+    if (ii == set->count)
+        set->seen[set->count++] = user;
+}
+
+static double
+elapsed(const struct timeval *start)
+{
+    struct timeval stop;
+    gettimeofday(&stop, NULL);
+    return (stop.tv_sec - start->tv_sec) + (stop.tv_usec - start->tv_usec) / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct msgfp *mf;
+    struct msgfp_info info;
+    struct user_set set;
+    struct timeval start;
+    char text[512];
+    unsigned long messages, hash, advert_hash, ii, detected, bot_start;
+    unsigned int bots, capacity, window, worst_users, worst_chans, errors;
+    unsigned long user, chan;
+    double total;
+    time_t when;
+
+    messages = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    bots = (argc > 2) ? strtoul(argv[2], NULL, 0) : 500;
+    capacity = (argc > 3) ? strtoul(argv[3], NULL, 0) : 4096;
+    window = (argc > 4) ? strtoul(argv[4], NULL, 0) : 60;
+    if (!bots)
+        bots = 1;
+
+    srand(1);
+    for (ii = 0; ii < VOCABULARY; ii++) {
+        unsigned int jj, len = 2 + rand() % 5;
+        for (jj = 0; jj < len; jj++)
+            vocabulary[ii][jj] = 'a' + rand() % 26;
+        vocabulary[ii][jj] = '\0';
+    }
+    make_advert(text, sizeof(text));
+    advert_hash = msgfp_hash(text, MIN_LEN);
+
+    mf = msgfp_new(capacity, window);
+    bot_start = messages / 2;
+    detected = worst_users = worst_chans = errors = 0;
+    total = 0;
+    for (ii = 0; ii < messages; ii++) {
+        when = 1000000000 + ii / RATE;
+        if (ii >= bot_start && rand() % BOT_SHARE == 0) {
+            user = USERS + 1 + rand() % bots;
+            make_advert(text, sizeof(text));
+        } else {
+            user = 1 + rand() % USERS;
+            make_chatter(text, sizeof(text));
+        }
+        chan = rand() % CHANNELS;
+
+        gettimeofday(&start, NULL);
+        if ((hash = msgfp_hash(text, MIN_LEN)))
+            msgfp_add(mf, hash, user, chan, NULL, when, &info);
+        total += elapsed(&start);
+        if (!hash)
+            continue;
+
+        if (hash == advert_hash) {
+            if (!detected && info.users >= ALERT_USERS && info.channels >= ALERT_CHANS)
+                detected = ii;
+        } else {
+            if (info.users > worst_users)
+                worst_users = info.users;
+            if (info.channels > worst_chans)
+                worst_chans = info.channels;
+        }
+
+        if (ii % 997 == 0) {
+            set.count = 0;
+            msgfp_foreach(mf, hash, count_user, &set);
+            if (set.count != info.users) {
+                fprintf(stderr, "Message %lu: counted %u users, expected %u\n", ii, info.users, set.count);
+                errors++;
+            }
+        }
+    }
+
+    printf("%lu messages, %u bots, capacity %u, window %us, %lu bytes\n", messages, bots, capacity, window, msgfp_memory(mf));
+    printf("%.3f s (%.3f us/message)\n", total, total * 1e6 / (messages ? messages : 1));
+    if (detected)
+        printf("advert detected after %lu messages (%lu simulated seconds)\n", detected - bot_start, (detected - bot_start) / RATE);
+    else
+        printf("advert NOT detected\n");
+    printf("worst ordinary fingerprint: %u users, %u channels\n", worst_users, worst_chans);
+    msgfp_delete(mf);
+    return (errors || !detected) ? 1 : 0;
+}
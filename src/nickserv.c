@@ -23,6 +23,7 @@
 #include "conf.h"
 #include "config.h"
 #include "global.h"
+#include "metrics.h"
 #include "modcmd.h"
 #include "opserv.h" /* for gag_create(), opserv_bad_channel() */
 #include "saxdb.h"
@@ -337,6 +338,8 @@ static const struct message_entry msgtab[] = {
     { "NSMSG_FAIL_RENAME", "Account $b%s$b not renamed to $b%s$b because it is in use by a network services, or contains invalid characters." },
     { "NSMSG_ACCOUNT_SEARCH_RESULTS", "The following accounts were found:" },
     { "NSMSG_SEARCH_MATCH", "Match: %s" },
+    { "NSMSG_SASL_STATS", "SASL: %u active sessions (peak %u); %lu started, %lu succeeded, %lu failed, %lu aborted, %lu expired, %lu refused." },
+    { "NSMSG_SASL_STATS_SERVER", "SASL: $b%s$b has %u active sessions (peak %u)." },
     { "NSMSG_INVALID_ACTION", "%s is an invalid search action." },
     { "NSMSG_CANNOT_MERGE_SELF", "You cannot merge account $b%s$b with itself." },
     { "NSMSG_HANDLES_MERGED", "Merged account $b%s$b into $b%s$b." },
@@ -466,6 +469,256 @@ nickserv_add_note(const char *setter, time_t date, const char *text)
     return note;
 }
 
+/* Secondary indexes used to plan account searches.  Each index holds
+ * every account that could match the corresponding criterion; the
+ * search still applies nickserv_discrim_match() to the candidates.
+ */
+struct handle_time_list {
+    struct handle_info *head, *tail;
+    unsigned int unsorted : 1;
+};
+
+static struct handle_time_list handle_time_lists[HANDLE_TIME_INDEXES];
+static int handle_indexes_dropped; /* set while nickserv_db_cleanup frees handles */
+static struct handle_info_list handle_flag_index[16];
+static struct handle_info_list nickserv_oper_index;
+static dict_t nickserv_email_domain_dict; /* contains struct handle_info_list*, indexed by email domain */
+static dict_t nickserv_quit_host_dict; /* contains struct handle_info_list*, indexed by last quit host */
+
+static time_t
+handle_time_key(struct handle_info *hi, enum handle_time_index idx)
+{
+    return (idx == HTI_REGISTERED) ? hi->registered : hi->lastseen;
+}
+
+static void
+handle_time_unlink(struct handle_info *hi, enum handle_time_index idx)
+{
+    struct handle_time_list *htl = &handle_time_lists[idx];
+
+    if (hi->time_prev[idx])
+        hi->time_prev[idx]->time_next[idx] = hi->time_next[idx];
+    else if (htl->head == hi)
+        htl->head = hi->time_next[idx];
+    else
+        return;
+    if (hi->time_next[idx])
+        hi->time_next[idx]->time_prev[idx] = hi->time_prev[idx];
+    else
+        htl->tail = hi->time_prev[idx];
+    hi->time_prev[idx] = hi->time_next[idx] = NULL;
+}
+
+static void
+handle_time_link(struct handle_info *hi, enum handle_time_index idx)
+{
+    struct handle_time_list *htl = &handle_time_lists[idx];
+    struct handle_info *pos;
+    time_t key = handle_time_key(hi, idx);
+
+    /* New keys are almost always "now", so search from the tail. */
+    pos = htl->tail;
+    if (!htl->unsorted)
+        while (pos && handle_time_key(pos, idx) > key)
+            pos = pos->time_prev[idx];
+    hi->time_prev[idx] = pos;
+    if (pos) {
+        hi->time_next[idx] = pos->time_next[idx];
+        pos->time_next[idx] = hi;
+    } else {
+        hi->time_next[idx] = htl->head;
+        htl->head = hi;
+    }
+    if (hi->time_next[idx])
+        hi->time_next[idx]->time_prev[idx] = hi;
+    else
+        htl->tail = hi;
+}
+
+static struct handle_info *
+handle_time_merge(struct handle_info *a, struct handle_info *b, enum handle_time_index idx)
+{
+    struct handle_info head, *tail = &head;
+
+    while (a && b) {
+        if (handle_time_key(b, idx) < handle_time_key(a, idx)) {
+            tail->time_next[idx] = b;
+            b = b->time_next[idx];
+        } else {
+            tail->time_next[idx] = a;
+            a = a->time_next[idx];
+        }
+        tail = tail->time_next[idx];
+    }
+    tail->time_next[idx] = a ? a : b;
+    return head.time_next[idx];
+}
+
+/* Accounts read from the database are appended in name order; sort
+ * them (stable bottom-up merge sort) before the first search. */
+static void
+handle_time_sort(enum handle_time_index idx)
+{
+    struct handle_time_list *htl = &handle_time_lists[idx];
+    struct handle_info *runs[32], *hi, *next, *prev;
+    unsigned int ii;
+
+    if (!htl->unsorted)
+        return;
+    memset(runs, 0, sizeof(runs));
+    for (hi = htl->head; hi; hi = next) {
+        next = hi->time_next[idx];
+        hi->time_next[idx] = NULL;
+        for (ii = 0; ii < ArrayLength(runs) - 1 && runs[ii]; ii++) {
+            hi = handle_time_merge(runs[ii], hi, idx);
+            runs[ii] = NULL;
+        }
+        runs[ii] = runs[ii] ? handle_time_merge(runs[ii], hi, idx) : hi;
+    }
+    for (hi = NULL, ii = 0; ii < ArrayLength(runs); ii++)
+        if (runs[ii])
+            hi = hi ? handle_time_merge(runs[ii], hi, idx) : runs[ii];
+    htl->head = hi;
+    for (prev = NULL; hi; prev = hi, hi = hi->time_next[idx])
+        hi->time_prev[idx] = prev;
+    htl->tail = prev;
+    htl->unsorted = 0;
+}
+
+static void
+nickserv_set_lastseen(struct handle_info *hi, time_t when)
+{
+    hi->lastseen = when;
+    handle_time_unlink(hi, HTI_LASTSEEN);
+    handle_time_link(hi, HTI_LASTSEEN);
+}
+
+static void
+handle_list_index_add(struct handle_info_list *hil, struct handle_info *hi, enum handle_list_index idx)
+{
+    hi->list_slot[idx] = hil->used;
+    handle_info_list_append(hil, hi);
+}
+
+static void
+handle_list_index_remove(struct handle_info_list *hil, struct handle_info *hi, enum handle_list_index idx)
+{
+    unsigned int slot = hi->list_slot[idx];
+    struct handle_info *moved;
+
+    assert(slot < hil->used && hil->list[slot] == hi);
+    /* Move the last entry into the hole; index order is not significant. */
+    moved = hil->list[--hil->used];
+    hil->list[slot] = moved;
+    moved->list_slot[idx] = slot;
+}
+
+void
+handle_set_flags(struct handle_info *hi, unsigned long flags)
+{
+    unsigned long changed;
+    unsigned int ii;
+
+    changed = (hi->flags ^ flags) & HI_INDEXED_FLAGS;
+    hi->flags = flags;
+    for (ii = 0; changed; ii++, changed >>= 1) {
+        if (!(changed & 1))
+            continue;
+        if (!handle_flag_index[ii].list)
+            handle_info_list_init(&handle_flag_index[ii]);
+        if (flags & (1 << ii))
+            handle_list_index_add(&handle_flag_index[ii], hi, HLI_FLAG + ii);
+        else
+            handle_list_index_remove(&handle_flag_index[ii], hi, HLI_FLAG + ii);
+    }
+}
+
+static void
+nickserv_set_opserv_level(struct handle_info *hi, unsigned short level)
+{
+    if (!nickserv_oper_index.list)
+        handle_info_list_init(&nickserv_oper_index);
+    if (level && !hi->opserv_level)
+        handle_list_index_add(&nickserv_oper_index, hi, HLI_OPER);
+    else if (!level && hi->opserv_level)
+        handle_list_index_remove(&nickserv_oper_index, hi, HLI_OPER);
+    hi->opserv_level = level;
+}
+
+static void
+handle_tag_index_remove(dict_t dict, const char *tag, struct handle_info *hi, enum handle_list_index idx)
+{
+    struct handle_info_list *hil;
+
+    if (!tag || !(hil = dict_find(dict, tag, NULL)))
+        return;
+    handle_list_index_remove(hil, hi, idx);
+    if (!hil->used)
+        dict_remove(dict, hil->tag);
+}
+
+static void
+handle_tag_index_add(dict_t dict, const char *tag, struct handle_info *hi, enum handle_list_index idx)
+{
+    struct handle_info_list *hil;
+
+    if (!(hil = dict_find(dict, tag, NULL))) {
+        hil = calloc(1, sizeof(*hil));
+        hil->tag = strdup(tag);
+        handle_info_list_init(hil);
+        dict_insert(dict, hil->tag, hil);
+    }
+    handle_list_index_add(hil, hi, idx);
+}
+
+static const char *
+handle_email_domain(const char *email_addr)
+{
+    const char *domain;
+    if (!email_addr || !(domain = strrchr(email_addr, '@')))
+        return NULL;
+    return domain + 1;
+}
+
+static const char *
+handle_quit_host(struct handle_info *hi)
+{
+    const char *host;
+    if (!hi->last_quit_host[0])
+        return NULL;
+    host = strrchr(hi->last_quit_host, '@');
+    return host ? host + 1 : hi->last_quit_host;
+}
+
+static void
+nickserv_set_last_quit_host(struct handle_info *hi, const char *ident, const char *host)
+{
+    handle_tag_index_remove(nickserv_quit_host_dict, handle_quit_host(hi), hi, HLI_QUIT_HOST);
+    if (ident)
+        snprintf(hi->last_quit_host, sizeof(hi->last_quit_host), "%s@%s", ident, host);
+    else
+        safestrncpy(hi->last_quit_host, host, sizeof(hi->last_quit_host));
+    if (hi->last_quit_host[0])
+        handle_tag_index_add(nickserv_quit_host_dict, handle_quit_host(hi), hi, HLI_QUIT_HOST);
+}
+
+static void
+nickserv_index_handle(struct handle_info *hi)
+{
+    handle_time_link(hi, HTI_REGISTERED);
+    handle_time_link(hi, HTI_LASTSEEN);
+}
+
+static void
+nickserv_unindex_handle(struct handle_info *hi)
+{
+    handle_time_unlink(hi, HTI_REGISTERED);
+    handle_time_unlink(hi, HTI_LASTSEEN);
+    handle_set_flags(hi, 0);
+    nickserv_set_opserv_level(hi, 0);
+    handle_tag_index_remove(nickserv_quit_host_dict, handle_quit_host(hi), hi, HLI_QUIT_HOST);
+}
+
 static struct handle_info *
 register_handle(const char *handle, const char *passwd, UNUSED_ARG(unsigned long id))
 {
@@ -552,6 +805,8 @@ nickserv_free_cookie(void *data)
     free(cookie);
 }
 
+static void nickserv_set_email_addr(struct handle_info *hi, const char *new_email_addr);
+
 static void
 free_handle_info(void *vhi)
 {
@@ -572,11 +827,9 @@ free_handle_info(void *vhi)
         timeq_del(hi->cookie->expires, nickserv_free_cookie, hi->cookie, 0);
         nickserv_free_cookie(hi->cookie);
     }
-    if (hi->email_addr) {
-        struct handle_info_list *hil = dict_find(nickserv_email_dict, hi->email_addr, NULL);
-        handle_info_list_remove(hil, hi);
-        if (!hil->used)
-            dict_remove(nickserv_email_dict, hi->email_addr);
+    if (!handle_indexes_dropped) {
+        nickserv_set_email_addr(hi, NULL);
+        nickserv_unindex_handle(hi);
     }
     free(hi);
 }
@@ -961,14 +1214,9 @@ generate_fakehost(struct handle_info *handle)
     struct userNode *target;
     extern const char *hidden_host_suffix;
     static char buffer[HOSTLEN+1];
-    char *data;
-    int style = 1;
+    int style = server_conf.hidden_host_type;
 
     if (!handle->fakehost) {
-        data = conf_get_data("server/hidden_host_type", RECDB_QSTRING);
-        if (data)
-            style = atoi(data);
-
         if ((style == 1) || (style == 3))
             snprintf(buffer, sizeof(buffer), "%s.%s", handle->handle, hidden_host_suffix);
         else if (style == 2) {
@@ -1051,11 +1299,11 @@ set_user_handle_info(struct userNode *user, struct handle_info *hi, int stamp)
         if (!user->handle_info->users && !user->handle_info->opserv_level)
             HANDLE_CLEAR_FLAG(user->handle_info, HELPING);
         /* record them as being last seen at this time */
-	user->handle_info->lastseen = now;
+        nickserv_set_lastseen(user->handle_info, now);
         if ((ni = get_nick_info(user->nick)))
             ni->lastseen = now;
         /* and record their hostmask */
-        snprintf(user->handle_info->last_quit_host, sizeof(user->handle_info->last_quit_host), "%s@%s", user->ident, user->hostname);
+        nickserv_set_last_quit_host(user->handle_info, user->ident, user->hostname);
     }
     old_info = user->handle_info;
     user->handle_info = hi;
@@ -1079,7 +1327,7 @@ set_user_handle_info(struct userNode *user, struct handle_info *hi, int stamp)
         /* Add this auth to users list of current auths */
 	user->next_authed = hi->users;
 	hi->users = user;
-	hi->lastseen = now;
+        nickserv_set_lastseen(hi, now);
         /* Add to helpers list */
         if (IsHelper(user) && !userList_contains(&curr_helpers, user))
             userList_append(&curr_helpers, user);
@@ -1177,7 +1425,8 @@ nickserv_register(struct userNode *user, struct userNode *settee, const char *ha
     hi->language = lang_C;
     hi->registered = now;
     hi->lastseen = now;
-    hi->flags = HI_DEFAULT_FLAGS;
+    handle_set_flags(hi, HI_DEFAULT_FLAGS);
+    nickserv_index_handle(hi);
     if (settee && !no_auth)
         set_user_handle_info(settee, hi, 1);
 
@@ -1363,8 +1612,9 @@ nickserv_set_email_addr(struct handle_info *hi, const char *new_email_addr)
 {
     struct handle_info_list *hil;
     /* Remove from old handle_info_list ... */
+    handle_tag_index_remove(nickserv_email_domain_dict, handle_email_domain(hi->email_addr), hi, HLI_EMAIL_DOMAIN);
     if (hi->email_addr && (hil = dict_find(nickserv_email_dict, hi->email_addr, 0))) {
-        handle_info_list_remove(hil, hi);
+        handle_list_index_remove(hil, hi, HLI_EMAIL);
         if (!hil->used) dict_remove(nickserv_email_dict, hil->tag);
         hi->email_addr = NULL;
     }
@@ -1376,8 +1626,10 @@ nickserv_set_email_addr(struct handle_info *hi, const char *new_email_addr)
             handle_info_list_init(hil);
             dict_insert(nickserv_email_dict, hil->tag, hil);
         }
-        handle_info_list_append(hil, hi);
+        handle_list_index_add(hil, hi, HLI_EMAIL);
         hi->email_addr = hil->tag;
+        if (handle_email_domain(hi->email_addr))
+            handle_tag_index_add(nickserv_email_domain_dict, handle_email_domain(hi->email_addr), hi, HLI_EMAIL_DOMAIN);
     }
 }
 
@@ -1490,7 +1742,7 @@ static NICKSERV_FUNC(cmd_register)
 
     /* If they're the first to register, give them level 1000. */
     if (dict_size(nickserv_handle_dict) == 1) {
-        hi->opserv_level = 1000;
+        nickserv_set_opserv_level(hi, 1000);
         reply("NSMSG_ROOT_HANDLE", argv[1]);
     }
 
@@ -3124,7 +3376,7 @@ nickserv_apply_flags(struct userNode *user, struct handle_info *hi, const char *
     before = hi->flags & (HI_FLAG_SUPPORT_HELPER|HI_FLAG_NETWORK_HELPER);
     if (!nickserv_modify_handle_flags(user, nickserv, flags, &added, &removed))
         return 0;
-    hi->flags = (hi->flags | added) & ~removed;
+    handle_set_flags(hi, (hi->flags | added) & ~removed);
     after = hi->flags & (HI_FLAG_SUPPORT_HELPER|HI_FLAG_NETWORK_HELPER);
 
     if (after && !before) {
@@ -3594,7 +3846,7 @@ oper_try_set_access(struct userNode *user, struct userNode *bot, struct handle_i
         return 0;
     log_module(NS_LOG, LOG_INFO, "Account %s setting oper level for account %s to %d (from %d).",
         user->handle_info->handle, target->handle, new_level, target->opserv_level);
-    target->opserv_level = new_level;
+    nickserv_set_opserv_level(target, new_level);
     return 1;
 }
 
@@ -4281,11 +4533,11 @@ static NICKSERV_FUNC(cmd_merge)
 
     /* Do they get an OpServ level promotion? */
     if (hi_from->opserv_level > hi_to->opserv_level)
-        hi_to->opserv_level = hi_from->opserv_level;
+        nickserv_set_opserv_level(hi_to, hi_from->opserv_level);
 
     /* What about last seen time? */
     if (hi_from->lastseen > hi_to->lastseen)
-        hi_to->lastseen = hi_from->lastseen;
+        nickserv_set_lastseen(hi_to, hi_from->lastseen);
 
     /* New karma is the sum of the two original karmas. */
     hi_to->karma += hi_from->karma;
@@ -4577,21 +4829,179 @@ nickserv_discrim_match(struct nickserv_discrim *discrim, struct handle_info *hi)
     return 1;
 }
 
+static int
+glob_is_literal(const char *glob)
+{
+    return !strpbrk(glob, "*?\\");
+}
+
+static const char *
+glob_host_part(const char *glob)
+{
+    const char *at = strrchr(glob, '@');
+    return at ? at + 1 : glob;
+}
+
+/* Walk a time index over [min, max] from one end, visiting at most
+ * cap + 1 accounts.  Matching accounts are appended to out (if given).
+ * Returns the number of accounts visited. */
+static unsigned int
+handle_time_walk(enum handle_time_index idx, time_t min, time_t max, int from_tail, unsigned int cap, struct handle_info_list *out)
+{
+    struct handle_info *hi;
+    unsigned int visited;
+    time_t key;
+
+    handle_time_sort(idx);
+    hi = from_tail ? handle_time_lists[idx].tail : handle_time_lists[idx].head;
+    for (visited = 0; hi && visited <= cap; visited++) {
+        key = handle_time_key(hi, idx);
+        if (from_tail ? (key < min) : (key > max))
+            break;
+        if (out && key >= min && key <= max)
+            handle_info_list_append(out, hi);
+        hi = from_tail ? hi->time_prev[idx] : hi->time_next[idx];
+    }
+    return visited;
+}
+
+struct discrim_plan {
+    unsigned int cost;
+    struct handle_info_list *list;
+    struct handle_info *single;
+    int time_index;
+    time_t min, max;
+    int from_tail;
+};
+
+static void
+discrim_plan_list(struct discrim_plan *plan, struct handle_info_list *hil)
+{
+    if (hil && hil->used < plan->cost) {
+        plan->cost = hil->used;
+        plan->list = hil;
+        plan->single = NULL;
+        plan->time_index = -1;
+    }
+}
+
+static void
+discrim_plan_time(struct discrim_plan *plan, enum handle_time_index idx, time_t min, time_t max, int from_tail)
+{
+    unsigned int cost = handle_time_walk(idx, min, max, from_tail, plan->cost, NULL);
+    if (cost < plan->cost) {
+        plan->cost = cost;
+        plan->list = NULL;
+        plan->single = NULL;
+        plan->time_index = idx;
+        plan->min = min;
+        plan->max = max;
+        plan->from_tail = from_tail;
+    }
+}
+
+/* Pick the most selective index for a search.  Returns zero if a
+ * full scan of nickserv_handle_dict is cheapest. */
+static int
+nickserv_discrim_plan(struct nickserv_discrim *discrim, struct discrim_plan *plan)
+{
+    struct handle_info_list empty;
+    unsigned int ii;
+
+    memset(plan, 0, sizeof(*plan));
+    memset(&empty, 0, sizeof(empty));
+    plan->cost = dict_size(nickserv_handle_dict);
+    plan->time_index = -1;
+
+    if (discrim->handlemask && glob_is_literal(discrim->handlemask)) {
+        plan->cost = 1;
+        plan->single = dict_find(nickserv_handle_dict, discrim->handlemask, NULL);
+        return 1;
+    }
+    if (discrim->emailmask && glob_is_literal(discrim->emailmask)) {
+        struct handle_info_list *hil = dict_find(nickserv_email_dict, discrim->emailmask, NULL);
+        discrim_plan_list(plan, hil ? hil : &empty);
+    } else if (discrim->emailmask && strchr(discrim->emailmask, '@')
+               && glob_is_literal(glob_host_part(discrim->emailmask))) {
+        struct handle_info_list *hil = dict_find(nickserv_email_domain_dict, glob_host_part(discrim->emailmask), NULL);
+        discrim_plan_list(plan, hil ? hil : &empty);
+    }
+    if (discrim->hostmask && (discrim->hostmask_type == LASTQUIT)
+        && glob_is_literal(glob_host_part(discrim->hostmask))) {
+        struct handle_info_list *hil = dict_find(nickserv_quit_host_dict, glob_host_part(discrim->hostmask), NULL);
+        discrim_plan_list(plan, hil ? hil : &empty);
+    }
+    if (discrim->min_level > 0)
+        discrim_plan_list(plan, &nickserv_oper_index);
+    for (ii = 0; ii < ArrayLength(handle_flag_index); ii++)
+        if (discrim->flags_on & HI_INDEXED_FLAGS & (1 << ii))
+            discrim_plan_list(plan, &handle_flag_index[ii]);
+    if (discrim->min_registered > 0)
+        discrim_plan_time(plan, HTI_REGISTERED, discrim->min_registered, discrim->max_registered, 1);
+    if (discrim->max_registered < INT_MAX)
+        discrim_plan_time(plan, HTI_REGISTERED, discrim->min_registered, discrim->max_registered, 0);
+    if (discrim->lastseen < now)
+        discrim_plan_time(plan, HTI_LASTSEEN, 0, discrim->lastseen, 0);
+
+    return plan->list || plan->single || (plan->time_index >= 0);
+}
+
+static int
+nickserv_sort_accounts_by_name(const void *a, const void *b)
+{
+    const struct handle_info *hi_a = *(const struct handle_info**)a;
+    const struct handle_info *hi_b = *(const struct handle_info**)b;
+    return irccasecmp(hi_a->handle, hi_b->handle);
+}
+
+static void search_count_func(struct userNode *source, struct handle_info *match, struct nickserv_discrim *discrim);
+
 static unsigned int
 nickserv_discrim_search(struct nickserv_discrim *discrim, discrim_search_func dsf, struct userNode *source)
 {
+    struct discrim_plan plan;
+    struct handle_info_list candidates, matches;
     dict_iterator_t it, next;
-    unsigned int matched;
-
-    for (it = dict_first(nickserv_handle_dict), matched = 0;
-         it && (matched < discrim->limit);
-         it = next) {
-        next = iter_next(it);
-        if (nickserv_discrim_match(discrim, iter_data(it))) {
-            dsf(source, iter_data(it), discrim);
-            matched++;
+    unsigned int matched, ii;
+
+    if (!nickserv_discrim_plan(discrim, &plan)) {
+        for (it = dict_first(nickserv_handle_dict), matched = 0;
+             it && (matched < discrim->limit);
+             it = next) {
+            next = iter_next(it);
+            if (nickserv_discrim_match(discrim, iter_data(it))) {
+                dsf(source, iter_data(it), discrim);
+                matched++;
+            }
         }
+        return matched;
+    }
+
+    handle_info_list_init(&candidates);
+    if (plan.single)
+        handle_info_list_append(&candidates, plan.single);
+    else if (plan.list)
+        for (ii = 0; ii < plan.list->used; ii++)
+            handle_info_list_append(&candidates, plan.list->list[ii]);
+    else if (plan.time_index >= 0)
+        handle_time_walk(plan.time_index, plan.min, plan.max, plan.from_tail, UINT_MAX - 1, &candidates);
+
+    /* Counting does not care which accounts hit the limit; anything
+     * else must see the same accounts, in the same order, as a scan. */
+    handle_info_list_init(&matches);
+    for (ii = 0; ii < candidates.used; ii++) {
+        if (!nickserv_discrim_match(discrim, candidates.list[ii]))
+            continue;
+        handle_info_list_append(&matches, candidates.list[ii]);
+        if ((dsf == search_count_func) && (matches.used >= discrim->limit))
+            break;
     }
+    handle_info_list_clean(&candidates);
+    if (dsf != search_count_func)
+        qsort(matches.list, matches.used, sizeof(matches.list[0]), nickserv_sort_accounts_by_name);
+    for (matched = 0; (matched < matches.used) && (matched < discrim->limit); matched++)
+        dsf(source, matches.list[matched], discrim);
+    handle_info_list_clean(&matches);
     return matched;
 }
 
@@ -4659,15 +5069,11 @@ nickserv_show_oper_accounts(struct userNode *user, struct svccmd *cmd)
     struct handle_info_list hil;
     struct helpfile_table tbl;
     unsigned int ii;
-    dict_iterator_t it;
     const char **ary;
 
     memset(&hil, 0, sizeof(hil));
-    for (it = dict_first(nickserv_handle_dict); it; it = iter_next(it)) {
-        struct handle_info *hi = iter_data(it);
-        if (hi->opserv_level)
-            handle_info_list_append(&hil, hi);
-    }
+    for (ii = 0; ii < nickserv_oper_index.used; ii++)
+        handle_info_list_append(&hil, nickserv_oper_index.list[ii]);
     qsort(hil.list, hil.used, sizeof(hil.list[0]), nickserv_sort_accounts_by_access);
     tbl.length = hil.used + 1;
     tbl.width = 2;
@@ -4832,7 +5238,7 @@ nickserv_db_read_handle(char *handle, dict_t obj)
     str = database_get_data(obj, KEY_LANGUAGE, RECDB_QSTRING);
     hi->language = language_find(str ? str : "C");
     str = database_get_data(obj, KEY_OPSERV_LEVEL, RECDB_QSTRING);
-    hi->opserv_level = str ? strtoul(str, NULL, 0) : 0;
+    nickserv_set_opserv_level(hi, str ? strtoul(str, NULL, 0) : 0);
     str = database_get_data(obj, KEY_INFO, RECDB_QSTRING);
     if (str)
         hi->infoline = strdup(str);
@@ -4840,6 +5246,7 @@ nickserv_db_read_handle(char *handle, dict_t obj)
     hi->registered = str ? (time_t)strtoul(str, NULL, 0) : now;
     str = database_get_data(obj, KEY_LAST_SEEN, RECDB_QSTRING);
     hi->lastseen = str ? (time_t)strtoul(str, NULL, 0) : hi->registered;
+    nickserv_index_handle(hi);
     str = database_get_data(obj, KEY_KARMA, RECDB_QSTRING);
     hi->karma = str ? strtoul(str, NULL, 0) : 0;
     /* We want to read the nicks even if disable_nicks is set.  This is so
@@ -4880,8 +5287,10 @@ nickserv_db_read_handle(char *handle, dict_t obj)
     }
     str = database_get_data(obj, KEY_FLAGS, RECDB_QSTRING);
     if (str) {
+        unsigned long flags = hi->flags;
         for (ii=0; str[ii]; ii++)
-            hi->flags |= 1 << (handle_inverse_flags[(unsigned char)str[ii]] - 1);
+            flags |= 1 << (handle_inverse_flags[(unsigned char)str[ii]] - 1);
+        handle_set_flags(hi, flags);
     }
     str = database_get_data(obj, KEY_USERLIST_STYLE, RECDB_QSTRING);
     hi->userlist_style = str ? str[0] : HI_DEFAULT_STYLE;
@@ -4895,7 +5304,7 @@ nickserv_db_read_handle(char *handle, dict_t obj)
     if (!str)
         str = database_get_data(obj, KEY_LAST_AUTHED_HOST, RECDB_QSTRING);
     if (str)
-        safestrncpy(hi->last_quit_host, str, sizeof(hi->last_quit_host));
+        nickserv_set_last_quit_host(hi, NULL, str);
     str = database_get_data(obj, KEY_EMAIL_ADDR, RECDB_QSTRING);
     if (str)
         nickserv_set_email_addr(hi, str);
@@ -4966,6 +5375,10 @@ nickserv_saxdb_read(dict_t db) {
     struct record_data *rd;
     char *handle;
 
+    /* Link accounts in database order and sort the time indexes later. */
+    handle_time_lists[HTI_REGISTERED].unsorted = 1;
+    handle_time_lists[HTI_LASTSEEN].unsorted = 1;
+
     for (it=dict_first(db); it; it=iter_next(it)) {
         rd = iter_data(it);
         handle = strdup(iter_key(it));
@@ -5178,6 +5591,10 @@ nickserv_conf_read(void)
     nickserv_conf.default_maxlogins = str ? strtoul(str, NULL, 0) : 2;
     str = database_get_data(conf_node, "hard_maxlogins", RECDB_QSTRING);
     nickserv_conf.hard_maxlogins = str ? strtoul(str, NULL, 0) : 10;
+    str = database_get_data(conf_node, "sasl_timeout", RECDB_QSTRING);
+    nickserv_conf.sasl_timeout = str ? ParseInterval(str) : 30;
+    str = database_get_data(conf_node, "sasl_max_sessions", RECDB_QSTRING);
+    nickserv_conf.sasl_max_sessions = str ? strtoul(str, NULL, 0) : 0;
     str = database_get_data(conf_node, KEY_OUNREGISTER_INACTIVE, RECDB_QSTRING);
     nickserv_conf.ounregister_inactive = str ? ParseInterval(str) : 86400*28;
     str = database_get_data(conf_node, KEY_OUNREGISTER_FLAGS, RECDB_QSTRING);
@@ -5566,116 +5983,205 @@ nickserv_define_func(const char *name, modcmd_func_t func, int min_level, int mu
     }
 }
 
-#define SDFLAG_STALE 0x01  /**< SASL session data is stale, delete on next pass. */
+#define SASL_WHEEL_SLOTS 64  /**< One-second slots in the SASL expiry wheel. */
 
 struct SASLSession
 {
-    struct SASLSession *next;
+    struct SASLSession *next;  /**< Next session in the same wheel slot. */
     struct SASLSession *prev;
     struct server* source;
+    struct sasl_server_count *server;
+    time_t expires;
     char *buf, *p;
     int buflen;
     char uid[128];
     char mech[10];
     char *sslclifp;
     char *hostmask;
-    int flags;
 };
 
-struct SASLSession *saslsessions = NULL;
-
-void
-sasl_delete_session(struct SASLSession *session)
+struct sasl_server_count
 {
-    if (!session)
-        return;
-
-    if (session->buf)
-        free(session->buf);
-    session->buf = NULL;
+    unsigned int active;
+    unsigned int peak;
+};
 
-    if (session->sslclifp)
-        free(session->sslclifp);
-    session->sslclifp = NULL;
+enum sasl_outcome {
+    SASL_SUCCEEDED,
+    SASL_FAILED,
+    SASL_ABORTED,
+    SASL_EXPIRED,
+    SASL_OUTCOMES
+};
 
-    if (session->hostmask)
-        free(session->hostmask);
-    session->hostmask = NULL;
+/* Sessions are found by UID in sasl_session_dict and expired from a
+ * timer wheel: each session lives in the slot for its deadline, and a
+ * one-second tick only looks at the slots that have come due. */
+static dict_t sasl_session_dict;
+static dict_t sasl_server_dict;
+static struct SASLSession *sasl_wheel[SASL_WHEEL_SLOTS];
+static time_t sasl_wheel_time;
+static int sasl_tick_pending;
+
+static struct {
+    unsigned int active;
+    unsigned int peak;
+    unsigned long started;
+    unsigned long refused;
+    unsigned long outcomes[SASL_OUTCOMES];
+} sasl_stats;
 
+static void
+sasl_wheel_unlink(struct SASLSession *session)
+{
     if (session->next)
         session->next->prev = session->prev;
     if (session->prev)
         session->prev->next = session->next;
     else
-        saslsessions = session->next;
+        sasl_wheel[session->expires % SASL_WHEEL_SLOTS] = session->next;
+    session->next = session->prev = NULL;
+}
 
-    free(session);
+static void
+sasl_wheel_link(struct SASLSession *session)
+{
+    struct SASLSession **slot = &sasl_wheel[session->expires % SASL_WHEEL_SLOTS];
+
+    session->prev = NULL;
+    session->next = *slot;
+    if (*slot)
+        (*slot)->prev = session;
+    *slot = session;
 }
 
-void
-sasl_delete_stale(UNUSED_ARG(void *data))
+static time_t
+sasl_deadline(void)
 {
-    int delcount = 0;
-    int remcount = 0;
-    struct SASLSession *sess = NULL;
-    struct SASLSession *nextsess = NULL;
+    return now + (nickserv_conf.sasl_timeout ? nickserv_conf.sasl_timeout : 30);
+}
 
-    log_module(NS_LOG, LOG_DEBUG, "SASL: Checking for stale sessions");
+static void
+sasl_touch_session(struct SASLSession *session)
+{
+    time_t expires = sasl_deadline();
 
-    for (sess = saslsessions; sess; sess = nextsess)
-    {
-        nextsess = sess->next;
+    if (session->expires == expires)
+        return;
+    sasl_wheel_unlink(session);
+    session->expires = expires;
+    sasl_wheel_link(session);
+}
 
-        if (sess->flags & SDFLAG_STALE)
-        {
+static void
+sasl_delete_session(struct SASLSession *session, enum sasl_outcome outcome)
+{
+    if (!session)
+        return;
+
+    sasl_wheel_unlink(session);
+    dict_remove(sasl_session_dict, session->uid);
+    session->server->active--;
+    sasl_stats.active--;
+    sasl_stats.outcomes[outcome]++;
+
+    if (session->buf)
+        free(session->buf);
+    if (session->sslclifp)
+        free(session->sslclifp);
+    if (session->hostmask)
+        free(session->hostmask);
+    free(session);
+}
+
+static void
+sasl_expire_sessions(UNUSED_ARG(void *data))
+{
+    struct SASLSession *sess, *nextsess;
+    unsigned int delcount = 0;
+    unsigned int ticks;
+    time_t when;
+
+    sasl_tick_pending = 0;
+    /* If we fell behind by more than a full turn, one pass over every
+     * slot is enough to catch up. */
+    ticks = now - sasl_wheel_time;
+    if (ticks > SASL_WHEEL_SLOTS)
+        ticks = SASL_WHEEL_SLOTS;
+    for (when = now - ticks + 1; when <= now; when++) {
+        for (sess = sasl_wheel[when % SASL_WHEEL_SLOTS]; sess; sess = nextsess) {
+            nextsess = sess->next;
+            if (sess->expires > now)
+                continue;
+            sasl_delete_session(sess, SASL_EXPIRED);
             delcount++;
-            sasl_delete_session(sess);
-        }
-        else
-        {
-            remcount++;
-            sess->flags |= SDFLAG_STALE;
         }
     }
+    sasl_wheel_time = now;
 
     if (delcount)
-        log_module(NS_LOG, LOG_DEBUG, "SASL: Deleted %d stale sessions, %d remaining", delcount, remcount);
-    if (remcount)
-        timeq_add(now + 30, sasl_delete_stale, NULL);
+        log_module(NS_LOG, LOG_DEBUG, "SASL: Expired %u stale sessions, %u remaining", delcount, sasl_stats.active);
+    if (sasl_stats.active) {
+        timeq_add(now + 1, sasl_expire_sessions, NULL);
+        sasl_tick_pending = 1;
+    }
+}
+
+static struct sasl_server_count *
+sasl_server_count(struct server *source)
+{
+    struct sasl_server_count *count;
+
+    if ((count = dict_find(sasl_server_dict, source->name, NULL)))
+        return count;
+    count = calloc(1, sizeof(*count));
+    dict_insert(sasl_server_dict, strdup(source->name), count);
+    return count;
 }
 
-struct SASLSession*
-sasl_get_session(const char *uid)
+static struct SASLSession*
+sasl_new_session(struct server *source, const char *uid)
 {
+    struct sasl_server_count *count;
     struct SASLSession *sess;
 
-    for (sess = saslsessions; sess; sess = sess->next)
+    count = sasl_server_count(source);
+    if (nickserv_conf.sasl_max_sessions && count->active >= nickserv_conf.sasl_max_sessions)
     {
-        if (!strncmp(sess->uid, uid, 128))
-        {
-            log_module(NS_LOG, LOG_DEBUG, "SASL: Found session for %s", sess->uid);
-            return sess;
-        }
+        log_module(NS_LOG, LOG_DEBUG, "SASL: Refusing session for %s, %s has %u active sessions", uid, source->name, count->active);
+        sasl_stats.refused++;
+        return NULL;
     }
 
-    sess = malloc(sizeof(struct SASLSession));
-    memset(sess, 0, sizeof(struct SASLSession));
-
-    strncpy(sess->uid, uid, 128);
-
-    if (!saslsessions)
-        timeq_add(now + 30, sasl_delete_stale, NULL);
-
-    if (saslsessions)
-        saslsessions->prev = sess;
-    sess->next = saslsessions;
-    saslsessions = sess;
+    sess = calloc(1, sizeof(struct SASLSession));
+    safestrncpy(sess->uid, uid, sizeof(sess->uid));
+    sess->source = source;
+    sess->server = count;
+    dict_insert(sasl_session_dict, sess->uid, sess);
+
+    if (!sasl_stats.active)
+        sasl_wheel_time = now;
+    /* Sessions that end by AUTH or abort can empty the wheel while a
+     * tick is still queued; that tick will carry on for this one. */
+    if (!sasl_tick_pending) {
+        timeq_add(now + 1, sasl_expire_sessions, NULL);
+        sasl_tick_pending = 1;
+    }
+    if (++count->active > count->peak)
+        count->peak = count->active;
+    if (++sasl_stats.active > sasl_stats.peak)
+        sasl_stats.peak = sasl_stats.active;
+    sasl_stats.started++;
+
+    sess->expires = sasl_deadline();
+    sasl_wheel_link(sess);
 
     log_module(NS_LOG, LOG_DEBUG, "SASL: Created session for %s", sess->uid);
     return sess;
 }
 
-void
+/* Returns non-zero if the session was finished (and freed). */
+static int
 sasl_packet(struct SASLSession *session)
 {
     log_module(NS_LOG, LOG_DEBUG, "SASL: Got packet containing: %s", session->buf);
@@ -5689,8 +6195,8 @@ sasl_packet(struct SASLSession *session)
             else
                 irc_sasl(session->source, session->uid, "M", "PLAIN,EXTERNAL");
             irc_sasl(session->source, session->uid, "D", "F");
-            sasl_delete_session(session);
-            return;
+            sasl_delete_session(session, SASL_FAILED);
+            return 1;
         }
 
         strncpy(session->mech, session->buf, 10);
@@ -5729,10 +6235,10 @@ sasl_packet(struct SASLSession *session)
             }
         }
 
-        sasl_delete_session(session);
+        sasl_delete_session(session, hi ? SASL_SUCCEEDED : SASL_FAILED);
 
         free(raw);
-        return;
+        return 1;
     }
     else /* We only have PLAIN at the moment so next message must be credentials */
     {
@@ -5787,32 +6293,40 @@ sasl_packet(struct SASLSession *session)
             }
         }
 
-        sasl_delete_session(session);
+        sasl_delete_session(session, hi ? SASL_SUCCEEDED : SASL_FAILED);
 
         free(raw);
-        return;
+        return 1;
     }
 
-    /* clear stale state */
-    session->flags &= ~SDFLAG_STALE;
+    return 0;
 }
 
 void
 handle_sasl_input(struct server* source ,const char *uid, const char *subcmd, const char *data, const char *ext, UNUSED_ARG(void *extra))
 {
-    struct SASLSession* sess = sasl_get_session(uid);
+    struct SASLSession* sess = dict_find(sasl_session_dict, uid, NULL);
     int len = strlen(data);
 
-    sess->source = source;
-
     if (!strcmp(subcmd, "D"))
     {
-        sasl_delete_session(sess);
+        if (sess)
+            sasl_delete_session(sess, SASL_ABORTED);
+        return;
+    }
+
+    if (sess)
+        sess->source = source;
+    else if (!(sess = sasl_new_session(source, uid)))
+    {
+        irc_sasl(source, uid, "D", "F");
         return;
     }
+    sasl_touch_session(sess);
 
     if (!strcmp(subcmd, "H")) {
        log_module(NS_LOG, LOG_DEBUG, "SASL: Storing host mask %s", data);
+       free(sess->hostmask);
        sess->hostmask = strdup(data);
        return ;
     }
@@ -5834,7 +6348,7 @@ handle_sasl_input(struct server* source ,const char *uid, const char *subcmd, co
         if (sess->buflen + len + 1 > 8192) /* This is a little much... */
         {
             irc_sasl(source, uid, "D", "F");
-            sasl_delete_session(sess);
+            sasl_delete_session(sess, SASL_FAILED);
             return;
         }
 
@@ -5844,15 +6358,18 @@ handle_sasl_input(struct server* source ,const char *uid, const char *subcmd, co
     }
 
     memcpy(sess->p, data, len);
-    sess->buf[len] = '\0';
+    sess->p[len] = '\0';
 
-    if (ext != NULL)
+    if (ext != NULL) {
+        free(sess->sslclifp);
         sess->sslclifp = strdup(ext);
+    }
 
     /* Messages not exactly 400 bytes are the end of a packet. */
     if(len < 400)
     {
-        sasl_packet(sess);
+        if (sasl_packet(sess))
+            return;
         sess->buflen = 0;
         if (sess->buf != NULL)
           free(sess->buf);
@@ -5860,18 +6377,52 @@ handle_sasl_input(struct server* source ,const char *uid, const char *subcmd, co
     }
 }
 
+void
+nickserv_show_sasl_stats(struct userNode *user, struct svccmd *cmd)
+{
+    struct sasl_server_count *count;
+    dict_iterator_t it;
+
+    send_message(user, cmd->parent->bot, "NSMSG_SASL_STATS", sasl_stats.active, sasl_stats.peak, sasl_stats.started,
+                 sasl_stats.outcomes[SASL_SUCCEEDED], sasl_stats.outcomes[SASL_FAILED],
+                 sasl_stats.outcomes[SASL_ABORTED], sasl_stats.outcomes[SASL_EXPIRED], sasl_stats.refused);
+    for (it = dict_first(sasl_server_dict); it; it = iter_next(it)) {
+        count = iter_data(it);
+        send_message(user, cmd->parent->bot, "NSMSG_SASL_STATS_SERVER", iter_key(it), count->active, count->peak);
+    }
+}
+
 static void
 nickserv_db_cleanup(UNUSED_ARG(void* extra))
 {
+    dict_iterator_t it;
+    unsigned int i;
+
     unreg_del_user_func(nickserv_remove_user, NULL);
     unreg_sasl_input_func(handle_sasl_input, NULL);
+    timeq_del(0, sasl_expire_sessions, NULL, TIMEQ_IGNORE_WHEN);
+    sasl_tick_pending = 0;
+    while ((it = dict_first(sasl_session_dict)))
+        sasl_delete_session(iter_data(it), SASL_ABORTED);
+    dict_delete(sasl_session_dict);
+    dict_delete(sasl_server_dict);
     userList_clean(&curr_helpers);
     policer_params_delete(nickserv_conf.auth_policer_params);
+    /* Drop the handle indexes wholesale first; taking each handle out
+     * of them one at a time would search the long lists every time. */
+    handle_indexes_dropped = 1;
+    dict_delete(nickserv_email_dict);
+    dict_delete(nickserv_email_domain_dict);
+    dict_delete(nickserv_quit_host_dict);
+    for (i = 0; i < ArrayLength(handle_flag_index); i++)
+        handle_info_list_clean(&handle_flag_index[i]);
+    handle_info_list_clean(&nickserv_oper_index);
+    memset(handle_time_lists, 0, sizeof(handle_time_lists));
     dict_delete(nickserv_handle_dict);
+    handle_indexes_dropped = 0;
     dict_delete(nickserv_nick_dict);
     dict_delete(nickserv_opt_dict);
     dict_delete(nickserv_allow_auth_dict);
-    dict_delete(nickserv_email_dict);
     dict_delete(nickserv_id_dict);
     dict_delete(nickserv_conf.weak_password_dict);
     free(auth_func_list);
@@ -5928,6 +6479,12 @@ void handle_loc_auth_oper(struct userNode *user, UNUSED_ARG(struct handle_info *
     }
 }
 
+static double
+nickserv_metric_accounts(UNUSED_ARG(void *extra))
+{
+    return dict_size(nickserv_handle_dict);
+}
+
 void
 init_nickserv(const char *nick)
 {
@@ -5940,6 +6497,10 @@ init_nickserv(const char *nick)
     reg_account_func(handle_account);
     reg_auth_func(handle_loc_auth_oper, NULL);
     reg_sasl_input_func(handle_sasl_input, NULL);
+    sasl_session_dict = dict_new();
+    sasl_server_dict = dict_new();
+    dict_set_free_keys(sasl_server_dict, free);
+    dict_set_free_data(sasl_server_dict, free);
 
     /* set up handle_inverse_flags */
     memset(handle_inverse_flags, 0, sizeof(handle_inverse_flags));
@@ -5954,6 +6515,12 @@ init_nickserv(const char *nick)
 
     dict_set_free_keys(nickserv_email_dict, free);
     dict_set_free_data(nickserv_email_dict, nickserv_free_email_addr);
+    nickserv_email_domain_dict = dict_new();
+    dict_set_free_keys(nickserv_email_domain_dict, free);
+    dict_set_free_data(nickserv_email_domain_dict, nickserv_free_email_addr);
+    nickserv_quit_host_dict = dict_new();
+    dict_set_free_keys(nickserv_quit_host_dict, free);
+    dict_set_free_data(nickserv_quit_host_dict, nickserv_free_email_addr);
 
     nickserv_module = module_register("NickServ", NS_LOG, "nickserv.help", NULL);
 /* Removed qualified_host as default requirement for AUTH, REGISTER, PASS, etc. nets 
@@ -6040,6 +6607,7 @@ init_nickserv(const char *nick)
     nickserv_handle_dict = dict_new();
     dict_set_free_keys(nickserv_handle_dict, free);
     dict_set_free_data(nickserv_handle_dict, free_handle_info);
+    metrics_register("x3_accounts", "Registered accounts.", METRIC_GAUGE, nickserv_metric_accounts, NULL);
 
     nickserv_id_dict = dict_new();
     dict_set_free_keys(nickserv_id_dict, free);
@@ -56,10 +56,13 @@ struct svccmd;
 /* This is overridden by conf file */
 #define HI_DEFAULT_STYLE       HI_STYLE_NORMAL
 
+/* Flags that are worth keeping a search index for. */
+#define HI_INDEXED_FLAGS       (0xffff & ~HI_DEFAULT_FLAGS)
+
 #define HANDLE_FLAGGED(hi, tok) ((hi)->flags & HI_FLAG_##tok)
-#define HANDLE_SET_FLAG(hi, tok) ((hi)->flags |= HI_FLAG_##tok)
-#define HANDLE_TOGGLE_FLAG(hi, tok) ((hi)->flags ^= HI_FLAG_##tok)
-#define HANDLE_CLEAR_FLAG(hi, tok) ((hi)->flags &= ~HI_FLAG_##tok)
+#define HANDLE_SET_FLAG(hi, tok) handle_set_flags((hi), (hi)->flags | HI_FLAG_##tok)
+#define HANDLE_TOGGLE_FLAG(hi, tok) handle_set_flags((hi), (hi)->flags ^ HI_FLAG_##tok)
+#define HANDLE_CLEAR_FLAG(hi, tok) handle_set_flags((hi), (hi)->flags & ~HI_FLAG_##tok)
 
 #define IsSupportHelper(user) (user->handle_info && HANDLE_FLAGGED(user->handle_info, SUPPORT_HELPER))
 #define IsNetworkHelper(user) (user->handle_info && HANDLE_FLAGGED(user->handle_info, NETWORK_HELPER))
@@ -89,6 +92,21 @@ struct handle_note {
     char            note[1];
 };
 
+enum handle_time_index {
+    HTI_REGISTERED,
+    HTI_LASTSEEN,
+    HANDLE_TIME_INDEXES
+};
+
+enum handle_list_index {
+    HLI_EMAIL,
+    HLI_EMAIL_DOMAIN,
+    HLI_QUIT_HOST,
+    HLI_OPER,
+    HLI_FLAG, /* one per indexed flag bit */
+    HANDLE_LIST_INDEXES = HLI_FLAG + 16
+};
+
 struct handle_info {
     struct nick_info *nicks;
     struct string_list *masks;
@@ -116,6 +134,11 @@ struct handle_info {
     unsigned char maxlogins;
     char passwd[MD5_CRYPT_LENGTH+1];
     char last_quit_host[USERLEN+HOSTLEN+2];
+    /* links in the registered and lastseen search indexes */
+    struct handle_info *time_prev[HANDLE_TIME_INDEXES];
+    struct handle_info *time_next[HANDLE_TIME_INDEXES];
+    /* position in each handle_info_list index this handle is on */
+    unsigned int list_slot[HANDLE_LIST_INDEXES];
 };
 
 struct nick_info {
@@ -188,6 +211,8 @@ struct nickserv_config {
     unsigned char hard_maxlogins;
     unsigned long ounregister_inactive;
     unsigned long ounregister_flags;
+    unsigned long sasl_timeout;
+    unsigned long sasl_max_sessions;
     const char *auto_oper;
     const char *auto_admin;
     const char *auto_oper_privs;
@@ -225,8 +250,10 @@ int oper_outranks(struct userNode *user, struct handle_info *hi);
 struct nick_info *get_nick_info(const char *nick);
 struct modeNode *find_handle_in_channel(struct chanNode *channel, struct handle_info *handle, struct userNode *except);
 int nickserv_modify_handle_flags(struct userNode *user, struct userNode *bot, const char *str, unsigned long *add, unsigned long *remove);
+void handle_set_flags(struct handle_info *hi, unsigned long flags);
 int oper_has_access(struct userNode *user, struct userNode *bot, unsigned int min_level, unsigned int quiet);
 void nickserv_show_oper_accounts(struct userNode *user, struct svccmd *cmd);
+void nickserv_show_sasl_stats(struct userNode *user, struct svccmd *cmd);
 
 struct handle_info *get_victim_oper(struct userNode *user, const char *target);
 struct handle_info *loc_auth(char *sslfp, char *handle, char *password, char *userhost);
@@ -19,6 +19,7 @@
  */
 
 #include "config.h"
+#include "auditlog.h"
 #include "chanserv.h"
 #include "conf.h"
 #include "common.h"
@@ -29,6 +30,8 @@
 #include "modules.h"
 #include "proto.h"
 #include "opserv.h"
+#include "profile.h"
+#include "sar.h"
 #include "timeq.h"
 #include "saxdb.h"
 #include "shun.h"
@@ -86,6 +89,9 @@
 #define KEY_CLONE_GLINE_DURATION "clone_gline_duration"
 #define KEY_BLOCK_GLINE_DURATION "block_gline_duration"
 #define KEY_BLOCK_SHUN_DURATION "block_shun_duration"
+#define KEY_BURST_SENDQ "burst_sendq"
+#define KEY_BURST_MIN_LIFETIME "burst_min_lifetime"
+#define KEY_BURST_SLICE "burst_slice"
 #define KEY_ISSUER "issuer"
 #define KEY_ISSUED "issued"
 #define KEY_ADMIN_LEVEL "admin_level"
@@ -159,8 +165,10 @@ static const struct message_entry msgtab[] = {
     { "OSMSG_GLINE_ISSUED", "G-line issued for $b%s$b." },
     { "OSMSG_GLINE_REMOVED", "G-line removed for $b%s$b." },
     { "OSMSG_GLINE_FORCE_REMOVED", "Unknown/expired G-line removed for $b%s$b." },
-    { "OSMSG_GLINES_ONE_REFRESHED", "All G-lines resent to $b%s$b." },
-    { "OSMSG_GLINES_REFRESHED", "All G-lines refreshed." },
+    { "OSMSG_GLINES_ONE_REFRESHED", "Resending all G-lines to $b%s$b." },
+    { "OSMSG_GLINES_REFRESHED", "Refreshing all G-lines." },
+    { "OSMSG_SHUNS_ONE_REFRESHED", "Resending all shuns to $b%s$b." },
+    { "OSMSG_SHUNS_REFRESHED", "Refreshing all shuns." },
     { "OSMSG_CLEARBANS_DONE", "Cleared all bans from channel $b%s$b." },
     { "OSMSG_CLEARMODES_DONE", "Cleared all modes from channel $b%s$b." },
     { "OSMSG_NO_CHANNEL_MODES", "Channel $b%s$b had no modes to clear." },
@@ -243,6 +251,8 @@ static const struct message_entry msgtab[] = {
     { "OSMSG_EXEMPTED_LIST", "Exempted channels: %s" },
     { "OSMSG_GLINE_COUNT", "There are %d glines active on the network." },
     { "OSMSG_SHUN_COUNT", "There are %d shuns active on the network." },
+    { "OSMSG_GLINE_BURSTS", "G-line bursts: %u running, %lu finished, %lu aborted; %lu sent, %lu skipped as short-lived; last took %lums, longest %lums." },
+    { "OSMSG_SHUN_BURSTS", "Shun bursts: %u running, %lu finished, %lu aborted; %lu sent, %lu skipped as short-lived; last took %lums, longest %lums." },
     { "OSMSG_NO_GLINE", "$b%s$b is not a known G-line." },
     { "OSMSG_NO_SHUN", "$b%s$b is not a known Shun" },
     { "OSMSG_LINKS_SERVER", "%s%s (%u clients; %s)" },
@@ -312,6 +322,16 @@ static const struct message_entry msgtab[] = {
     { "OSMSG_UNGAG_APPLIED", "Ungagged $b%s$b, affecting %d users." },
     { "OSMSG_UNGAG_ADDED", "Ungagged $b%s$b." },
     { "OSMSG_TIMEQ_INFO", "%u events in timeq; next in %lu seconds." },
+    { "OSMSG_PROFILE_DISABLED", "Callback profiling is disabled (server/profile)." },
+    { "OSMSG_PROFILE_RESET", "Callback profile and event loop lag statistics reset." },
+    { "OSMSG_PROFILE_LAG", "Event loop lag: %lu events; 50%% %luus, 99%% %luus, max %luus." },
+    { "OSMSG_PROFILE_NONE", "No callbacks have been profiled yet." },
+    { "OSMSG_PROFILE_SITES", "Callback times in microseconds, busiest first (%u of %u callbacks):" },
+    { "OSMSG_RESOLVER_CACHE", "DNS cache: %u of %u entries; %lu hits (%lu negative), %lu shared with a pending query, %lu sent (%u%% answered without a query); %lu evicted early." },
+    { "OSMSG_RESOLVER_PENDING", "%u DNS requests pending." },
+    { "OSMSG_LOG_FILE", "$b%s$b: %lu lines (%lu bytes) in %lu writes; %u of %u bytes buffered; %lu lines dropped." },
+    { "OSMSG_LOG_AUDIT_STORE", "$bAudit store$b: %lu records (%lu bytes) in %u segments; %u channel and %u account index entries; oldest record is %s old." },
+    { "OSMSG_RESOLVER_NAMESERVER", "Nameserver %s: %u queries, %u answers, %u timeouts; %lums smoothed round trip time." },
     { "OSMSG_ALERT_EXISTS", "An alert named $b%s$b already exists." },
     { "OSMSG_UNKNOWN_REACTION", "Unknown alert reaction $b%s$b." },
     { "OSMSG_ADDED_ALERT", "Added alert named $b%s$b." },
@@ -371,6 +391,12 @@ static const struct message_entry msgtab[] = {
     { "OSMSG_REHASH_COMPLETE", "Completed rehash of configuration database." },
     { "OSMSG_REHASH_FAILED", "Rehash of configuration database failed, previous configuration is intact." },
     { "OSMSG_REOPEN_COMPLETE", "Closed and reopened all log files." },
+    { "OSMSG_IMPORTLOG_NO_STORE", "The audit store is not enabled or could not be opened." },
+    { "OSMSG_IMPORTLOG_BUSY", "An import into the audit store is already running." },
+    { "OSMSG_IMPORTLOG_NOT_EMPTY", "The audit store already holds records; only an empty store can be imported into." },
+    { "OSMSG_IMPORTLOG_FAILED", "Unable to read %s: %s" },
+    { "OSMSG_IMPORTLOG_STARTED", "Importing %s into the audit store; you will be told when it is done." },
+    { "OSMSG_IMPORTLOG_DONE", "Imported %lu audit records from %s." },
     { "OSMSG_RECONNECTING", "Reconnecting to my uplink." },
     { "OSMSG_NUMERIC_COLLIDE", "Numeric %d (%s) is already in use." },
     { "OSMSG_NAME_COLLIDE", "That name is already in use." },
@@ -492,6 +518,9 @@ static struct {
     unsigned long clone_gline_duration;
     unsigned long block_gline_duration;
     unsigned long block_shun_duration;
+    unsigned int burst_sendq;
+    unsigned long burst_min_lifetime;
+    unsigned int burst_slice;
     unsigned long purge_lock_delay;
     unsigned long join_flood_moderate;
     unsigned long join_flood_moderate_threshold;
@@ -1107,6 +1136,41 @@ static MODCMD_FUNC(cmd_reopen)
     return 1;
 }
 
+static char importlog_requester[NICKLEN+1];
+
+static void
+opserv_importlog_done(unsigned long count, UNUSED_ARG(void *extra))
+{
+    struct userNode *user;
+
+    log_module(OS_LOG, LOG_INFO, "Imported %lu audit records from %s.", count, AccountingLog);
+    if ((user = GetUserH(importlog_requester)))
+        send_message(user, opserv, "OSMSG_IMPORTLOG_DONE", count, AccountingLog);
+}
+
+static MODCMD_FUNC(cmd_importlog)
+{
+    switch (audit_store_import(AccountingLog, opserv_importlog_done, NULL)) {
+    case AUDIT_IMPORT_STARTED:
+        break;
+    case AUDIT_IMPORT_NO_STORE:
+        reply("OSMSG_IMPORTLOG_NO_STORE");
+        return 0;
+    case AUDIT_IMPORT_BUSY:
+        reply("OSMSG_IMPORTLOG_BUSY");
+        return 0;
+    case AUDIT_IMPORT_NOT_EMPTY:
+        reply("OSMSG_IMPORTLOG_NOT_EMPTY");
+        return 0;
+    default:
+        reply("OSMSG_IMPORTLOG_FAILED", AccountingLog, strerror(errno));
+        return 0;
+    }
+    safestrncpy(importlog_requester, user->nick, sizeof(importlog_requester));
+    reply("OSMSG_IMPORTLOG_STARTED", AccountingLog);
+    return 1;
+}
+
 static MODCMD_FUNC(cmd_reconnect)
 {
     reply("OSMSG_RECONNECTING");
@@ -2554,11 +2618,108 @@ static MODCMD_FUNC(cmd_stats_gags) {
     return 1;
 }
 
+static MODCMD_FUNC(cmd_stats_sasl) {
+    nickserv_show_sasl_stats(user, cmd);
+    return 1;
+}
+
 static MODCMD_FUNC(cmd_stats_timeq) {
     reply("OSMSG_TIMEQ_INFO", timeq_size(), timeq_next()-now);
     return 1;
 }
 
+static MODCMD_FUNC(cmd_stats_logs) {
+    struct log_file_stats files[32];
+    struct audit_store_stats audit;
+    char buf[INTERVALLEN];
+    unsigned int count, ii;
+
+    count = log_get_file_stats(files, ArrayLength(files));
+    for (ii = 0; ii < count && ii < ArrayLength(files); ii++)
+        reply("OSMSG_LOG_FILE", files[ii].name, files[ii].lines, files[ii].bytes, files[ii].writes, files[ii].buffered, files[ii].buffer_size, files[ii].dropped);
+    if (audit_store_get_stats(&audit))
+        reply("OSMSG_LOG_AUDIT_STORE", audit.records, audit.bytes, audit.segments, audit.channels, audit.accounts, intervalString(buf, audit.oldest ? now - audit.oldest : 0, user->handle_info));
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_resolver) {
+    struct sar_nameserver_stats ns[16];
+    struct sar_stats stats;
+    unsigned long lookups;
+    unsigned int count, ii;
+
+    sar_get_stats(&stats);
+    lookups = stats.hits + stats.coalesced + stats.misses;
+    reply("OSMSG_RESOLVER_CACHE", stats.cache_entries, stats.cache_size, stats.hits, stats.negative_hits, stats.coalesced, stats.misses, (unsigned int)(lookups ? (lookups - stats.misses) * 100 / lookups : 0), stats.evicted);
+    reply("OSMSG_RESOLVER_PENDING", stats.pending);
+    count = sar_get_nameserver_stats(ns, ArrayLength(ns));
+    for (ii = 0; ii < count && ii < ArrayLength(ns); ii++)
+        reply("OSMSG_RESOLVER_NAMESERVER", ns[ii].name, ns[ii].sent, ns[ii].answered, ns[ii].timeouts, ns[ii].srtt);
+    return 1;
+}
+
+static MODCMD_FUNC(cmd_stats_profile) {
+    struct helpfile_table tbl;
+    struct profile_site **sites;
+    const struct histogram *hist;
+    unsigned int count, ii, limit = 20;
+    char *cells;
+
+    if (argc > 1 && !irccasecmp(argv[1], "RESET")) {
+        profile_reset();
+        reply("OSMSG_PROFILE_RESET");
+        return 1;
+    }
+    if (!profile_enabled) {
+        reply("OSMSG_PROFILE_DISABLED");
+        return 0;
+    }
+    if (argc > 1)
+        limit = strtoul(argv[1], NULL, 0);
+    hist = profile_loop_lag();
+    reply("OSMSG_PROFILE_LAG", hist->count, histogram_percentile(hist, 0.5), histogram_percentile(hist, 0.99), hist->max);
+
+    count = profile_get_sites(NULL, 0);
+    sites = malloc((count ? count : 1) * sizeof(sites[0]));
+    profile_get_sites(sites, count);
+    /* Sites are sorted by total time, so idle ones come last. */
+    while (count && !sites[count-1]->hist.count)
+        count--;
+    if (!count) {
+        reply("OSMSG_PROFILE_NONE");
+        free(sites);
+        return 1;
+    }
+    if (!limit || limit > count)
+        limit = count;
+
+    tbl.width = 7;
+    tbl.flags = TABLE_PAD_LEFT;
+    cells = table_alloc_cells(&tbl, limit);
+    tbl.contents[0][0] = "Kind";
+    tbl.contents[0][1] = "Callback";
+    tbl.contents[0][2] = "Calls";
+    tbl.contents[0][3] = "Total ms";
+    tbl.contents[0][4] = "Avg";
+    tbl.contents[0][5] = "p99";
+    tbl.contents[0][6] = "Max";
+    for (ii = 0; ii < limit; ii++) {
+        hist = &sites[ii]->hist;
+        tbl.contents[ii+1][0] = sites[ii]->kind;
+        tbl.contents[ii+1][1] = sites[ii]->where;
+        table_cell_printf(&tbl, cells, ii+1, 2, "%lu", hist->count);
+        table_cell_printf(&tbl, cells, ii+1, 3, "%.0f", hist->sum / 1000);
+        table_cell_printf(&tbl, cells, ii+1, 4, "%lu", (unsigned long)(hist->sum / hist->count));
+        table_cell_printf(&tbl, cells, ii+1, 5, "%lu", histogram_percentile(hist, 0.99));
+        table_cell_printf(&tbl, cells, ii+1, 6, "%lu", hist->max);
+    }
+    reply("OSMSG_PROFILE_SITES", limit, count);
+    table_send(cmd->parent->bot, user->nick, 0, 0, tbl);
+    free(cells);
+    free(sites);
+    return 1;
+}
+
 /*
 static MODCMD_FUNC(cmd_stats_warn) {
     dict_iterator_t it;
@@ -6503,7 +6664,11 @@ gtrace_print_func(struct gline *gline, void *extra)
 
 static MODCMD_FUNC(cmd_stats_glines) {
     if (argc < 2) {
+        struct gline_burst_stats bursts;
+
         reply("OSMSG_GLINE_COUNT", gline_count());
+        gline_get_burst_stats(&bursts);
+        reply("OSMSG_GLINE_BURSTS", bursts.active, bursts.completed, bursts.aborted, bursts.sent, bursts.skipped, bursts.last_msec, bursts.max_msec);
         return 1;
     } else if (argc < 3) {
         struct gline_extra extra;
@@ -6607,7 +6772,11 @@ strace_print_func(struct shun *shun, void *extra)
 
 static MODCMD_FUNC(cmd_stats_shuns) {
     if (argc < 2) {
+        struct shun_burst_stats bursts;
+
         reply("OSMSG_SHUN_COUNT", shun_count());
+        shun_get_burst_stats(&bursts);
+        reply("OSMSG_SHUN_BURSTS", bursts.active, bursts.completed, bursts.aborted, bursts.sent, bursts.skipped, bursts.last_msec, bursts.max_msec);
         return 1;
     } else if (argc < 3) {
         struct shun_extra extra;
@@ -7086,6 +7255,15 @@ opserv_conf_read(void)
     str = database_get_data(conf_node, KEY_BLOCK_SHUN_DURATION, RECDB_QSTRING);
     opserv_conf.block_shun_duration = str ? ParseInterval(str) : 3600;
 
+    str = database_get_data(conf_node, KEY_BURST_SENDQ, RECDB_QSTRING);
+    opserv_conf.burst_sendq = str ? strtoul(str, NULL, 0) : 65536;
+    str = database_get_data(conf_node, KEY_BURST_MIN_LIFETIME, RECDB_QSTRING);
+    opserv_conf.burst_min_lifetime = str ? ParseInterval(str) : 0;
+    str = database_get_data(conf_node, KEY_BURST_SLICE, RECDB_QSTRING);
+    opserv_conf.burst_slice = str ? strtoul(str, NULL, 0) : 100;
+    gline_burst_configure(opserv_conf.burst_sendq, opserv_conf.burst_min_lifetime, opserv_conf.burst_slice);
+    shun_burst_configure(opserv_conf.burst_sendq, opserv_conf.burst_min_lifetime, opserv_conf.burst_slice);
+
     if (!opserv_conf.join_policer_params)
         opserv_conf.join_policer_params = policer_params_new();
     policer_params_set(opserv_conf.join_policer_params, "size", "20");
@@ -7284,6 +7462,7 @@ init_opserv(const char *nick)
     opserv_define_func("STRACE COUNT", NULL, 0, 0, 0);
     opserv_define_func("STRACE PRINT", NULL, 0, 0, 0);
     opserv_define_func("INVITE", cmd_invite, 100, 2, 0);
+    opserv_define_func("IMPORTLOG", cmd_importlog, 999, 0, 0);
     opserv_define_func("INVITEME", cmd_inviteme, 100, 0, 0);
     opserv_define_func("JOIN", cmd_join, 601, 1, 0);
     opserv_define_func("SVSNICK", cmd_svsnick, 999, 0, 3);
@@ -7329,11 +7508,15 @@ init_opserv(const char *nick)
     opserv_define_func("STATS GLINES", cmd_stats_glines, 0, 0, 0);
     opserv_define_func("STATS SHUNS", cmd_stats_shuns, 0, 0, 0);
     opserv_define_func("STATS LINKS", cmd_stats_links, 0, 0, 0);
+    opserv_define_func("STATS LOGS", cmd_stats_logs, 0, 0, 0);
     opserv_define_func("STATS MAX", cmd_stats_max, 0, 0, 0);
     opserv_define_func("STATS NETWORK", cmd_stats_network, 0, 0, 0);
     opserv_define_func("STATS NETWORK2", cmd_stats_network2, 0, 0, 0);
+    opserv_define_func("STATS PROFILE", cmd_stats_profile, 0, 0, 0);
     opserv_define_func("STATS RESERVED", cmd_stats_reserved, 0, 0, 0);
+    opserv_define_func("STATS RESOLVER", cmd_stats_resolver, 0, 0, 0);
     opserv_define_func("STATS ROUTING", cmd_stats_routing_plans, 0, 0, 0);
+    opserv_define_func("STATS SASL", cmd_stats_sasl, 0, 0, 0);
     opserv_define_func("STATS TIMEQ", cmd_stats_timeq, 0, 0, 0);
     opserv_define_func("STATS TRUSTED", cmd_stats_trusted, 0, 0, 0);
     opserv_define_func("STATS UPLINK", cmd_stats_uplink, 0, 0, 0);
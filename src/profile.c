@@ -0,0 +1,223 @@
+/* profile.c - Callback cost and event loop lag profiling
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+#include "profile.h"
+#include "timeq.h"
+
+#define PROFILE_DUMP_SITES 10
+
+unsigned int profile_enabled;
+
+static dict_t profile_sites;
+static struct histogram profile_lag;
+static struct timeval profile_woke;
+static unsigned long profile_dump_interval;
+
+static unsigned long
+profile_usec_since(const struct timeval *start)
+{
+    struct timeval stop;
+    long usec;
+
+    gettimeofday(&stop, NULL);
+    usec = (stop.tv_sec - start->tv_sec) * 1000000 + (stop.tv_usec - start->tv_usec);
+    return (usec > 0) ? (unsigned long)usec : 0;
+}
+
+struct profile_site *
+profile_site(const char *name)
+{
+    struct profile_site *site;
+    const char *sep, *slash;
+
+    if (!profile_sites) {
+        profile_sites = dict_new();
+        dict_set_free_data(profile_sites, free);
+    }
+    if ((site = dict_find(profile_sites, name, NULL)))
+        return site;
+    site = calloc(1, sizeof(*site));
+    site->name = name;
+    if ((sep = strchr(name, ' '))) {
+        safestrncpy(site->kind, name, (sep - name < (int)sizeof(site->kind)) ? (size_t)(sep - name + 1) : sizeof(site->kind));
+        site->where = sep + 1;
+    } else {
+        site->where = name;
+    }
+    if ((slash = strrchr(site->where, '/')))
+        site->where = slash + 1;
+    dict_insert(profile_sites, name, site);
+    return site;
+}
+
+void
+profile_record(struct profile_site *site, const struct timeval *start)
+{
+    histogram_add(&site->hist, profile_usec_since(start));
+}
+
+void
+profile_loop_woke(void)
+{
+    PROFILE_START(&profile_woke);
+}
+
+void
+profile_loop_event(void)
+{
+    if (profile_woke.tv_sec)
+        histogram_add(&profile_lag, profile_usec_since(&profile_woke));
+}
+
+const struct histogram *
+profile_loop_lag(void)
+{
+    return &profile_lag;
+}
+
+static int
+profile_site_compare(const void *a_, const void *b_)
+{
+    const struct profile_site *a = *(struct profile_site* const*)a_;
+    const struct profile_site *b = *(struct profile_site* const*)b_;
+
+    if (a->hist.sum != b->hist.sum)
+        return (a->hist.sum < b->hist.sum) ? 1 : -1;
+    return strcmp(a->name, b->name);
+}
+
+unsigned int
+profile_get_sites(struct profile_site **sites, unsigned int max)
+{
+    struct profile_site **all;
+    dict_iterator_t it;
+    unsigned int count, ii;
+
+    count = profile_sites ? dict_size(profile_sites) : 0;
+    if (!count || !max)
+        return count;
+    all = malloc(count * sizeof(all[0]));
+    for (it = dict_first(profile_sites), ii = 0; it; it = iter_next(it))
+        all[ii++] = iter_data(it);
+    qsort(all, count, sizeof(all[0]), profile_site_compare);
+    if (max > count)
+        max = count;
+    memcpy(sites, all, max * sizeof(sites[0]));
+    free(all);
+    return count;
+}
+
+void
+profile_reset(void)
+{
+    dict_iterator_t it;
+
+    if (profile_sites)
+        for (it = dict_first(profile_sites); it; it = iter_next(it))
+            histogram_clear(&((struct profile_site*)iter_data(it))->hist);
+    histogram_clear(&profile_lag);
+}
+
+static void
+profile_dump(UNUSED_ARG(void *data))
+{
+    struct profile_site *sites[PROFILE_DUMP_SITES];
+    const struct histogram *hist;
+    unsigned int count, ii;
+
+    if (!profile_enabled || !profile_dump_interval)
+        return;
+    log_module(MAIN_LOG, LOG_INFO, "Event loop lag: %lu events, 50%% %luus, 99%% %luus, max %luus.",
+               profile_lag.count, histogram_percentile(&profile_lag, 0.5),
+               histogram_percentile(&profile_lag, 0.99), profile_lag.max);
+    count = profile_get_sites(sites, ArrayLength(sites));
+    for (ii = 0; ii < count && ii < ArrayLength(sites); ii++) {
+        hist = &sites[ii]->hist;
+        if (!hist->count)
+            break;
+        log_module(MAIN_LOG, LOG_INFO, "Callback %s %s: %lu calls, %.0fms total, 99%% %luus, max %luus.",
+                   sites[ii]->kind, sites[ii]->where, hist->count, hist->sum / 1000,
+                   histogram_percentile(hist, 0.99), hist->max);
+    }
+    timeq_add(now + profile_dump_interval, profile_dump, NULL);
+}
+
+static void
+profile_metric_lag(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    metrics_summary(out, NULL, NULL, &profile_lag, 1e-6);
+}
+
+static void
+profile_metric_sites(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    struct profile_site *site;
+    dict_iterator_t it;
+    char label[128];
+
+    if (!profile_sites)
+        return;
+    for (it = dict_first(profile_sites); it; it = iter_next(it)) {
+        site = iter_data(it);
+        if (!site->hist.count)
+            continue;
+        snprintf(label, sizeof(label), "%s %s", site->kind, site->where);
+        metrics_summary(out, "callback", label, &site->hist, 1e-6);
+    }
+}
+
+static void
+profile_conf_read(void)
+{
+    const char *str;
+
+    str = conf_get_data("server/profile", RECDB_QSTRING);
+    profile_enabled = str ? enabled_string(str) : 0;
+    str = conf_get_data("server/profile_dump", RECDB_QSTRING);
+    profile_dump_interval = str ? ParseInterval(str) : 0;
+    if (!profile_enabled)
+        profile_woke.tv_sec = 0;
+
+    timeq_del(0, profile_dump, NULL, TIMEQ_IGNORE_WHEN|TIMEQ_IGNORE_DATA);
+    if (profile_enabled && profile_dump_interval)
+        timeq_add(now + profile_dump_interval, profile_dump, NULL);
+}
+
+static void
+profile_cleanup(UNUSED_ARG(void *extra))
+{
+    /* Callback lists keep pointers to their sites; make sure nothing
+     * touches them once they are gone. */
+    profile_enabled = 0;
+    dict_delete(profile_sites);
+    profile_sites = NULL;
+}
+
+void
+profile_init(void)
+{
+    reg_exit_func(profile_cleanup, NULL);
+    conf_register_reload(profile_conf_read);
+    metrics_register_collector("x3_event_loop_lag_seconds", "Time from a socket becoming ready to it being handled (with server/profile on).", METRIC_SUMMARY, profile_metric_lag, NULL);
+    metrics_register_collector("x3_callback_seconds", "Time spent in each hook and timer callback (with server/profile on).", METRIC_SUMMARY, profile_metric_sites, NULL);
+}
@@ -0,0 +1,86 @@
+/* profile.h - Callback cost and event loop lag profiling
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+#include "histogram.h"
+
+/* A profile site is one registered callback: a hook in one of the
+ * hash.c callback lists or a timeq function.  Sites are named when
+ * the callback is registered, from the kind of hook, the source file
+ * that registered it and the callback's name, so time is attributed
+ * to the module that owns the callback without any help from it.
+ *
+ * Profiling is off unless enabled in the configuration; when off, a
+ * callback costs one extra test of profile_enabled.
+ */
+
+struct profile_site {
+    const char *name;       /* "kind file.c:function" */
+    const char *where;      /* points into name, past any directory */
+    char kind[16];
+    struct histogram hist;  /* microseconds per call */
+};
+
+extern unsigned int profile_enabled;
+
+/* Builds a site name from a string literal kind and a function name,
+ * e.g. PROFILE_NAME("join", handle_join). */
+#define PROFILE_NAME(KIND, FUNC) (KIND " " __FILE__ ":" #FUNC)
+
+#define PROFILE_START(TV) do { \
+    if (profile_enabled) gettimeofday((TV), NULL); else (TV)->tv_sec = 0; \
+} while (0)
+#define PROFILE_STOP(SITE, TV) do { \
+    if ((TV)->tv_sec) profile_record((SITE), (TV)); \
+} while (0)
+
+/* Times one call through a callback list.  The site is fetched before
+ * the call, since the callback may unregister itself. */
+#define PROFILE_CALL(SITE, CALL) do { \
+    struct profile_site *profile_site_ = (SITE); \
+    struct timeval profile_start_; \
+    PROFILE_START(&profile_start_); \
+    CALL; \
+    PROFILE_STOP(profile_site_, &profile_start_); \
+} while (0)
+
+/* Returns the site with the given name, creating it if necessary.
+ * The name must outlive the site (normally it is a PROFILE_NAME()
+ * literal). */
+struct profile_site *profile_site(const char *name);
+void profile_record(struct profile_site *site, const struct timeval *start);
+
+/* Event loop lag: engines call profile_loop_woke() as soon as their
+ * wait returns, and ioset_events() calls profile_loop_event() before
+ * it handles each ready descriptor. */
+void profile_loop_woke(void);
+void profile_loop_event(void);
+const struct histogram *profile_loop_lag(void);
+
+/* Fills sites[] with up to max sites, sorted by total time spent, and
+ * returns the number of sites that exist. */
+unsigned int profile_get_sites(struct profile_site **sites, unsigned int max);
+void profile_reset(void);
+void profile_init(void);
+
+#endif /* !defined(PROFILE_H) */
@@ -890,11 +890,7 @@ generate_hostmask(struct userNode *user, int options)
     if (IsFakeHost(user) && IsHiddenHost(user) && !(options & GENMASK_NO_HIDING)) {
         hostname = user->fakehost;
     } else if (IsHiddenHost(user)) {
-        int style = 1;
-        char *data;
-        data = conf_get_data("server/hidden_host_type", RECDB_QSTRING);
-        if (data)
-            style = atoi(data);
+        int style = server_conf.hidden_host_type;
 
         if (((style == 1) || (style == 3)) && user->handle_info && hidden_host_suffix && !(options & GENMASK_NO_HIDING)) {
             hostname = alloca(strlen(user->handle_info->handle) + strlen(hidden_host_suffix) + 2);
@@ -1104,24 +1104,12 @@ void
 irc_topic(struct userNode *service, struct userNode *who, struct chanNode *what, const char *topic)
 {
 
-   int type = 4, host_in_topic = 0, hasident = 0, hhtype = 0;
-   const char *hstr, *tstr, *hhstr, *htstr;
+   int host_in_topic = server_conf.host_in_topic, hasident = 0, hhtype = server_conf.hidden_host_type;
    char *host, *hostmask;
    char shost[MAXLEN];
    char sident[MAXLEN];
 
-   tstr = conf_get_data("server/type", RECDB_QSTRING);
-   hstr = conf_get_data("server/host_in_topic", RECDB_QSTRING);
-   hhstr = conf_get_data("server/hidden_host", RECDB_QSTRING);
-   htstr = conf_get_data("server/hidden_host_type", RECDB_QSTRING);
-   if(tstr)
-     type = atoi(tstr);
-   else
-     type = 4;/* default to 040 style topics */
-   if (htstr)
-     hhtype = atoi(htstr);
-
-   if (hstr) {
+   if (host_in_topic) {
       if (IsHiddenHost(who) && IsFakeHost(who))
           safestrncpy(shost, who->fakehost, sizeof(shost));
       else if (IsHiddenHost(who) && IsSetHost(who)) {
@@ -1138,17 +1126,16 @@ irc_topic(struct userNode *service, struct userNode *who, struct chanNode *what,
               safestrncpy(sident, who->ident, sizeof(shost));
 
           safestrncpy(shost, host, sizeof(shost));
-      } else if (IsHiddenHost(who) && ((hhtype == 1) || (hhtype == 3)) && who->handle_info && hhstr) {
-          snprintf(shost, sizeof(shost), "%s.%s", who->handle_info->handle, hhstr);
+      } else if (IsHiddenHost(who) && ((hhtype == 1) || (hhtype == 3)) && who->handle_info && hidden_host_suffix) {
+          snprintf(shost, sizeof(shost), "%s.%s", who->handle_info->handle, hidden_host_suffix);
       } else if (IsHiddenHost(who) && ((hhtype == 2) || (hhtype == 3)) && who->crypthost[0]) {
           safestrncpy(shost, who->crypthost, sizeof(shost));
       } else
           safestrncpy(shost, who->hostname, sizeof(shost));
-
-      host_in_topic = atoi(hstr);
    }
 
-   if (type >= 5) {
+   /* 0.4.x style topics do not carry the setter. */
+   if (server_conf.type >= 5) {
      putsock("%s " P10_TOPIC " %s %s%s%s%s%s " FMT_TIME_T " " FMT_TIME_T " :%s", service->numeric, what->name,
              who->nick, host_in_topic ? "!" : "", host_in_topic ? (IsSetHost(who) ? sident : who->ident) : "", 
              host_in_topic ? "@" : "", host_in_topic ? shost : "", what->timestamp, now, topic);
@@ -1179,20 +1166,12 @@ void
 irc_mark(struct userNode *user, char *mark)
 {
     char *host = user->hostname;
-    int type = 4;
-    const char *tstr = NULL;
 
     /* TODO: Allow mark overwrite. If they are marked, and their fakehost is oldmark.hostname, update it to newmark.hostname so mark can be called multiple times. Probably requires ircd modification also */
     if(user->mark)
         return;
 
-    tstr = conf_get_data("server/type", RECDB_QSTRING);
-    if(tstr)
-        type = atoi(tstr);
-    else
-        type = 4;
-
-    if (type >= 9)
+    if (server_conf.type >= 9)
     {
         putsock("%s " CMD_MARK " %s MARK %s", self->numeric, user->nick, mark);
         return;
@@ -1332,7 +1311,6 @@ static CMD_FUNC(cmd_whois)
 static CMD_FUNC(cmd_server)
 {
     struct server *srv;
-    const char *str;
 
     if (argc < 8)
         return 0;
@@ -1362,8 +1340,7 @@ static CMD_FUNC(cmd_server)
         if (srv->hops == 1) {
             log_module(MAIN_LOG, LOG_ERROR, "Server %s claims to have booted at time "FMT_TIME_T".  This is absurd.", srv->name, srv->boot);
         }
-    } else if ((str = conf_get_data("server/reliable_clock", RECDB_QSTRING))
-               && enabled_string(str)) {
+    } else if (server_conf.reliable_clock) {
         /* If we have a reliable clock, we just keep our current time. */
     } else {
         if (srv->boot <= self->boot) {
@@ -1767,29 +1744,21 @@ irc_raw_privs(struct userNode *target, const char *privs)
 
 static CMD_FUNC(cmd_privs)
 {
-    char *tstr = NULL;
     char buf[512] = "";
     char *p = 0;
     char *tmp;
 
     int what = PRIV_ADD;
-    int type = 0;
 
     unsigned int i;
 
     struct server *sender;
     struct userNode *user;
 
-
-    tstr = conf_get_data("server/type", RECDB_QSTRING);
-    if(tstr)
-        type = atoi(tstr);
-
-
     if (!(sender = GetServerH(origin))) { /* from oper */
         return 1; /* ignore as no services have privs set */
     } else { /* from server */
-        if (type < 5)
+        if (server_conf.type < 5)
             return 1; /* silently ignore */
 
         user = argc > 1 ? GetUserN(argv[1]) : NULL;
@@ -1832,9 +1801,7 @@ static CMD_FUNC(cmd_burst)
     struct modeNode *mNode;
     long mode;
     int oplevel = -1;
-    int type = 0;
     char *user, *end, sep;
-    char *tstr;
     time_t in_timestamp;
     char* parm = NULL;
 
@@ -1842,11 +1809,6 @@ static CMD_FUNC(cmd_burst)
         return 0;
     modes[0] = 0;
 
-    tstr = conf_get_data("server/type", RECDB_QSTRING);
-    if(tstr) {
-        type = atoi(tstr);
-    }
-
     exemptlist[0] = 0;
     banlist[0] = 0;
 
@@ -1857,7 +1819,7 @@ static CMD_FUNC(cmd_burst)
             int n_modes;
             for (pos=argv[next], n_modes = 1; *pos; pos++)
                 if ((*pos == 'k') || (*pos == 'l') || (*pos == 'A')
-                    || (*pos == 'U') || ((type > 7) && (*pos == 'L')))
+                    || (*pos == 'U') || ((server_conf.type > 7) && (*pos == 'L')))
                     n_modes++;
             if (next + n_modes > argc)
                 n_modes = argc - next;
@@ -3057,8 +3019,6 @@ AddUser(struct server* uplink, const char *nick, const char *ident, const char *
 {
     struct userNode *oldUser, *uNode;
     unsigned int ignore_user, dummy;
-    char *tstr;
-    int type;
 
     if ((strlen(numeric) < 3) || (strlen(numeric) > 5)) {
         log_module(MAIN_LOG, LOG_WARNING, "AddUser(%p, %s, ...): numeric %s wrong length!", (void*)uplink, nick, numeric);
@@ -3116,9 +3076,7 @@ AddUser(struct server* uplink, const char *nick, const char *ident, const char *
     safestrncpy(uNode->numeric, numeric, sizeof(uNode->numeric));
     irc_p10_pton(&uNode->ip, realip);
 
-    tstr = conf_get_data("server/type", RECDB_QSTRING);
-    type = atoi(tstr);
-    if (type == 7) {
+    if (server_conf.type == 7) {
       if (irc_in_addr_is_ipv4(uNode->ip)) {
         make_virtip((char*)irc_ntoa(&uNode->ip), (char*)irc_ntoa(&uNode->ip), uNode->cryptip);
         make_virthost((char*)irc_ntoa(&uNode->ip), uNode->hostname, uNode->crypthost);
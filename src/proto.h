@@ -81,6 +81,9 @@ struct cManagerNode
     int			enabled;
 };
 
+/* The connection to our uplink, or NULL while we are not linked. */
+extern struct io_fd *socket_io_fd;
+
 #ifdef WITH_PROTOCOL_P10
 struct server* GetServerN(const char *numeric);
 struct userNode* GetUserN(const char *numeric);
@@ -0,0 +1,201 @@
+#include "common.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* Drives a QServer listener with pipelined requests:
+ *
+ *   qserverbench [-l] [-p password] [-n requests] [-w window]
+ *                <host> <port> <target> [args...]
+ *
+ * Keeps up to <window> copies of "<tag> <target> [args...]" in flight
+ * and reports throughput and the latency distribution.  Requests use
+ * the JSON framing, where every response is one line, unless -l asks
+ * for the classic S/E framing, where a response ends at its "E" (or
+ * "X") line. */
+
+static int legacy;
+
+static double
+elapsed(const struct timeval *start)
+{
+    struct timeval stop;
+
+    gettimeofday(&stop, NULL);
+    return (stop.tv_sec - start->tv_sec) + (stop.tv_usec - start->tv_usec) / 1e6;
+}
+
+static int
+compare_doubles(const void *a_, const void *b_)
+{
+    double a = *(const double*)a_, b = *(const double*)b_;
+    return (a > b) - (a < b);
+}
+
+static void
+send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while (len > 0) {
+        if ((res = send(fd, buf, len, 0)) < 0) {
+            perror("send");
+            exit(1);
+        }
+        buf += res;
+        len -= res;
+    }
+}
+
+/* Returns non-zero if the line completes a response; counts errors. */
+static int
+response_done(const char *line, unsigned long *errors)
+{
+    const char *sp;
+
+    if (!legacy) {
+        if (strstr(line, "\"ok\":false"))
+            (*errors)++;
+        return 1;
+    }
+    if (!(sp = strchr(line, ' ')))
+        return 0;
+    if (sp[1] == 'X' || !strcmp(sp + 1, "MISSING_ARGS")) {
+        (*errors)++;
+        return 1;
+    }
+    return sp[1] == 'E' && (sp[2] == '\0' || sp[2] == '\r');
+}
+
+/* Reads until <count> more responses have completed, recording the
+ * latency of each numbered request. */
+static unsigned long
+read_responses(int fd, unsigned long count, unsigned long first, struct timeval *sent, unsigned int window, double *latency, unsigned long *errors)
+{
+    static char buf[65536];
+    static size_t used;
+    unsigned long done;
+    char *line, *nl;
+    ssize_t res;
+
+    for (done = 0; ; ) {
+        buf[used] = '\0';
+        for (line = buf; done < count && (nl = strchr(line, '\n')); line = nl + 1) {
+            *nl = '\0';
+            if (response_done(line, errors)) {
+                if (latency)
+                    latency[first + done] = elapsed(&sent[(first + done) % window]);
+                done++;
+            }
+        }
+        used -= line - buf;
+        memmove(buf, line, used);
+        if (done == count)
+            break;
+        if (used == sizeof(buf) - 1) {
+            fprintf(stderr, "response line too long\n");
+            exit(1);
+        }
+        if ((res = recv(fd, buf + used, sizeof(buf) - used - 1, 0)) <= 0) {
+            fprintf(stderr, "connection closed after %lu responses\n", first + done);
+            exit(1);
+        }
+        used += res;
+    }
+    return done;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct addrinfo hints, *ai;
+    struct timeval start, *sent;
+    const char *password = NULL;
+    char request[512], line[600], batch[16384];
+    unsigned long requests = 100000, issued, completed, errors, setup, ii;
+    unsigned int window = 64;
+    double *latency, total, sum;
+    int opt, fd, res;
+    size_t len;
+
+    while ((opt = getopt(argc, argv, "lp:n:w:")) != -1) {
+        switch (opt) {
+        case 'l': legacy = 1; break;
+        case 'p': password = optarg; break;
+        case 'n': requests = strtoul(optarg, NULL, 0); break;
+        case 'w': window = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-l] [-p password] [-n requests] [-w window] host port target [args...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 3 || !requests || !window) {
+        fprintf(stderr, "usage: %s [-l] [-p password] [-n requests] [-w window] host port target [args...]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((res = getaddrinfo(argv[optind], argv[optind + 1], &hints, &ai))) {
+        fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(res));
+        return 1;
+    }
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        return 1;
+    }
+    freeaddrinfo(ai);
+
+    for (len = 0, ii = optind + 2; ii < (unsigned long)argc; ii++)
+        len += snprintf(request + len, sizeof(request) - len, "%s%s", len ? " " : "", argv[ii]);
+
+    /* The classic framing does not answer a successful PASS, so check
+     * it through the answer to the MODE request that follows it. */
+    errors = 0;
+    if (password) {
+        snprintf(line, sizeof(line), "p PASS %s\n", password);
+        send_all(fd, line, strlen(line));
+    }
+    setup = legacy ? 0 : 1;
+    if (!legacy)
+        send_all(fd, "m MODE JSON\n", 12);
+    if (setup) {
+        read_responses(fd, setup, 0, NULL, 1, NULL, &errors);
+        if (errors) {
+            fprintf(stderr, "setup failed\n");
+            return 1;
+        }
+    }
+
+    sent = calloc(window, sizeof(sent[0]));
+    latency = calloc(requests, sizeof(latency[0]));
+    gettimeofday(&start, NULL);
+    for (issued = completed = 0; completed < requests; ) {
+        for (len = 0; issued < requests && issued - completed < window && len + sizeof(line) <= sizeof(batch); issued++) {
+            gettimeofday(&sent[issued % window], NULL);
+            len += snprintf(batch + len, sizeof(batch) - len, "%lu %s\n", issued, request);
+        }
+        if (len)
+            send_all(fd, batch, len);
+        completed += read_responses(fd, 1, completed, sent, window, latency, &errors);
+    }
+    total = elapsed(&start);
+    close(fd);
+
+    qsort(latency, requests, sizeof(latency[0]), compare_doubles);
+    for (ii = 0, sum = 0; ii < requests; ii++)
+        sum += latency[ii];
+    printf("%lu requests (%lu errors) in %.3f s: %.0f requests/s\n", requests, errors, total, requests / total);
+    printf("latency ms: avg %.3f  p50 %.3f  p99 %.3f  max %.3f\n",
+           sum * 1000 / requests,
+           latency[requests / 2] * 1000,
+           latency[requests - 1 - requests / 100] * 1000,
+           latency[requests - 1] * 1000);
+    free(latency);
+    free(sent);
+    return 0;
+}
@@ -20,10 +20,16 @@
 
 #include "sar.h"
 #include "conf.h"
+#include "heap.h"
 #include "ioset.h"
 #include "log.h"
+#include "metrics.h"
 #include "timeq.h"
 
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
 #if defined(HAVE_NETINET_IN_H)
 # include <netinet/in.h> /* sockaddr_in6 on some BSDs */
 #endif
@@ -161,8 +167,13 @@ sar_free(struct addrinfo *ai)
 static struct {
     unsigned int sar_timeout;
     unsigned int sar_retries;
+    unsigned int sar_backoff;
     unsigned int sar_ndots;
     unsigned int sar_edns0;
+    unsigned int sar_port;
+    unsigned int sar_cache_size;
+    unsigned int sar_cache_max_ttl;
+    unsigned int sar_cache_neg_ttl;
     char sar_localdomain[MAXLEN];
     struct string_list *sar_search;
     struct string_list *sar_nslist;
@@ -179,9 +190,11 @@ static struct log_type *sar_log;
  * future support.
  * DNSSEC (including RFCs 2535, 3007, 3655, etc) is less likely until
  * a good application is found.
- * Caching (RFC 2308) and redirection (RFC 2672) are much less likely,
- * since most users will have a separate local, caching, recursive
- * nameserver.
+ * Redirection (RFC 2672) is much less likely, since most users will
+ * have a separate local, caching, recursive nameserver.  We do keep a
+ * small answer cache (honoring TTLs and, for negative answers, the SOA
+ * minimum from RFC 2308) because DNSBL lookups for clones and
+ * reconnecting clients repeat the same questions within seconds.
  * Other DNS extensions (at least through RFC 3755) are believed to be
  * too rare or insufficiently useful to bother supporting.
  *
@@ -201,6 +214,9 @@ struct sar_nameserver {
     unsigned int resp_fallback;
     unsigned int resp_failures;
     unsigned int resp_scrambled;
+    unsigned int timeouts;
+    unsigned int rtt_samples;
+    unsigned long srtt; /* smoothed round trip time, msec */
     unsigned int ss_len;
     void *ss;
 };
@@ -221,8 +237,13 @@ enum {
 #define RES_SF_LABEL   0x00
 #define RES_SF_POINTER 0xc0
 
-static dict_t sar_requests;
+static struct sar_request *sar_requests[65536];
+static unsigned int sar_request_count;
+static unsigned long sar_request_serial;
+static heap_t sar_deadlines;
+static time_t sar_deadline_timer;
 static dict_t sar_nameservers;
+static dict_t sar_inflight;
 static struct io_fd *sar_fd;
 static int sar_fd_fd;
 
@@ -246,63 +267,156 @@ sar_rcode_text(unsigned int rcode)
     }
 }
 
+/* A request whose question is already in flight is not sent; it is
+ * linked onto the waiters list of the request that was, and gets the
+ * same answer (or failure).  sar_inflight maps each question key to
+ * the request that was sent for it.  The doubly linked waiter lists
+ * let any waiter be unlinked, even from a list that has already been
+ * moved onto the stack for delivery. */
+
+static void
+sar_waiter_unlink(struct sar_request *req)
+{
+    if (!req->prev_waiter)
+        return;
+    *req->prev_waiter = req->next_waiter;
+    if (req->next_waiter)
+        req->next_waiter->prev_waiter = req->prev_waiter;
+    req->next_waiter = NULL;
+    req->prev_waiter = NULL;
+}
+
+static void
+sar_waiter_link(struct sar_request **head, struct sar_request *req)
+{
+    req->next_waiter = *head;
+    if (*head)
+        (*head)->prev_waiter = &req->next_waiter;
+    req->prev_waiter = head;
+    *head = req;
+}
+
+/** Move \a req's waiters onto the list at \a head. */
+static void
+sar_take_waiters(struct sar_request *req, struct sar_request **head)
+{
+    *head = req->waiters;
+    req->waiters = NULL;
+    if (*head)
+        (*head)->prev_waiter = head;
+}
+
+static void
+sar_request_unflight(struct sar_request *req)
+{
+    if (req->key && dict_find(sar_inflight, req->key, NULL) == req)
+        dict_remove(sar_inflight, req->key);
+}
+
 static void
 sar_request_fail(struct sar_request *req, unsigned int rcode)
 {
+    struct sar_request *waiters, *waiter;
+
     log_module(sar_log, LOG_DEBUG, "sar_request_fail({id=%d}, rcode=%d)", req->id, rcode);
+    sar_request_unflight(req);
+    sar_take_waiters(req, &waiters);
     req->expiry = 0;
-    if (req->cb_fail) {
+    if (req->cb_fail)
         req->cb_fail(req, rcode);
-        if (req->expiry)
-            return;
+    if (!req->expiry)
+        sar_request_abort(req);
+    while ((waiter = waiters)) {
+        sar_waiter_unlink(waiter);
+        sar_request_fail(waiter, rcode);
     }
-    sar_request_abort(req);
 }
 
-static unsigned long next_sar_timeout;
+/* Pending requests are indexed by deadline in sar_deadlines.  Each
+ * heap entry names its request by id and serial number, and is
+ * skipped when it pops if that request has since gone away or been
+ * sent again.  Only the earliest deadline has a timeq entry.
+ */
+#define SAR_DEADLINE_TOKEN(REQ) ((void*)(((REQ)->serial << 16) | (REQ)->id))
+#define SAR_MAX_RTT 60000
 
 static void
 sar_timeout_cb(void *data)
 {
-    dict_iterator_t it;
-    dict_iterator_t next;
-    time_t next_timeout = INT_MAX;
-
-    for (it = dict_first(sar_requests); it; it = next) {
-        struct sar_request *req;
+    struct sar_request *req;
+    unsigned long token;
+    void *key, *tok;
 
-        req = iter_data(it);
-        next = iter_next(it);
-        if (req->expiry > next_timeout)
+    /* A later timer superseded by an earlier one; that one reschedules. */
+    if ((time_t)(unsigned long)data != sar_deadline_timer)
+        return;
+    sar_deadline_timer = 0;
+    while (heap_size(sar_deadlines)) {
+        heap_peek(sar_deadlines, &key, &tok);
+        if ((time_t)(unsigned long)key > now)
+            break;
+        heap_pop(sar_deadlines);
+        token = (unsigned long)tok;
+        req = sar_requests[token & 0xffff];
+        if (!req
+            || req->serial != token >> 16
+            || req->expiry != (time_t)(unsigned long)key
+            || req->prev_waiter)
             continue;
-        else if (req->expiry > now)
-            next_timeout = req->expiry;
-        else if (req->retries >= conf.sar_retries)
+        if (req->ns) {
+            /* Steer later queries away from a server that stopped answering. */
+            struct sar_nameserver *ns = req->ns;
+            ns->timeouts++;
+            ns->rtt_samples++;
+            ns->srtt = ns->srtt * 2;
+            if (ns->srtt < conf.sar_timeout * 1000)
+                ns->srtt = conf.sar_timeout * 1000;
+            if (ns->srtt > SAR_MAX_RTT)
+                ns->srtt = SAR_MAX_RTT;
+        }
+        if (req->retries >= conf.sar_retries)
             sar_request_fail(req, RCODE_TIMED_OUT);
         else
             sar_request_send(req);
     }
-    if (next_timeout < INT_MAX) {
-        next_sar_timeout = next_timeout;
-        timeq_add(next_timeout, sar_timeout_cb, data);
+    /* Requests sent again above may have set a later timer. */
+    if (heap_size(sar_deadlines)) {
+        heap_peek(sar_deadlines, &key, NULL);
+        if (!sar_deadline_timer || (time_t)(unsigned long)key < sar_deadline_timer) {
+            sar_deadline_timer = (time_t)(unsigned long)key;
+            timeq_add(sar_deadline_timer, sar_timeout_cb, key);
+        }
     }
 }
 
 static void
-sar_check_timeout(unsigned long when)
+sar_check_timeout(struct sar_request *req)
 {
-    if (!next_sar_timeout || when < next_sar_timeout) {
-        timeq_del(0, sar_timeout_cb, NULL, TIMEQ_IGNORE_WHEN | TIMEQ_IGNORE_DATA);
-        timeq_add(when, sar_timeout_cb, NULL);
-        next_sar_timeout = when;
+    heap_insert(sar_deadlines, (void*)(unsigned long)req->expiry, SAR_DEADLINE_TOKEN(req));
+    /* Leave any later timer in place; it will notice it is stale. */
+    if (!sar_deadline_timer || req->expiry < sar_deadline_timer) {
+        sar_deadline_timer = req->expiry;
+        timeq_add(sar_deadline_timer, sar_timeout_cb, (void*)(unsigned long)sar_deadline_timer);
     }
 }
 
+static void sar_cache_deliver(void *data);
+
 static void
 sar_request_cleanup(void *d)
 {
     struct sar_request *req = d;
     log_module(sar_log, LOG_DEBUG, "sar_request_cleanup({id=%d})", req->id);
+    /* Any waiters left here are being destroyed along with us. */
+    while (req->waiters)
+        sar_waiter_unlink(req->waiters);
+    sar_waiter_unlink(req);
+    sar_request_unflight(req);
+    if (req->answer) {
+        timeq_del(0, sar_cache_deliver, req, TIMEQ_IGNORE_WHEN);
+        free(req->answer);
+    }
+    free(req->key);
     free(req->body);
     if (req->cb_fail)
         req->cb_fail(req, RCODE_DESTROYED);
@@ -322,8 +436,13 @@ sar_dns_init(const char *resolv_conf_path)
     conf.sar_localdomain[0] = '\0';
     conf.sar_timeout = 3;
     conf.sar_retries = 3;
+    conf.sar_backoff = 2;
     conf.sar_ndots = 1;
     conf.sar_edns0 = 0;
+    conf.sar_port = 53;
+    conf.sar_cache_size = 4096;
+    conf.sar_cache_max_ttl = 3600;
+    conf.sar_cache_neg_ttl = 300;
     ns_sv = alloc_string_list(4);
     ds_sv = alloc_string_list(4);
 
@@ -399,12 +518,22 @@ sar_dns_init(const char *resolv_conf_path)
         if (str) conf.sar_timeout = ParseInterval(str);
         str = database_get_data(node, "retries", RECDB_QSTRING);
         if (str) conf.sar_retries = atoi(str);
+        str = database_get_data(node, "retry_backoff", RECDB_QSTRING);
+        if (str) conf.sar_backoff = atoi(str);
         str = database_get_data(node, "ndots", RECDB_QSTRING);
         if (str) conf.sar_ndots = atoi(str);
         str = database_get_data(node, "edns0", RECDB_QSTRING);
         if (str) conf.sar_edns0 = enabled_string(str);
         str = database_get_data(node, "domain", RECDB_QSTRING);
         if (str) safestrncpy(conf.sar_localdomain, str, sizeof(conf.sar_localdomain));
+        str = database_get_data(node, "nameserver_port", RECDB_QSTRING);
+        if (str) conf.sar_port = atoi(str);
+        str = database_get_data(node, "cache_size", RECDB_QSTRING);
+        if (str) conf.sar_cache_size = atoi(str);
+        str = database_get_data(node, "cache_max_ttl", RECDB_QSTRING);
+        if (str) conf.sar_cache_max_ttl = ParseInterval(str);
+        str = database_get_data(node, "cache_negative_ttl", RECDB_QSTRING);
+        if (str) conf.sar_cache_neg_ttl = ParseInterval(str);
         slist = database_get_data(node, "search", RECDB_STRING_LIST);
         if (slist) {
             free_string_list(ds_sv);
@@ -441,16 +570,28 @@ sar_dns_init(const char *resolv_conf_path)
     conf.sar_nslist = ns_sv;
 }
 
+static void sar_request_promote(struct sar_request *req);
+
+static void
+sar_request_free(struct sar_request *req)
+{
+    sar_requests[req->id] = NULL;
+    sar_request_count--;
+    sar_request_cleanup(req);
+}
+
 void
 sar_request_abort(struct sar_request *req)
 {
     if (!req)
         return;
-    assert(dict_find(sar_requests, req->id_text, NULL) == req);
+    assert(sar_requests[req->id] == req);
     log_module(sar_log, LOG_DEBUG, "sar_request_abort({id=%d})", req->id);
+    if (req->waiters)
+        sar_request_promote(req);
     req->cb_ok = NULL;
     req->cb_fail = NULL;
-    dict_remove(sar_requests, req->id_text);
+    sar_request_free(req);
 }
 
 static struct sar_nameserver *
@@ -582,7 +723,7 @@ sar_decode_answer(struct sar_request *req, struct dns_header *hdr, unsigned char
     if (!req->expiry) {
         req->cb_ok = NULL;
         req->cb_fail = NULL;
-        dict_remove(sar_requests, req->id_text);
+        sar_request_free(req);
     }
 
 out:
@@ -602,17 +743,312 @@ sar_extract_rdata(struct dns_rr *rr, unsigned int len, unsigned char *raw, unsig
     return raw + rr->rd_start;
 }
 
+static void
+sar_read_header(struct dns_header *hdr, const unsigned char *buf)
+{
+    hdr->id = buf[0] << 8 | buf[1];
+    hdr->flags = buf[2] << 8 | buf[3];
+    hdr->qdcount = buf[4] << 8 | buf[5];
+    hdr->ancount = buf[6] << 8 | buf[7];
+    hdr->nscount = buf[8] << 8 | buf[9];
+    hdr->arcount = buf[10] << 8 | buf[11];
+}
+
+/** Pass a response to \a req's callbacks.  Returns non-zero if the
+ * response could not be parsed. */
+static int
+sar_request_answer(struct sar_request *req, unsigned char *buf, unsigned int size)
+{
+    struct dns_header hdr;
+    unsigned int rcode;
+
+    sar_read_header(&hdr, buf);
+    rcode = hdr.flags & REQ_FLAG_RCODE_MASK;
+    if (rcode != RCODE_NO_ERROR) {
+        sar_request_fail(req, rcode);
+    } else if (sar_decode_answer(req, &hdr, buf, size)) {
+        sar_request_fail(req, RCODE_FORMAT_ERROR);
+        return 1;
+    }
+    return 0;
+}
+
+/* Answer cache.  Entries are keyed by the question section (see
+ * sar_question_key()) and hold the raw response packet.  Expiry times
+ * are also queued by key in a heap, soonest first; when the cache is
+ * full, the entry closest to expiring is dropped.  Heap entries for
+ * keys that were replaced or dropped early are skipped by comparing
+ * expiry times. */
+
+struct sar_cache_entry {
+    time_t expires;
+    unsigned int size;
+    unsigned char *packet;
+    char *key;
+};
+
+static struct {
+    dict_t entries;
+    heap_t expiry;
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long coalesced;
+    unsigned long misses;
+    unsigned long evicted;
+} sar_cache;
+
+/** Build the cache key for a request packet: "qtype:qname" for each
+ * question, separated by spaces. */
+static char *
+sar_question_key(const unsigned char *body, unsigned int body_len)
+{
+    struct string_buffer key;
+    unsigned int qdcount, ii, pos;
+    char *name, qtype[8];
+
+    if (body_len < 12)
+        return NULL;
+    qdcount = body[4] << 8 | body[5];
+    key.used = 0;
+    key.size = 64;
+    key.list = malloc(key.size);
+    for (ii = 0, pos = 12; ii < qdcount; ++ii) {
+        name = sar_extract_name(body, body_len, &pos);
+        if (!name || pos + 4 > body_len) {
+            free(name);
+            string_buffer_clean(&key);
+            return NULL;
+        }
+        snprintf(qtype, sizeof(qtype), "%u:", body[pos] << 8 | body[pos+1]);
+        if (ii)
+            string_buffer_append(&key, ' ');
+        string_buffer_append_string(&key, qtype);
+        string_buffer_append_string(&key, name);
+        free(name);
+        pos += 4;
+    }
+    string_buffer_append(&key, '\0');
+    return key.list;
+}
+
+/** Work out how long a response may be cached, or zero if it should
+ * not be.  Positive answers use the smallest answer TTL; negative
+ * ones use the SOA from the authority section (RFC 2308 section 5). */
+static unsigned int
+sar_answer_ttl(const unsigned char *buf, unsigned int size)
+{
+    struct dns_header hdr;
+    unsigned int ii, pos, rcode, type, rdlength, ttl, min_ttl, neg_ttl;
+    char *name;
+
+    sar_read_header(&hdr, buf);
+    rcode = hdr.flags & REQ_FLAG_RCODE_MASK;
+    if ((hdr.flags & REQ_FLAG_TC)
+        || (rcode != RCODE_NO_ERROR && rcode != RCODE_NAME_ERROR))
+        return 0;
+
+    /* Skip over query section. */
+    for (ii = 0, pos = 12; ii < hdr.qdcount; ++ii) {
+        if (!(name = sar_extract_name(buf, size, &pos)))
+            return 0;
+        free(name);
+        pos += 4;
+    }
+
+    min_ttl = conf.sar_cache_max_ttl;
+    neg_ttl = conf.sar_cache_neg_ttl;
+    for (ii = 0; ii < (unsigned int)hdr.ancount + hdr.nscount; ++ii) {
+        if (!(name = sar_extract_name(buf, size, &pos)))
+            return 0;
+        free(name);
+        if (pos + 10 > size)
+            return 0;
+        type = buf[pos+0] << 8 | buf[pos+1];
+        ttl = buf[pos+4] << 24 | buf[pos+5] << 16 | buf[pos+6] << 8 | buf[pos+7];
+        rdlength = buf[pos+8] << 8 | buf[pos+9];
+        pos += 10;
+        if (pos + rdlength > size)
+            return 0;
+        if (ii < hdr.ancount) {
+            if (ttl < min_ttl)
+                min_ttl = ttl;
+        } else if (type == REQ_TYPE_SOA && rdlength >= 20) {
+            /* The SOA MINIMUM field is the last in the RDATA. */
+            unsigned int minimum = buf[pos+rdlength-4] << 24 | buf[pos+rdlength-3] << 16 | buf[pos+rdlength-2] << 8 | buf[pos+rdlength-1];
+            if (minimum < ttl)
+                ttl = minimum;
+            if (ttl < neg_ttl)
+                neg_ttl = ttl;
+        }
+        pos += rdlength;
+    }
+    return (rcode == RCODE_NO_ERROR && hdr.ancount) ? min_ttl : neg_ttl;
+}
+
+/** Drop expired entries, and then the soonest-expiring ones until
+ * there is room for \a room more. */
+static void
+sar_cache_prune(unsigned int room)
+{
+    struct sar_cache_entry *entry;
+    void *when;
+    char *key;
+
+    while (heap_size(sar_cache.expiry)) {
+        heap_peek(sar_cache.expiry, &when, (void**)&key);
+        if ((time_t)when > now
+            && dict_size(sar_cache.entries) + room <= conf.sar_cache_size)
+            break;
+        heap_pop(sar_cache.expiry);
+        entry = dict_find(sar_cache.entries, key, NULL);
+        if (entry && entry->expires == (time_t)when) {
+            if (entry->expires > now)
+                sar_cache.evicted++;
+            dict_remove(sar_cache.entries, key);
+        }
+        free(key);
+    }
+}
+
+static void
+sar_cache_store(struct sar_request *req, const unsigned char *buf, unsigned int size)
+{
+    struct sar_cache_entry *entry;
+    unsigned int ttl, key_len;
+
+    if (!req->key || !conf.sar_cache_size)
+        return;
+    ttl = sar_answer_ttl(buf, size);
+    if (!ttl)
+        return;
+    dict_remove(sar_cache.entries, req->key);
+    sar_cache_prune(1);
+    key_len = strlen(req->key) + 1;
+    entry = malloc(sizeof(*entry) + key_len + size);
+    entry->expires = now + ttl;
+    entry->size = size;
+    entry->key = (char*)(entry + 1);
+    memcpy(entry->key, req->key, key_len);
+    entry->packet = (unsigned char*)entry->key + key_len;
+    memcpy(entry->packet, buf, size);
+    dict_insert(sar_cache.entries, entry->key, entry);
+    heap_insert(sar_cache.expiry, (void*)entry->expires, strdup(entry->key));
+}
+
+static void
+sar_cache_deliver(void *data)
+{
+    struct sar_request *req = data;
+    unsigned char *answer;
+
+    answer = req->answer;
+    req->answer = NULL;
+    sar_request_answer(req, answer, req->answer_len);
+    free(answer);
+}
+
+/** Try to satisfy \a req without sending it: from the cache, or by
+ * waiting on an identical request.  Returns non-zero if that worked. */
+static int
+sar_cache_lookup(struct sar_request *req)
+{
+    struct sar_cache_entry *entry;
+    struct sar_request *sent;
+
+    entry = dict_find(sar_cache.entries, req->key, NULL);
+    if (entry && entry->expires > now) {
+        if (((entry->packet[3] & REQ_FLAG_RCODE_MASK) != RCODE_NO_ERROR)
+            || !(entry->packet[6] | entry->packet[7]))
+            sar_cache.negative_hits++;
+        sar_cache.hits++;
+        /* Deliver from the event loop: callers such as
+         * sar_request_simple() users fill in their data after the
+         * request is "sent". */
+        free(req->answer);
+        req->answer = malloc(entry->size);
+        memcpy(req->answer, entry->packet, entry->size);
+        req->answer_len = entry->size;
+        req->expiry = now + conf.sar_timeout;
+        timeq_add(now, sar_cache_deliver, req);
+        return 1;
+    } else if (entry) {
+        dict_remove(sar_cache.entries, req->key);
+    }
+
+    sent = dict_find(sar_inflight, req->key, NULL);
+    if (sent && sent != req) {
+        sar_cache.coalesced++;
+        req->expiry = 0;
+        sar_waiter_link(&sent->waiters, req);
+        return 1;
+    }
+
+    sar_cache.misses++;
+    dict_insert(sar_inflight, req->key, req);
+    return 0;
+}
+
+/** When a request with waiters is aborted, send the first waiter in
+ * its place and move the rest to it. */
+static void
+sar_request_promote(struct sar_request *req)
+{
+    struct sar_request *first;
+
+    sar_request_unflight(req);
+    first = req->waiters;
+    sar_waiter_unlink(first);
+    first->waiters = req->waiters;
+    req->waiters = NULL;
+    if (first->waiters)
+        first->waiters->prev_waiter = &first->waiters;
+    dict_insert(sar_inflight, first->key, first);
+    sar_request_send(first);
+}
+
+void
+sar_get_stats(struct sar_stats *stats)
+{
+    stats->cache_entries = sar_cache.entries ? dict_size(sar_cache.entries) : 0;
+    stats->cache_size = conf.sar_cache_size;
+    stats->pending = sar_request_count;
+    stats->hits = sar_cache.hits;
+    stats->negative_hits = sar_cache.negative_hits;
+    stats->coalesced = sar_cache.coalesced;
+    stats->misses = sar_cache.misses;
+    stats->evicted = sar_cache.evicted;
+}
+
+unsigned int
+sar_get_nameserver_stats(struct sar_nameserver_stats *stats, unsigned int count)
+{
+    dict_iterator_t it;
+    struct sar_nameserver *ns;
+    unsigned int ii;
+
+    if (!sar_nameservers)
+        return 0;
+    for (ii = 0, it = dict_first(sar_nameservers); it && ii < count; it = iter_next(it), ++ii) {
+        ns = iter_data(it);
+        stats[ii].name = ns->name;
+        stats[ii].sent = ns->req_sent;
+        stats[ii].answered = ns->resp_used;
+        stats[ii].timeouts = ns->timeouts;
+        stats[ii].srtt = ns->srtt;
+    }
+    return dict_size(sar_nameservers);
+}
+
 static void
 sar_fd_readable(struct io_fd *fd)
 {
     struct dns_header hdr;
     struct sar_nameserver *ns;
-    struct sar_request *req;
+    struct sar_request *req, *waiters, *waiter;
     void *ss;
     unsigned char *buf;
     socklen_t ss_len;
-    int res, rcode, buf_len;
-    char id_text[6];
+    int res, buf_len;
 
     assert(sar_fd == fd);
     buf_len = conf.sar_edns0;
@@ -624,26 +1060,37 @@ sar_fd_readable(struct io_fd *fd)
     res = recvfrom(sar_fd_fd, buf, buf_len, 0, (struct sockaddr*)ss, &ss_len);
     if (res < 12 || !(ns = sar_our_server((struct sockaddr_storage*)ss, ss_len)))
         return;
-    hdr.id = buf[0] << 8 | buf[1];
-    hdr.flags = buf[2] << 8 | buf[3];
-    hdr.qdcount = buf[4] << 8 | buf[5];
-    hdr.ancount = buf[6] << 8 | buf[7];
-    hdr.nscount = buf[8] << 8 | buf[9];
-    hdr.arcount = buf[10] << 8 | buf[11];
-
-    sprintf(id_text, "%d", hdr.id);
-    req = dict_find(sar_requests, id_text, NULL);
+    sar_read_header(&hdr, buf);
+
+    req = sar_requests[hdr.id];
     log_module(sar_log, LOG_DEBUG, "sar_fd_readable(%p): hdr {id=%d, flags=0x%x, qdcount=%d, ancount=%d, nscount=%d, arcount=%d} -> req %p", (void*)fd, hdr.id, hdr.flags, hdr.qdcount, hdr.ancount, hdr.nscount, hdr.arcount, (void*)req);
     if (!req || !req->retries || !(hdr.flags & REQ_FLAG_QR)) {
         ns->resp_ignored++;
         return;
     }
-    rcode = hdr.flags & REQ_FLAG_RCODE_MASK;
-    if (rcode != RCODE_NO_ERROR) {
-        sar_request_fail(req, rcode);
-    } else if (sar_decode_answer(req, &hdr, (unsigned char*)buf, res)) {
+    ns->resp_used++;
+    if (ns == req->ns) {
+        struct timeval tv;
+        unsigned long rtt;
+
+        gettimeofday(&tv, NULL);
+        rtt = tv.tv_sec * 1000 + tv.tv_usec / 1000 - req->sent;
+        if (rtt > SAR_MAX_RTT)
+            rtt = SAR_MAX_RTT;
+        if (ns->rtt_samples++)
+            ns->srtt = (ns->srtt * 7 + rtt) / 8;
+        else
+            ns->srtt = rtt;
+    } else
+        ns->resp_fallback++;
+    sar_cache_store(req, buf, res);
+    sar_request_unflight(req);
+    sar_take_waiters(req, &waiters);
+    if (sar_request_answer(req, buf, res))
         ns->resp_scrambled++;
-        sar_request_fail(req, RCODE_FORMAT_ERROR);
+    while ((waiter = waiters)) {
+        sar_waiter_unlink(waiter);
+        sar_request_answer(waiter, buf, res);
     }
 }
 
@@ -676,7 +1123,7 @@ sar_build_nslist(struct string_list *nslist)
                 free(it);
                 continue;
             }
-            sar_set_port(sa, ns->ss_len, 53);
+            sar_set_port(sa, ns->ss_len, conf.sar_port);
             ns->ss_len = sar_helpers[sa->sa_family]->socklen;
             dict_insert(sar_nameservers, ns->name, ns);
         }
@@ -686,8 +1133,12 @@ sar_build_nslist(struct string_list *nslist)
     for (it = dict_first(sar_nameservers); it; it = next) {
         next = iter_next(it);
         ns = iter_data(it);
-        if (!ns->valid)
-            dict_remove(sar_nameservers, ns->name);
+        if (ns->valid)
+            continue;
+        for (ii = 0; ii < ArrayLength(sar_requests); ++ii)
+            if (sar_requests[ii] && sar_requests[ii]->ns == ns)
+                sar_requests[ii]->ns = NULL;
+        dict_remove(sar_nameservers, ns->name);
     }
 }
 
@@ -872,6 +1323,10 @@ out:
     free(req->body);
     req->body = (unsigned char*)cv.list;
     req->body_len = cv.used;
+    sar_request_unflight(req);
+    free(req->key);
+    req->key = sar_question_key(req->body, req->body_len);
+    req->looked_up = 0;
     return cv.used;
 }
 
@@ -890,10 +1345,34 @@ sar_request_build(struct sar_request *req, ...)
     return ret;
 }
 
+static struct sar_nameserver *
+sar_pick_nameserver(struct sar_nameserver *last)
+{
+    dict_iterator_t it;
+    struct sar_nameserver *ns, *best;
+
+    for (best = NULL, it = dict_first(sar_nameservers); it; it = iter_next(it)) {
+        ns = iter_data(it);
+        if (ns == last && dict_size(sar_nameservers) > 1)
+            continue;
+        if (!best || ns->srtt < best->srtt)
+            best = ns;
+    }
+    return best;
+}
+
 void
 sar_request_send(struct sar_request *req)
 {
-    dict_iterator_t it;
+    struct sar_nameserver *ns;
+    unsigned int delay, ii;
+
+    /* Answer from the cache or an identical pending request if we can. */
+    if (req->key && !req->looked_up) {
+        req->looked_up = 1;
+        if (sar_cache_lookup(req))
+            return;
+    }
 
     /* make sure we have our local socket */
     if (!sar_fd && sar_open_fd()) {
@@ -903,12 +1382,13 @@ sar_request_send(struct sar_request *req)
 
     log_module(sar_log, LOG_DEBUG, "sar_request_send({id=%d})", req->id);
 
-    /* send query to each configured nameserver */
-    for (it = dict_first(sar_nameservers); it; it = iter_next(it)) {
-        struct sar_nameserver *ns;
+    /* Each attempt goes to a single nameserver: the fastest one first,
+     * then the fastest one we did not just try. */
+    ns = sar_pick_nameserver(req->ns);
+    if (ns) {
+        struct timeval tv;
         int res;
 
-        ns = iter_data(it);
         res = sendto(sar_fd_fd, req->body, req->body_len, 0, (struct sockaddr*)ns->ss, ns->ss_len);
         if (res > 0) {
             ns->req_sent++;
@@ -917,11 +1397,19 @@ sar_request_send(struct sar_request *req)
             log_module(sar_log, LOG_ERROR, "Unable to send %u bytes to nameserver %s: %s", req->body_len, ns->name, strerror(errno));
         else /* res == 0 */
             assert(0 && "resolver sendto() unexpectedly returned zero");
+        gettimeofday(&tv, NULL);
+        req->sent = tv.tv_sec * 1000 + tv.tv_usec / 1000;
     }
+    req->ns = ns;
 
-    /* Check that query timeout is soon enough. */
-    req->expiry = now + (conf.sar_timeout << ++req->retries);
-    sar_check_timeout(req->expiry);
+    /* Back off before the next attempt. */
+    for (delay = conf.sar_timeout, ii = 0; ii < req->retries && delay < 3600; ++ii)
+        delay *= conf.sar_backoff;
+    if (delay < 1)
+        delay = 1;
+    req->retries++;
+    req->expiry = now + delay;
+    sar_check_timeout(req);
 }
 
 struct sar_request *
@@ -929,14 +1417,19 @@ sar_request_alloc(unsigned int data_len, sar_request_ok_cb ok_cb, sar_request_fa
 {
     struct sar_request *req;
 
+    if (sar_request_count >= ArrayLength(sar_requests)) {
+        log_module(sar_log, LOG_ERROR, "Unable to allocate a resolver request: all %u ids are in use.", sar_request_count);
+        return NULL;
+    }
     req = calloc(1, sizeof(*req) + data_len);
     req->cb_ok = ok_cb;
     req->cb_fail = fail_cb;
+    req->serial = ++sar_request_serial & (ULONG_MAX >> 16);
     do {
         req->id = rand() & 0xffff;
-        sprintf(req->id_text, "%d", req->id);
-    } while (dict_find(sar_requests, req->id_text, NULL));
-    dict_insert(sar_requests, req->id_text, req);
+    } while (sar_requests[req->id]);
+    sar_requests[req->id] = req;
+    sar_request_count++;
     log_module(sar_log, LOG_DEBUG, "sar_request_alloc(%d) -> {id=%d}", data_len, req->id);
     return req;
 }
@@ -1406,6 +1899,10 @@ sar_getaddr(const char *node, const char *service, const struct addrinfo *hints_
         unsigned int len, ii;
 
         req = sar_request_alloc(sizeof(*state), sar_getaddr_ok, sar_getaddr_fail);
+        if (!req) {
+            cb(cb_ctx, NULL, SAI_AGAIN);
+            return NULL;
+        }
 
         state = (struct sar_getaddr_state*)(req + 1);
         state->helper = helper;
@@ -1601,6 +2098,10 @@ sar_getname(const struct sockaddr *sa, unsigned int salen, int flags, sar_name_c
     }
 
     req = sar_request_alloc(sizeof(*state), sar_getname_ok, sar_getname_fail);
+    if (!req) {
+        cb(cb_ctx, NULL, NULL, SAI_AGAIN);
+        return NULL;
+    }
 
     state = (struct sar_getname_state*)(req + 1);
     state->cb = cb;
@@ -2024,11 +2525,25 @@ static struct sar_family_helper sar_ipv6_helper = {
 static void
 sar_cleanup(UNUSED_ARG(void *extra))
 {
+    unsigned int ii;
+
     ioset_close(sar_fd, 1);
     dict_delete(services_byname);
     dict_delete(services_byport);
+    for (ii = 0; ii < ArrayLength(sar_requests); ++ii)
+        if (sar_requests[ii])
+            sar_request_free(sar_requests[ii]);
+    heap_delete(sar_deadlines);
     dict_delete(sar_nameservers);
-    dict_delete(sar_requests);
+    dict_delete(sar_inflight);
+    dict_delete(sar_cache.entries);
+    while (heap_size(sar_cache.expiry)) {
+        char *key;
+        heap_peek(sar_cache.expiry, NULL, (void**)&key);
+        heap_pop(sar_cache.expiry);
+        free(key);
+    }
+    heap_delete(sar_cache.expiry);
     free_string_list(conf.sar_search);
     free_string_list(conf.sar_nslist);
 }
@@ -2050,6 +2565,19 @@ sar_conf_reload(void)
     }
     sar_dns_init(resolv_conf);
     sar_services_init(services);
+    sar_cache_prune(0);
+}
+
+static double
+sar_metric_requests(UNUSED_ARG(void *extra))
+{
+    return sar_request_count;
+}
+
+static double
+sar_metric_cache_entries(UNUSED_ARG(void *extra))
+{
+    return dict_size(sar_cache.entries);
 }
 
 void
@@ -2059,16 +2587,27 @@ sar_init(void)
     reg_exit_func(sar_cleanup, NULL);
     sar_log = log_register_type("sar", NULL);
 
-    sar_requests = dict_new();
-    dict_set_free_data(sar_requests, sar_request_cleanup);
+    sar_deadlines = heap_new(ulong_comparator);
 
     sar_nameservers = dict_new();
     dict_set_free_data(sar_nameservers, sar_free_nameserver);
 
+    sar_inflight = dict_new();
+    sar_cache.entries = dict_new();
+    dict_set_free_data(sar_cache.entries, free);
+    sar_cache.expiry = heap_new(ulong_comparator);
+
     sar_register_helper(&sar_ipv4_helper);
 #if defined(AF_INET6)
     sar_register_helper(&sar_ipv6_helper);
 #endif
 
+    metrics_register("x3_dns_requests", "DNS requests waiting for an answer.", METRIC_GAUGE, sar_metric_requests, NULL);
+    metrics_register("x3_dns_cache_entries", "Answers held in the DNS cache.", METRIC_GAUGE, sar_metric_cache_entries, NULL);
+    metrics_register_ulong("x3_dns_cache_hits_total", "DNS lookups answered from the cache.", METRIC_COUNTER, &sar_cache.hits);
+    metrics_register_ulong("x3_dns_cache_negative_hits_total", "DNS lookups answered from a cached failure.", METRIC_COUNTER, &sar_cache.negative_hits);
+    metrics_register_ulong("x3_dns_cache_coalesced_total", "DNS lookups that joined a request already in flight.", METRIC_COUNTER, &sar_cache.coalesced);
+    metrics_register_ulong("x3_dns_cache_misses_total", "DNS lookups sent to a nameserver.", METRIC_COUNTER, &sar_cache.misses);
+    metrics_register_ulong("x3_dns_cache_evicted_total", "DNS cache entries dropped before they expired.", METRIC_COUNTER, &sar_cache.evicted);
     conf_register_reload(sar_conf_reload);
 }
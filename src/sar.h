@@ -130,6 +130,7 @@ struct dns_rr {
 #define REQ_QCLASS_ALL 255
 
 struct sar_request;
+struct sar_nameserver;
 typedef void (*sar_request_ok_cb)(struct sar_request *req, struct dns_header *hdr, struct dns_rr *rr, unsigned char *raw, unsigned int raw_size);
 typedef void (*sar_request_fail_cb)(struct sar_request *req, unsigned int rcode);
 
@@ -144,7 +145,42 @@ struct sar_request {
     unsigned char *body;
     unsigned int body_len;
     unsigned char retries;
-    char id_text[6];
+    unsigned char looked_up;
+    unsigned long serial;
+    unsigned long sent;
+    struct sar_nameserver *ns;
+    char *key;
+    unsigned char *answer;
+    unsigned int answer_len;
+    struct sar_request *waiters;
+    struct sar_request *next_waiter;
+    struct sar_request **prev_waiter;
+};
+
+/** Resolver statistics.  Lookups are counted once per question sent
+ * by the user; hits are answered from the cache, and coalesced
+ * lookups shared an identical query that was already in flight.
+ */
+struct sar_stats {
+    unsigned int cache_entries;
+    unsigned int cache_size;
+    unsigned int pending;
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long coalesced;
+    unsigned long misses;
+    unsigned long evicted;
+};
+
+/** Per-nameserver statistics; srtt is the smoothed round trip time
+ * in milliseconds, which decides where queries are sent first.
+ */
+struct sar_nameserver_stats {
+    const char *name;
+    unsigned int sent;
+    unsigned int answered;
+    unsigned int timeouts;
+    unsigned long srtt;
 };
 
 const char *sar_rcode_text(unsigned int rcode);
@@ -154,5 +190,7 @@ void sar_request_send(struct sar_request *req);
 struct sar_request *sar_request_simple(unsigned int data_len, sar_request_ok_cb ok_cb, sar_request_fail_cb fail_cb, ...);
 void sar_request_abort(struct sar_request *req);
 char *sar_extract_name(const unsigned char *buf, unsigned int size, unsigned int *ppos);
+void sar_get_stats(struct sar_stats *stats);
+unsigned int sar_get_nameserver_stats(struct sar_nameserver_stats *stats, unsigned int count);
 
 #endif /* !defined(SRVX_SAR_H) */
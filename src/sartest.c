@@ -0,0 +1,423 @@
+#include "common.h"
+#include "conf.h"
+#include "helpfile.h"
+#include "ioset.h"
+#include "log.h"
+#include "sar.h"
+#include "teststubs.h"
+#include "timeq.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+/* Checks the resolver's answer cache and request coalescing against
+ * a stub nameserver on a loopback UDP port:
+ *
+ *   sartest [clients] [addresses] [zones] [delay-ms]
+ *
+ * Each round, every client looks its address up in every zone, the
+ * way mod-blacklist checks new users; several clients share each
+ * address, like clones.  The stub answers after delay-ms, listing
+ * every seventh address and returning NXDOMAIN with an SOA for the
+ * rest.  The first round should send one query per address and zone,
+ * the second none at all, and the third (once the negative answers
+ * have expired) only the unlisted ones.
+ *
+ * A second nameserver on 127.0.0.2 never answers.  The third round
+ * probes it first, since it has no round trip time yet, so every
+ * query there must time out and be retried on the stub; the last
+ * round (once everything has expired) should avoid it entirely.  The
+ * clock is run forward whenever the loop is idle, so timeouts do not
+ * take real time.  Reports queries, hit rates and lookup latency for
+ * each round, and exits non-zero if the query or timeout counts are
+ * wrong. */
+
+#define STUB_TTL     300
+#define STUB_NEG_TTL 120
+#define MAX_QUERIES  65536
+
+struct stub_query {
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    unsigned long due;
+    unsigned int len;
+    unsigned char packet[512];
+};
+
+static struct stub_query *stub_queries;
+static unsigned int stub_used;
+static unsigned long stub_received;
+static int stub_fd;
+
+static struct io_fd *sar_io_fd;
+static time_t time_offset;
+
+struct lookup {
+    struct timeval start;
+};
+
+static struct {
+    unsigned int pending;
+    unsigned int listed;
+    unsigned int unlisted;
+    unsigned int failed;
+    unsigned long total_usec;
+    unsigned long max_usec;
+} round_stats;
+
+static unsigned long
+msec_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+lookup_done(struct sar_request *req)
+{
+    struct lookup *lookup = (struct lookup*)(req + 1);
+    struct timeval stop;
+    unsigned long usec;
+
+    gettimeofday(&stop, NULL);
+    usec = (stop.tv_sec - lookup->start.tv_sec) * 1000000 + (stop.tv_usec - lookup->start.tv_usec);
+    round_stats.total_usec += usec;
+    if (usec > round_stats.max_usec)
+        round_stats.max_usec = usec;
+    round_stats.pending--;
+}
+
+static void
+lookup_ok(struct sar_request *req, struct dns_header *hdr, UNUSED_ARG(struct dns_rr *rr), UNUSED_ARG(unsigned char *raw), UNUSED_ARG(unsigned int raw_size))
+{
+    if (hdr->ancount)
+        round_stats.listed++;
+    else
+        round_stats.unlisted++;
+    lookup_done(req);
+}
+
+static void
+lookup_fail(struct sar_request *req, unsigned int rcode)
+{
+    if (rcode == RCODE_NAME_ERROR)
+        round_stats.unlisted++;
+    else
+        round_stats.failed++;
+    lookup_done(req);
+}
+
+/* Returns zero once there is nothing left to read. */
+static int
+stub_receive(void)
+{
+    struct stub_query *query;
+    int res;
+
+    if (stub_used == MAX_QUERIES)
+        return 0;
+    query = &stub_queries[stub_used];
+    query->from_len = sizeof(query->from);
+    res = recvfrom(stub_fd, query->packet, sizeof(query->packet), 0, (struct sockaddr*)&query->from, &query->from_len);
+    if (res < 0)
+        return 0;
+    if (res < 12)
+        return 1;
+    query->len = res;
+    query->due = 0;
+    stub_received++;
+    stub_used++;
+    return 1;
+}
+
+static int
+sar_readable(void)
+{
+    struct timeval timeout;
+    fd_set readfds;
+
+    if (!sar_io_fd)
+        return 0;
+    FD_ZERO(&readfds);
+    FD_SET(sar_io_fd->fd, &readfds);
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    return select(sar_io_fd->fd + 1, &readfds, NULL, NULL, &timeout) > 0;
+}
+
+/* Answer a query: A 127.0.0.2 if the first label is a multiple of
+ * seven, otherwise NXDOMAIN with an SOA in the authority section. */
+static void
+stub_answer(struct stub_query *query)
+{
+    unsigned char *pkt = query->packet;
+    unsigned int pos, listed, len, flags;
+
+    for (pos = 12; pos < query->len && pkt[pos]; pos += pkt[pos] + 1) ;
+    if (pos + 5 > query->len)
+        return;
+    pos += 5;
+    listed = (atoi((char*)pkt + 13) % 7) == 0;
+    flags = REQ_FLAG_QR | REQ_FLAG_RD | REQ_FLAG_RA | (listed ? RCODE_NO_ERROR : RCODE_NAME_ERROR);
+    pkt[2] = flags >> 8;
+    pkt[3] = flags & 255;
+    pkt[6] = 0; pkt[7] = listed;
+    pkt[8] = 0; pkt[9] = !listed;
+    pkt[10] = 0; pkt[11] = 0;
+    /* Owner name is a pointer to the question. */
+    pkt[pos++] = 0xc0;
+    pkt[pos++] = 12;
+    pkt[pos++] = 0;
+    pkt[pos++] = listed ? REQ_TYPE_A : REQ_TYPE_SOA;
+    pkt[pos++] = 0;
+    pkt[pos++] = REQ_CLASS_IN;
+    len = listed ? STUB_TTL : STUB_NEG_TTL * 5;
+    pkt[pos++] = len >> 24;
+    pkt[pos++] = len >> 16;
+    pkt[pos++] = len >> 8;
+    pkt[pos++] = len;
+    if (listed) {
+        pkt[pos++] = 0;
+        pkt[pos++] = 4;
+        pkt[pos++] = 127;
+        pkt[pos++] = 0;
+        pkt[pos++] = 0;
+        pkt[pos++] = 2;
+    } else {
+        /* Root MNAME and RNAME, then serial, refresh, retry, expire
+         * and minimum; the negative TTL is the minimum. */
+        pkt[pos++] = 0;
+        pkt[pos++] = 22;
+        memset(pkt + pos, 0, 18);
+        pos += 18;
+        pkt[pos++] = STUB_NEG_TTL >> 24;
+        pkt[pos++] = STUB_NEG_TTL >> 16;
+        pkt[pos++] = STUB_NEG_TTL >> 8;
+        pkt[pos++] = STUB_NEG_TTL & 255;
+    }
+    sendto(stub_fd, pkt, pos, 0, (struct sockaddr*)&query->from, query->from_len);
+}
+
+static void
+run_loop(unsigned int delay)
+{
+    struct timeval timeout;
+    unsigned long started, msec;
+    unsigned long idle;
+    unsigned int ii, jj, answered;
+    fd_set readfds;
+    int max_fd;
+
+    started = idle = msec_now();
+    while (round_stats.pending && msec_now() - started < 20000) {
+        FD_ZERO(&readfds);
+        FD_SET(stub_fd, &readfds);
+        max_fd = stub_fd;
+        if (sar_io_fd) {
+            FD_SET(sar_io_fd->fd, &readfds);
+            if (sar_io_fd->fd > max_fd)
+                max_fd = sar_io_fd->fd;
+        }
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 1000;
+        if (select(max_fd + 1, &readfds, NULL, NULL, &timeout) > 0) {
+            if (FD_ISSET(stub_fd, &readfds))
+                while (stub_receive()) ;
+            while (sar_readable())
+                sar_io_fd->readable_cb(sar_io_fd);
+            idle = msec_now();
+        } else if (!stub_used && msec_now() - idle >= 50) {
+            /* Everything left is waiting for a timeout. */
+            time_offset++;
+            idle = msec_now();
+        }
+        /* Answer in small batches so the resolver's socket buffer
+         * does not overflow. */
+        msec = msec_now();
+        for (ii = jj = answered = 0; ii < stub_used; ii++) {
+            if (!stub_queries[ii].due)
+                stub_queries[ii].due = msec + delay;
+            if (stub_queries[ii].due <= msec && answered < 64) {
+                stub_answer(&stub_queries[ii]);
+                answered++;
+            }
+            else if (ii != jj)
+                stub_queries[jj++] = stub_queries[ii];
+            else
+                jj++;
+        }
+        stub_used = jj;
+        now = time(NULL) + time_offset;
+        timeq_run();
+    }
+}
+
+static unsigned int
+dead_timeouts(void)
+{
+    struct sar_nameserver_stats ns[2];
+    unsigned int count, ii;
+
+    count = sar_get_nameserver_stats(ns, ArrayLength(ns));
+    for (ii = 0; ii < count && ii < ArrayLength(ns); ii++)
+        if (!strcmp(ns[ii].name, "127.0.0.2"))
+            return ns[ii].timeouts;
+    return 0;
+}
+
+static int
+run_round(const char *name, unsigned int clients, unsigned int addresses, unsigned int zones, unsigned int delay, unsigned long expected, unsigned int expected_timeouts)
+{
+    struct sar_nameserver_stats ns[2];
+    struct sar_stats before, after;
+    struct sar_request *req;
+    struct lookup *lookup;
+    unsigned long received, lookups;
+    unsigned int ii, jj, addr, timeouts, count;
+    char qname[128];
+
+    memset(&round_stats, 0, sizeof(round_stats));
+    sar_get_stats(&before);
+    received = stub_received;
+    timeouts = dead_timeouts();
+    for (ii = 0; ii < clients; ii++) {
+        addr = ii % addresses;
+        for (jj = 0; jj < zones; jj++) {
+            snprintf(qname, sizeof(qname), "%u.%u.0.10.zone%u.test", addr % 256, addr / 256, jj);
+            req = sar_request_simple(sizeof(*lookup), lookup_ok, lookup_fail, qname, REQ_TYPE_A, NULL);
+            if (!req)
+                continue;
+            lookup = (struct lookup*)(req + 1);
+            gettimeofday(&lookup->start, NULL);
+            round_stats.pending++;
+        }
+    }
+    lookups = round_stats.pending;
+    run_loop(delay);
+    sar_get_stats(&after);
+    received = stub_received - received;
+    timeouts = dead_timeouts() - timeouts;
+
+    printf("%s: %lu lookups, %lu queries (expected %lu); %u listed, %u unlisted, %u failed, %u unanswered\n",
+           name, lookups, received, expected, round_stats.listed, round_stats.unlisted, round_stats.failed, round_stats.pending);
+    printf("  %lu cache hits (%lu negative), %lu coalesced, %lu sent; %u cached answers; latency avg %luus, max %luus\n",
+           after.hits - before.hits, after.negative_hits - before.negative_hits,
+           after.coalesced - before.coalesced, after.misses - before.misses,
+           after.cache_entries,
+           lookups ? round_stats.total_usec / lookups : 0, round_stats.max_usec);
+    count = sar_get_nameserver_stats(ns, ArrayLength(ns));
+    for (ii = 0; ii < count && ii < ArrayLength(ns); ii++)
+        printf("  nameserver %s: %u sent, %u answered, %u timeouts, %lums rtt\n",
+               ns[ii].name, ns[ii].sent, ns[ii].answered, ns[ii].timeouts, ns[ii].srtt);
+    printf("  %u timeouts on the dead nameserver (expected %u)\n", timeouts, expected_timeouts);
+    return (received == expected) && (timeouts == expected_timeouts) && !round_stats.pending && !round_stats.failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    dict_t modules, sar;
+    struct string_list *nslist;
+    unsigned int clients, addresses, zones, delay, unlisted, ii;
+    char port[16];
+    int ok;
+
+    clients = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000;
+    addresses = argc > 2 ? strtoul(argv[2], NULL, 0) : 500;
+    zones = argc > 3 ? strtoul(argv[3], NULL, 0) : 3;
+    delay = argc > 4 ? strtoul(argv[4], NULL, 0) : 20;
+    if (!clients || !addresses || addresses > 65536 || !zones || clients * zones > MAX_QUERIES) {
+        fprintf(stderr, "usage: %s [clients] [addresses] [zones] [delay-ms]\n", argv[0]);
+        return 2;
+    }
+    if (addresses > clients)
+        addresses = clients;
+
+    tools_init();
+    stub_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin_len = sizeof(sin);
+    if (stub_fd < 0
+        || bind(stub_fd, (struct sockaddr*)&sin, sizeof(sin)) < 0
+        || getsockname(stub_fd, (struct sockaddr*)&sin, &sin_len) < 0) {
+        perror("stub nameserver");
+        return 2;
+    }
+    fcntl(stub_fd, F_SETFL, O_NONBLOCK);
+    /* The first round sends a query per address and zone at once. */
+    ii = 1 << 22;
+    setsockopt(stub_fd, SOL_SOCKET, SO_RCVBUF, &ii, sizeof(ii));
+    stub_queries = calloc(MAX_QUERIES, sizeof(stub_queries[0]));
+    snprintf(port, sizeof(port), "%u", ntohs(sin.sin_port));
+
+    sar = alloc_database();
+    dict_insert(sar, "resolv_conf", alloc_record_data_qstring("/dev/null"));
+    dict_insert(sar, "services", alloc_record_data_qstring("/dev/null"));
+    dict_insert(sar, "nameserver_port", alloc_record_data_qstring(port));
+    dict_insert(sar, "timeout", alloc_record_data_qstring("5"));
+    nslist = alloc_string_list(2);
+    string_list_append(nslist, strdup("127.0.0.1"));
+    string_list_append(nslist, strdup("127.0.0.2"));
+    dict_insert(sar, "nameservers", alloc_record_data_string_list(nslist));
+    modules = alloc_database();
+    dict_insert(modules, "sar", alloc_record_data_object(sar));
+    test_conf = alloc_database();
+    dict_insert(test_conf, "modules", alloc_record_data_object(modules));
+
+    srand(time(NULL));
+    now = time(NULL);
+    sar_init();
+    test_run_reloads();
+
+    for (ii = unlisted = 0; ii < addresses; ii++)
+        if ((ii % 256) % 7)
+            unlisted++;
+    ok = run_round("cold", clients, addresses, zones, delay, (unsigned long)addresses * zones, 0);
+    ok &= run_round("warm", clients, addresses, zones, delay, 0, 0);
+    time_offset = STUB_NEG_TTL + 1;
+    now = time(NULL) + time_offset;
+    ok &= run_round("negative expired", clients, addresses, zones, delay, (unsigned long)unlisted * zones, unlisted * zones);
+    time_offset += STUB_TTL + 1;
+    now = time(NULL) + time_offset;
+    ok &= run_round("all expired", clients, addresses, zones, delay, (unsigned long)addresses * zones, 0);
+    return ok ? 0 : 1;
+}
+
+/* Stand-ins for the parts of the services that sar uses; the rest
+ * come from teststubs.c. */
+
+struct io_fd *
+ioset_add(int fd)
+{
+    sar_io_fd = calloc(1, sizeof(*sar_io_fd));
+    sar_io_fd->fd = fd;
+    return sar_io_fd;
+}
+
+void
+ioset_close(struct io_fd *fd, int os_close)
+{
+    if (os_close)
+        close(fd->fd);
+    if (fd == sar_io_fd)
+        sar_io_fd = NULL;
+    free(fd);
+}
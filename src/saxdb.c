@@ -20,6 +20,7 @@
 
 #include "conf.h"
 #include "hash.h"
+#include "metrics.h"
 #include "modcmd.h"
 #include "saxdb.h"
 #include "timeq.h"
@@ -535,12 +536,40 @@ saxdb_expand_help(const char *variable) {
     return exp;
 }
 
+static void
+saxdb_metric_write_time(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    dict_iterator_t it;
+    struct saxdb *db;
+
+    for (it = dict_first(saxdbs); it; it = iter_next(it)) {
+        db = iter_data(it);
+        if (db->last_write)
+            metrics_sample(out, "db", db->name, db->last_write);
+    }
+}
+
+static void
+saxdb_metric_write_duration(struct metrics_out *out, UNUSED_ARG(void *extra))
+{
+    dict_iterator_t it;
+    struct saxdb *db;
+
+    for (it = dict_first(saxdbs); it; it = iter_next(it)) {
+        db = iter_data(it);
+        if (db->last_write)
+            metrics_sample(out, "db", db->name, db->last_write_duration);
+    }
+}
+
 void
 saxdb_init(void) {
     reg_exit_func(saxdb_cleanup, NULL);
     saxdbs = dict_new();
     dict_set_free_data(saxdbs, saxdb_free);
     saxdb_register("mondo", saxdb_mondo_reader, saxdb_mondo_writer);
+    metrics_register_collector("x3_saxdb_last_write_time_seconds", "When each database was last written, as a Unix time.", METRIC_GAUGE, saxdb_metric_write_time, NULL);
+    metrics_register_collector("x3_saxdb_last_write_duration_seconds", "How long the last write of each database took.", METRIC_GAUGE, saxdb_metric_write_duration, NULL);
     saxdb_module = module_register("saxdb", MAIN_LOG, "saxdb.help", saxdb_expand_help);
     modcmd_register(saxdb_module, "write", cmd_write, 2, MODCMD_REQUIRE_AUTHED, "level", "800", NULL);
     modcmd_register(saxdb_module, "writeall", cmd_writeall, 0, MODCMD_REQUIRE_AUTHED, "level", "800", NULL);
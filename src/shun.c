@@ -20,8 +20,11 @@
 
 #include "heap.h"
 #include "helpfile.h"
+#include "ioset.h"
 #include "log.h"
+#include "maskindex.h"
 #include "saxdb.h"
+#include "sweep.h"
 #include "timeq.h"
 #include "shun.h"
 
@@ -37,6 +40,9 @@
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #define KEY_REASON "reason"
 #define KEY_EXPIRES "expires"
@@ -45,6 +51,25 @@
 
 static heap_t shun_heap; /* key: expiry time, data: struct shun_entry* */
 static dict_t shun_dict; /* key: target, data: struct shun_entry* */
+static struct mask_index *shun_index; /* wildcard lookups by host part */
+
+/* A burst resends every shun to one server (or all of them) a slice
+ * at a time, sleeping whenever the uplink's send queue backs up. */
+struct shun_burst {
+    char *server; /* NULL for every server */
+    struct sweep *sweep;
+    struct timeval started;
+    unsigned long sent;
+    unsigned long skipped;
+    unsigned int aborted : 1;
+    struct shun_burst *next;
+};
+
+static struct shun_burst *shun_bursts;
+static struct shun_burst_stats shun_burst_stats;
+static unsigned int shun_burst_sendq = 65536;
+static unsigned long shun_burst_min_lifetime;
+static unsigned int shun_burst_slice = 100;
 
 static int
 shun_comparator(const void *a, const void *b)
@@ -57,6 +82,7 @@ static void
 free_shun_from_dict(void *data)
 {
     struct shun *ent = data;
+    mask_index_remove(shun_index, ent->target);
     free(ent->issuer);
     free(ent->target);
     free(ent->reason);
@@ -149,6 +175,7 @@ shun_add(const char *issuer, const char *target, unsigned long duration, const c
         ent->expires = now + duration;
         ent->reason = strdup(reason);
         dict_insert(shun_dict, ent->target, ent);
+        mask_index_add(shun_index, ent->target, ent);
     }
     heap_insert(shun_heap, ent, ent);
     if (!prev_first || (ent->expires < prev_first->expires)) {
@@ -188,19 +215,15 @@ struct shun *
 shun_find(const char *target)
 {
     struct shun *res;
-    dict_iterator_t it;
     char *alt_target;
 
     res = dict_find(shun_dict, target, NULL);
     if (res)
         return res;
     else if (target[strcspn(target, "*?")]) {
-        /* Wildcard: do an obnoxiously long search. */
-        for (it = dict_first(shun_dict); it; it = iter_next(it)) {
-            res = iter_data(it);
-            if (match_ircglob(target, res->target))
-                return res;
-        }
+        /* Wildcard: only try the entries whose host part could match. */
+        if ((res = mask_index_find(shun_index, target)))
+            return res;
     }
     /* See if we can resolve the hostname part of the mask. */
     if ((alt_target = shun_alternate_target(target))) {
@@ -211,24 +234,115 @@ shun_find(const char *target)
     return NULL;
 }
 
+static void
+shun_burst_free(struct shun_burst *burst)
+{
+    struct shun_burst **pp;
+
+    for (pp = &shun_bursts; *pp; pp = &(*pp)->next) {
+        if (*pp == burst) {
+            *pp = burst->next;
+            break;
+        }
+    }
+    free(burst->server);
+    free(burst);
+}
+
 static int
-shun_refresh_helper(UNUSED_ARG(void *key), void *data, void *extra)
+shun_burst_entry(UNUSED_ARG(const char *key), void *data, void *extra)
 {
+    struct shun_burst *burst = extra;
     struct shun *ge = data;
-    irc_shun(extra, ge);
+    struct server *srv = NULL;
+
+    if (burst->server && !(srv = GetServerH(burst->server))) {
+        burst->aborted = 1;
+        return 1;
+    }
+    if (ge->expires < (time_t)(now + shun_burst_min_lifetime)) {
+        burst->skipped++;
+    } else {
+        irc_shun(srv, ge);
+        burst->sent++;
+    }
+    if (shun_burst_sendq && socket_io_fd && ioset_send_queued(socket_io_fd) > shun_burst_sendq)
+        sweep_defer(burst->sweep, now + 1);
     return 0;
 }
 
+static void
+shun_burst_done(void *extra)
+{
+    struct shun_burst *burst = extra;
+    struct timeval stop;
+    unsigned long msec;
+
+    gettimeofday(&stop, NULL);
+    msec = (stop.tv_sec - burst->started.tv_sec) * 1000 + (stop.tv_usec - burst->started.tv_usec) / 1000;
+    if (burst->aborted)
+        shun_burst_stats.aborted++;
+    else
+        shun_burst_stats.completed++;
+    shun_burst_stats.sent += burst->sent;
+    shun_burst_stats.skipped += burst->skipped;
+    shun_burst_stats.last_msec = msec;
+    if (msec > shun_burst_stats.max_msec)
+        shun_burst_stats.max_msec = msec;
+    log_module(MAIN_LOG, LOG_INFO, "shun burst to %s %s: %lu sent, %lu skipped in %lu ms.", burst->server ? burst->server : "all servers", burst->aborted ? "aborted" : "finished", burst->sent, burst->skipped, msec);
+    shun_burst_free(burst);
+}
+
+static void
+shun_burst_start(const char *server)
+{
+    struct shun_burst *burst;
+
+    /* A new burst to the same place replaces one in progress. */
+    for (burst = shun_bursts; burst; burst = burst->next) {
+        if (server ? (burst->server && !irccasecmp(burst->server, server)) : !burst->server) {
+            sweep_cancel(burst->sweep);
+            shun_burst_free(burst);
+            break;
+        }
+    }
+    burst = calloc(1, sizeof(*burst));
+    burst->server = server ? strdup(server) : NULL;
+    gettimeofday(&burst->started, NULL);
+    burst->sweep = sweep_dict("shun burst", shun_dict, shun_burst_entry, shun_burst_done, burst);
+    sweep_set_slice(burst->sweep, shun_burst_slice, SWEEP_DEFAULT_USEC);
+    burst->next = shun_bursts;
+    shun_bursts = burst;
+}
+
 void
 shun_refresh_server(struct server *srv)
 {
-    heap_remove_pred(shun_heap, shun_refresh_helper, srv);
+    shun_burst_start(srv->name);
 }
 
 void
 shun_refresh_all(void)
 {
-    heap_remove_pred(shun_heap, shun_refresh_helper, 0);
+    shun_burst_start(NULL);
+}
+
+void
+shun_burst_configure(unsigned int sendq, unsigned long min_lifetime, unsigned int slice)
+{
+    shun_burst_sendq = sendq;
+    shun_burst_min_lifetime = min_lifetime;
+    shun_burst_slice = slice;
+}
+
+void
+shun_get_burst_stats(struct shun_burst_stats *stats)
+{
+    struct shun_burst *burst;
+
+    *stats = shun_burst_stats;
+    for (burst = shun_bursts; burst; burst = burst->next)
+        stats->active++;
 }
 
 unsigned int
@@ -297,8 +411,13 @@ shun_saxdb_write(struct saxdb_context *ctx)
 static void
 shun_db_cleanup(UNUSED_ARG(void *extra))
 {
+    while (shun_bursts) {
+        sweep_cancel(shun_bursts->sweep);
+        shun_burst_free(shun_bursts);
+    }
     heap_delete(shun_heap);
     dict_delete(shun_dict);
+    mask_index_delete(shun_index);
 }
 
 void
@@ -307,6 +426,7 @@ shun_init(void)
     shun_heap = heap_new(shun_comparator);
     shun_dict = dict_new();
     dict_set_free_data(shun_dict, free_shun_from_dict);
+    shun_index = mask_index_new();
     saxdb_register("shun", shun_saxdb_read, shun_saxdb_write);
     reg_exit_func(shun_db_cleanup, NULL);
 }
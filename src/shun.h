@@ -42,12 +42,24 @@ struct shun_discrim {
     time_t min_expire;
 };
 
+struct shun_burst_stats {
+    unsigned int active;
+    unsigned long completed;
+    unsigned long aborted;
+    unsigned long sent;
+    unsigned long skipped;
+    unsigned long last_msec;
+    unsigned long max_msec;
+};
+
 void shun_init(void);
 struct shun *shun_add(const char *issuer, const char *target, unsigned long duration, const char *reason, time_t issued, int announce);
 struct shun *shun_find(const char *target);
 int shun_remove(const char *target, int announce);
 void shun_refresh_server(struct server *srv);
 void shun_refresh_all(void);
+void shun_burst_configure(unsigned int sendq, unsigned long min_lifetime, unsigned int slice);
+void shun_get_burst_stats(struct shun_burst_stats *stats);
 unsigned int shun_count(void);
 
 typedef void (*shun_search_func)(struct shun *shun, void *extra);
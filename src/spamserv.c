@@ -18,13 +18,17 @@
  * $Id$
  */
 
+#include "acmatch.h"
 #include "conf.h"
 #include "spamserv.h"
 #include "chanserv.h"
 #include "helpfile.h"
 #include "global.h"
 #include "modcmd.h"
+#include "msgfp.h"
 #include "saxdb.h"
+#include "shun.h"
+#include "sweep.h"
 #include "timeq.h"
 #include "gline.h"
 
@@ -59,6 +63,12 @@
 #define KEY_ADV_CHAN_MUST_EXIST      "adv_chan_must_exist"
 #define KEY_STRIP_MIRC_CODES         "strip_mirc_codes"
 #define KEY_ALLOW_MOVE_MERGE         "allow_move_merge"
+#define KEY_FINGERPRINT_LINES        "fingerprint_lines"
+#define KEY_FINGERPRINT_WINDOW       "fingerprint_window"
+#define KEY_FINGERPRINT_MIN_LEN      "fingerprint_min_len"
+#define KEY_FINGERPRINT_USERS        "fingerprint_users"
+#define KEY_FINGERPRINT_CHANNELS     "fingerprint_channels"
+#define KEY_FINGERPRINT_SHUN         "fingerprint_shun"
 #define KEY_CAPSMIN                  "capsmin"
 #define KEY_CAPSPERCENT              "capspercent"
 #define KEY_EXCEPTLEVEL              "exceptlevel"
@@ -98,7 +108,7 @@ dict_t killed_users_dict;
 const char *set_subcommands[SET_SUBCMDS_SIZE] = {"EXCEPTLEVEL", "EXCEPTADVLEVEL", "EXCEPTBADWORDLEVEL", "EXCEPTCAPSLEVEL", "EXCEPTFLOODLEVEL", "EXCEPTSPAMLEVEL", "SPAMLIMIT", "BADREACTION", "CAPSREACTION", "ADVREACTION", "WARNREACTION", "ADVSCAN", "CAPSSCAN", "SPAMSCAN", "BADWORDSCAN", "CHANFLOODSCAN", "JOINFLOODSCAN", "CAPSMIN", "CAPSPERCENT"};
 
 extern struct string_list *autojoin_channels;
-static void spamserv_clear_spamNodes(struct chanNode *channel);
+static void spamserv_clear_spam_state(struct chanInfo *cInfo);
 static void spamserv_punish(struct chanNode *channel, struct userNode *user, time_t expires, char *reason, int ban);
 static unsigned long crc32(const char *text);
 
@@ -150,6 +160,7 @@ static const struct message_entry msgtab[] = {
     { "SSMSG_STATUS_USERS",            "Total Users Online:  %u" },
     { "SSMSG_STATUS_CHANNELS",         "Registered Channels: %u" },
     { "SSMSG_STATUS_MEMORY",           "$bMemory Information:$b" },
+    { "SSMSG_STATUS_FINGERPRINTS",     "Message Fingerprints: %u lines, %u distinct, last %s" },
     { "SSMSG_STATUS_CHANNEL_LIST",     "$bRegistered Channels:$b" },
     { "SSMSG_STATUS_NO_CHANNEL",       "No channels registered." },
 
@@ -190,6 +201,7 @@ static const struct message_entry msgtab[] = {
 #define SSMSG_DEBUG_KILL              "Killed user $b%s$b, last violation in $b%s$b"
 #define SSMSG_DEBUG_GLINE             "Glined user $b%s$b, host $b%s$b, last violation in $b%s$b"
 #define SSMSG_DEBUG_RECONNECT         "Killed user $b%s$b reconnected to the network"
+#define SSMSG_DEBUG_FINGERPRINT       "Same message from $b%u$b users in $b%u$b channels within %lu seconds: %s"
 
 #define SSMSG_SPAM                    "Spamming"
 #define SSMSG_FLOOD                   "Flooding the channel/network"
@@ -197,6 +209,7 @@ static const struct message_entry msgtab[] = {
 #define SSMSG_BAD                     "Badwords"
 #define SSMSG_CAPS                    "Caps"
 #define SSMSG_JOINFLOOD               "Join flooding the channel"
+#define SSMSG_FINGERPRINT_SHUN        "Distributed spam"
 
 #define SSMSG_WARNING                  "%s is against the network rules"
 #define SSMSG_WARNING_2                "You are violating the network rules"
@@ -232,8 +245,18 @@ static struct
 	unsigned int strip_mirc_codes : 1;
 	unsigned int allow_move_merge : 1;
 	unsigned long untrusted_max;
+	unsigned long fingerprint_lines;
+	unsigned long fingerprint_window;
+	unsigned long fingerprint_min_len;
+	unsigned long fingerprint_users;
+	unsigned long fingerprint_channels;
+	unsigned long fingerprint_shun;
 } spamserv_conf;
 
+/* Recent messages from all channels, to spot one line being sent by
+ * many users at once. */
+static struct msgfp *spamserv_fingerprints;
+
 struct trusted_account {
     char *account;
     struct string_list *channel;
@@ -266,11 +289,32 @@ spamserv_join_channel(struct chanNode *channel)
 static void
 spamserv_part_channel(struct chanNode *channel, char *reason)
 {
-	/* we only have to clear the spamNodes because every other node expires on it's own */
-	spamserv_clear_spamNodes(channel);
+	struct chanInfo *cInfo = get_chanInfo(channel->name);
+
+	/* flood counters decay on their own; repeat detection starts over */
+	if(cInfo)
+		spamserv_clear_spam_state(cInfo);
 	DelChannelUser(spamserv, channel, reason, 0);
 }
 
+/* Tags for the words in a channel's wordmatch. */
+#define WORD_EXCEPTION      0x01
+#define WORD_BADWORD        0x02
+
+static void
+spamserv_compile_words(struct chanInfo *cInfo)
+{
+	unsigned int i;
+
+	acmatch_delete(cInfo->wordmatch);
+	cInfo->wordmatch = acmatch_new();
+	for(i = 0; i < cInfo->exceptions->used; i++)
+		acmatch_add(cInfo->wordmatch, cInfo->exceptions->list[i], WORD_EXCEPTION);
+	for(i = 0; i < cInfo->badwords->used; i++)
+		acmatch_add(cInfo->wordmatch, cInfo->badwords->list[i], WORD_BADWORD);
+	acmatch_compile(cInfo->wordmatch);
+}
+
 static struct chanInfo*
 spamserv_register_channel(struct chanNode *channel, struct string_list *exceptions, struct string_list *badwords, unsigned int flags, char *info)
 {
@@ -285,6 +329,11 @@ spamserv_register_channel(struct chanNode *channel, struct string_list *exceptio
 	cInfo->channel = channel;
 	cInfo->exceptions = exceptions ? string_list_copy(exceptions) : alloc_string_list(1);
 	cInfo->badwords = badwords ? string_list_copy(badwords) : alloc_string_list(1);
+	cInfo->wordmatch = NULL;
+	cInfo->slots = NULL;
+	cInfo->slots_used = 0;
+	cInfo->slots_size = 0;
+	spamserv_compile_words(cInfo);
 	cInfo->flags = flags;
 	cInfo->exceptlevel = 300;
 	cInfo->exceptspamlevel = 100;
@@ -316,6 +365,8 @@ spamserv_unregister_channel(struct chanInfo *cInfo)
 
 	free_string_list(cInfo->exceptions);
 	free_string_list(cInfo->badwords);
+	acmatch_delete(cInfo->wordmatch);
+	free(cInfo->slots);
 	dict_remove(registered_channels_dict, cInfo->channel->name);
 	free(cInfo);
 }
@@ -442,129 +493,156 @@ get_userInfo(const char *nickname)
 	return dict_find(connected_users_dict, nickname, 0);
 }
 
+static unsigned long next_user_id;
+
+static unsigned int
+spamserv_slot_hash(unsigned long user_id, unsigned int size)
+{
+	return (user_id * 2654435761UL) & (size - 1);
+}
+
 static void
-spamserv_create_spamNode(struct chanNode *channel, struct userInfo *uInfo, char *text)
+spamserv_resize_slots(struct chanInfo *cInfo, unsigned int size)
 {
-	struct spamNode *sNode = malloc(sizeof(struct spamNode));
+	struct spamSlot *old = cInfo->slots;
+	unsigned int old_size = cInfo->slots_size, i, pos;
+
+	cInfo->slots = size ? calloc(size, sizeof(struct spamSlot)) : NULL;
+	cInfo->slots_size = size;
 
-	if(!sNode)
+	for(i = 0; i < old_size; i++)
 	{
-		log_module(SS_LOG, LOG_ERROR, "Couldn't allocate memory for sNode; channel: %s; user: %s", channel->name, uInfo->user->nick);
-		return;
+		if(!old[i].user_id)
+			continue;
+
+		for(pos = spamserv_slot_hash(old[i].user_id, size); cInfo->slots[pos].user_id; pos = (pos + 1) & (size - 1)) ;
+		cInfo->slots[pos] = old[i];
 	}
 
-	sNode->channel = channel;	
-	sNode->crc32 = crc32(text);
-	sNode->count = 1;
-	sNode->next = NULL;
+	free(old);
+}
 
-	if(uInfo->spam)
-	{
-		struct spamNode *temp = uInfo->spam;
-		
-		while(temp->next)
-			temp = temp->next;
+static struct spamSlot *
+spamserv_find_slot(struct chanInfo *cInfo, struct userInfo *uInfo, int create)
+{
+	struct spamSlot *slot;
+	unsigned int pos;
 
-		sNode->prev = temp;
-		temp->next = sNode;
-	}
-	else
+	if(cInfo->slots_size)
 	{
-		sNode->prev = NULL;
-		uInfo->spam = sNode;
+		for(pos = spamserv_slot_hash(uInfo->id, cInfo->slots_size); (slot = &cInfo->slots[pos])->user_id; pos = (pos + 1) & (cInfo->slots_size - 1))
+			if(slot->user_id == uInfo->id)
+				return slot;
 	}
+
+	if(!create)
+		return NULL;
+
+	/* Keep the table at most half full. */
+	if((cInfo->slots_used + 1) * 2 > cInfo->slots_size)
+		spamserv_resize_slots(cInfo, cInfo->slots_size ? cInfo->slots_size * 2 : 8);
+
+	for(pos = spamserv_slot_hash(uInfo->id, cInfo->slots_size); cInfo->slots[pos].user_id; pos = (pos + 1) & (cInfo->slots_size - 1)) ;
+	slot = &cInfo->slots[pos];
+	memset(slot, 0, sizeof(*slot));
+	slot->user_id = uInfo->id;
+	cInfo->slots_used++;
+	return slot;
 }
 
 static void
-spamserv_delete_spamNode(struct userInfo *uInfo, struct spamNode *sNode)
+spamserv_remove_slot(struct chanInfo *cInfo, struct spamSlot *slot)
 {
-	if(!sNode)
-		return;
+	unsigned int mask = cInfo->slots_size - 1;
+	unsigned int hole = slot - cInfo->slots, pos, home;
 
-	if(sNode == uInfo->spam)
-		uInfo->spam = sNode->next;
-	
-	if(sNode->next)
-		 sNode->next->prev = sNode->prev;
-	if(sNode->prev)
-		 sNode->prev->next = sNode->next;
+	/* Shift later members of the probe run back into the hole so
+	 * that lookups never need tombstones. */
+	for(pos = (hole + 1) & mask; cInfo->slots[pos].user_id; pos = (pos + 1) & mask)
+	{
+		home = spamserv_slot_hash(cInfo->slots[pos].user_id, cInfo->slots_size);
+
+		if(((pos - home) & mask) >= ((pos - hole) & mask))
+		{
+			cInfo->slots[hole] = cInfo->slots[pos];
+			hole = pos;
+		}
+	}
 
-	free(sNode);
+	cInfo->slots[hole].user_id = 0;
+	cInfo->slots_used--;
 }
 
+/* Take one from *count for every period that has passed since it was
+ * last touched, after an initial grace of expire seconds. */
 static void
-spamserv_clear_spamNodes(struct chanNode *channel)
+spamserv_decay(unsigned int *count, time_t *last, unsigned int expire, unsigned int period)
 {
-	struct userInfo *uInfo;
-	struct spamNode *sNode;
-	unsigned int i;
+	unsigned long steps;
 
-	for(i = 0; i < channel->members.used; i++)
+	if(!*count || now - *last <= (time_t)expire)
+		return;
+
+	steps = (now - *last - expire - 1) / period + 1;
+
+	if(steps >= *count)
+		*count = 0;
+	else
 	{
-		if((uInfo = get_userInfo(channel->members.list[i]->user->nick)))
-		{
-			if((sNode = uInfo->spam))
-			{
-				for(; sNode; sNode = sNode->next)
-					if(sNode->channel == channel)
-						break;
-					
-				if(sNode)
-					spamserv_delete_spamNode(uInfo, sNode);
-			}
-		}
+		*count -= steps;
+		*last += steps * period;
 	}
 }
 
+/* Returns non-zero if nothing is left in the slot. */
+static int
+spamserv_decay_slot(struct spamSlot *slot)
+{
+	spamserv_decay(&slot->flood_count, &slot->flood_time, FLOOD_EXPIRE, FLOOD_DECAY);
+	spamserv_decay(&slot->join_count, &slot->join_time, JOINFLOOD_EXPIRE, JOINFLOOD_DECAY);
+	return !slot->spam_count && !slot->flood_count && !slot->join_count;
+}
+
 static void
-spamserv_create_floodNode(struct chanNode *channel, struct userNode *user, struct floodNode **uI_fNode)
+spamserv_decay_user(struct userInfo *uInfo)
 {
-	struct floodNode *fNode = malloc(sizeof(struct floodNode));
+	unsigned long steps = (now - uInfo->warnlevel_time) / WARNLEVEL_DECAY;
 
-	if(!fNode)
+	if(steps)
 	{
-		log_module(SS_LOG, LOG_ERROR, "Couldn't allocate memory for fNode; channel: %s; user: %s", channel->name, user->nick);
-		return;
+		uInfo->warnlevel = (steps >= uInfo->warnlevel) ? 0 : uInfo->warnlevel - steps;
+		uInfo->warnlevel_time += steps * WARNLEVEL_DECAY;
 	}
 
-	fNode->channel = channel;
-	fNode->owner = user;
-	fNode->count = 1;
-	fNode->time = now;	
-	fNode->next = NULL;
+	if(uInfo->lastadv && now - uInfo->lastadv > ADV_EXPIRE)
+	{
+		uInfo->lastadv = 0;
+		uInfo->flags &= ~USER_ADV_WARNED;
+	}
 
-	if(*uI_fNode)
+	if(uInfo->lastbad && now - uInfo->lastbad > BAD_EXPIRE)
 	{
-		struct floodNode *temp = *uI_fNode;
-		
-		while(temp->next)
-			temp = temp->next;
-		
-		fNode->prev = temp;
-		temp->next = fNode;
+		uInfo->lastbad = 0;
+		uInfo->flags &= ~USER_BAD_WARNED;
 	}
-	else
+
+	if(uInfo->lastcaps && now - uInfo->lastcaps > CAPS_EXPIRE)
 	{
-		fNode->prev = NULL;
-		*uI_fNode = fNode;
+		uInfo->lastcaps = 0;
+		uInfo->flags &= ~USER_CAPS_WARNED;
 	}
 }
 
 static void
-spamserv_delete_floodNode(struct floodNode **uI_fNode, struct floodNode *fNode)
+spamserv_clear_spam_state(struct chanInfo *cInfo)
 {
-	if(!fNode)
-		return;
-
-	if(fNode == *uI_fNode)
-		*uI_fNode = fNode->next;
-	
-	if(fNode->next)
-		 fNode->next->prev = fNode->prev;
-	if(fNode->prev)
-		 fNode->prev->next = fNode->next;
+	unsigned int i;
 
-	free(fNode);
+	for(i = 0; i < cInfo->slots_size; i++)
+	{
+		cInfo->slots[i].spam_count = 0;
+		cInfo->slots[i].crc32 = 0;
+	}
 }
 
 static void
@@ -573,6 +651,13 @@ spamserv_create_user(struct userNode *user)
 	struct userInfo *uInfo = malloc(sizeof(struct userInfo));
 	struct killNode *kNode = dict_find(killed_users_dict, irc_ntoa(&user->ip), 0);
 
+	/* stale entries are only swept out hourly */
+	if(kNode && now - kNode->time > KILL_EXPIRE)
+	{
+		dict_remove(killed_users_dict, irc_ntoa(&user->ip));
+		kNode = NULL;
+	}
+
 	if(!uInfo)
 	{
 		log_module(SS_LOG, LOG_ERROR, "Couldn't allocate memory for uInfo; nick: %s", user->nick);
@@ -583,11 +668,10 @@ spamserv_create_user(struct userNode *user)
 		spamserv_debug(SSMSG_DEBUG_RECONNECT, user->nick);
 
 	uInfo->user = user;
-	uInfo->spam = NULL;
-	uInfo->flood = NULL;
-	uInfo->joinflood = NULL;
+	uInfo->id = ++next_user_id ? next_user_id : ++next_user_id;
 	uInfo->flags = kNode ? USER_KILLED : 0;
 	uInfo->warnlevel = kNode ? kNode->warnlevel : 0;
+	uInfo->warnlevel_time = now;
 	uInfo->lastadv = 0;
 	uInfo->lastbad = 0;
 	uInfo->lastcaps = 0;
@@ -607,18 +691,6 @@ spamserv_delete_user(struct userInfo *uInfo)
 	if(!uInfo)
 		return;
 
-	if(uInfo->spam)
-		while(uInfo->spam)
-			spamserv_delete_spamNode(uInfo, uInfo->spam);	
-
-	if(uInfo->flood)
-		while(uInfo->flood)
-			spamserv_delete_floodNode(&uInfo->flood, uInfo->flood);
-
-	if(uInfo->joinflood)
-		while(uInfo->joinflood)
-			spamserv_delete_floodNode(&uInfo->joinflood, uInfo->joinflood);
-
 	dict_remove(connected_users_dict, uInfo->user->nick);
 	free(uInfo);
 }
@@ -649,6 +721,8 @@ spamserv_del_user_func(struct userNode *user, struct userNode *killer, UNUSED_AR
 			return;
 		}
 
+		spamserv_decay_user(uInfo);
+
 		if(uInfo->warnlevel > KILL_WARNLEVEL)
 			kNode->warnlevel = uInfo->warnlevel - KILL_WARNLEVEL;
 		else
@@ -680,39 +754,23 @@ spamserv_user_join(struct modeNode *mNode, UNUSED_ARG(void *extra))
 	struct userNode	*user = mNode->user;    
 	struct chanInfo	*cInfo;
 	struct userInfo	*uInfo;
-	struct floodNode *jfNode;
+	struct spamSlot *slot;
 
 	if(user->uplink->burst || !(cInfo = get_chanInfo(channel->name)) || !CHECK_JOINFLOOD(cInfo) || !(uInfo = get_userInfo(user->nick)))
 		return 0;
 
-	if(!(jfNode = uInfo->joinflood))
-	{
-		spamserv_create_floodNode(channel, user, &uInfo->joinflood);
-	}
-	else
-	{
-		for(; jfNode; jfNode = jfNode->next)
-			if(jfNode->channel == channel)
-				break;
-
-		if(!jfNode)
-		{
-			spamserv_create_floodNode(channel, user, &uInfo->joinflood);
-		}
-		else
-		{
-			jfNode->count++;
-			jfNode->time = now;		
+	slot = spamserv_find_slot(cInfo, uInfo, 1);
+	spamserv_decay(&slot->join_count, &slot->join_time, JOINFLOOD_EXPIRE, JOINFLOOD_DECAY);
+	slot->join_count++;
+	slot->join_time = now;
 
-			if(jfNode->count > JOINFLOOD_MAX)
-			{
-				char reason[MAXLEN];
+	if(slot->join_count > JOINFLOOD_MAX)
+	{
+		char reason[MAXLEN];
 
-				spamserv_delete_floodNode(&uInfo->joinflood, jfNode);
-				snprintf(reason, sizeof(reason), spamserv_conf.network_rules ? SSMSG_WARNING_RULES : SSMSG_WARNING, SSMSG_JOINFLOOD, spamserv_conf.network_rules);
-				spamserv_punish(channel, user, JOINFLOOD_B_DURATION, reason, 1);
-			}
-		}
+		slot->join_count = 0;
+		snprintf(reason, sizeof(reason), spamserv_conf.network_rules ? SSMSG_WARNING_RULES : SSMSG_WARNING, SSMSG_JOINFLOOD, spamserv_conf.network_rules);
+		spamserv_punish(channel, user, JOINFLOOD_B_DURATION, reason, 1);
 	}
 
 	return 0;
@@ -723,32 +781,19 @@ spamserv_user_part(struct modeNode *mn, UNUSED_ARG(const char *reason), UNUSED_A
 {
 	struct userNode *user = mn->user;
 	struct chanNode *channel = mn->channel;
+	struct chanInfo *cInfo;
 	struct userInfo *uInfo;
-	struct spamNode *sNode;
-	struct floodNode *fNode;
+	struct spamSlot *slot;
 
-	if(user->dead || !get_chanInfo(channel->name) || !(uInfo = get_userInfo(user->nick)))
+	if(!(cInfo = get_chanInfo(channel->name)) || !(uInfo = get_userInfo(user->nick)) || !(slot = spamserv_find_slot(cInfo, uInfo, 0)))
 		return;
 
-	if((sNode = uInfo->spam))
-	{
-		for(; sNode; sNode = sNode->next)
-			if(sNode->channel == channel)
-				break;
-
-		if(sNode)
-			spamserv_delete_spamNode(uInfo, sNode);
-	}
+	/* join flood state outlives a part, but not a quit */
+	slot->spam_count = 0;
+	slot->flood_count = 0;
 
-	if((fNode = uInfo->flood))
-	{
-		for(; fNode; fNode = fNode->next)
-			if(fNode->channel == channel)
-				break;
-
-		if(fNode)
-			spamserv_delete_floodNode(&uInfo->flood, fNode);
-	}
+	if(user->dead || !slot->join_count)
+		spamserv_remove_slot(cInfo, slot);
 }
 
 /***********************************************/
@@ -793,164 +838,66 @@ crc32(const char *text)
 	return (crc^0xFFFFFFFF);
 }
 
-static void
-timeq_flood(UNUSED_ARG(void *data))
-{
-	dict_iterator_t		it;
-	struct userInfo		*uInfo;
-	struct floodNode	*fNode;
-
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
-	{
-		uInfo = iter_data(it);
-
-                if (!uInfo)
-                    continue;
-
-		if(!(fNode = uInfo->flood))
-			continue;
-
-		for(; fNode; fNode = fNode->next)
-		{
-			if(now - fNode->time > FLOOD_EXPIRE)
-			{
-				if(!(--fNode->count))
-					spamserv_delete_floodNode(&uInfo->flood, fNode);
-			}
-		}
-	}
-	
-	timeq_add(now + FLOOD_TIMEQ_FREQ, timeq_flood, NULL);
-}
+/* Nearly everything decays when it is next used; this only throws
+ * away state that nobody has come back to. */
+static struct sweep *spamserv_gc_channels, *spamserv_gc_kills;
 
-static void
-timeq_joinflood(UNUSED_ARG(void *data))
+static int
+spamserv_gc_channel(UNUSED_ARG(const char *key), void *data, UNUSED_ARG(void *extra))
 {
-	dict_iterator_t it;
-	struct userInfo *uInfo;
-	struct floodNode *fNode, *nextnode;
+	struct chanInfo *cInfo = data;
+	unsigned int i, live, size;
 
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
+	for(i = live = 0; i < cInfo->slots_size; i++)
 	{
-		uInfo = iter_data(it);
-
-		if(!(fNode = uInfo->joinflood))
+		if(!cInfo->slots[i].user_id)
 			continue;
 
-		for(; fNode; fNode = nextnode)
-		{
-                        nextnode = fNode->next;
-			if(now - fNode->time > JOINFLOOD_EXPIRE)
-			{
-				if(!(--fNode->count))
-					spamserv_delete_floodNode(&uInfo->joinflood, fNode);				
-			}
-		}
+		if(spamserv_decay_slot(&cInfo->slots[i]))
+			cInfo->slots[i].user_id = 0;
+		else
+			live++;
 	}
 
-	timeq_add(now + JOINFLOOD_TIMEQ_FREQ, timeq_joinflood, NULL);
+	for(size = 8; live && size < live * 2; size <<= 1) ;
+	cInfo->slots_used = live;
+	spamserv_resize_slots(cInfo, live ? size : 0);
+	return 0;
 }
 
-static void
-timeq_bad(UNUSED_ARG(void *data))
+static int
+spamserv_gc_kill(const char *key, void *data, UNUSED_ARG(void *extra))
 {
-	dict_iterator_t it;
-	struct userInfo *uInfo;
+	struct killNode *kNode = data;
 
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
-	{
-		uInfo = iter_data(it);
-
-		if(uInfo->lastbad && uInfo->lastbad - now > BAD_EXPIRE)
-		{
-			uInfo->lastbad = 0;
-			uInfo->flags &= ~USER_BAD_WARNED;
-		}
-	}
-
-	timeq_add(now + BAD_TIMEQ_FREQ, timeq_bad, NULL);
-}
-
-static void
-timeq_caps(UNUSED_ARG(void *data))
-{
-	dict_iterator_t it;
-	struct userInfo *uInfo;
+	if(now - kNode->time > KILL_EXPIRE)
+		dict_remove(killed_users_dict, key);
 
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
-	{
-		uInfo = iter_data(it);
-
-		if(uInfo->lastcaps && uInfo->lastcaps - now > CAPS_EXPIRE)
-		{
-			uInfo->lastcaps = 0;
-			uInfo->flags &= ~USER_CAPS_WARNED;
-		}
-	}
-
-	timeq_add(now + CAPS_TIMEQ_FREQ, timeq_caps, NULL);
+	return 0;
 }
 
 static void
-timeq_adv(UNUSED_ARG(void *data))
+spamserv_gc_channels_done(UNUSED_ARG(void *extra))
 {
-	dict_iterator_t it;
-	struct userInfo *uInfo;
-
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
-	{
-		uInfo = iter_data(it);
-
-		if(uInfo->lastadv && uInfo->lastadv - now > ADV_EXPIRE)
-		{
-			uInfo->lastadv = 0;
-			uInfo->flags &= ~USER_ADV_WARNED;
-		}
-	}
-
-	timeq_add(now + ADV_TIMEQ_FREQ, timeq_adv, NULL);
+	spamserv_gc_channels = NULL;
 }
 
 static void
-timeq_warnlevel(UNUSED_ARG(void *data))
+spamserv_gc_kills_done(UNUSED_ARG(void *extra))
 {
-	dict_iterator_t it;
-	struct userInfo *uInfo;
-
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
-	{
-		uInfo = iter_data(it);
-
-		if(uInfo->warnlevel > 0)
-			uInfo->warnlevel--;
-	}
-
-	timeq_add(now + WARNLEVEL_TIMEQ_FREQ, timeq_warnlevel, NULL);
+	spamserv_gc_kills = NULL;
 }
 
 static void
-timeq_kill(UNUSED_ARG(void *data))
+spamserv_gc(UNUSED_ARG(void *data))
 {
-	dict_iterator_t it;
-	struct killNode *kNode;
+	if(!spamserv_gc_channels)
+		spamserv_gc_channels = sweep_dict("spamserv-gc-channels", registered_channels_dict, spamserv_gc_channel, spamserv_gc_channels_done, NULL);
 
-        while(1) {
-            for(it = dict_first(killed_users_dict); it; it = iter_next(it))
-            {
-                    kNode = iter_data(it);
-
-                    if(now - kNode->time > KILL_EXPIRE) {
-                            dict_remove(killed_users_dict, iter_key(it));
-                             /* have to restart the loop because next is
-                              * now invalid. FIXME: how could we do this better? */
-                             break; /* out of for() loop */
-                    }
-            }
-            /* no more killed_users to delete, so stop while loop */
-            break; /* out of while() loop */ 
-        }
+	if(!spamserv_gc_kills)
+		spamserv_gc_kills = sweep_dict("spamserv-gc-kills", killed_users_dict, spamserv_gc_kill, spamserv_gc_kills_done, NULL);
 
-	timeq_add(now + KILL_TIMEQ_FREQ, timeq_kill, NULL);
+	timeq_add(now + SPAMSERV_GC_FREQ, spamserv_gc, NULL);
 }
 
 static int
@@ -1098,16 +1045,14 @@ show_memory_usage(struct userNode *user)
 	dict_iterator_t it;
 	struct helpfile_table table;
 	struct chanInfo *cInfo;
-	struct userInfo *uInfo;
-	struct spamNode *sNode;
-	struct floodNode *fNode;
 	double channel_size = 0, user_size, size;
-	unsigned int spamcount = 0, floodcount = 0, i, j;
+	unsigned int i, j;
 	char buffer[64];
 
 	for(it = dict_first(registered_channels_dict); it; it = iter_next(it))
 	{
 		cInfo = iter_data(it);
+		channel_size += cInfo->slots_size * sizeof(struct spamSlot);
 
 		if(!cInfo->exceptions->used)
 			continue;
@@ -1122,21 +1067,13 @@ show_memory_usage(struct userNode *user)
 			channel_size += strlen(cInfo->badwords->list[i]) * sizeof(char);		
 	}
 
-	for(it = dict_first(connected_users_dict); it; it = iter_next(it))
-	{
-		uInfo = iter_data(it);
-
-		for(sNode = uInfo->spam; sNode; sNode = sNode->next, spamcount++);
-		for(fNode = uInfo->flood; fNode; fNode = fNode->next, floodcount++);
-		for(fNode = uInfo->joinflood; fNode; fNode = fNode->next, floodcount++);
-	}
-
 	channel_size += dict_size(registered_channels_dict) * sizeof(struct chanInfo);
 	
 	user_size = dict_size(connected_users_dict) * sizeof(struct userInfo) +
-				dict_size(killed_users_dict) * sizeof(struct killNode) +
-				spamcount * sizeof(struct spamNode)	+
-				floodcount *  sizeof(struct floodNode);
+				dict_size(killed_users_dict) * sizeof(struct killNode);
+
+	if(spamserv_fingerprints)
+		user_size += msgfp_memory(spamserv_fingerprints);
 
 	size = channel_size + user_size;
 	
@@ -1329,6 +1266,14 @@ SPAMSERV_FUNC(cmd_status)
 	ss_reply("SSMSG_STATUS_USERS", dict_size(connected_users_dict));
 	ss_reply("SSMSG_STATUS_CHANNELS", dict_size(registered_channels_dict));
 
+	if(IsOper(user) && spamserv_fingerprints)
+	{
+		char interval[INTERVALLEN];
+
+		intervalString(interval, msgfp_window(spamserv_fingerprints), user->handle_info);
+		ss_reply("SSMSG_STATUS_FINGERPRINTS", msgfp_lines(spamserv_fingerprints), msgfp_count(spamserv_fingerprints), interval);
+	}
+
 	if(IsOper(user) && argc > 1)
 	{
 		if(!irccasecmp(argv[1], "memory"))
@@ -1395,6 +1340,7 @@ SPAMSERV_FUNC(cmd_addexception)
 	}
 
 	string_list_append(cInfo->exceptions, strdup(argv[1]));
+	spamserv_compile_words(cInfo);
 	ss_reply("SSMSG_EXCEPTION_ADDED", argv[1]);
 
 	return 1;
@@ -1445,6 +1391,7 @@ SPAMSERV_FUNC(cmd_delexception)
 	}
 
 	string_list_delete(cInfo->exceptions, i);
+	spamserv_compile_words(cInfo);
 	ss_reply("SSMSG_EXCEPTION_DELETED", argv[1]);
 
 	return 1;
@@ -1505,6 +1452,7 @@ SPAMSERV_FUNC(cmd_addbadword)
 	}
 
 	string_list_append(cInfo->badwords, strdup(argv[1]));
+	spamserv_compile_words(cInfo);
 	ss_reply("SSMSG_BADWORD_ADDED", argv[1]);
 
 	return 1;
@@ -1555,6 +1503,7 @@ SPAMSERV_FUNC(cmd_delbadword)
 	}
 
 	string_list_delete(cInfo->badwords, i);
+	spamserv_compile_words(cInfo);
 	ss_reply("SSMSG_BADWORD_DELETED", argv[1]);
 
 	return 1;
@@ -2394,12 +2343,12 @@ static SPAMSERV_FUNC(cmd_listtrust) {
 static void 
 to_lower(char *message)
 {
-	unsigned int i, diff = 'a' - 'A';
+	unsigned int diff = 'a' - 'A';
 
-	for(i = 0; i < strlen(message); i++)
+	for(; *message; message++)
 	{
-		if((message[i] >= 'A') && (message[i] <= 'Z'))
-			message[i] = message[i] + diff;
+		if((*message >= 'A') && (*message <= 'Z'))
+			*message += diff;
 	}
 }
 
@@ -2454,25 +2403,54 @@ strip_mirc_codes(char *text)
 static int
 is_in_exception_list(struct chanInfo *cInfo, char *message)
 {
-	unsigned int i;
-
-	for(i = 0; i < cInfo->exceptions->used; i++)
-		if(strstr(message, cInfo->exceptions->list[i]))
-			return 1;
-
-	return 0;
+	return acmatch_scan(cInfo->wordmatch, message, WORD_EXCEPTION) & WORD_EXCEPTION;
 }
 
-static int
-is_in_badword_list(struct chanInfo *cInfo, char *message)
+/* Like strip_mirc_codes() followed by an exception and badword scan,
+ * but in one pass and without copying the message. */
+static unsigned int
+scan_words(struct chanInfo *cInfo, const char *text)
 {
-	unsigned int i;
+	const struct acmatch *ac = cInfo->wordmatch;
+	unsigned int state = 0, found = 0;
+	int nc = 0, col = 0;
 
-	for(i = 0; i < cInfo->badwords->used; i++)
-		if(strstr(message, cInfo->badwords->list[i]))
-			return 1;
+	if(!spamserv_conf.strip_mirc_codes)
+		return acmatch_scan(ac, text, WORD_EXCEPTION);
 
-	return 0;
+	for(; *text && !(found & WORD_EXCEPTION); text++)
+	{
+		if((col && isdigit(*text) && nc < 2) ||
+			(col && *text == ',' && isdigit(*(text + 1)) && nc < 3))
+		{
+			nc++;
+
+			if(*text == ',')
+				nc = 0;
+			continue;
+		}
+
+		col = 0;
+
+		switch(*text)
+		{
+		case '\003':
+			col = 1;
+			nc = 0;
+			continue;
+		case '\002':
+		case '\022':
+		case '\026':
+		case '\031':
+		case '\037':
+			continue;
+		}
+
+		state = acmatch_step(ac, state, *text);
+		found |= acmatch_tags(ac, state);
+	}
+
+	return found;
 }
 
 static int
@@ -2499,17 +2477,8 @@ check_caps(struct chanInfo *cInfo, char *message)
 static int
 check_badwords(struct chanInfo *cInfo, char *message)
 {
-	if(spamserv_conf.strip_mirc_codes)
-		message = strip_mirc_codes(message);
-
-	/* This needs improving */
-	if(is_in_exception_list(cInfo, message))
-		return 0;
-
-	if(is_in_badword_list(cInfo, message))
-		return 1;
-
-	return 0;
+	/* An exception anywhere in the message excuses any badwords. */
+	return (scan_words(cInfo, message) & (WORD_EXCEPTION | WORD_BADWORD)) == WORD_BADWORD;
 }
 
 static int
@@ -2589,6 +2558,50 @@ spamserv_punish(struct chanNode *channel, struct userNode *user, time_t expires,
 	KickChannelUser(user, channel, spamserv, reason);	
 }
 
+static void
+spamserv_fingerprint_shun(UNUSED_ARG(unsigned long user_id), const irc_in_addr_t *ip, UNUSED_ARG(void *extra))
+{
+	char mask[IRC_NTOP_MAX_SIZE + 3];
+
+	if(!irc_in_addr_is_valid(*ip))
+		return;
+
+	snprintf(mask, sizeof(mask), "*@%s", irc_ntoa(ip));
+
+	if(!shun_find(mask))
+		shun_add(spamserv->nick, mask, spamserv_conf.fingerprint_shun, SSMSG_FINGERPRINT_SHUN, now, 1);
+}
+
+static void
+spamserv_fingerprint(struct chanNode *channel, struct userNode *user, struct userInfo *uInfo, const char *text)
+{
+	struct msgfp_info info;
+	unsigned long hash;
+
+	if(!spamserv_fingerprints || !(hash = msgfp_hash(text, spamserv_conf.fingerprint_min_len)))
+		return;
+
+	msgfp_add(spamserv_fingerprints, hash, uInfo->id, (unsigned long)channel, &user->ip, now, &info);
+
+	if(info.marked)
+	{
+		/* already reported; catch the stragglers */
+		if(spamserv_conf.fingerprint_shun)
+			spamserv_fingerprint_shun(uInfo->id, &user->ip, NULL);
+		return;
+	}
+
+	if(info.users < spamserv_conf.fingerprint_users || info.channels < spamserv_conf.fingerprint_channels)
+		return;
+
+	msgfp_mark(spamserv_fingerprints, hash);
+	log_module(SS_LOG, LOG_WARNING, "Same message from %u users in %u channels within %lu seconds: %s", info.users, info.channels, (unsigned long)(now - info.first), text);
+	spamserv_debug(SSMSG_DEBUG_FINGERPRINT, info.users, info.channels, (unsigned long)(now - info.first), text);
+
+	if(spamserv_conf.fingerprint_shun)
+		msgfp_foreach(spamserv_fingerprints, hash, spamserv_fingerprint_shun, NULL);
+}
+
 void
 spamserv_channel_message(struct chanNode *channel, struct userNode *user, char *text)
 {
@@ -2596,8 +2609,7 @@ spamserv_channel_message(struct chanNode *channel, struct userNode *user, char *
 	struct chanInfo *cInfo;
 	struct userInfo	*uInfo;
 	struct userData *uData;
-	struct spamNode *sNode;
-	struct floodNode *fNode;
+	struct spamSlot *slot;
         struct trusted_account *ta;
 	unsigned int violation = 0;
 	char reason[MAXLEN];
@@ -2627,6 +2639,9 @@ spamserv_channel_message(struct chanNode *channel, struct userNode *user, char *
         if(uData && (uData->access >= cInfo->exceptlevel))
             return;
 
+	spamserv_decay_user(uInfo);
+	spamserv_fingerprint(channel, user, uInfo, text);
+
 	if(CHECK_CAPSSCAN(cInfo) && check_caps(cInfo, text))
 	{
                 if(uData && (uData->access >= cInfo->exceptcapslevel))
@@ -2666,75 +2681,61 @@ spamserv_channel_message(struct chanNode *channel, struct userNode *user, char *
 
 	if(CHECK_SPAM(cInfo))
 	{
+		unsigned long crc;
+
                 if(uData && (uData->access >= cInfo->exceptspamlevel))
                     return;
 
-		if(!(sNode = uInfo->spam))
-		{
-			spamserv_create_spamNode(channel, uInfo, text);
-		}
-		else
+		crc = crc32(text);
+
+		slot = spamserv_find_slot(cInfo, uInfo, 1);
+
+		if(slot->spam_count && crc == slot->crc32)
 		{
-			for(; sNode; sNode = sNode->next)
-				if(sNode->channel == channel)
-					break;
+			unsigned int spamlimit = 2;
+			slot->spam_count++;
 
-			if(!sNode)
+			switch(cInfo->info[ci_SpamLimit])
 			{
-				spamserv_create_spamNode(channel, uInfo, text);
+				case 'a': spamlimit = 2; break;
+				case 'b': spamlimit = 3; break;
+				case 'c': spamlimit = 4; break;
+				case 'd': spamlimit = 5; break;
+				case 'e': spamlimit = 6; break;
 			}
-			else
+
+			if(slot->spam_count == spamlimit)
 			{
-				unsigned long crc = crc32(text);
+				uInfo->warnlevel += SPAM_WARNLEVEL;
 
-				if(crc == sNode->crc32)
-				{
-					unsigned int spamlimit = 2;
-					sNode->count++;
-
-					switch(cInfo->info[ci_SpamLimit])
-					{
-						case 'a': spamlimit = 2; break;
-						case 'b': spamlimit = 3; break;
-						case 'c': spamlimit = 4; break;
-						case 'd': spamlimit = 5; break;
-						case 'e': spamlimit = 6; break;
-					}
-
-					if(sNode->count == spamlimit)
-					{
-						uInfo->warnlevel += SPAM_WARNLEVEL;
-
-						if(uInfo->warnlevel < MAX_WARNLEVEL) {
-							if (spamserv_conf.network_rules)
-								spamserv_notice(user, "SSMSG_WARNING_RULES_T", SSMSG_SPAM, spamserv_conf.network_rules);
-							else
-								spamserv_notice(user, "SSMSG_WARNING_T", SSMSG_SPAM, spamserv_conf.network_rules);
-						}
-					}
-					else if(sNode->count > spamlimit)
-					{
-						switch(cInfo->info[ci_WarnReaction])
-						{
-							case 'k': uInfo->flags |= USER_KICK; break;
-							case 'b': uInfo->flags |= USER_KICKBAN; break;
-							case 's': uInfo->flags |= USER_SHORT_TBAN; break;
-							case 'l': uInfo->flags |= USER_LONG_TBAN; break;
-							case 'd': uInfo->flags |= CHECK_KILLED(uInfo) ? USER_GLINE : USER_KILL; break;
-						}
-
-						spamserv_delete_spamNode(uInfo, sNode);
-						uInfo->warnlevel += SPAM_WARNLEVEL;
-						violation = 1;
-					}
+				if(uInfo->warnlevel < MAX_WARNLEVEL) {
+					if (spamserv_conf.network_rules)
+						spamserv_notice(user, "SSMSG_WARNING_RULES_T", SSMSG_SPAM, spamserv_conf.network_rules);
+					else
+						spamserv_notice(user, "SSMSG_WARNING_T", SSMSG_SPAM, spamserv_conf.network_rules);
 				}
-				else
+			}
+			else if(slot->spam_count > spamlimit)
+			{
+				switch(cInfo->info[ci_WarnReaction])
 				{
-					sNode->crc32 = crc;					
-					sNode->count = 1;
+					case 'k': uInfo->flags |= USER_KICK; break;
+					case 'b': uInfo->flags |= USER_KICKBAN; break;
+					case 's': uInfo->flags |= USER_SHORT_TBAN; break;
+					case 'l': uInfo->flags |= USER_LONG_TBAN; break;
+					case 'd': uInfo->flags |= CHECK_KILLED(uInfo) ? USER_GLINE : USER_KILL; break;
 				}
+
+				slot->spam_count = 0;
+				uInfo->warnlevel += SPAM_WARNLEVEL;
+				violation = 1;
 			}
 		}
+		else
+		{
+			slot->crc32 = crc;
+			slot->spam_count = 1;
+		}
 	}
 
 	if(CHECK_FLOOD(cInfo))
@@ -2742,50 +2743,41 @@ spamserv_channel_message(struct chanNode *channel, struct userNode *user, char *
                 if(uData && (uData->access >= cInfo->exceptfloodlevel))
                     return;
 
-		if(!(fNode = uInfo->flood))
-		{
-			spamserv_create_floodNode(channel, user, &uInfo->flood);
-		}
-		else
-		{
-			for(; fNode; fNode = fNode->next)
-				if(fNode->channel == channel)
-					break;
-				
-			if(!fNode) {
-				spamserv_create_floodNode(channel, user, &uInfo->flood);
-			} else {
-				if(((now - fNode->time) < FLOOD_EXPIRE)) {
-					fNode->count++;
-					
-					if(fNode->count == FLOOD_MAX_LINES - 1) {
-					    uInfo->warnlevel += FLOOD_WARNLEVEL;
-
-					    if(uInfo->warnlevel < MAX_WARNLEVEL) {
-						if (spamserv_conf.network_rules)
-						    spamserv_notice(user, "SSMSG_WARNING_RULES_T", SSMSG_FLOOD, spamserv_conf.network_rules);
-						else
-						    spamserv_notice(user, "SSMSG_WARNING_T", SSMSG_FLOOD, spamserv_conf.network_rules);
-					    }
-				            fNode->time = now;
-					}
-					else if(fNode->count > FLOOD_MAX_LINES) {
-						switch(cInfo->info[ci_WarnReaction]) {
-							case 'k': uInfo->flags |= USER_KICK; break;
-							case 'b': uInfo->flags |= USER_KICKBAN; break;
-							case 's': uInfo->flags |= USER_SHORT_TBAN; break;
-							case 'l': uInfo->flags |= USER_LONG_TBAN; break;
-							case 'd': uInfo->flags |= CHECK_KILLED(uInfo) ? USER_GLINE : USER_KILL; break;
-						}
-
-						spamserv_delete_floodNode(&uInfo->flood, fNode);
-						uInfo->warnlevel += FLOOD_WARNLEVEL;
-						violation = 2;						
-					}
-				} else {
-				    fNode->time = now;
-                                }
+		slot = spamserv_find_slot(cInfo, uInfo, 1);
+		spamserv_decay(&slot->flood_count, &slot->flood_time, FLOOD_EXPIRE, FLOOD_DECAY);
+
+		if(!slot->flood_count) {
+			slot->flood_count = 1;
+			slot->flood_time = now;
+		} else if(((now - slot->flood_time) < FLOOD_EXPIRE)) {
+			slot->flood_count++;
+
+			if(slot->flood_count == FLOOD_MAX_LINES - 1) {
+			    uInfo->warnlevel += FLOOD_WARNLEVEL;
+
+			    if(uInfo->warnlevel < MAX_WARNLEVEL) {
+				if (spamserv_conf.network_rules)
+				    spamserv_notice(user, "SSMSG_WARNING_RULES_T", SSMSG_FLOOD, spamserv_conf.network_rules);
+				else
+				    spamserv_notice(user, "SSMSG_WARNING_T", SSMSG_FLOOD, spamserv_conf.network_rules);
+			    }
+			    slot->flood_time = now;
 			}
+			else if(slot->flood_count > FLOOD_MAX_LINES) {
+				switch(cInfo->info[ci_WarnReaction]) {
+					case 'k': uInfo->flags |= USER_KICK; break;
+					case 'b': uInfo->flags |= USER_KICKBAN; break;
+					case 's': uInfo->flags |= USER_SHORT_TBAN; break;
+					case 'l': uInfo->flags |= USER_LONG_TBAN; break;
+					case 'd': uInfo->flags |= CHECK_KILLED(uInfo) ? USER_GLINE : USER_KILL; break;
+				}
+
+				slot->flood_count = 0;
+				uInfo->warnlevel += FLOOD_WARNLEVEL;
+				violation = 2;
+			}
+		} else {
+		    slot->flood_time = now;
 		}
 	}
 
@@ -3183,6 +3175,35 @@ spamserv_conf_read(void)
 
 	str = database_get_data(conf_node, KEY_ALLOW_MOVE_MERGE, RECDB_QSTRING);
 	spamserv_conf.allow_move_merge = str ? enabled_string(str) : 0;
+
+	str = database_get_data(conf_node, KEY_FINGERPRINT_LINES, RECDB_QSTRING);
+	spamserv_conf.fingerprint_lines = str ? strtoul(str, NULL, 0) : 4096;
+
+	str = database_get_data(conf_node, KEY_FINGERPRINT_WINDOW, RECDB_QSTRING);
+	spamserv_conf.fingerprint_window = str ? ParseInterval(str) : 60;
+
+	str = database_get_data(conf_node, KEY_FINGERPRINT_MIN_LEN, RECDB_QSTRING);
+	spamserv_conf.fingerprint_min_len = str ? strtoul(str, NULL, 0) : 12;
+
+	str = database_get_data(conf_node, KEY_FINGERPRINT_USERS, RECDB_QSTRING);
+	spamserv_conf.fingerprint_users = str ? strtoul(str, NULL, 0) : 10;
+
+	str = database_get_data(conf_node, KEY_FINGERPRINT_CHANNELS, RECDB_QSTRING);
+	spamserv_conf.fingerprint_channels = str ? strtoul(str, NULL, 0) : 3;
+
+	str = database_get_data(conf_node, KEY_FINGERPRINT_SHUN, RECDB_QSTRING);
+	spamserv_conf.fingerprint_shun = str ? ParseInterval(str) : 0;
+
+	if(spamserv_fingerprints && (!spamserv_conf.fingerprint_lines
+	   || msgfp_capacity(spamserv_fingerprints) != spamserv_conf.fingerprint_lines
+	   || msgfp_window(spamserv_fingerprints) != spamserv_conf.fingerprint_window))
+	{
+		msgfp_delete(spamserv_fingerprints);
+		spamserv_fingerprints = NULL;
+	}
+
+	if(!spamserv_fingerprints && spamserv_conf.fingerprint_lines)
+		spamserv_fingerprints = msgfp_new(spamserv_conf.fingerprint_lines, spamserv_conf.fingerprint_window);
 }
 
 static void
@@ -3190,6 +3211,13 @@ spamserv_db_cleanup(UNUSED_ARG(void* extra))
 {
 	dict_iterator_t it;
 
+	if(spamserv_gc_channels)
+		sweep_cancel(spamserv_gc_channels);
+	if(spamserv_gc_kills)
+		sweep_cancel(spamserv_gc_kills);
+	spamserv_gc_channels = spamserv_gc_kills = NULL;
+	timeq_del(0, spamserv_gc, NULL, TIMEQ_IGNORE_WHEN);
+
 	while((it = dict_first(registered_channels_dict)))
 	{
 		spamserv_unregister_channel(iter_data(it));
@@ -3206,6 +3234,8 @@ spamserv_db_cleanup(UNUSED_ARG(void* extra))
 	dict_delete(connected_users_dict);
 	dict_delete(killed_users_dict);
 	dict_delete(spamserv_trusted_accounts);
+	msgfp_delete(spamserv_fingerprints);
+	spamserv_fingerprints = NULL;
 }
 
 void
@@ -3247,13 +3277,7 @@ init_spamserv(const char *nick)
 	reg_join_func(spamserv_user_join, NULL);
 	reg_part_func(spamserv_user_part, NULL);
 
-	timeq_add(now + FLOOD_TIMEQ_FREQ, timeq_flood, NULL);
-	timeq_add(now + JOINFLOOD_TIMEQ_FREQ, timeq_joinflood, NULL);
-	timeq_add(now + ADV_TIMEQ_FREQ, timeq_adv, NULL);
-	timeq_add(now + BAD_TIMEQ_FREQ, timeq_bad, NULL);
-	timeq_add(now + CAPS_TIMEQ_FREQ, timeq_caps, NULL);
-	timeq_add(now + WARNLEVEL_TIMEQ_FREQ, timeq_warnlevel, NULL);
-	timeq_add(now + KILL_TIMEQ_FREQ, timeq_kill, NULL);
+	timeq_add(now + SPAMSERV_GC_FREQ, spamserv_gc, NULL);
 
 	spamserv_module = module_register("SpamServ", SS_LOG, "spamserv.help", NULL);
 
@@ -67,6 +67,10 @@ struct chanInfo
     struct chanNode        *channel;
     struct string_list     *exceptions;
     struct string_list     *badwords;
+    struct acmatch         *wordmatch;
+    struct spamSlot        *slots;		/* open-addressed by user_id */
+    unsigned int           slots_used;
+    unsigned int           slots_size;
     unsigned int           exceptlevel;
     unsigned int           exceptadvlevel;
     unsigned int           exceptbadwordlevel;
@@ -110,52 +114,44 @@ struct chanInfo
 
 #define SPAM_WARNLEVEL          1
 
-#define FLOOD_TIMEQ_FREQ        5
+#define FLOOD_DECAY             5
 #define FLOOD_EXPIRE            5
 #define FLOOD_WARNLEVEL         1
 #define FLOOD_MAX_LINES         8
 
-#define JOINFLOOD_TIMEQ_FREQ    225
+#define JOINFLOOD_DECAY         225
 #define JOINFLOOD_EXPIRE        450
 #define JOINFLOOD_MAX           3
 #define JOINFLOOD_B_DURATION    900
 
-#define ADV_TIMEQ_FREQ          300
 #define ADV_EXPIRE              900
 #define ADV_WARNLEVEL           2
 
-#define BAD_TIMEQ_FREQ          300
 #define BAD_EXPIRE              900
 #define BAD_WARNLEVEL           2
 
-#define CAPS_TIMEQ_FREQ          300
 #define CAPS_EXPIRE              900
 #define CAPS_WARNLEVEL           2
 
-#define WARNLEVEL_TIMEQ_FREQ    1800
+#define WARNLEVEL_DECAY         1800
 #define MAX_WARNLEVEL           6
 
-#define KILL_TIMEQ_FREQ         450
 #define KILL_EXPIRE             1800
 #define KILL_WARNLEVEL          3
 
-struct spamNode
-{
-	struct chanNode		*channel;
-	unsigned long		crc32;
-	unsigned int		count;
-	struct spamNode		*prev;
-	struct spamNode		*next;
-};
+#define SPAMSERV_GC_FREQ        3600
 
-struct floodNode
+/* Per-user state in one channel.  Counters are decayed when they are
+ * next touched rather than by a periodic pass over every user. */
+struct spamSlot
 {
-	struct chanNode		*channel;
-	struct userNode		*owner;
-	unsigned int		count;
-	time_t        		time;
-	struct floodNode	*prev;
-	struct floodNode	*next;
+	unsigned long		user_id;	/* 0 if the slot is free */
+	unsigned long		crc32;
+	unsigned int		spam_count;
+	unsigned int		flood_count;
+	unsigned int		join_count;
+	time_t        		flood_time;
+	time_t        		join_time;
 };
 
 struct killNode
@@ -167,11 +163,10 @@ struct killNode
 struct userInfo
 {
     struct userNode		*user;
-	struct spamNode		*spam;
-	struct floodNode	*flood;
-	struct floodNode	*joinflood;
+	unsigned long		id;
 	unsigned int		flags : 30;
 	unsigned int		warnlevel;
+	time_t        		warnlevel_time;
 	time_t        		lastadv;
 	time_t        		lastbad;
 	time_t        		lastcaps;
@@ -0,0 +1,301 @@
+/* sweep.c - Incremental, time-sliced maintenance sweeps
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "sweep.h"
+#include "timeq.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+struct sweep {
+    char *name;
+    dict_t dict;
+    sweep_dict_func func;
+    sweep_step_func step;
+    sweep_done_func done;
+    void *extra;
+
+    /* Key of the next dict node to visit; NULL before the first slice. */
+    char *cursor;
+    unsigned int cursor_size;
+
+    unsigned int max_items;
+    unsigned long max_usec;
+
+    unsigned long items;
+    unsigned int slices;
+    struct timeval started;
+
+    /* Non-zero while sleeping until that time (see sweep_defer()). */
+    unsigned long wake;
+
+    unsigned int at_end : 1;
+    unsigned int running : 1;
+    unsigned int dead : 1;
+    struct sweep *prev, *next;
+};
+
+static struct sweep *sweep_head, *sweep_tail;
+static int sweep_in_run;
+
+static void sweep_wake(void *data);
+
+static void
+sweep_free(struct sweep *sweep)
+{
+    if (sweep->wake)
+        timeq_del(0, sweep_wake, sweep, TIMEQ_IGNORE_WHEN);
+    if (sweep->prev)
+        sweep->prev->next = sweep->next;
+    else
+        sweep_head = sweep->next;
+    if (sweep->next)
+        sweep->next->prev = sweep->prev;
+    else
+        sweep_tail = sweep->prev;
+    free(sweep->cursor);
+    free(sweep->name);
+    free(sweep);
+}
+
+static void
+sweep_cleanup(UNUSED_ARG(void *extra))
+{
+    while (sweep_head)
+        sweep_free(sweep_head);
+}
+
+/* Exit functions run in reverse order, so registering this before
+ * the services start lets their cleanup cancel their own sweeps. */
+void
+sweep_init(void)
+{
+    reg_exit_func(sweep_cleanup, NULL);
+}
+
+static struct sweep *
+sweep_new(const char *name, sweep_done_func done, void *extra)
+{
+    struct sweep *sweep;
+
+    sweep = calloc(1, sizeof(*sweep));
+    sweep->name = strdup(name);
+    sweep->done = done;
+    sweep->extra = extra;
+    sweep->max_items = SWEEP_DEFAULT_ITEMS;
+    sweep->max_usec = SWEEP_DEFAULT_USEC;
+    gettimeofday(&sweep->started, NULL);
+    sweep->prev = sweep_tail;
+    if (sweep_tail)
+        sweep_tail->next = sweep;
+    else
+        sweep_head = sweep;
+    sweep_tail = sweep;
+    return sweep;
+}
+
+struct sweep *
+sweep_dict(const char *name, dict_t dict, sweep_dict_func func, sweep_done_func done, void *extra)
+{
+    struct sweep *sweep = sweep_new(name, done, extra);
+    sweep->dict = dict;
+    sweep->func = func;
+    return sweep;
+}
+
+struct sweep *
+sweep_job(const char *name, sweep_step_func step, sweep_done_func done, void *extra)
+{
+    struct sweep *sweep = sweep_new(name, done, extra);
+    sweep->step = step;
+    return sweep;
+}
+
+void
+sweep_set_slice(struct sweep *sweep, unsigned int max_items, unsigned long max_usec)
+{
+    sweep->max_items = max_items ? max_items : SWEEP_DEFAULT_ITEMS;
+    sweep->max_usec = max_usec ? max_usec : SWEEP_DEFAULT_USEC;
+}
+
+static void
+sweep_set_cursor(struct sweep *sweep, const char *key)
+{
+    unsigned int len = strlen(key) + 1;
+    if (len > sweep->cursor_size) {
+        sweep->cursor_size = len < 64 ? 64 : len;
+        sweep->cursor = realloc(sweep->cursor, sweep->cursor_size);
+    }
+    memcpy(sweep->cursor, key, len);
+}
+
+static unsigned long
+sweep_elapsed(const struct timeval *start)
+{
+    struct timeval stop;
+    gettimeofday(&stop, NULL);
+    return (stop.tv_sec - start->tv_sec) * 1000000 + (stop.tv_usec - start->tv_usec);
+}
+
+/* Advance the sweep by one item.  Returns zero when it is finished. */
+static int
+sweep_advance(struct sweep *sweep)
+{
+    dict_iterator_t it, next;
+
+    if (sweep->step)
+        return sweep->step(sweep->extra);
+
+    if (sweep->at_end)
+        return 0;
+    else if (!sweep->cursor)
+        it = dict_first(sweep->dict);
+    else
+        it = dict_lower_bound(sweep->dict, sweep->cursor);
+    if (!it)
+        return 0;
+    next = iter_next(it);
+    if (next)
+        sweep_set_cursor(sweep, iter_key(next));
+    else
+        sweep->at_end = 1;
+    if (sweep->func(iter_key(it), iter_data(it), sweep->extra))
+        return 0;
+    return next != NULL;
+}
+
+static void
+sweep_complete(struct sweep *sweep)
+{
+    log_module(MAIN_LOG, LOG_DEBUG, "Sweep %s visited %lu items in %u slices (%lu msec).", sweep->name, sweep->items, sweep->slices, sweep_elapsed(&sweep->started) / 1000);
+    if (sweep->done)
+        sweep->done(sweep->extra);
+    sweep->done = NULL;
+    if (sweep_in_run)
+        sweep->dead = 1;
+    else
+        sweep_free(sweep);
+}
+
+/* Run one slice; returns non-zero if the sweep was retired. */
+static int
+sweep_slice(struct sweep *sweep, unsigned int max_items, unsigned long max_usec)
+{
+    struct timeval start;
+    unsigned int count;
+    int more;
+
+    gettimeofday(&start, NULL);
+    sweep->running = 1;
+    sweep->slices++;
+    for (count = 0, more = 1; more && !sweep->dead && !sweep->wake && count < max_items; ) {
+        more = sweep_advance(sweep);
+        sweep->items++;
+        count++;
+        if (max_usec && sweep_elapsed(&start) >= max_usec)
+            break;
+    }
+    sweep->running = 0;
+    if (sweep->dead) {
+        if (!sweep_in_run)
+            sweep_free(sweep);
+        return 1;
+    }
+    if (!more) {
+        sweep_complete(sweep);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+sweep_wake(void *data)
+{
+    struct sweep *sweep = data;
+    sweep->wake = 0;
+}
+
+void
+sweep_defer(struct sweep *sweep, unsigned long when)
+{
+    if (sweep->wake)
+        timeq_del(0, sweep_wake, sweep, TIMEQ_IGNORE_WHEN);
+    sweep->wake = when;
+    timeq_add(when, sweep_wake, sweep);
+}
+
+void
+sweep_finish(struct sweep *sweep)
+{
+    if (sweep->running || sweep->dead)
+        return;
+    if (sweep->wake) {
+        timeq_del(0, sweep_wake, sweep, TIMEQ_IGNORE_WHEN);
+        sweep->wake = 0;
+    }
+    while (!sweep_slice(sweep, UINT_MAX, 0)) ;
+}
+
+void
+sweep_cancel(struct sweep *sweep)
+{
+    sweep->done = NULL;
+    if (sweep->running || sweep_in_run)
+        sweep->dead = 1;
+    else
+        sweep_free(sweep);
+}
+
+/* Sleeping sweeps are not pending: the timeq wakes the loop for them. */
+unsigned int
+sweep_pending(void)
+{
+    struct sweep *sweep;
+    unsigned int count;
+
+    for (sweep = sweep_head, count = 0; sweep; sweep = sweep->next)
+        if (!sweep->wake && !sweep->dead)
+            count++;
+    return count;
+}
+
+void
+sweep_run(void)
+{
+    struct sweep *sweep, *next, *last;
+
+    /* Retired sweeps stay linked until the pass is over, so callbacks
+     * may start or cancel sweeps; new ones wait for the next pass. */
+    sweep_in_run = 1;
+    for (sweep = sweep_head, last = sweep_tail; sweep; sweep = next) {
+        next = (sweep == last) ? NULL : sweep->next;
+        if (!sweep->dead && !sweep->wake)
+            sweep_slice(sweep, sweep->max_items, sweep->max_usec);
+    }
+    sweep_in_run = 0;
+    for (sweep = sweep_head; sweep; sweep = next) {
+        next = sweep->next;
+        if (sweep->dead)
+            sweep_free(sweep);
+    }
+}
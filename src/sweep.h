@@ -0,0 +1,63 @@
+/* sweep.h - Incremental, time-sliced maintenance sweeps
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "dict.h"
+
+/* A sweep is a cursor over some collection that is advanced a bounded
+ * number of items (and microseconds) per pass through the event loop,
+ * so that maintenance work never stalls protocol processing.
+ *
+ * Dict sweeps remember the key of the next node to visit, so the
+ * callback may freely remove the current entry (or any other) from
+ * the dict between slices.  Job sweeps call a step function until it
+ * returns zero.
+ *
+ * A callback may put its sweep to sleep with sweep_defer(), for
+ * example to let an output queue drain; the current slice ends after
+ * that item and the sweep resumes from the same place once the time
+ * has come.
+ */
+
+struct sweep;
+
+/* Return non-zero to stop the sweep early. */
+typedef int (*sweep_dict_func)(const char *key, void *data, void *extra);
+/* Return non-zero while there is more work to do. */
+typedef int (*sweep_step_func)(void *extra);
+/* Called once when the sweep runs to completion (not on cancel). */
+typedef void (*sweep_done_func)(void *extra);
+
+#define SWEEP_DEFAULT_ITEMS 256
+#define SWEEP_DEFAULT_USEC  2000
+
+void sweep_init(void);
+struct sweep *sweep_dict(const char *name, dict_t dict, sweep_dict_func func, sweep_done_func done, void *extra);
+struct sweep *sweep_job(const char *name, sweep_step_func step, sweep_done_func done, void *extra);
+void sweep_set_slice(struct sweep *sweep, unsigned int max_items, unsigned long max_usec);
+void sweep_defer(struct sweep *sweep, unsigned long when);
+void sweep_finish(struct sweep *sweep);
+void sweep_cancel(struct sweep *sweep);
+unsigned int sweep_pending(void);
+void sweep_run(void);
+
+#endif /* ndef SWEEP_H */
@@ -0,0 +1,50 @@
+/* teststubs-metrics.c - Metrics registration for test programs
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "metrics.h"
+
+/* Test programs that do not link metrics.c still link modules that
+ * register metrics; the registrations are simply dropped. */
+
+void
+metrics_register(UNUSED_ARG(const char *name), UNUSED_ARG(const char *help), UNUSED_ARG(enum metric_type type), UNUSED_ARG(metric_value_func value), UNUSED_ARG(void *extra))
+{
+}
+
+void
+metrics_register_ulong(UNUSED_ARG(const char *name), UNUSED_ARG(const char *help), UNUSED_ARG(enum metric_type type), UNUSED_ARG(const unsigned long *value))
+{
+}
+
+void
+metrics_register_collector(UNUSED_ARG(const char *name), UNUSED_ARG(const char *help), UNUSED_ARG(enum metric_type type), UNUSED_ARG(metric_collect_func collect), UNUSED_ARG(void *extra))
+{
+}
+
+void
+metrics_sample(UNUSED_ARG(struct metrics_out *out), UNUSED_ARG(const char *label), UNUSED_ARG(const char *label_value), UNUSED_ARG(double value))
+{
+}
+
+void
+metrics_summary(UNUSED_ARG(struct metrics_out *out), UNUSED_ARG(const char *label), UNUSED_ARG(const char *label_value), UNUSED_ARG(const struct histogram *hist), UNUSED_ARG(double scale))
+{
+}
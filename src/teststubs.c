@@ -0,0 +1,115 @@
+/* teststubs.c - Stand-ins for the services core in test programs
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#include "common.h"
+#include "conf.h"
+#include "helpfile.h"
+#include "log.h"
+#include "teststubs.h"
+
+dict_t test_conf;
+
+static conf_reload_func reload_funcs[8];
+static unsigned int reload_count;
+static exit_func_t exit_funcs[8];
+static void *exit_extras[8];
+static unsigned int exit_count;
+
+void
+test_run_reloads(void)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < reload_count; ii++)
+        reload_funcs[ii]();
+}
+
+void
+test_run_exit_funcs(void)
+{
+    while (exit_count > 0) {
+        exit_count--;
+        exit_funcs[exit_count](exit_extras[exit_count]);
+    }
+}
+
+void
+log_module(UNUSED_ARG(struct log_type *type), enum log_severity sev, const char *format, ...)
+{
+    va_list va;
+
+    if (sev < LOG_ERROR && !getenv("TEST_DEBUG"))
+        return;
+    va_start(va, format);
+    vfprintf(stderr, format, va);
+    va_end(va);
+    fputc('\n', stderr);
+}
+
+struct log_type *
+log_register_type(UNUSED_ARG(const char *name), UNUSED_ARG(const char *default_log))
+{
+    return NULL;
+}
+
+void *
+conf_get_data(const char *full_path, enum recdb_type type)
+{
+    return database_get_data(test_conf, full_path, type);
+}
+
+/* A module that is initialized again after its exit function ran
+ * registers the same reload function again; keep just one. */
+void
+conf_register_reload(conf_reload_func crf)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < reload_count; ii++)
+        if (reload_funcs[ii] == crf)
+            return;
+    assert(reload_count < ArrayLength(reload_funcs));
+    reload_funcs[reload_count++] = crf;
+}
+
+void
+reg_exit_func(exit_func_t handler, void *extra)
+{
+    assert(exit_count < ArrayLength(exit_funcs));
+    exit_funcs[exit_count] = handler;
+    exit_extras[exit_count++] = extra;
+}
+
+const char *
+language_find_message(UNUSED_ARG(struct language *lang), UNUSED_ARG(const char *msgid))
+{
+    return "Stub -- Not implemented.";
+}
+
+time_t now;
+struct log_type *MAIN_LOG;
+struct language *lang_C;
+const char *hidden_host_suffix;
+
+struct chanNode *
+GetChannel(UNUSED_ARG(const char *name))
+{
+    return NULL;
+}
@@ -0,0 +1,40 @@
+/* teststubs.h - Stand-ins for the services core in test programs
+ * Copyright 2000-2004 srvx Development Team
+ *
+ * This file is part of x3.
+ *
+ * x3 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with srvx; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+ */
+
+#ifndef TESTSTUBS_H
+#define TESTSTUBS_H
+
+#include "conf.h"
+
+/* The test programs link a few real modules and supply the rest of
+ * what those modules call from teststubs.c.  Configuration is read
+ * from test_conf; log messages below LOG_ERROR are only printed when
+ * TEST_DEBUG is set in the environment. */
+extern dict_t test_conf;
+
+/* Calls every function passed to conf_register_reload(), as a rehash
+ * would. */
+void test_run_reloads(void);
+
+/* Calls every function passed to reg_exit_func(), newest first, as a
+ * shutdown would, and forgets them. */
+void test_run_exit_funcs(void);
+
+#endif /* !defined(TESTSTUBS_H) */
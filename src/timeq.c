@@ -27,6 +27,7 @@ heap_t timeq;
 struct timeq_entry {
     timeq_func func;
     void *data;
+    const char *name;
 };
 
 static void
@@ -55,13 +56,14 @@ timeq_next(void)
 }
 
 void
-timeq_add(unsigned long when, timeq_func func, void *data)
+timeq_add_named(unsigned long when, timeq_func func, void *data, const char *name)
 {
     struct timeq_entry *ent;
     void *w;
     ent = malloc(sizeof(struct timeq_entry));
     ent->func = func;
     ent->data = data;
+    ent->name = name;
     w = (void*)when;
     if (!timeq)
         timeq_init();
@@ -105,7 +107,7 @@ timeq_del(unsigned long when, timeq_func func, void *data, int mask)
 unsigned int
 timeq_size(void)
 {
-    return heap_size(timeq);
+    return timeq ? heap_size(timeq) : 0;
 }
 
 void
@@ -113,13 +115,16 @@ timeq_run(void)
 {
     void *k, *d;
     struct timeq_entry *ent;
+    struct timeval start;
     while (heap_size(timeq) > 0) {
         heap_peek(timeq, &k, &d);
         if ((time_t)k > now)
             break;
         ent = d;
         heap_pop(timeq);
+        PROFILE_START(&start);
         ent->func(ent->data);
+        PROFILE_STOP(profile_site(ent->name), &start);
         free(ent);
     }
 }
@@ -21,13 +21,17 @@
 #ifndef TIMEQ_H
 #define TIMEQ_H
 
+#include "profile.h"
+
 typedef void (*timeq_func)(void *data);
 
 #define TIMEQ_IGNORE_WHEN    0x01
 #define TIMEQ_IGNORE_FUNC    0x02
 #define TIMEQ_IGNORE_DATA    0x04
 
-void timeq_add(unsigned long when, timeq_func func, void *data);
+/* The name labels the timer for profiling; use timeq_add(). */
+void timeq_add_named(unsigned long when, timeq_func func, void *data, const char *name);
+#define timeq_add(WHEN, FUNC, DATA) timeq_add_named((WHEN), (FUNC), (DATA), PROFILE_NAME("timer", FUNC))
 void timeq_del(unsigned long when, timeq_func func, void *data, int mask);
 unsigned long timeq_next(void);
 unsigned int timeq_size(void);